@@ -0,0 +1,1420 @@
+// SPDX-License-Identifier: Zlib
+//
+// Benchmarks for libdldipatch, and a generator of synthetic drivers and ROMs
+// to run them on. Results are printed as one JSON object per line. The same
+// synthetic files are used to check the library against reference
+// implementations, with "dldibench check".
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "libdldipatch.h"
+
+#ifndef DLDIPATCH_VERSION
+#define DLDIPATCH_VERSION "unknown"
+#endif
+
+// Minimum time spent on each measurement.
+#define BENCH_MIN_SECONDS   0.25
+
+// Address drivers are built for, and the address of the stub in ROMs.
+#define BENCH_DRIVER_BASE   0xBF800000
+#define BENCH_STUB_BASE     0x02004000
+
+static const char *const stub_positions[] = { "start", "middle", "end" };
+
+static double benchNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static u64 benchRandom(u64 *state)
+{
+	// xorshift64*
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void benchHeader(DLDI_INTERFACE *io, u8 driver_size, u8 allocated_size, u8 fix,
+                        const char *name, u32 start, u32 ioType)
+{
+	memset(io, 0, sizeof(*io));
+	io->magicNumber = DLDI_MAGIC_NUMBER;
+	memcpy(io->magicString, " Chishm", DLDI_MAGIC_STRING_LEN);
+	io->versionNumber = 1;
+	io->driverSize = driver_size;
+	io->fixSectionsFlags = fix;
+	io->allocatedSize = allocated_size;
+	strncpy(io->friendlyName, name, DLDI_FRIENDLY_NAME_LEN - 1);
+	io->dldiStart = start;
+	io->ioInterface.ioType = ioType;
+}
+
+// Builds a driver of 1 << driver_size bytes. A third of the words of the code
+// point into the driver, so every fixed section has work to do.
+static void benchMakeDriver(u8 *buffer, u8 driver_size, u8 fix, u64 seed)
+{
+	u32 size = 1u << driver_size;
+	DLDI_INTERFACE *io = (DLDI_INTERFACE *)buffer;
+	u64 state = seed | 1;
+
+	memset(buffer, 0, 1 << DLDI_SIZE_32KB);
+	for (u32 i = sizeof(DLDI_INTERFACE); i < size; i += 4)
+	{
+		u64 r = benchRandom(&state);
+		u32 word = (r % 3 == 0) ? BENCH_DRIVER_BASE + (u32)((r >> 8) % size) : (u32)(r >> 32);
+		memcpy(buffer + i, &word, 4);
+	}
+
+	benchHeader(io, driver_size, driver_size, fix, "Benchmark driver", BENCH_DRIVER_BASE, 0x48434E42);
+	io->dldiEnd = BENCH_DRIVER_BASE + size - size / 8;
+	io->interworkStart = BENCH_DRIVER_BASE + size / 2;
+	io->interworkEnd = io->interworkStart + size / 16;
+	io->gotStart = io->interworkEnd;
+	io->gotEnd = io->gotStart + size / 16;
+	io->bssStart = io->dldiEnd;
+	io->bssEnd = BENCH_DRIVER_BASE + size;
+	io->ioInterface.features = FEATURE_MEDIUM_CANREAD | FEATURE_MEDIUM_CANWRITE | FEATURE_SLOT_NDS;
+	io->ioInterface.startup = BENCH_DRIVER_BASE + 0x100;
+	io->ioInterface.isInserted = BENCH_DRIVER_BASE + 0x104;
+	io->ioInterface.readSectors = BENCH_DRIVER_BASE + 0x108;
+	io->ioInterface.writeSectors = BENCH_DRIVER_BASE + 0x10C;
+	io->ioInterface.clearStatus = BENCH_DRIVER_BASE + 0x110;
+	io->ioInterface.shutdown = BENCH_DRIVER_BASE + 0x114;
+}
+
+static int benchWriteDriver(const char *path, u8 driver_size, u8 fix)
+{
+	static u8 buffer[1 << DLDI_SIZE_32KB] ALIGN(4);
+	benchMakeDriver(buffer, driver_size, fix, driver_size * 16 + fix);
+
+	FILE *f = fopen(path, "wb");
+	if (f == NULL)
+		return -errno;
+	int rc = fwrite(buffer, 1, 1 << driver_size, f) == (size_t)(1 << driver_size) ? 0 : -EIO;
+	if (fclose(f) != 0 && rc == 0)
+		rc = -EIO;
+	return rc;
+}
+
+// Writes a ROM of random data with an empty 32 KB stub at the start, middle
+// or end, and decoy magic numbers without a valid header around it.
+static int benchWriteRom(const char *path, u64 size, const char *position, int decoys)
+{
+	const u32 chunk = 1 << 20;
+	const u32 stub_size = 1 << DLDI_SIZE_32KB;
+	u64 state = size ^ 0x5DEECE66DULL;
+
+	u64 stub_offset = 0x200;
+	if (strcmp(position, "middle") == 0)
+		stub_offset = (size / 2) & ~(u64)3;
+	else if (strcmp(position, "end") == 0)
+		stub_offset = (size - stub_size) & ~(u64)3;
+
+	u8 *buffer = (u8 *)malloc(chunk);
+	if (buffer == NULL)
+		return -ENOMEM;
+
+	FILE *f = fopen(path, "wb");
+	if (f == NULL)
+	{
+		free(buffer);
+		return -errno;
+	}
+
+	int rc = 0;
+	for (u64 base = 0; base < size && rc == 0; base += chunk)
+	{
+		u32 len = size - base < chunk ? size - base : chunk;
+
+		for (u32 i = 0; i + 8 <= len; i += 8)
+		{
+			u64 r = benchRandom(&state);
+			memcpy(buffer + i, &r, 8);
+		}
+
+		// Decoys are spread evenly over the file.
+		for (int d = 0; d < decoys; d++)
+		{
+			u64 at = ((size / (decoys + 1)) * (d + 1)) & ~(u64)3;
+			if (at >= base && at + 4 <= base + len)
+				memcpy(buffer + (at - base), &DLDI_MAGIC_NUMBER, 4);
+		}
+
+		// The stub may span two chunks.
+		if (stub_offset < base + len && stub_offset + stub_size > base)
+		{
+			static u8 stub[1 << DLDI_SIZE_32KB] ALIGN(4);
+			memset(stub, 0, sizeof(stub));
+			DLDI_INTERFACE *io = (DLDI_INTERFACE *)stub;
+			benchHeader(io, DLDI_SIZE_32KB, DLDI_SIZE_32KB, 0, "Default (No interface)", BENCH_STUB_BASE, 0x49444C44);
+			io->dldiEnd = BENCH_STUB_BASE + sizeof(DLDI_INTERFACE);
+
+			u64 from = stub_offset > base ? stub_offset : base;
+			u64 to = stub_offset + stub_size < base + len ? stub_offset + stub_size : base + len;
+			memcpy(buffer + (from - base), stub + (from - stub_offset), to - from);
+		}
+
+		if (fwrite(buffer, 1, len, f) != len)
+			rc = -EIO;
+	}
+
+	if (fclose(f) != 0 && rc == 0)
+		rc = -EIO;
+	free(buffer);
+	return rc;
+}
+
+// Drops a file from the page cache, so that the next read comes from storage.
+static void benchDropCache(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+static int benchScan(const char *dir, u64 size_mb, bool cold)
+{
+	char path[4096];
+
+	for (int p = 0; p < 3; p++)
+	{
+		snprintf(path, sizeof(path), "%s/rom_%llumb_%s.nds", dir, (unsigned long long)size_mb, stub_positions[p]);
+
+		int runs = 0;
+		double elapsed = 0;
+		while (elapsed < BENCH_MIN_SECONDS || runs == 0)
+		{
+			if (cold)
+				benchDropCache(path);
+
+			double start = benchNow();
+			DLDI_IMAGE *image;
+			int rc = dldiImageOpen(path, 0, &image);
+			if (rc != 0)
+				return rc;
+			dldiImageClose(image);
+			elapsed += benchNow() - start;
+			runs++;
+
+			// Cold runs of large files are slow enough to measure once.
+			if (cold && elapsed > BENCH_MIN_SECONDS / 4)
+				break;
+		}
+
+		printf("{\"version\":\"%s\",\"bench\":\"scan\",\"rom_mb\":%llu,\"stub\":\"%s\","
+		       "\"cache\":\"%s\",\"runs\":%d,\"seconds\":%.6f,\"mb_per_s\":%.1f}\n",
+		       DLDIPATCH_VERSION, (unsigned long long)size_mb, stub_positions[p],
+		       cold ? "cold" : "warm", runs, elapsed / runs, size_mb * runs / elapsed);
+	}
+
+	return 0;
+}
+
+static int benchRelocate(void)
+{
+	static u8 driver[1 << DLDI_SIZE_32KB] ALIGN(4);
+	static u8 work[1 << DLDI_SIZE_32KB] ALIGN(4);
+	static const u8 fixes[] = {
+		FIX_ALL, FIX_GLUE, FIX_GOT, FIX_BSS,
+		FIX_GLUE | FIX_GOT, FIX_GLUE | FIX_GOT | FIX_BSS,
+		FIX_ALL | FIX_GLUE | FIX_GOT | FIX_BSS,
+	};
+
+	for (u8 size = DLDI_SIZE_512B; size <= DLDI_SIZE_32KB; size++)
+	{
+		for (size_t f = 0; f < sizeof(fixes); f++)
+		{
+			benchMakeDriver(driver, size, fixes[f], size * 16 + fixes[f]);
+
+			u64 runs = 0;
+			u32 fixups = 0;
+			double start = benchNow();
+			double elapsed;
+			do
+			{
+				for (int i = 0; i < 64; i++)
+				{
+					memcpy(work, driver, 1 << size);
+					fixups = dldiRelocate((DLDI_INTERFACE *)work, BENCH_STUB_BASE + (u32)(runs % 16) * 4);
+					runs++;
+				}
+				elapsed = benchNow() - start;
+			} while (elapsed < BENCH_MIN_SECONDS);
+
+			printf("{\"version\":\"%s\",\"bench\":\"relocate\",\"driver_bytes\":%u,\"fix\":\"0x%02x\","
+			       "\"fixups\":%u,\"runs\":%llu,\"relocs_per_s\":%.0f,\"fixups_per_s\":%.0f}\n",
+			       DLDIPATCH_VERSION, 1u << size, fixes[f], fixups, (unsigned long long)runs,
+			       runs / elapsed, (double)fixups * runs / elapsed);
+		}
+	}
+
+	return 0;
+}
+
+// Targets the checks relocate drivers to: another region, the same address,
+// one word up so that moved words land in the driver again, below the driver,
+// and an address the driver wraps around from.
+static const u32 check_targets[] = {
+	BENCH_STUB_BASE, BENCH_DRIVER_BASE, BENCH_DRIVER_BASE + 4, BENCH_DRIVER_BASE - 0x1000, 0xFFFFFF00,
+};
+
+// Fixes the words of a section one at a time, the way the original dlditool
+// does.
+static u32 benchReferenceFixSection(u32 *words, u32 start, u32 end, u32 oldStart, u32 oldEnd, u32 offset)
+{
+	u32 fixed = 0;
+
+	for (u32 i = (start - oldStart) / 4; i < (end - oldStart) / 4; i++)
+	{
+		if (words[i] >= oldStart && words[i] < oldEnd)
+		{
+			words[i] += offset;
+			fixed++;
+		}
+	}
+
+	return fixed;
+}
+
+// Reference relocation of a driver, without SIMD or precomputed words.
+static u32 benchReferenceRelocate(DLDI_INTERFACE *io, u32 targetAddress)
+{
+	u32 offset = targetAddress - io->dldiStart;
+	DLDI_INTERFACE old = *io;
+	u32 *words = (u32 *)io;
+	u32 fixed = 0;
+
+	io->dldiStart += offset;
+	io->dldiEnd += offset;
+	io->interworkStart += offset;
+	io->interworkEnd += offset;
+	io->gotStart += offset;
+	io->gotEnd += offset;
+	io->bssStart += offset;
+	io->bssEnd += offset;
+	io->ioInterface.startup += offset;
+	io->ioInterface.isInserted += offset;
+	io->ioInterface.readSectors += offset;
+	io->ioInterface.writeSectors += offset;
+	io->ioInterface.clearStatus += offset;
+	io->ioInterface.shutdown += offset;
+
+	if (old.fixSectionsFlags & FIX_ALL)
+		fixed += benchReferenceFixSection(words, old.dldiStart, old.dldiEnd, old.dldiStart, old.dldiEnd, offset);
+	if (old.fixSectionsFlags & FIX_GLUE)
+		fixed += benchReferenceFixSection(words, old.interworkStart, old.interworkEnd, old.dldiStart, old.dldiEnd, offset);
+	if (old.fixSectionsFlags & FIX_GOT)
+		fixed += benchReferenceFixSection(words, old.gotStart, old.gotEnd, old.dldiStart, old.dldiEnd, offset);
+	if (old.fixSectionsFlags & FIX_BSS)
+		memset((u8 *)io + (old.bssStart - old.dldiStart), 0, old.bssEnd - old.bssStart);
+
+	return fixed;
+}
+
+// Builds a driver whose sections overlap each other, end in the middle of a
+// word, and are sized so that the vector loops leave a tail. The glue starts
+// with words on either side of the bounds of the driver.
+static void benchCheckDriver(u8 *buffer, u8 driver_size, u8 fix)
+{
+	u32 size = 1u << driver_size;
+	DLDI_INTERFACE *io = (DLDI_INTERFACE *)buffer;
+
+	benchMakeDriver(buffer, driver_size, fix, driver_size * 16 + fix);
+	io->dldiEnd -= 4;
+	io->interworkStart = BENCH_DRIVER_BASE + size / 2 + 4;
+	io->interworkEnd = io->interworkStart + size / 16 + 26;
+	io->gotStart = io->interworkEnd - 10;
+	io->gotEnd = io->gotStart + size / 16 + 20;
+	io->bssStart = io->dldiEnd;
+
+	const u32 edges[] = {
+		io->dldiStart - 1, io->dldiStart, io->dldiEnd - 1, io->dldiEnd,
+	};
+	memcpy(buffer + (io->interworkStart - BENCH_DRIVER_BASE), edges, sizeof(edges));
+	memcpy(buffer + (io->gotStart - BENCH_DRIVER_BASE), edges + 1, 2 * sizeof(u32));
+}
+
+// Compares a relocated driver with the reference, and reports the first
+// byte that differs.
+static bool benchCheckSame(const char *what, u8 driver_size, u8 fix, u32 target,
+                           const u8 *expected, u32 expected_fixed, const u8 *actual, u32 actual_fixed,
+                           u32 length)
+{
+	if (actual_fixed != expected_fixed)
+	{
+		fprintf(stderr, "%s: %u byte driver, fix 0x%02x, target 0x%08x: %u words fixed instead of %u\n",
+		        what, 1u << driver_size, fix, target, actual_fixed, expected_fixed);
+		return false;
+	}
+
+	for (u32 i = 0; i < length; i++)
+	{
+		if (actual[i] != expected[i])
+		{
+			fprintf(stderr, "%s: %u byte driver, fix 0x%02x, target 0x%08x: byte 0x%x is 0x%02x instead of 0x%02x\n",
+			        what, 1u << driver_size, fix, target, i, actual[i], expected[i]);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Relocates drivers of every size with every combination of fix flags, and
+// compares the result of dldiRelocate() with the reference.
+static int benchCheckRelocate(void)
+{
+	static u8 driver[1 << DLDI_SIZE_32KB] ALIGN(4);
+	static u8 expected[1 << DLDI_SIZE_32KB] ALIGN(4);
+	static u8 actual[1 << DLDI_SIZE_32KB] ALIGN(4);
+	int cases = 0;
+	int failed = 0;
+
+	for (u8 size = DLDI_SIZE_512B; size <= DLDI_SIZE_32KB; size++)
+	{
+		for (u8 fix = 0; fix <= (FIX_ALL | FIX_GLUE | FIX_GOT | FIX_BSS); fix++)
+		{
+			benchCheckDriver(driver, size, fix);
+
+			for (size_t t = 0; t < sizeof(check_targets) / sizeof(check_targets[0]); t++)
+			{
+				memcpy(expected, driver, sizeof(expected));
+				u32 expected_fixed = benchReferenceRelocate((DLDI_INTERFACE *)expected, check_targets[t]);
+
+				memcpy(actual, driver, sizeof(actual));
+				u32 fixed = dldiRelocate((DLDI_INTERFACE *)actual, check_targets[t]);
+				if (!benchCheckSame("relocate", size, fix, check_targets[t], expected, expected_fixed,
+				                    actual, fixed, sizeof(actual)))
+					failed++;
+				cases++;
+			}
+		}
+	}
+
+	printf("{\"version\":\"%s\",\"check\":\"relocate\",\"cases\":%d,\"failed\":%d}\n",
+	       DLDIPATCH_VERSION, cases, failed);
+	return failed != 0 ? -EIO : 0;
+}
+
+// Relocates the same drivers with plans built by dldiRelocPlanCreate() and
+// by dldiRelocPlanLoad() from its entries, and through a relocation cache,
+// and compares the results with the reference.
+static int benchCheckPlan(void)
+{
+	static u8 driver[1 << DLDI_SIZE_32KB] ALIGN(4);
+	static u8 expected[1 << DLDI_SIZE_32KB] ALIGN(4);
+	static u8 actual[1 << DLDI_SIZE_32KB] ALIGN(4);
+	const size_t target_count = sizeof(check_targets) / sizeof(check_targets[0]);
+	int cases = 0;
+	int failed = 0;
+
+	DLDI_RELOC_CACHE *cache = dldiRelocCacheCreate(target_count);
+	if (cache == NULL)
+		return -ENOMEM;
+
+	for (u8 size = DLDI_SIZE_512B; size <= DLDI_SIZE_32KB; size++)
+	{
+		for (u8 fix = 0; fix <= (FIX_ALL | FIX_GLUE | FIX_GOT | FIX_BSS); fix++)
+		{
+			benchCheckDriver(driver, size, fix);
+
+			DLDI_RELOC_PLAN *plan;
+			int rc = dldiRelocPlanCreate((const DLDI_INTERFACE *)driver, &plan);
+			if (rc != 0)
+			{
+				dldiRelocCacheFree(cache);
+				return rc;
+			}
+
+			const DLDI_RELOC_ENTRY *entries;
+			u32 count = dldiRelocPlanEntries(plan, &entries);
+			DLDI_RELOC_PLAN *loaded;
+			rc = dldiRelocPlanLoad((const DLDI_INTERFACE *)driver, dldiRelocPlanHash(plan), entries, count, &loaded);
+			if (rc != 0)
+			{
+				dldiRelocPlanFree(plan);
+				dldiRelocCacheFree(cache);
+				return rc;
+			}
+
+			for (size_t t = 0; t < target_count; t++)
+			{
+				memcpy(expected, driver, sizeof(expected));
+				u32 expected_fixed = benchReferenceRelocate((DLDI_INTERFACE *)expected, check_targets[t]);
+
+				u32 fixed = dldiRelocPlanApply(plan, (DLDI_INTERFACE *)actual, check_targets[t]);
+				if (!benchCheckSame("plan", size, fix, check_targets[t], expected, expected_fixed,
+				                    actual, fixed, sizeof(actual)))
+					failed++;
+
+				fixed = dldiRelocPlanApply(loaded, (DLDI_INTERFACE *)actual, check_targets[t]);
+				if (!benchCheckSame("loaded plan", size, fix, check_targets[t], expected, expected_fixed,
+				                    actual, fixed, sizeof(actual)))
+					failed++;
+				cases += 2;
+			}
+
+			// The cache sets the allocated size of the stub, and only keeps
+			// the bytes of the driver. The first pass fills it, the second
+			// one reads from it.
+			for (int pass = 0; pass < 2; pass++)
+			{
+				for (size_t t = 0; t < target_count; t++)
+				{
+					memcpy(expected, driver, sizeof(expected));
+					u32 expected_fixed = benchReferenceRelocate((DLDI_INTERFACE *)expected, check_targets[t]);
+					((DLDI_INTERFACE *)expected)->allocatedSize = DLDI_SIZE_32KB;
+
+					bool hit = dldiRelocCacheGet(cache, plan, check_targets[t], DLDI_SIZE_32KB,
+					                             (DLDI_INTERFACE *)actual);
+					if (hit != (pass == 1))
+					{
+						fprintf(stderr, "cache: %u byte driver, fix 0x%02x, target 0x%08x: %s instead of %s\n",
+						        1u << size, fix, check_targets[t], hit ? "hit" : "miss", hit ? "miss" : "hit");
+						failed++;
+					}
+					else if (!benchCheckSame("cache", size, fix, check_targets[t], expected, expected_fixed,
+					                         actual, expected_fixed, 1u << size))
+						failed++;
+					cases++;
+				}
+			}
+
+			dldiRelocPlanFree(loaded);
+			dldiRelocPlanFree(plan);
+		}
+	}
+
+	dldiRelocCacheFree(cache);
+	printf("{\"version\":\"%s\",\"check\":\"plan\",\"cases\":%d,\"failed\":%d}\n",
+	       DLDIPATCH_VERSION, cases, failed);
+	return failed != 0 ? -EIO : 0;
+}
+
+// The IPS offset that reads as "EOF", and the byte of the driver that is left
+// different in the stub of the delta check, so that its only change lands
+// there.
+#define CHECK_EOF_OFFSET    0x454F46
+#define CHECK_EOF_CHANGE    0x302
+
+// Size of the image of the delta check, which must reach past the "EOF"
+// offset.
+#define CHECK_IMAGE_SIZE    0x460000
+
+static int benchWriteFile(const char *path, const void *data, size_t size)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+	int rc = write(fd, data, size) == (ssize_t)size ? 0 : -EIO;
+	if (close(fd) != 0 && rc == 0)
+		rc = -errno;
+	return rc;
+}
+
+// Compares a file with the bytes it should hold, and reports the first byte
+// that differs.
+static bool benchCheckFile(const char *what, const char *path, const u8 *expected, size_t size)
+{
+	u8 *data = (u8 *)malloc(size + 1);
+	int fd = open(path, O_RDONLY);
+	ssize_t got = -1;
+	if (data != NULL && fd >= 0)
+		got = read(fd, data, size + 1);
+	if (fd >= 0)
+		close(fd);
+
+	bool same = got == (ssize_t)size;
+	if (!same)
+		fprintf(stderr, "%s: %s has %zd bytes instead of %zu\n", what, path, got, size);
+	for (size_t i = 0; same && i < size; i++)
+	{
+		if (data[i] != expected[i])
+		{
+			fprintf(stderr, "%s: byte 0x%zx is 0x%02x instead of 0x%02x\n", what, i, data[i], expected[i]);
+			same = false;
+		}
+	}
+
+	free(data);
+	return same;
+}
+
+// Applies a patch to a copy of an image, and checks the result. A second
+// application must find nothing left to do.
+static bool benchCheckApply(const char *what, const char *delta_path, const char *path,
+                            const u8 *image, const u8 *expected, size_t size)
+{
+	int rc = benchWriteFile(path, image, size);
+	int delta_fd = open(delta_path, O_RDONLY);
+	int fd = open(path, O_RDWR);
+
+	int changed = -EIO;
+	int again = -EIO;
+	if (rc == 0 && delta_fd >= 0 && fd >= 0)
+	{
+		changed = dldiDeltaApply(delta_fd, fd, 0, NULL);
+		if (changed > 0)
+			again = dldiDeltaApply(delta_fd, fd, 0, NULL);
+	}
+	if (delta_fd >= 0)
+		close(delta_fd);
+	if (fd >= 0)
+		close(fd);
+
+	if (changed <= 0 || again != 0)
+	{
+		fprintf(stderr, "%s: applied with %d, then %d\n", what, changed, again);
+		return false;
+	}
+	return benchCheckFile(what, path, expected, size);
+}
+
+// Writes an IPS patch by hand, with a change longer than a record split in
+// two and a record that starts before the "EOF" offset and runs past it.
+static int benchWriteIps(const char *path, u8 *expected)
+{
+	static const struct { u32 offset; u32 size; } records[] = {
+		{ 0x100000, 0xFFFF },
+		{ 0x10FFFF, 0x2346 },
+		{ CHECK_EOF_OFFSET - 1, 3 },
+	};
+	u8 *patch = (u8 *)malloc(5 + 0x20000);
+	if (patch == NULL)
+		return -ENOMEM;
+
+	size_t pos = 0;
+	memcpy(patch, "PATCH", 5);
+	pos += 5;
+	for (size_t r = 0; r < sizeof(records) / sizeof(records[0]); r++)
+	{
+		u32 offset = records[r].offset;
+		u32 length = records[r].size;
+		patch[pos++] = offset >> 16;
+		patch[pos++] = offset >> 8;
+		patch[pos++] = offset;
+		patch[pos++] = length >> 8;
+		patch[pos++] = length;
+		for (u32 i = 0; i < length; i++)
+			patch[pos++] = expected[offset + i] = (u8)(offset + i * 7);
+	}
+	memcpy(patch + pos, "EOF", 3);
+	pos += 3;
+
+	int rc = benchWriteFile(path, patch, pos);
+	free(patch);
+	return rc;
+}
+
+// Creates IPS and BPS patches of an image and applies them to copies, which
+// must then match the image patched by dldiImagePatch(). The image has an
+// empty stub, and one that only differs from the driver at the "EOF" offset.
+// Patches made by dldiDeltaCreate() have one range per stub, so a change
+// longer than an IPS record is checked with a patch written by hand.
+static int benchCheckDelta(void)
+{
+	static u8 driver[1 << DLDI_SIZE_32KB] ALIGN(4);
+	static u8 stub[1 << DLDI_SIZE_32KB] ALIGN(4);
+	static const DLDI_DELTA_FORMAT formats[] = { DLDI_DELTA_IPS, DLDI_DELTA_BPS };
+	static const char *const format_names[] = { "ips", "bps" };
+	char dir[] = "/tmp/dldibench-check.XXXXXX";
+	char src[64], patched[64], applied[64], delta[64];
+	int cases = 0;
+	int failed = 0;
+
+	if (mkdtemp(dir) == NULL)
+		return -errno;
+	snprintf(src, sizeof(src), "%s/src.nds", dir);
+	snprintf(patched, sizeof(patched), "%s/patched.nds", dir);
+	snprintf(applied, sizeof(applied), "%s/applied.nds", dir);
+	snprintf(delta, sizeof(delta), "%s/delta", dir);
+
+	DLDI_RELOC_PLAN *plan = NULL;
+	u8 *image = (u8 *)malloc(CHECK_IMAGE_SIZE);
+	u8 *expected = (u8 *)malloc(CHECK_IMAGE_SIZE);
+	int rc = image != NULL && expected != NULL ? 0 : -ENOMEM;
+
+	if (rc == 0)
+	{
+		u64 state = 0x5DEECE66DULL;
+		for (u32 i = 0; i < CHECK_IMAGE_SIZE; i += 8)
+		{
+			u64 r = benchRandom(&state);
+			memcpy(image + i, &r, 8);
+		}
+
+		DLDI_INTERFACE *io = (DLDI_INTERFACE *)stub;
+		memset(stub, 0, sizeof(stub));
+		benchHeader(io, DLDI_SIZE_32KB, DLDI_SIZE_32KB, 0, "Default (No interface)", BENCH_STUB_BASE, 0x49444C44);
+		io->dldiEnd = BENCH_STUB_BASE + sizeof(DLDI_INTERFACE);
+		memcpy(image + 0x200, stub, sizeof(stub));
+
+		benchMakeDriver(driver, DLDI_SIZE_16KB, FIX_GLUE | FIX_GOT | FIX_BSS, 1);
+		rc = dldiRelocPlanCreate((const DLDI_INTERFACE *)driver, &plan);
+	}
+	if (rc == 0)
+	{
+		dldiRelocPlanApply(plan, (DLDI_INTERFACE *)stub, BENCH_STUB_BASE + 0x10000);
+		stub[CHECK_EOF_CHANGE] ^= 0xFF;
+		memcpy(image + CHECK_EOF_OFFSET - CHECK_EOF_CHANGE, stub, 1 << DLDI_SIZE_16KB);
+		rc = benchWriteFile(src, image, CHECK_IMAGE_SIZE);
+	}
+
+	// The image patched in place is what every patch must produce.
+	if (rc == 0)
+		rc = benchWriteFile(patched, image, CHECK_IMAGE_SIZE);
+	if (rc == 0)
+	{
+		DLDI_IMAGE *target;
+		rc = dldiImageOpen(patched, DLDI_IMAGE_WRITE, &target);
+		if (rc == 0)
+		{
+			rc = dldiImagePatch(target, plan, NULL, dldiImageFd(target), 0);
+			int close_rc = dldiImageClose(target);
+			rc = rc == 2 ? close_rc : rc < 0 ? rc : -EIO;
+		}
+	}
+	if (rc == 0)
+	{
+		int fd = open(patched, O_RDONLY);
+		if (fd < 0 || read(fd, expected, CHECK_IMAGE_SIZE) != CHECK_IMAGE_SIZE)
+			rc = -EIO;
+		if (fd >= 0)
+			close(fd);
+	}
+	if (rc == 0 && expected[CHECK_EOF_OFFSET] == image[CHECK_EOF_OFFSET])
+	{
+		fprintf(stderr, "delta: the stub wasn't changed at the \"EOF\" offset\n");
+		rc = -EIO;
+	}
+
+	for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]) && rc == 0; f++)
+	{
+		DLDI_IMAGE *source;
+		rc = dldiImageOpen(src, 0, &source);
+		if (rc != 0)
+			break;
+		int fd = open(delta, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		int created = fd >= 0 ? dldiDeltaCreate(source, plan, formats[f], fd) : -errno;
+		if (fd >= 0)
+			close(fd);
+		dldiImageClose(source);
+
+		char what[32];
+		snprintf(what, sizeof(what), "delta %s", format_names[f]);
+		if (created != 2)
+		{
+			fprintf(stderr, "%s: created with %d\n", what, created);
+			failed++;
+		}
+		else if (!benchCheckApply(what, delta, applied, image, expected, CHECK_IMAGE_SIZE))
+		{
+			failed++;
+		}
+		cases++;
+	}
+
+	// A damaged BPS patch is refused before anything is written.
+	if (rc == 0)
+		rc = benchWriteFile(applied, image, CHECK_IMAGE_SIZE);
+	if (rc == 0)
+	{
+		int delta_fd = open(delta, O_RDWR);
+		int fd = open(applied, O_RDWR);
+		u8 byte = 0;
+		if (delta_fd < 0 || fd < 0 || pread(delta_fd, &byte, 1, 8) != 1)
+			rc = -EIO;
+		byte ^= 0xFF;
+		if (rc == 0 && pwrite(delta_fd, &byte, 1, 8) != 1)
+			rc = -EIO;
+		if (rc == 0)
+		{
+			int damaged = dldiDeltaApply(delta_fd, fd, 0, NULL);
+			if (damaged != -EBADMSG)
+				fprintf(stderr, "delta damaged: applied with %d\n", damaged);
+			if (damaged != -EBADMSG || !benchCheckFile("delta damaged", applied, image, CHECK_IMAGE_SIZE))
+				failed++;
+			cases++;
+		}
+		if (fd >= 0)
+			close(fd);
+		if (delta_fd >= 0)
+			close(delta_fd);
+	}
+
+	if (rc == 0)
+	{
+		memcpy(expected, image, CHECK_IMAGE_SIZE);
+		rc = benchWriteIps(delta, expected);
+	}
+	if (rc == 0)
+	{
+		if (!benchCheckApply("delta ips records", delta, applied, image, expected, CHECK_IMAGE_SIZE))
+			failed++;
+		cases++;
+	}
+
+	unlink(src);
+	unlink(patched);
+	unlink(applied);
+	unlink(delta);
+	rmdir(dir);
+	dldiRelocPlanFree(plan);
+	free(expected);
+	free(image);
+	if (rc != 0)
+		return rc;
+
+	printf("{\"version\":\"%s\",\"check\":\"delta\",\"cases\":%d,\"failed\":%d}\n",
+	       DLDIPATCH_VERSION, cases, failed);
+	return failed != 0 ? -EIO : 0;
+}
+
+// Layout of the file of the FAT check: two empty stubs, neither of which
+// starts on a cluster.
+#define CHECK_FAT_STUB_1    0x1204
+#define CHECK_FAT_STUB_2    0xB400
+#define CHECK_FAT_FILE_SIZE (CHECK_FAT_STUB_2 + (1 << DLDI_SIZE_32KB) + 0x64)
+
+// Clusters are a single sector, so files have many of them.
+#define CHECK_FAT_CLUSTER   512
+
+static void benchPut16(u8 *data, u16 value)
+{
+	data[0] = value;
+	data[1] = value >> 8;
+}
+
+static void benchPut32(u8 *data, u32 value)
+{
+	benchPut16(data, value);
+	benchPut16(data + 2, value >> 16);
+}
+
+// Writes a sparse disk image with a FAT16 or FAT32 filesystem that holds one
+// file, /GAME.NDS, in clusters that run backwards with a free cluster between
+// each of them. On FAT32, they are past cluster 0xFFFF.
+static int benchWriteFat(const char *path, bool fat32, const u8 *file, u32 *clusters, u32 *data_offset)
+{
+	const u32 cluster_count = fat32 ? 65600 : 8000;
+	const u32 file_clusters = (CHECK_FAT_FILE_SIZE + CHECK_FAT_CLUSTER - 1) / CHECK_FAT_CLUSTER;
+	const u32 entry_size = fat32 ? 4 : 2;
+	const u32 reserved_sectors = fat32 ? 32 : 1;
+	const u32 root_entries = fat32 ? 0 : 512;
+	const u32 root_sectors = root_entries * 32 / CHECK_FAT_CLUSTER;
+	const u32 fat_sectors = ((cluster_count + 2) * entry_size + CHECK_FAT_CLUSTER - 1) / CHECK_FAT_CLUSTER;
+	const u32 data_sector = reserved_sectors + fat_sectors + root_sectors;
+	const u32 eoc = fat32 ? 0x0FFFFFFF : 0xFFFF;
+
+	u8 boot[512] = { 0xEB, 0x3C, 0x90 };
+	memcpy(boot + 3, "DLDIBNCH", 8);
+	benchPut16(boot + 11, CHECK_FAT_CLUSTER);
+	boot[13] = 1;
+	benchPut16(boot + 14, reserved_sectors);
+	boot[16] = 1;
+	benchPut16(boot + 17, root_entries);
+	boot[21] = 0xF8;
+	benchPut32(boot + 32, data_sector + cluster_count);
+	if (fat32)
+	{
+		benchPut32(boot + 36, fat_sectors);
+		benchPut32(boot + 44, 2);
+	}
+	else
+	{
+		benchPut16(boot + 22, fat_sectors);
+	}
+	boot[510] = 0x55;
+	boot[511] = 0xAA;
+
+	u8 *table = (u8 *)calloc(fat_sectors, CHECK_FAT_CLUSTER);
+	if (table == NULL)
+		return -ENOMEM;
+
+	// The FAT32 root directory is cluster 2, a single cluster.
+	u32 last = cluster_count + 1;
+	for (u32 i = 0; i < file_clusters; i++)
+		clusters[i] = last - 2 * i;
+	for (u32 i = 0; i < file_clusters; i++)
+	{
+		u32 next = i + 1 < file_clusters ? clusters[i + 1] : eoc;
+		if (fat32)
+			benchPut32(table + clusters[i] * 4, next);
+		else
+			benchPut16(table + clusters[i] * 2, next);
+	}
+	if (fat32)
+	{
+		benchPut32(table, 0x0FFFFFF8);
+		benchPut32(table + 4, eoc);
+		benchPut32(table + 8, eoc);
+	}
+	else
+	{
+		benchPut16(table, 0xFFF8);
+		benchPut16(table + 2, eoc);
+	}
+
+	u8 entry[32];
+	memset(entry, 0, sizeof(entry));
+	memcpy(entry, "GAME    NDS", 11);
+	entry[11] = 0x20;
+	benchPut16(entry + 20, fat32 ? clusters[0] >> 16 : 0);
+	benchPut16(entry + 26, clusters[0]);
+	benchPut32(entry + 28, CHECK_FAT_FILE_SIZE);
+
+	*data_offset = data_sector * CHECK_FAT_CLUSTER;
+	u64 root_offset = fat32 ? *data_offset : (u64)(reserved_sectors + fat_sectors) * CHECK_FAT_CLUSTER;
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	int rc = fd >= 0 ? 0 : -errno;
+	if (rc == 0 && ftruncate(fd, (u64)(data_sector + cluster_count) * CHECK_FAT_CLUSTER) != 0)
+		rc = -errno;
+	if (rc == 0 && (pwrite(fd, boot, sizeof(boot), 0) != sizeof(boot) ||
+	                pwrite(fd, table, fat_sectors * CHECK_FAT_CLUSTER, reserved_sectors * CHECK_FAT_CLUSTER) !=
+	                    (ssize_t)(fat_sectors * CHECK_FAT_CLUSTER) ||
+	                pwrite(fd, entry, sizeof(entry), root_offset) != sizeof(entry)))
+		rc = -EIO;
+	for (u32 i = 0; i < file_clusters && rc == 0; i++)
+	{
+		u32 len = CHECK_FAT_FILE_SIZE - i * CHECK_FAT_CLUSTER;
+		len = len < CHECK_FAT_CLUSTER ? len : CHECK_FAT_CLUSTER;
+		if (pwrite(fd, file + i * CHECK_FAT_CLUSTER, len, *data_offset + (u64)(clusters[i] - 2) * CHECK_FAT_CLUSTER) != len)
+			rc = -EIO;
+	}
+	if (fd >= 0 && close(fd) != 0 && rc == 0)
+		rc = -errno;
+
+	free(table);
+	return rc;
+}
+
+// Reads the file of the FAT check back from its clusters, and checks that
+// the free clusters between them are still empty.
+static bool benchCheckFatFile(const char *what, const char *path, const u32 *clusters, u32 data_offset,
+                              const u8 *expected)
+{
+	const u32 file_clusters = (CHECK_FAT_FILE_SIZE + CHECK_FAT_CLUSTER - 1) / CHECK_FAT_CLUSTER;
+	static u8 cluster[CHECK_FAT_CLUSTER];
+	static const u8 zero[CHECK_FAT_CLUSTER];
+	bool same = true;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	for (u32 i = 0; i < file_clusters && same; i++)
+	{
+		u32 len = CHECK_FAT_FILE_SIZE - i * CHECK_FAT_CLUSTER;
+		len = len < CHECK_FAT_CLUSTER ? len : CHECK_FAT_CLUSTER;
+		u64 offset = data_offset + (u64)(clusters[i] - 2) * CHECK_FAT_CLUSTER;
+
+		if (pread(fd, cluster, CHECK_FAT_CLUSTER, offset) != CHECK_FAT_CLUSTER ||
+		    memcmp(cluster, expected + i * CHECK_FAT_CLUSTER, len) != 0)
+		{
+			fprintf(stderr, "%s: cluster %u of the file differs\n", what, i);
+			same = false;
+		}
+		else if (i > 0 && (pread(fd, cluster, CHECK_FAT_CLUSTER, offset + CHECK_FAT_CLUSTER) != CHECK_FAT_CLUSTER ||
+		                   memcmp(cluster, zero, CHECK_FAT_CLUSTER) != 0))
+		{
+			fprintf(stderr, "%s: the free cluster before cluster %u of the file was written\n", what, i - 1);
+			same = false;
+		}
+	}
+
+	close(fd);
+	return same;
+}
+
+// Patches a fragmented file in a FAT16 and in a FAT32 image: checking first,
+// which must find both stubs and write nothing, then patching, then patching
+// again, which must find nothing left to do.
+static int benchCheckFat(void)
+{
+	static u8 driver[1 << DLDI_SIZE_32KB] ALIGN(4);
+	static u8 stub[1 << DLDI_SIZE_32KB] ALIGN(4);
+	static const u32 stub_offsets[] = { CHECK_FAT_STUB_1, CHECK_FAT_STUB_2 };
+	char path[] = "/tmp/dldibench-fat.XXXXXX";
+	int cases = 0;
+	int failed = 0;
+
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return -errno;
+	close(fd);
+
+	DLDI_RELOC_PLAN *plan = NULL;
+	u8 *file = (u8 *)malloc(CHECK_FAT_FILE_SIZE);
+	u8 *expected = (u8 *)malloc(CHECK_FAT_FILE_SIZE);
+	u32 *clusters = (u32 *)malloc(CHECK_FAT_FILE_SIZE / CHECK_FAT_CLUSTER * sizeof(u32) + sizeof(u32));
+	int rc = file != NULL && expected != NULL && clusters != NULL ? 0 : -ENOMEM;
+
+	if (rc == 0)
+	{
+		benchMakeDriver(driver, DLDI_SIZE_16KB, FIX_GLUE | FIX_GOT | FIX_BSS, 2);
+		rc = dldiRelocPlanCreate((const DLDI_INTERFACE *)driver, &plan);
+	}
+	if (rc == 0)
+	{
+		u64 state = 0x2545F4914F6CDD1DULL;
+		for (u32 i = 0; i + 8 <= CHECK_FAT_FILE_SIZE; i += 8)
+		{
+			u64 r = benchRandom(&state);
+			memcpy(file + i, &r, 8);
+		}
+
+		for (size_t s = 0; s < sizeof(stub_offsets) / sizeof(stub_offsets[0]); s++)
+		{
+			u32 address = BENCH_STUB_BASE + (u32)s * 0x100000;
+			DLDI_INTERFACE *io = (DLDI_INTERFACE *)stub;
+			memset(stub, 0, sizeof(stub));
+			benchHeader(io, DLDI_SIZE_32KB, DLDI_SIZE_32KB, 0, "Default (No interface)", address, 0x49444C44);
+			io->dldiEnd = address + sizeof(DLDI_INTERFACE);
+			memcpy(file + stub_offsets[s], stub, sizeof(stub));
+
+			dldiRelocPlanApply(plan, (DLDI_INTERFACE *)stub, address);
+			io->allocatedSize = DLDI_SIZE_32KB;
+			memcpy(expected + stub_offsets[s], stub, 1 << DLDI_SIZE_16KB);
+		}
+
+		// Everything but the drivers is left as it was.
+		for (u32 i = 0; i < CHECK_FAT_FILE_SIZE; i++)
+		{
+			bool in_driver = (i >= CHECK_FAT_STUB_1 && i < CHECK_FAT_STUB_1 + (1 << DLDI_SIZE_16KB)) ||
+			                 (i >= CHECK_FAT_STUB_2 && i < CHECK_FAT_STUB_2 + (1 << DLDI_SIZE_16KB));
+			if (!in_driver)
+				expected[i] = file[i];
+		}
+	}
+
+	for (int fat32 = 0; fat32 < 2 && rc == 0; fat32++)
+	{
+		const char *what = fat32 ? "fat32" : "fat16";
+		u32 data_offset;
+		rc = benchWriteFat(path, fat32, file, clusters, &data_offset);
+		if (rc != 0)
+			break;
+
+		DLDI_FAT *fat;
+		rc = dldiFatOpen(path, DLDI_IMAGE_WRITE, &fat);
+		if (rc != 0)
+		{
+			fprintf(stderr, "%s: failed to open the image: %s\n", what, strerror(-rc));
+			break;
+		}
+
+		int checked = dldiFatPatch(fat, "/GAME.NDS", plan, NULL, DLDI_PATCH_CHECK, DLDI_SYNC_NONE, NULL);
+		bool same = checked == 2 && benchCheckFatFile(what, path, clusters, data_offset, file);
+		int patched = dldiFatPatch(fat, "/GAME.NDS", plan, NULL, 0, DLDI_SYNC_NONE, NULL);
+		same = same && patched == 2 && benchCheckFatFile(what, path, clusters, data_offset, expected);
+		int again = dldiFatPatch(fat, "/GAME.NDS", plan, NULL, 0, DLDI_SYNC_NONE, NULL);
+		same = same && again == 0;
+		rc = dldiFatClose(fat);
+
+		if (!same)
+		{
+			fprintf(stderr, "%s: checked with %d, patched with %d, then %d\n", what, checked, patched, again);
+			failed++;
+		}
+		cases++;
+	}
+
+	unlink(path);
+	dldiRelocPlanFree(plan);
+	free(clusters);
+	free(expected);
+	free(file);
+	if (rc != 0)
+		return rc;
+
+	printf("{\"version\":\"%s\",\"check\":\"fat\",\"cases\":%d,\"failed\":%d}\n",
+	       DLDIPATCH_VERSION, cases, failed);
+	return failed != 0 ? -EIO : 0;
+}
+
+// Patches copies of a ROM the way "dldipatch patch" does, one file at a time.
+static int benchPatch(const char *dir, u64 size_mb, int files, bool cold)
+{
+	char path[4096];
+	char src[4096];
+
+	snprintf(src, sizeof(src), "%s/rom_%llumb_middle.nds", dir, (unsigned long long)size_mb);
+	snprintf(path, sizeof(path), "%s/driver_%u.dldi", dir, 1u << DLDI_SIZE_8KB);
+
+	DLDI_IMAGE *driver_image;
+	int rc = dldiImageOpen(path, 0, &driver_image);
+	if (rc != 0)
+		return rc;
+	DLDI_RELOC_PLAN *plan;
+	rc = dldiRelocPlanCreate(dldiImageDriver(driver_image), &plan);
+	dldiImageClose(driver_image);
+	if (rc != 0)
+		return rc;
+
+	// Each target is a fresh copy of the same unpatched ROM.
+	u8 *rom = NULL;
+	FILE *f = fopen(src, "rb");
+	if (f == NULL)
+	{
+		dldiRelocPlanFree(plan);
+		return -errno;
+	}
+	u64 rom_size = size_mb << 20;
+	rom = (u8 *)malloc(rom_size);
+	if (rom == NULL || fread(rom, 1, rom_size, f) != rom_size)
+		rc = -EIO;
+	fclose(f);
+
+	for (int i = 0; i < files && rc == 0; i++)
+	{
+		snprintf(path, sizeof(path), "%s/target_%d.nds", dir, i);
+		f = fopen(path, "wb");
+		if (f == NULL || fwrite(rom, 1, rom_size, f) != rom_size)
+			rc = -EIO;
+		if (f != NULL)
+			fclose(f);
+		if (cold)
+			benchDropCache(path);
+	}
+	free(rom);
+
+	DLDI_INTERFACE *new_dldi = (DLDI_INTERFACE *)dldiBufferGet();
+	double start = benchNow();
+	for (int i = 0; i < files && rc == 0; i++)
+	{
+		snprintf(path, sizeof(path), "%s/target_%d.nds", dir, i);
+
+		DLDI_IMAGE *image;
+		rc = dldiImageOpen(path, DLDI_IMAGE_WRITE, &image);
+		if (rc != 0)
+			break;
+
+		for (int s = 0; s < dldiImageStubCount(image); s++)
+		{
+			const DLDI_STUB *stub = dldiImageStub(image, s);
+			dldiRelocPlanApply(plan, new_dldi, stub->header.dldiStart);
+			new_dldi->allocatedSize = stub->header.allocatedSize;
+			ssize_t dldi_size = 1 << new_dldi->driverSize;
+			if (pwrite(dldiImageFd(image), new_dldi, dldi_size, stub->offset) != dldi_size)
+				rc = -EIO;
+		}
+		int close_rc = dldiImageClose(image);
+		if (rc == 0)
+			rc = close_rc;
+	}
+	double elapsed = benchNow() - start;
+	dldiBufferPut(new_dldi);
+	dldiRelocPlanFree(plan);
+
+	for (int i = 0; i < files; i++)
+	{
+		snprintf(path, sizeof(path), "%s/target_%d.nds", dir, i);
+		unlink(path);
+	}
+
+	if (rc != 0)
+		return rc;
+
+	printf("{\"version\":\"%s\",\"bench\":\"patch\",\"rom_mb\":%llu,\"files\":%d,"
+	       "\"cache\":\"%s\",\"seconds\":%.6f,\"files_per_s\":%.1f}\n",
+	       DLDIPATCH_VERSION, (unsigned long long)size_mb, files,
+	       cold ? "cold" : "warm", elapsed, files / elapsed);
+	return 0;
+}
+
+// Size of the ROMs of the batch benchmark, typical of homebrew.
+#define BENCH_BATCH_ROM_SIZE    (512 << 10)
+
+static void benchBatchDone(void *arg, int index, int rc, const DLDI_STUB *stubs,
+                           int stub_count, const bool *changed, const DLDI_STATS *stats)
+{
+	int *failed = (int *)arg;
+	(void)index;
+	(void)stubs;
+	(void)stub_count;
+	(void)changed;
+	(void)stats;
+
+	if (rc <= 0)
+		(*failed)++;
+}
+
+// Patches many small ROMs one at a time, then as a batch with each engine.
+// Every run starts from fresh copies, so each one writes every file.
+static int benchBatch(const char *dir, int files, int threads, bool cold)
+{
+	static const DLDI_BATCH_ENGINE engines[] = { DLDI_BATCH_AUTO, DLDI_BATCH_THREADS, DLDI_BATCH_URING };
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s/driver_%u.dldi", dir, 1u << DLDI_SIZE_8KB);
+	DLDI_IMAGE *driver_image;
+	int rc = dldiImageOpen(path, 0, &driver_image);
+	if (rc != 0)
+		return rc;
+	DLDI_RELOC_PLAN *plan;
+	rc = dldiRelocPlanCreate(dldiImageDriver(driver_image), &plan);
+	dldiImageClose(driver_image);
+	if (rc != 0)
+		return rc;
+
+	char **paths = (char **)calloc(files, sizeof(char *));
+	if (paths == NULL)
+		rc = -ENOMEM;
+	for (int i = 0; i < files && rc == 0; i++)
+	{
+		snprintf(path, sizeof(path), "%s/batch_%d.nds", dir, i);
+		paths[i] = strdup(path);
+		if (paths[i] == NULL)
+			rc = -ENOMEM;
+	}
+
+	// DLDI_BATCH_AUTO stands for the synchronous path.
+	for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]) && rc == 0; e++)
+	{
+		for (int i = 0; i < files && rc == 0; i++)
+		{
+			rc = benchWriteRom(paths[i], BENCH_BATCH_ROM_SIZE, stub_positions[i % 3], 4);
+			if (cold)
+				benchDropCache(paths[i]);
+		}
+		if (rc != 0)
+			break;
+
+		int failed = 0;
+		int used = engines[e];
+		double start = benchNow();
+		if (engines[e] == DLDI_BATCH_AUTO)
+		{
+			for (int i = 0; i < files && rc == 0; i++)
+			{
+				DLDI_IMAGE *image;
+				rc = dldiImageOpen(paths[i], DLDI_IMAGE_WRITE, &image);
+				if (rc != 0)
+					break;
+				if (dldiImagePatch(image, plan, NULL, dldiImageFd(image), 0) <= 0)
+					failed++;
+				rc = dldiImageClose(image);
+			}
+		}
+		else
+		{
+			used = dldiBatchRun((const char *const *)paths, files, plan, NULL, 0, DLDI_SYNC_NONE,
+			                    engines[e], 64, threads, benchBatchDone, &failed);
+		}
+		double elapsed = benchNow() - start;
+
+		if (used == -ENOSYS || used == -EPERM)
+		{
+			fprintf(stderr, "io_uring isn't available, skipping\n");
+			continue;
+		}
+		if (used < 0)
+			rc = used;
+		if (rc == 0 && failed != 0)
+			rc = -EIO;
+		if (rc != 0)
+			break;
+
+		printf("{\"version\":\"%s\",\"bench\":\"batch\",\"engine\":\"%s\",\"threads\":%d,"
+		       "\"files\":%d,\"rom_kb\":%d,\"cache\":\"%s\",\"seconds\":%.6f,\"files_per_s\":%.1f}\n",
+		       DLDIPATCH_VERSION, engines[e] == DLDI_BATCH_AUTO ? "sync" : dldiBatchEngineName(used),
+		       engines[e] == DLDI_BATCH_THREADS ? threads : 1, files, BENCH_BATCH_ROM_SIZE >> 10,
+		       cold ? "cold" : "warm", elapsed, files / elapsed);
+	}
+
+	for (int i = 0; i < files && paths != NULL; i++)
+	{
+		if (paths[i] != NULL)
+			unlink(paths[i]);
+		free(paths[i]);
+	}
+	free(paths);
+	dldiRelocPlanFree(plan);
+	return rc;
+}
+
+static int benchGenerate(const char *dir, const u64 *sizes, int size_count)
+{
+	char path[4096];
+	int rc;
+
+	for (u8 size = DLDI_SIZE_512B; size <= DLDI_SIZE_32KB; size++)
+	{
+		snprintf(path, sizeof(path), "%s/driver_%u.dldi", dir, 1u << size);
+		rc = benchWriteDriver(path, size, FIX_GLUE | FIX_GOT | FIX_BSS);
+		if (rc != 0)
+			return rc;
+	}
+
+	for (int s = 0; s < size_count; s++)
+	{
+		for (int p = 0; p < 3; p++)
+		{
+			snprintf(path, sizeof(path), "%s/rom_%llumb_%s.nds", dir, (unsigned long long)sizes[s], stub_positions[p]);
+
+			// Only regenerate files that don't exist yet, as large ones take
+			// a while to write.
+			struct stat st;
+			if (stat(path, &st) == 0 && (u64)st.st_size == sizes[s] << 20)
+				continue;
+
+			rc = benchWriteRom(path, sizes[s] << 20, stub_positions[p], 16);
+			if (rc != 0)
+				return rc;
+		}
+	}
+
+	return 0;
+}
+
+static int benchParseSizes(const char *list, u64 *sizes, int max)
+{
+	int count = 0;
+	char *end;
+
+	while (*list != '\0' && count < max)
+	{
+		u64 size = strtoull(list, &end, 10);
+		if (end == list || size == 0 || size > 2048)
+			return -EINVAL;
+		sizes[count++] = size;
+		list = *end == ',' ? end + 1 : end;
+	}
+
+	return count;
+}
+
+static void benchHelp(void)
+{
+	printf("dldibench\n\n");
+	printf("Running every benchmark on generated files:\n");
+	printf("dldibench run [--dir dir] [--sizes 1,16,256] [--files n]\n\n");
+	printf("Generating a driver:\n");
+	printf("dldibench gen-driver out.dldi size_log2 fix_flags\n\n");
+	printf("Generating a ROM with an empty stub:\n");
+	printf("dldibench gen-rom out.nds size_mb start|middle|end decoys\n\n");
+	printf("Checking the library against reference implementations:\n");
+	printf("dldibench check\n\n");
+	printf("ROM sizes are in MB, from 1 to 2048.\n");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		benchHelp();
+		return -EINVAL;
+	}
+
+	if (strcmp(argv[1], "gen-driver") == 0 && argc == 5)
+	{
+		int size = atoi(argv[3]);
+		if (size < DLDI_SIZE_512B || size > DLDI_SIZE_32KB)
+		{
+			fprintf(stderr, "Invalid driver size: %s\n", argv[3]);
+			return -EINVAL;
+		}
+		return benchWriteDriver(argv[2], size, strtol(argv[4], NULL, 0) & 0x0F);
+	}
+	else if (strcmp(argv[1], "gen-rom") == 0 && argc == 6)
+	{
+		u64 size;
+		if (benchParseSizes(argv[3], &size, 1) != 1)
+		{
+			fprintf(stderr, "Invalid ROM size: %s\n", argv[3]);
+			return -EINVAL;
+		}
+		return benchWriteRom(argv[2], size << 20, argv[4], atoi(argv[5]));
+	}
+	else if (strcmp(argv[1], "check") == 0 && argc == 2)
+	{
+		int rc = benchCheckRelocate();
+		if (rc == 0)
+			rc = benchCheckPlan();
+		if (rc == 0)
+			rc = benchCheckDelta();
+		if (rc == 0)
+			rc = benchCheckFat();
+		if (rc != 0)
+			fprintf(stderr, "Check failed: %s\n", strerror(-rc));
+		return rc;
+	}
+	else if (strcmp(argv[1], "run") != 0)
+	{
+		benchHelp();
+		return -EINVAL;
+	}
+
+	const char *dir = "/tmp/dldibench";
+	const char *size_list = "1,16,256";
+	int files = 64;
+	for (int arg = 2; arg + 1 < argc; arg += 2)
+	{
+		if (strcmp(argv[arg], "--dir") == 0)
+			dir = argv[arg + 1];
+		else if (strcmp(argv[arg], "--sizes") == 0)
+			size_list = argv[arg + 1];
+		else if (strcmp(argv[arg], "--files") == 0)
+			files = atoi(argv[arg + 1]);
+	}
+
+	u64 sizes[16];
+	int size_count = benchParseSizes(size_list, sizes, 16);
+	if (size_count <= 0 || files < 1)
+	{
+		fprintf(stderr, "Invalid ROM sizes: %s\n", size_list);
+		return -EINVAL;
+	}
+
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "Failed to create %s: %s\n", dir, strerror(errno));
+		return -errno;
+	}
+
+	int rc = benchGenerate(dir, sizes, size_count);
+	if (rc == 0)
+		rc = benchRelocate();
+	for (int s = 0; s < size_count && rc == 0; s++)
+	{
+		rc = benchScan(dir, sizes[s], false);
+		if (rc == 0)
+			rc = benchScan(dir, sizes[s], true);
+	}
+	for (int s = 0; s < size_count && rc == 0; s++)
+	{
+		// Keep the end-to-end run to about 1 GB of copies per cache state.
+		int n = files;
+		if ((u64)n * sizes[s] > 1024)
+			n = 1024 / sizes[s] > 0 ? 1024 / sizes[s] : 1;
+		rc = benchPatch(dir, sizes[s], n, false);
+		if (rc == 0)
+			rc = benchPatch(dir, sizes[s], n, true);
+	}
+	if (rc == 0)
+	{
+		long threads = sysconf(_SC_NPROCESSORS_ONLN);
+		rc = benchBatch(dir, files * 8, threads > 1 ? threads : 1, false);
+		if (rc == 0)
+			rc = benchBatch(dir, files * 8, threads > 1 ? threads : 1, true);
+	}
+
+	if (rc != 0)
+		fprintf(stderr, "Benchmark failed: %s\n", strerror(-rc));
+	return rc;
+}
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_BUILTIN_H__
+#define DLDIPATCH_DLDI_BUILTIN_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dldi_catalog.h"
+
+/// Drivers built into dldipatch, sorted by ID.
+///
+/// The table is generated by dldibundle from the drivers of BUILTIN_DIRS when
+/// dldipatch is built, and is empty if no directory was given.
+extern const DLDI_BUILTIN dldiBuiltins[];
+
+/// Number of drivers in dldiBuiltins.
+extern const int dldiBuiltinCount;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_BUILTIN_H__
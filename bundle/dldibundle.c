@@ -0,0 +1,206 @@
+// SPDX-License-Identifier: Zlib
+//
+// Generates the table of drivers built into dldipatch from driver files and
+// directories. The C source of the table is written to stdout. Drivers are
+// loaded and validated like those of --drivers, and their relocation plans
+// are computed here so that dldipatch never has to.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "libdldipatch.h"
+
+// Address the plans are checked at.
+#define BUNDLE_CHECK_ADDRESS    0x02004000
+
+// Prints a string literal. Everything that isn't printable ASCII is escaped,
+// in octal so that the next character can't be taken as part of the escape.
+static void bundlePrintString(const char *s, size_t size)
+{
+	putchar('"');
+	for (size_t i = 0; i < size; i++)
+	{
+		unsigned char c = (unsigned char)s[i];
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c >= 0x20 && c < 0x7F)
+			putchar(c);
+		else
+			printf("\\%03o", c);
+	}
+	putchar('"');
+}
+
+static const char *bundleBaseName(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	return slash != NULL ? slash + 1 : path;
+}
+
+// Builds the plan of a driver and checks that a plan loaded back from its
+// entries relocates the driver the same way.
+static int bundlePlan(const DLDI_CATALOG_ENTRY *entry, DLDI_RELOC_PLAN **plan)
+{
+	int rc = dldiCatalogPlan(entry, plan);
+	if (rc != 0)
+		return rc;
+
+	const DLDI_RELOC_ENTRY *relocs;
+	u32 count = dldiRelocPlanEntries(*plan, &relocs);
+	DLDI_RELOC_PLAN *loaded;
+	rc = dldiRelocPlanLoad(entry->driver, entry->hash, relocs, count, &loaded);
+	if (rc != 0)
+	{
+		dldiRelocPlanFree(*plan);
+		return rc;
+	}
+
+	u8 *expected = (u8 *)dldiBufferGet();
+	u8 *actual = (u8 *)dldiBufferGet();
+	if (expected == NULL || actual == NULL)
+	{
+		rc = -ENOMEM;
+	}
+	else
+	{
+		dldiRelocPlanApply(*plan, (DLDI_INTERFACE *)expected, BUNDLE_CHECK_ADDRESS);
+		dldiRelocPlanApply(loaded, (DLDI_INTERFACE *)actual, BUNDLE_CHECK_ADDRESS);
+		if (memcmp(expected, actual, DLDI_BUFFER_SIZE) != 0)
+			rc = -EINVAL;
+	}
+
+	dldiBufferPut(expected);
+	dldiBufferPut(actual);
+	dldiRelocPlanFree(loaded);
+	if (rc != 0)
+		dldiRelocPlanFree(*plan);
+	return rc;
+}
+
+static void bundlePrintDriver(int index, const DLDI_CATALOG_ENTRY *entry, const DLDI_RELOC_PLAN *plan)
+{
+	u32 words = (1u << entry->driver->driverSize) / sizeof(u32);
+	const u8 *bytes = (const u8 *)entry->driver;
+
+	printf("static const u32 dldiBuiltinDriver%d[%u] = {", index, words);
+	for (u32 i = 0; i < words; i++)
+	{
+		u32 word;
+		memcpy(&word, bytes + i * sizeof(u32), sizeof(u32));
+		printf("%s0x%08x,", i % 8 == 0 ? "\n\t" : " ", word);
+	}
+	printf("\n};\n\n");
+
+	const DLDI_RELOC_ENTRY *relocs;
+	u32 count = dldiRelocPlanEntries(plan, &relocs);
+	printf("static const DLDI_RELOC_ENTRY dldiBuiltinRelocs%d[%u] = {", index, count);
+	for (u32 i = 0; i < count; i++)
+		printf("%s{ %u, %u, %u },", i % 6 == 0 ? "\n\t" : " ", relocs[i].index, relocs[i].always, relocs[i].passes);
+	printf("\n};\n\n");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && argv[1][0] == '-')
+	{
+		fprintf(stderr, "dldibundle [dir/driver...] > table.c\n");
+		return -EINVAL;
+	}
+
+	DLDI_CATALOG *catalog;
+	int rc = dldiCatalogLoad((const char *const *)argv + 1, argc - 1, sysconf(_SC_NPROCESSORS_ONLN), &catalog);
+	if (rc != 0)
+	{
+		fprintf(stderr, "Failed to load drivers: %s\n", strerror(-rc));
+		return rc;
+	}
+
+	// Copies of a driver are only built in once. Different drivers with the
+	// same ID would make the table ambiguous.
+	int count = dldiCatalogCount(catalog);
+	bool *keep = (bool *)calloc(count + 1, sizeof(bool));
+	if (keep == NULL)
+	{
+		dldiCatalogFree(catalog);
+		return -ENOMEM;
+	}
+	for (int i = 0; i < count; i++)
+	{
+		const DLDI_CATALOG_ENTRY *entry = dldiCatalogEntry(catalog, i);
+		keep[i] = true;
+		for (int j = i - 1; j >= 0; j--)
+		{
+			const DLDI_CATALOG_ENTRY *other = dldiCatalogEntry(catalog, j);
+			if (strcmp(other->id, entry->id) != 0)
+				break;
+			if (other->hash != entry->hash)
+			{
+				fprintf(stderr, "Conflicting driver ID %s: %s, %s\n", entry->id, other->path, entry->path);
+				rc = -EINVAL;
+			}
+			keep[i] = false;
+		}
+	}
+
+	if (rc == 0)
+	{
+		printf("// Generated by bundle/dldibundle. Do not edit.\n\n");
+		printf("#include \"dldi_builtin.h\"\n\n");
+	}
+
+	int kept = 0;
+	for (int i = 0; i < count && rc == 0; i++)
+	{
+		const DLDI_CATALOG_ENTRY *entry = dldiCatalogEntry(catalog, i);
+		if (!keep[i])
+			continue;
+
+		DLDI_RELOC_PLAN *plan;
+		rc = bundlePlan(entry, &plan);
+		if (rc != 0)
+		{
+			fprintf(stderr, "%s: Failed to relocate driver: %s\n", entry->path, strerror(-rc));
+			break;
+		}
+		bundlePrintDriver(i, entry, plan);
+		dldiRelocPlanFree(plan);
+		kept++;
+	}
+
+	if (rc == 0)
+	{
+		printf("const DLDI_BUILTIN dldiBuiltins[] = {\n");
+		for (int i = 0; i < count; i++)
+		{
+			const DLDI_CATALOG_ENTRY *entry = dldiCatalogEntry(catalog, i);
+			if (!keep[i])
+				continue;
+
+			printf("\t{\n\t\t.path = ");
+			bundlePrintString(bundleBaseName(entry->path), strlen(bundleBaseName(entry->path)));
+			printf(",\n\t\t.name = ");
+			bundlePrintString(entry->name, strlen(entry->name));
+			printf(",\n\t\t.id = ");
+			bundlePrintString(entry->id, 4);
+			printf(",\n\t\t.hash = 0x%016llxULL,\n", (unsigned long long)entry->hash);
+			printf("\t\t.driver = (const DLDI_INTERFACE *)dldiBuiltinDriver%d,\n", i);
+			printf("\t\t.relocs = dldiBuiltinRelocs%d,\n", i);
+			printf("\t\t.reloc_count = sizeof(dldiBuiltinRelocs%d) / sizeof(DLDI_RELOC_ENTRY),\n\t},\n", i);
+		}
+		printf("};\n\n");
+		printf("const int dldiBuiltinCount = %d;\n", kept);
+	}
+
+	if (fflush(stdout) != 0 && rc == 0)
+	{
+		rc = -errno;
+		fprintf(stderr, "Failed to write the table: %s\n", strerror(-rc));
+	}
+
+	free(keep);
+	dldiCatalogFree(catalog);
+	return rc;
+}
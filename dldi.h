@@ -11,6 +11,8 @@
 extern "C" {
 #endif
 
+#include <sys/types.h>
+
 #include "dldi_asm.h"
 #include "disc_io.h"
 
@@ -67,9 +69,16 @@ typedef struct DLDI_INTERFACE
 /// Load a DLDI driver from a file and set up the bus permissions.
 ///
 /// This is not directly usable as a filesystem driver.
-/// @return a pointer to the loaded DLDI_INTERFACE. This allocates the number of bytes specified in driverSize.
+/// @return a pointer to the loaded DLDI_INTERFACE. This allocates at least the number of bytes specified in driverSize.
 DLDI_INTERFACE *dldiLoadFromFile(const char *path);
 
+/// Load a DLDI driver from an open file.
+///
+/// The file is memory mapped for scanning, so it must be a regular file.
+/// @param dldi_offset If not NULL, receives the file offset of the driver.
+/// @return a pointer to the loaded DLDI_INTERFACE. This allocates at least the number of bytes specified in driverSize.
+DLDI_INTERFACE *dldiLoadFromFd(int fd, off_t *dldi_offset);
+
 /// Free the memory used by the DLDI driver.
 ///
 /// Remember to shut down the driver itself first:
@@ -0,0 +1,1003 @@
+// SPDX-License-Identifier: Zlib
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+#define DLDI_BATCH_URING_SUPPORTED
+#endif
+#endif
+
+#include "dldi_batch.h"
+#include "dldi_nds.h"
+#include "dldi_scan.h"
+#include "dldi_workers.h"
+
+typedef struct DLDI_BATCH
+{
+    const char *const *paths;
+    int count;
+    const DLDI_RELOC_PLAN *plan;
+    DLDI_RELOC_CACHE *cache;
+    int flags;
+    int sync;
+    DLDI_BATCH_FN fn;
+    void *arg;
+    int next; // Next file to start.
+    pthread_mutex_t report_lock;
+} DLDI_BATCH;
+
+// Files are opened for writing only if they may be patched.
+static bool dldiBatchWrites(const DLDI_BATCH *batch)
+{
+	return batch->plan != NULL && !(batch->flags & DLDI_PATCH_CHECK);
+}
+
+static void dldiBatchReport(DLDI_BATCH *batch, int index, int rc, const DLDI_STUB *stubs,
+                            int stub_count, const bool *changed, const DLDI_STATS *stats)
+{
+	pthread_mutex_lock(&batch->report_lock);
+	batch->fn(batch->arg, index, rc, stubs, stub_count, rc >= 0 ? changed : NULL, stats);
+	pthread_mutex_unlock(&batch->report_lock);
+}
+
+// Opens and patches one file at a time, exactly like a single target. The
+// stubs are copied, so that the file can be closed before it is reported.
+static void *dldiBatchWorker(void *arg)
+{
+	DLDI_BATCH *batch = (DLDI_BATCH *)arg;
+	bool writes = dldiBatchWrites(batch);
+
+	for (;;)
+	{
+		int index = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+		if (index >= batch->count)
+			break;
+
+		DLDI_STATS stats = {};
+		DLDI_STUB *stubs = NULL;
+		bool *changed = NULL;
+		int stub_count = 0;
+		DLDI_IMAGE *image;
+		int rc = dldiImageOpenIndexed(batch->paths[index], writes ? DLDI_IMAGE_WRITE : 0,
+		                              NULL, &stats, &image);
+		if (rc == 0)
+		{
+			stub_count = dldiImageStubCount(image);
+			stubs = (DLDI_STUB *)malloc(stub_count * sizeof(DLDI_STUB));
+			if (stubs == NULL)
+				rc = -ENOMEM;
+			for (int i = 0; i < stub_count && stubs != NULL; i++)
+				stubs[i] = *dldiImageStub(image, i);
+
+			if (rc == 0 && batch->plan != NULL)
+			{
+				rc = dldiImagePatch(image, batch->plan, batch->cache, dldiImageFd(image),
+				                    batch->flags & DLDI_PATCH_CHECK);
+				if (rc >= 0)
+					changed = (bool *)malloc(stub_count * sizeof(bool));
+				if (rc >= 0 && changed == NULL)
+					rc = -ENOMEM;
+				for (int i = 0; i < stub_count && changed != NULL; i++)
+					changed[i] = dldiImageStubChanged(image, i);
+			}
+			if (rc > 0 && writes)
+			{
+				int sync_rc = dldiSync(dldiImageFd(image), batch->sync, &stats);
+				if (sync_rc != 0)
+					rc = sync_rc;
+			}
+
+			int close_rc = dldiImageClose(image);
+			if (rc >= 0 && close_rc != 0)
+				rc = close_rc;
+		}
+
+		dldiBatchReport(batch, index, rc, stubs, stubs != NULL ? stub_count : 0, changed, &stats);
+		free(stubs);
+		free(changed);
+	}
+
+	return NULL;
+}
+
+static int dldiBatchThreads(DLDI_BATCH *batch, int threads)
+{
+	if (threads > batch->count)
+		threads = batch->count;
+	if (threads < 1)
+		threads = 1;
+
+	dldiRunWorkers(dldiBatchWorker, batch, threads);
+
+	return DLDI_BATCH_THREADS;
+}
+
+#ifdef DLDI_BATCH_URING_SUPPORTED
+
+// Largest number of files in flight, which bounds the size of the ring.
+#define DLDI_BATCH_MAX_DEPTH    1024
+
+// Reads and writes of one file that are in flight at once.
+#define DLDI_BATCH_FILE_OPS     4
+
+// Regions are read in pieces of this size, so that a large ARM binary is
+// read by several operations at once.
+#define DLDI_BATCH_READ_SIZE    (1 << 20)
+
+// Read buffers up to this size are kept for the next file of their slot.
+#define DLDI_BATCH_KEEP_SIZE    (64 << 20)
+
+// Submission and completion rings shared with the kernel.
+typedef struct DLDI_URING
+{
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_local_tail;
+    unsigned int sq_queued;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+} DLDI_URING;
+
+// Steps every file goes through, in order. Steps that have nothing to do for
+// a file are skipped.
+typedef enum DLDI_BATCH_STEP
+{
+    DLDI_BATCH_OPEN,
+    DLDI_BATCH_STAT,
+    DLDI_BATCH_HEADER,  // Reading the NDS header.
+    DLDI_BATCH_REGIONS, // Reading the regions to search.
+    DLDI_BATCH_COMPARE, // Reading stubs that may already hold the driver.
+    DLDI_BATCH_WRITE,
+    DLDI_BATCH_FSYNC,
+    DLDI_BATCH_CLOSE,
+    DLDI_BATCH_DONE,
+} DLDI_BATCH_STEP;
+
+// One read or write of a step, resubmitted until it is complete.
+typedef struct DLDI_BATCH_IO
+{
+    u64 offset;
+    u32 size;
+    u32 done;
+    int stub; // Stub written by the operation.
+} DLDI_BATCH_IO;
+
+// A file in flight.
+typedef struct DLDI_BATCH_FILE
+{
+    int index; // -1 for a free slot.
+    DLDI_BATCH_STEP step;
+    int fd;
+    int rc;
+    struct open_how how;
+    struct statx stx;
+    u64 size;
+    // The file is read into a buffer of at least its own size, at the same
+    // offsets. Only the bytes that were read are ever looked at, so the
+    // buffer is reused between files without clearing it.
+    u8 *data;
+    u64 data_size;
+    u32 header_size;
+    DLDI_REGION regions[DLDI_NDS_MAX_REGIONS];
+    int region_count;
+    DLDI_STUB *stubs;
+    int stub_count;
+    bool *changed;
+    int changed_count;
+    DLDI_INTERFACE *driver; // The driver relocated for one stub.
+    int relocated; // The stub driver is relocated for, or -1.
+    // Operations of the current step.
+    DLDI_BATCH_IO *io;
+    int io_capacity;
+    int io_count;
+    int io_next;
+    int io_busy;
+    DLDI_STATS stats;
+    u64 start;
+} DLDI_BATCH_FILE;
+
+static int dldiUringSetup(unsigned int entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int dldiUringEnter(int fd, unsigned int submit, unsigned int wait, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int dldiUringRegister(int fd, unsigned int opcode, void *arg, unsigned int count)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// Checks that the kernel knows every operation a batch uses. They all exist
+// since Linux 5.6, but io_uring may also be restricted by policy.
+static int dldiUringProbe(int fd)
+{
+	static const u8 ops[] = {
+		IORING_OP_OPENAT2, IORING_OP_STATX, IORING_OP_READ,
+		IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_CLOSE,
+	};
+	const unsigned int count = 256;
+
+	struct io_uring_probe *probe = (struct io_uring_probe *)
+		calloc(1, sizeof(struct io_uring_probe) + count * sizeof(struct io_uring_probe_op));
+	if (probe == NULL)
+		return -ENOMEM;
+
+	int rc = 0;
+	if (dldiUringRegister(fd, IORING_REGISTER_PROBE, probe, count) < 0)
+		rc = -ENOSYS;
+	for (size_t i = 0; i < sizeof(ops) && rc == 0; i++)
+	{
+		if (ops[i] >= probe->ops_len || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+			rc = -ENOSYS;
+	}
+
+	free(probe);
+	return rc;
+}
+
+static void dldiUringFree(DLDI_URING *ring)
+{
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+	if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED)
+		munmap(ring->sq_map, ring->sq_map_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+}
+
+static int dldiUringInit(DLDI_URING *ring, unsigned int entries)
+{
+	struct io_uring_params params = {};
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = dldiUringSetup(entries, &params);
+	if (ring->fd < 0)
+		return -errno;
+
+	int rc = dldiUringProbe(ring->fd);
+	if (rc != 0)
+	{
+		dldiUringFree(ring);
+		return rc;
+	}
+
+	ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+	ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_map && ring->cq_map_size > ring->sq_map_size)
+		ring->sq_map_size = ring->cq_map_size;
+
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED)
+		goto init_error;
+	if (single_map)
+		ring->cq_map = ring->sq_map;
+	else
+		ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+		                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_map == MAP_FAILED)
+		goto init_error;
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+	                                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto init_error;
+
+	u8 *sq = (u8 *)ring->sq_map;
+	ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	ring->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sq_local_tail = *ring->sq_tail;
+
+	u8 *cq = (u8 *)ring->cq_map;
+	ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	return 0;
+
+init_error:
+	rc = -errno;
+	dldiUringFree(ring);
+	return rc;
+}
+
+// Queues an operation. The ring has room for every operation of every file in
+// flight, so there is always a free entry.
+static struct io_uring_sqe *dldiUringQueue(DLDI_URING *ring, u8 opcode, int fd, int slot, int io)
+{
+	unsigned int index = ring->sq_local_tail & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = ((u64)slot << 32) | (u32)io;
+
+	ring->sq_array[index] = index;
+	ring->sq_local_tail++;
+	ring->sq_queued++;
+	return sqe;
+}
+
+// Submits the queued operations and waits for at least one to complete.
+static int dldiUringSubmit(DLDI_URING *ring)
+{
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	for (;;)
+	{
+		int rc = dldiUringEnter(ring->fd, ring->sq_queued, 1, IORING_ENTER_GETEVENTS);
+		if (rc >= 0)
+		{
+			ring->sq_queued -= rc;
+			return 0;
+		}
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			return -errno;
+	}
+}
+
+// Number of region bytes that come before a file offset.
+static u64 dldiBatchRegionBytes(const DLDI_BATCH_FILE *f, u64 offset)
+{
+	u64 bytes = 0;
+
+	for (int r = 0; r < f->region_count && f->regions[r].offset < offset; r++)
+	{
+		u64 end = f->regions[r].offset + f->regions[r].size;
+		bytes += (end < offset ? end : offset) - f->regions[r].offset;
+	}
+
+	return bytes;
+}
+
+// Whether a range of the file was already read into the buffer.
+static bool dldiBatchIsRead(const DLDI_BATCH_FILE *f, u64 offset, u64 size)
+{
+	if (offset + size <= f->header_size)
+		return true;
+
+	for (int r = 0; r < f->region_count; r++)
+	{
+		const DLDI_REGION *region = &f->regions[r];
+		if (offset >= region->offset && offset + size <= region->offset + region->size)
+			return true;
+	}
+
+	return false;
+}
+
+static int dldiBatchAddIo(DLDI_BATCH_FILE *f, u64 offset, u32 size, int stub)
+{
+	if (f->io_count == f->io_capacity)
+	{
+		int capacity = f->io_capacity > 0 ? f->io_capacity * 2 : DLDI_BATCH_FILE_OPS;
+		DLDI_BATCH_IO *io = (DLDI_BATCH_IO *)realloc(f->io, capacity * sizeof(DLDI_BATCH_IO));
+		if (io == NULL)
+			return -ENOMEM;
+		f->io = io;
+		f->io_capacity = capacity;
+	}
+
+	f->io[f->io_count++] = (DLDI_BATCH_IO){ offset, size, 0, stub };
+	return 0;
+}
+
+static void dldiBatchBufferFree(DLDI_BATCH_FILE *f)
+{
+	if (f->data != NULL)
+		munmap(f->data, f->data_size);
+	f->data = NULL;
+	f->data_size = 0;
+}
+
+// Makes the read buffer of a file large enough for it. The buffer is mapped
+// rather than allocated, so the pages that are never read cost nothing.
+static int dldiBatchBuffer(DLDI_BATCH_FILE *f)
+{
+	if (f->data_size >= f->size)
+		return 0;
+
+	dldiBatchBufferFree(f);
+	u64 size = (f->size + DLDI_BATCH_READ_SIZE - 1) & ~(u64)(DLDI_BATCH_READ_SIZE - 1);
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (data == MAP_FAILED)
+		return -ENOMEM;
+
+	f->data = (u8 *)data;
+	f->data_size = size;
+	return 0;
+}
+
+// Relocates the driver for a stub, unless it already is, and returns it.
+static const DLDI_INTERFACE *dldiBatchRelocate(DLDI_BATCH *batch, DLDI_BATCH_FILE *f, int stub,
+                                               DLDI_PHASE phase)
+{
+	if (f->relocated == stub)
+		return f->driver;
+
+	const DLDI_INTERFACE *dst_dldi = &f->stubs[stub].header;
+	f->start = dldiStatsPhase(&f->stats, phase, f->start);
+	if (batch->cache != NULL)
+	{
+		dldiRelocCacheGet(batch->cache, batch->plan, dst_dldi->dldiStart, dst_dldi->allocatedSize, f->driver);
+	}
+	else
+	{
+		dldiRelocPlanApply(batch->plan, f->driver, dst_dldi->dldiStart);
+		f->driver->allocatedSize = dst_dldi->allocatedSize;
+	}
+	f->start = dldiStatsPhase(&f->stats, DLDI_PHASE_RELOCATE, f->start);
+
+	f->relocated = stub;
+	return f->driver;
+}
+
+// Queues the reads and writes of the current step, as far as the limit of the
+// file allows. Writes all use the relocated driver, so they go one at a time.
+static void dldiBatchPump(DLDI_BATCH *batch, DLDI_URING *ring, int slot, DLDI_BATCH_FILE *f)
+{
+	int limit = f->step == DLDI_BATCH_WRITE ? 1 : DLDI_BATCH_FILE_OPS;
+
+	while (f->io_busy < limit && f->io_next < f->io_count)
+	{
+		DLDI_BATCH_IO *io = &f->io[f->io_next];
+		struct io_uring_sqe *sqe;
+
+		if (f->step == DLDI_BATCH_WRITE)
+		{
+			const DLDI_INTERFACE *driver = dldiBatchRelocate(batch, f, io->stub, DLDI_PHASE_WRITE);
+			sqe = dldiUringQueue(ring, IORING_OP_WRITE, f->fd, slot, f->io_next);
+			sqe->addr = (u64)(uintptr_t)driver;
+			f->stats.write_calls++;
+		}
+		else
+		{
+			sqe = dldiUringQueue(ring, IORING_OP_READ, f->fd, slot, f->io_next);
+			sqe->addr = (u64)(uintptr_t)(f->data + io->offset);
+			f->stats.read_calls++;
+		}
+		sqe->len = io->size;
+		sqe->off = io->offset;
+
+		f->io_next++;
+		f->io_busy++;
+	}
+}
+
+// Sets up the reads of the stubs that may already hold the driver. Stubs
+// whose header differs from the relocated one are known to differ without
+// reading anything more.
+static int dldiBatchCompare(DLDI_BATCH *batch, DLDI_BATCH_FILE *f)
+{
+	const DLDI_INTERFACE *src_dldi = dldiRelocPlanDriver(batch->plan);
+
+	// Every stub is checked before anything is written, so that a target is
+	// either fully patched or left alone.
+	for (int i = 0; i < f->stub_count; i++)
+	{
+		if (src_dldi->driverSize > f->stubs[i].header.allocatedSize)
+			return -ENOSPC;
+	}
+
+	f->changed = (bool *)calloc(f->stub_count, sizeof(bool));
+	f->driver = (DLDI_INTERFACE *)dldiBufferGet();
+	if (f->changed == NULL || f->driver == NULL)
+		return -ENOMEM;
+
+	for (int i = 0; i < f->stub_count; i++)
+	{
+		const DLDI_STUB *stub = &f->stubs[i];
+		const DLDI_INTERFACE *driver = dldiBatchRelocate(batch, f, i, DLDI_PHASE_VALIDATE);
+		u64 size = 1 << driver->driverSize;
+
+		if (memcmp(&stub->header, driver, DLDI_HEADER_SIZE) != 0 ||
+		    (u64)stub->offset + size > f->size)
+		{
+			f->changed[i] = true;
+			continue;
+		}
+
+		if (!dldiBatchIsRead(f, stub->offset, size))
+		{
+			int rc = dldiBatchAddIo(f, stub->offset, size, i);
+			if (rc != 0)
+				return rc;
+		}
+	}
+
+	return 0;
+}
+
+// Compares the stubs that weren't ruled out by their header, now that they
+// are read, and sets up the writes of the stubs that differ.
+static int dldiBatchPrepareWrites(DLDI_BATCH *batch, DLDI_BATCH_FILE *f)
+{
+	for (int i = 0; i < f->stub_count; i++)
+	{
+		if (!f->changed[i])
+		{
+			const DLDI_INTERFACE *driver = dldiBatchRelocate(batch, f, i, DLDI_PHASE_VALIDATE);
+			f->changed[i] = memcmp(f->data + f->stubs[i].offset, driver, 1 << driver->driverSize) != 0;
+		}
+		if (!f->changed[i])
+			continue;
+
+		f->changed_count++;
+		if (batch->flags & DLDI_PATCH_CHECK)
+			continue;
+
+		int rc = dldiBatchAddIo(f, f->stubs[i].offset, 1 << dldiRelocPlanDriver(batch->plan)->driverSize, i);
+		if (rc != 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+// Searches the regions that were read for stubs.
+static int dldiBatchScan(DLDI_BATCH_FILE *f)
+{
+	u64 *offsets;
+	int found = dldiFindStubsInRegions(f->data, f->regions, f->region_count, INT_MAX, 1, &offsets);
+	if (found < 0)
+		return found;
+
+	u64 scanned = dldiBatchRegionBytes(f, f->size);
+	f->stats.bytes_scanned += scanned;
+	f->stats.bytes_to_stub += found > 0 ? dldiBatchRegionBytes(f, offsets[0]) : scanned;
+
+	if (found == 0)
+		return -ENODATA;
+
+	f->stubs = (DLDI_STUB *)malloc(found * sizeof(DLDI_STUB));
+	if (f->stubs == NULL)
+	{
+		free(offsets);
+		return -ENOMEM;
+	}
+	for (int i = 0; i < found; i++)
+		dldiStubInit(&f->stubs[i], (const DLDI_INTERFACE *)(f->data + offsets[i]), offsets[i]);
+	f->stub_count = found;
+
+	free(offsets);
+	return 0;
+}
+
+// Sets up the regions to read once the NDS header is known. Regions are
+// read in pieces, skipping what the header read already covers.
+static int dldiBatchRegions(DLDI_BATCH_FILE *f)
+{
+	f->region_count = dldiScanRegions(f->data, f->header_size, f->size, f->regions);
+
+	for (int r = 0; r < f->region_count; r++)
+	{
+		u64 offset = f->regions[r].offset;
+		u64 end = offset + f->regions[r].size;
+		if (offset < f->header_size)
+			offset = f->header_size;
+
+		for (; offset < end; offset += DLDI_BATCH_READ_SIZE)
+		{
+			u64 size = end - offset < DLDI_BATCH_READ_SIZE ? end - offset : DLDI_BATCH_READ_SIZE;
+			int rc = dldiBatchAddIo(f, offset, size, -1);
+			if (rc != 0)
+				return rc;
+		}
+	}
+
+	return 0;
+}
+
+// Moves a file to its next step once every operation of the current one is
+// complete, and queues the operations of that step. Steps with nothing to
+// do are skipped. A file that fails is closed right away.
+static void dldiBatchAdvance(DLDI_BATCH *batch, DLDI_URING *ring, int slot, DLDI_BATCH_FILE *f)
+{
+	static const DLDI_PHASE phases[] = {
+		[DLDI_BATCH_OPEN] = DLDI_PHASE_LOAD,
+		[DLDI_BATCH_STAT] = DLDI_PHASE_LOAD,
+		[DLDI_BATCH_HEADER] = DLDI_PHASE_LOAD,
+		[DLDI_BATCH_REGIONS] = DLDI_PHASE_LOAD,
+		[DLDI_BATCH_COMPARE] = DLDI_PHASE_VALIDATE,
+		[DLDI_BATCH_WRITE] = DLDI_PHASE_WRITE,
+		[DLDI_BATCH_FSYNC] = DLDI_PHASE_FSYNC,
+		[DLDI_BATCH_CLOSE] = DLDI_PHASE_LOAD,
+	};
+
+	for (;;)
+	{
+		f->start = dldiStatsPhase(&f->stats, phases[f->step], f->start);
+		f->io_count = 0;
+		f->io_next = 0;
+
+		DLDI_BATCH_STEP step = f->step + 1;
+		if (f->rc < 0 && step < DLDI_BATCH_CLOSE)
+			step = DLDI_BATCH_CLOSE;
+		if (step == DLDI_BATCH_CLOSE && f->fd < 0)
+			step = DLDI_BATCH_DONE;
+		f->step = step;
+
+		int rc = 0;
+		struct io_uring_sqe *sqe;
+		switch (step)
+		{
+			case DLDI_BATCH_OPEN:
+				break;
+
+			case DLDI_BATCH_STAT:
+				sqe = dldiUringQueue(ring, IORING_OP_STATX, f->fd, slot, 0);
+				sqe->addr = (u64)(uintptr_t)"";
+				sqe->len = STATX_TYPE | STATX_SIZE;
+				sqe->off = (u64)(uintptr_t)&f->stx;
+				sqe->statx_flags = AT_EMPTY_PATH;
+				f->io_busy++;
+				return;
+
+			case DLDI_BATCH_HEADER:
+				if (!S_ISREG(f->stx.stx_mode))
+				{
+					rc = -EINVAL;
+					break;
+				}
+				f->size = f->stx.stx_size;
+				if (f->size < DLDI_HEADER_SIZE)
+				{
+					rc = -ENODATA;
+					break;
+				}
+				rc = dldiBatchBuffer(f);
+				if (rc != 0)
+					break;
+				f->header_size = f->size < DLDI_NDS_HEADER_SIZE ? f->size : DLDI_NDS_HEADER_SIZE;
+				rc = dldiBatchAddIo(f, 0, f->header_size, -1);
+				break;
+
+			case DLDI_BATCH_REGIONS:
+				rc = dldiBatchRegions(f);
+				break;
+
+			case DLDI_BATCH_COMPARE:
+				rc = dldiBatchScan(f);
+				f->start = dldiStatsPhase(&f->stats, DLDI_PHASE_SCAN, f->start);
+				if (rc == 0 && batch->plan == NULL)
+				{
+					// Only the stubs were asked for.
+					f->step = DLDI_BATCH_FSYNC;
+					continue;
+				}
+				if (rc == 0)
+					rc = dldiBatchCompare(batch, f);
+				break;
+
+			case DLDI_BATCH_WRITE:
+				rc = dldiBatchPrepareWrites(batch, f);
+				break;
+
+			case DLDI_BATCH_FSYNC:
+				if (batch->sync == DLDI_SYNC_NONE || f->changed_count == 0 || !dldiBatchWrites(batch))
+					break;
+				sqe = dldiUringQueue(ring, IORING_OP_FSYNC, f->fd, slot, 0);
+				if (batch->sync == DLDI_SYNC_DATA)
+					sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+				f->io_busy++;
+				return;
+
+			case DLDI_BATCH_CLOSE:
+				dldiUringQueue(ring, IORING_OP_CLOSE, f->fd, slot, 0);
+				f->fd = -1;
+				f->io_busy++;
+				return;
+
+			case DLDI_BATCH_DONE:
+				return;
+		}
+
+		if (rc != 0)
+			f->rc = rc;
+		if (f->rc == 0 && f->io_count > 0)
+		{
+			dldiBatchPump(batch, ring, slot, f);
+			return;
+		}
+	}
+}
+
+static void dldiBatchOpen(DLDI_BATCH *batch, DLDI_URING *ring, int slot, DLDI_BATCH_FILE *f)
+{
+	struct io_uring_sqe *sqe = dldiUringQueue(ring, IORING_OP_OPENAT2, AT_FDCWD, slot, 0);
+	sqe->addr = (u64)(uintptr_t)batch->paths[f->index];
+	sqe->len = sizeof(f->how);
+	sqe->off = (u64)(uintptr_t)&f->how;
+	f->io_busy++;
+}
+
+// Starts the next file of the batch in a free slot.
+static void dldiBatchStart(DLDI_BATCH *batch, DLDI_URING *ring, int slot, DLDI_BATCH_FILE *f)
+{
+	int index = batch->next++;
+	DLDI_BATCH_IO *io = f->io;
+	int io_capacity = f->io_capacity;
+	u8 *data = f->data;
+	u64 data_size = f->data_size;
+
+	// The buffers of the previous file are kept for this one.
+	memset(f, 0, sizeof(*f));
+	f->index = index;
+	f->fd = -1;
+	f->relocated = -1;
+	f->io = io;
+	f->io_capacity = io_capacity;
+	f->data = data;
+	f->data_size = data_size;
+	f->step = DLDI_BATCH_OPEN;
+	f->start = dldiStatsNow();
+
+	// Opens that only need cached directory entries complete right away.
+	// Others are retried without RESOLVE_CACHED, which io_uring hands to a
+	// worker thread.
+	f->how.flags = (dldiBatchWrites(batch) ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+	f->how.resolve = RESOLVE_CACHED;
+	dldiBatchOpen(batch, ring, slot, f);
+}
+
+// Reports a file that is done and frees what it used.
+static void dldiBatchFinish(DLDI_BATCH *batch, DLDI_BATCH_FILE *f)
+{
+	int rc = f->rc;
+	if (rc == 0 && batch->plan != NULL)
+		rc = f->changed_count;
+
+	dldiBatchReport(batch, f->index, rc, f->stubs, f->stub_count, f->changed, &f->stats);
+
+	if (f->data_size > DLDI_BATCH_KEEP_SIZE)
+		dldiBatchBufferFree(f);
+	free(f->stubs);
+	free(f->changed);
+	dldiBufferPut(f->driver);
+	f->index = -1;
+}
+
+// Handles the completion of an operation of a file.
+static void dldiBatchComplete(DLDI_BATCH *batch, DLDI_URING *ring, int slot, DLDI_BATCH_FILE *f,
+                              int io_index, int res)
+{
+	f->io_busy--;
+
+	switch (f->step)
+	{
+		case DLDI_BATCH_OPEN:
+			// Kernels before 5.12 don't know RESOLVE_CACHED.
+			if ((res == -EAGAIN || res == -EINVAL) && f->how.resolve != 0)
+			{
+				f->how.resolve = 0;
+				dldiBatchOpen(batch, ring, slot, f);
+				return;
+			}
+			if (res >= 0)
+				f->fd = res;
+			break;
+
+		case DLDI_BATCH_HEADER:
+		case DLDI_BATCH_REGIONS:
+		case DLDI_BATCH_COMPARE:
+		case DLDI_BATCH_WRITE:
+		{
+			DLDI_BATCH_IO *io = &f->io[io_index];
+			if (res <= 0)
+			{
+				// The file can't be shorter than it was when it was opened.
+				if (res == 0)
+					res = -EIO;
+				break;
+			}
+
+			io->done += res;
+			if (f->step == DLDI_BATCH_WRITE)
+				f->stats.bytes_written += res;
+			else
+				f->stats.bytes_read += res;
+
+			// Short reads and writes are resumed where they stopped.
+			if (io->done < io->size)
+			{
+				struct io_uring_sqe *sqe = dldiUringQueue(ring, f->step == DLDI_BATCH_WRITE ?
+				                                          IORING_OP_WRITE : IORING_OP_READ,
+				                                          f->fd, slot, io_index);
+				sqe->addr = f->step == DLDI_BATCH_WRITE ?
+					(u64)(uintptr_t)((u8 *)f->driver + io->done) :
+					(u64)(uintptr_t)(f->data + io->offset + io->done);
+				sqe->len = io->size - io->done;
+				sqe->off = io->offset + io->done;
+				f->io_busy++;
+				if (f->step == DLDI_BATCH_WRITE)
+					f->stats.write_calls++;
+				else
+					f->stats.read_calls++;
+				return;
+			}
+			break;
+		}
+
+		default:
+			break;
+	}
+
+	if (res < 0 && f->rc == 0)
+		f->rc = res;
+
+	if (f->rc == 0 && f->io_next < f->io_count)
+		dldiBatchPump(batch, ring, slot, f);
+	if (f->io_busy == 0)
+		dldiBatchAdvance(batch, ring, slot, f);
+	if (f->step == DLDI_BATCH_DONE)
+		dldiBatchFinish(batch, f);
+}
+
+static int dldiBatchUring(DLDI_BATCH *batch, int depth)
+{
+	if (depth > DLDI_BATCH_MAX_DEPTH)
+		depth = DLDI_BATCH_MAX_DEPTH;
+	if (depth > batch->count)
+		depth = batch->count;
+	if (depth < 1)
+		depth = 1;
+
+	// Every file has at most DLDI_BATCH_FILE_OPS operations in flight, so
+	// neither ring can overflow.
+	DLDI_URING ring;
+	int rc = dldiUringInit(&ring, depth * DLDI_BATCH_FILE_OPS);
+	if (rc != 0)
+		return rc;
+
+	DLDI_BATCH_FILE *files = (DLDI_BATCH_FILE *)calloc(depth, sizeof(DLDI_BATCH_FILE));
+	if (files == NULL)
+	{
+		dldiUringFree(&ring);
+		return -ENOMEM;
+	}
+	for (int i = 0; i < depth; i++)
+		files[i].index = -1;
+
+	int active = 0;
+	for (;;)
+	{
+		for (int i = 0; i < depth && batch->next < batch->count; i++)
+		{
+			if (files[i].index < 0)
+			{
+				dldiBatchStart(batch, &ring, i, &files[i]);
+				active++;
+			}
+		}
+		if (active == 0)
+			break;
+
+		rc = dldiUringSubmit(&ring);
+		if (rc != 0)
+			break;
+
+		unsigned int head = *ring.cq_head;
+		unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			const struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+			int slot = cqe->user_data >> 32;
+			int io_index = (u32)cqe->user_data;
+
+			dldiBatchComplete(batch, &ring, slot, &files[slot], io_index, cqe->res);
+			if (files[slot].index < 0)
+				active--;
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	// Closing the ring cancels whatever is still in flight after a failure.
+	dldiUringFree(&ring);
+	for (int i = 0; i < depth; i++)
+	{
+		if (files[i].index >= 0)
+		{
+			if (files[i].fd >= 0)
+				close(files[i].fd);
+			files[i].rc = rc;
+			dldiBatchFinish(batch, &files[i]);
+		}
+		dldiBatchBufferFree(&files[i]);
+		free(files[i].io);
+	}
+	free(files);
+
+	// Files that weren't started are reported like the ones in flight.
+	DLDI_STATS stats = {};
+	for (; rc != 0 && batch->next < batch->count; batch->next++)
+		dldiBatchReport(batch, batch->next, rc, NULL, 0, NULL, &stats);
+
+	return DLDI_BATCH_URING;
+}
+
+#else
+
+static int dldiBatchUring(DLDI_BATCH *batch, int depth)
+{
+	(void)batch;
+	(void)depth;
+	return -ENOSYS;
+}
+
+#endif
+
+int dldiBatchRun(const char *const *paths, int count, const DLDI_RELOC_PLAN *plan,
+                 DLDI_RELOC_CACHE *cache, int flags, int sync, DLDI_BATCH_ENGINE engine,
+                 int depth, int threads, DLDI_BATCH_FN fn, void *arg)
+{
+	DLDI_BATCH batch = {
+		.paths = paths,
+		.count = count,
+		.plan = plan,
+		.cache = cache,
+		.flags = flags,
+		.sync = sync,
+		.fn = fn,
+		.arg = arg,
+		.next = 0,
+	};
+	pthread_mutex_init(&batch.report_lock, NULL);
+
+	int rc = DLDI_BATCH_THREADS;
+	if (engine != DLDI_BATCH_THREADS)
+		rc = dldiBatchUring(&batch, depth);
+
+	// io_uring may be missing from the kernel, or disabled by policy. Either
+	// way, nothing has been started yet.
+	if (rc < 0 && engine == DLDI_BATCH_AUTO)
+		rc = DLDI_BATCH_THREADS;
+	if (rc == DLDI_BATCH_THREADS)
+		rc = dldiBatchThreads(&batch, threads);
+
+	pthread_mutex_destroy(&batch.report_lock);
+	return rc;
+}
+
+const char *dldiBatchEngineName(DLDI_BATCH_ENGINE engine)
+{
+	static const char *const names[] = { "auto", "uring", "threads" };
+
+	return (unsigned int)engine < sizeof(names) / sizeof(names[0]) ? names[engine] : "unknown";
+}
@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_BATCH_H__
+#define DLDIPATCH_DLDI_BATCH_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dldi_image.h"
+#include "dldi_output.h"
+#include "dldi_reloc.h"
+#include "dldi_stats.h"
+
+/// Ways of running a batch.
+typedef enum DLDI_BATCH_ENGINE
+{
+    /// io_uring if the kernel provides it, a pool of threads otherwise.
+    DLDI_BATCH_AUTO,
+    /// A single thread that keeps the I/O of many files in flight at once
+    /// through io_uring.
+    DLDI_BATCH_URING,
+    /// A pool of threads, each opening and patching one file at a time.
+    DLDI_BATCH_THREADS,
+} DLDI_BATCH_ENGINE;
+
+/// Called once for every file of a batch.
+///
+/// Calls are never made from several threads at once, but files are reported
+/// in the order they complete, which isn't the order of the paths.
+///
+/// @param arg The argument given to dldiBatchRun().
+/// @param index Index of the file in the paths of the batch.
+/// @param rc As returned by dldiImagePatch() when patching: the number of
+///     stubs that differed from the driver, or a negative errno value. When
+///     only reading, 0 or a negative errno value. -ENODATA if the file has no
+///     DLDI stub.
+/// @param stubs The stubs of the file, as they were before patching, or NULL
+///     if the file couldn't be read.
+/// @param stub_count Number of stubs.
+/// @param changed For each stub, whether it differed from the driver and was
+///     written unless DLDI_PATCH_CHECK was given. NULL when only reading, or
+///     if the file couldn't be patched.
+/// @param stats Counters of the work done on this file.
+typedef void (*DLDI_BATCH_FN)(void *arg, int index, int rc, const DLDI_STUB *stubs,
+                              int stub_count, const bool *changed, const DLDI_STATS *stats);
+
+/// Patch or read many files at once.
+///
+/// With io_uring, the opens, reads, writes and closes of up to depth files are
+/// queued together, so the cost of each system call and of waiting for
+/// storage is shared by the whole batch. Files are read rather than mapped,
+/// and NDS ROMs are only read where their ARM binaries are, plus the stubs
+/// that have to be compared with the driver. The stub index isn't used.
+///
+/// With threads, each thread opens and patches files one at a time like
+/// dldiImageOpen() and dldiImagePatch() do.
+///
+/// Either way, a file is patched exactly like dldiImagePatch() would: every
+/// stub is checked before anything is written, and stubs that already hold
+/// the driver aren't written.
+///
+/// @param paths Paths of the files.
+/// @param count Number of files.
+/// @param plan The plan of the driver to insert, or NULL to only locate the
+///     stubs of the files.
+/// @param cache Cache of relocated drivers, or NULL.
+/// @param flags DLDI_PATCH_CHECK to only compare.
+/// @param sync How files that were written are flushed to storage before they
+///     are reported: DLDI_SYNC_NONE, DLDI_SYNC_DATA or DLDI_SYNC_FULL.
+/// @param engine The engine to use.
+/// @param depth Number of files in flight with io_uring.
+/// @param threads Number of threads of the pool, including the calling
+///     thread.
+/// @param fn Function called for every file.
+/// @param arg Argument passed to fn.
+/// @return The engine the batch ran on, DLDI_BATCH_URING or
+///     DLDI_BATCH_THREADS, once every file has been reported, or a negative
+///     errno value if the batch couldn't start. That is -ENOSYS or -EPERM if
+///     DLDI_BATCH_URING was asked for and io_uring isn't available.
+int dldiBatchRun(const char *const *paths, int count, const DLDI_RELOC_PLAN *plan,
+                 DLDI_RELOC_CACHE *cache, int flags, int sync, DLDI_BATCH_ENGINE engine,
+                 int depth, int threads, DLDI_BATCH_FN fn, void *arg);
+
+/// Short lowercase name of an engine, such as "uring".
+const char *dldiBatchEngineName(DLDI_BATCH_ENGINE engine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_BATCH_H__
@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: Zlib
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dldi_buffer.h"
+#include "dldi_image.h"
+#include "dldi_nds.h"
+#include "dldi_reloc.h"
+#include "dldi_scan.h"
+
+ssize_t dldiRelocateInto(const void *src, size_t src_size, u32 targetAddress,
+                         u8 allocatedSize, void *out, size_t out_size)
+{
+	const DLDI_INTERFACE *src_dldi = (const DLDI_INTERFACE *)src;
+
+	if (!dldiIsValid(src_dldi, src_size))
+		return -EINVAL;
+
+	size_t dldi_size = 1 << src_dldi->driverSize;
+	if (out_size < dldi_size)
+		return -ENOSPC;
+
+	// dldiRelocate() works on a full size buffer, as the sections may reach
+	// past the end of the source.
+	DLDI_INTERFACE *new_dldi = (DLDI_INTERFACE *)dldiBufferGet();
+	if (new_dldi == NULL)
+		return -ENOMEM;
+
+	if (src_size > DLDI_BUFFER_SIZE)
+		src_size = DLDI_BUFFER_SIZE;
+	memcpy(new_dldi, src, src_size);
+	memset((u8 *)new_dldi + src_size, 0, DLDI_BUFFER_SIZE - src_size);
+
+	ssize_t fixed = dldiRelocate(new_dldi, targetAddress);
+	new_dldi->allocatedSize = allocatedSize;
+	memcpy(out, new_dldi, dldi_size);
+
+	dldiBufferPut(new_dldi);
+	return fixed;
+}
+
+int dldiPatchBuffer(const void *driver, size_t driver_size, void *rom, size_t rom_size)
+{
+	DLDI_REGION regions[DLDI_NDS_MAX_REGIONS];
+	int region_count = dldiScanRegions(driver, driver_size, driver_size, regions);
+
+	ssize_t src_offset = dldiFindInRegions(driver, regions, region_count, 0);
+	if (src_offset < 0)
+		return -ENODATA;
+
+	const DLDI_INTERFACE *src_dldi = (const DLDI_INTERFACE *)((const u8 *)driver + src_offset);
+
+	// Every stub is checked before anything is written, so that the ROM is
+	// either fully patched or left alone.
+	region_count = dldiScanRegions(rom, rom_size, rom_size, regions);
+	ssize_t dst_offset = dldiFindInRegions(rom, regions, region_count, 0);
+	if (dst_offset < 0)
+		return -ENODATA;
+	for (ssize_t i = dst_offset; i >= 0; )
+	{
+		const DLDI_INTERFACE *dst_dldi = (const DLDI_INTERFACE *)((u8 *)rom + i);
+		if (src_dldi->driverSize > dst_dldi->allocatedSize)
+			return -ENOSPC;
+		i = dldiFindInRegions(rom, regions, region_count, i + dldiStubSpan(dst_dldi));
+	}
+
+	DLDI_INTERFACE *new_dldi = (DLDI_INTERFACE *)dldiBufferGet();
+	if (new_dldi == NULL)
+		return -ENOMEM;
+
+	ssize_t rc = 0;
+	for (ssize_t i = dst_offset; i >= 0 && rc >= 0; )
+	{
+		DLDI_INTERFACE *dst_dldi = (DLDI_INTERFACE *)((u8 *)rom + i);
+		size_t next = i + dldiStubSpan(dst_dldi);
+
+		rc = dldiRelocateInto(src_dldi, driver_size - src_offset,
+		                      dst_dldi->dldiStart, dst_dldi->allocatedSize,
+		                      new_dldi, DLDI_BUFFER_SIZE);
+		if (rc >= 0)
+		{
+			// The stub may be cut short by the end of the ROM.
+			size_t dldi_size = 1 << new_dldi->driverSize;
+			if (dldi_size > rom_size - i)
+				dldi_size = rom_size - i;
+			memcpy(dst_dldi, new_dldi, dldi_size);
+		}
+
+		i = dldiFindInRegions(rom, regions, region_count, next);
+	}
+
+	dldiBufferPut(new_dldi);
+	return rc < 0 ? rc : 0;
+}
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_BUFFER_H__
+#define DLDIPATCH_DLDI_BUFFER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "dldi.h"
+
+/// Relocate a driver into a caller-owned buffer.
+///
+/// The source is not modified. It may be shorter than the size given by its
+/// driverSize field, as raw .dldi files often are; missing bytes are zero.
+///
+/// @param src A buffer that starts with a valid DLDI header.
+/// @param src_size Size of src in bytes.
+/// @param targetAddress The new value of dldiStart.
+/// @param allocatedSize The allocatedSize to store in the relocated driver.
+/// @param out Destination buffer.
+/// @param out_size Size of out in bytes. It must fit 1 << driverSize bytes.
+/// @return The number of section words that were fixed, -EINVAL if src
+///     isn't a valid driver, -ENOSPC if out is too small, or -ENOMEM.
+ssize_t dldiRelocateInto(const void *src, size_t src_size, u32 targetAddress,
+                         u8 allocatedSize, void *out, size_t out_size);
+
+/// Patch a ROM in memory with a driver in memory.
+///
+/// The driver is searched for in the driver buffer, so it may be a raw .dldi
+/// file or a homebrew that carries a driver. Every valid stub of the ROM is
+/// replaced by the driver relocated to that stub's address.
+///
+/// @param driver Buffer that contains the driver.
+/// @param driver_size Size of driver in bytes.
+/// @param rom ROM to patch. It must be 4-byte aligned.
+/// @param rom_size Size of rom in bytes.
+/// @return 0 on success, -ENODATA if either buffer has no DLDI header,
+///     -ENOSPC if the driver doesn't fit in the stub, or -ENOMEM.
+int dldiPatchBuffer(const void *driver, size_t driver_size, void *rom, size_t rom_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_BUFFER_H__
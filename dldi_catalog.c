@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: Zlib
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "dldi_catalog.h"
+#include "dldi_crawl.h"
+#include "dldi_scan.h"
+
+struct DLDI_CATALOG
+{
+	int count;
+	DLDI_CATALOG_ENTRY *entries;
+	// The entries are followed by the drivers, then the strings.
+};
+
+// A driver read by the crawler, before it is moved to the arena.
+typedef struct DLDI_CATALOG_ITEM
+{
+	char *path;
+	DLDI_STUB stub;
+	u8 *driver;
+} DLDI_CATALOG_ITEM;
+
+typedef struct DLDI_CATALOG_LOAD
+{
+	pthread_mutex_t lock;
+	DLDI_CATALOG_ITEM *items;
+	int count;
+	int capacity;
+	int rc;
+} DLDI_CATALOG_LOAD;
+
+static void dldiCatalogAdd(void *arg, const char *path, const DLDI_IMAGE *image,
+                           int rc, const DLDI_STATS *stats)
+{
+	DLDI_CATALOG_LOAD *load = (DLDI_CATALOG_LOAD *)arg;
+	(void)stats;
+
+	if (rc != 0)
+		return;
+
+	// The stub of a homebrew that was never patched can't do anything.
+	const DLDI_INTERFACE *driver = dldiImageDriver(image);
+	if (!(driver->ioInterface.features & FEATURE_MEDIUM_CANREAD))
+		return;
+
+	DLDI_CATALOG_ITEM item = {
+		.path = strdup(path),
+		.stub = *dldiImageStub(image, 0),
+		.driver = (u8 *)malloc(1 << driver->driverSize),
+	};
+	if (item.path != NULL && item.driver != NULL)
+		memcpy(item.driver, driver, 1 << driver->driverSize);
+
+	pthread_mutex_lock(&load->lock);
+	if (item.path != NULL && item.driver != NULL && load->count == load->capacity)
+	{
+		int capacity = load->capacity ? load->capacity * 2 : 32;
+		DLDI_CATALOG_ITEM *items = (DLDI_CATALOG_ITEM *)realloc(load->items, capacity * sizeof(DLDI_CATALOG_ITEM));
+		if (items != NULL)
+		{
+			load->items = items;
+			load->capacity = capacity;
+		}
+	}
+	if (item.path == NULL || item.driver == NULL || load->count == load->capacity)
+	{
+		load->rc = -ENOMEM;
+		free(item.path);
+		free(item.driver);
+	}
+	else
+	{
+		load->items[load->count++] = item;
+	}
+	pthread_mutex_unlock(&load->lock);
+}
+
+static int dldiCatalogCompare(const void *a, const void *b)
+{
+	const DLDI_CATALOG_ENTRY *x = (const DLDI_CATALOG_ENTRY *)a;
+	const DLDI_CATALOG_ENTRY *y = (const DLDI_CATALOG_ENTRY *)b;
+
+	int rc = strcmp(x->id, y->id);
+	if (rc == 0)
+		rc = strcasecmp(x->name, y->name);
+	if (rc == 0)
+		rc = strcmp(x->path, y->path);
+	return rc;
+}
+
+int dldiCatalogLoad(const char *const *paths, int count, int threads, DLDI_CATALOG **catalog)
+{
+	DLDI_CATALOG_LOAD load = {};
+	pthread_mutex_init(&load.lock, NULL);
+
+	int rc = dldiCrawl(paths, count, threads, 0, NULL, dldiCatalogAdd, &load);
+	pthread_mutex_destroy(&load.lock);
+	if (rc == 0)
+		rc = load.rc;
+
+	// Everything is laid out in one block: the entries, then the drivers,
+	// which keeps them 4-byte aligned, then the paths and names.
+	size_t drivers_size = 0;
+	size_t strings_size = 0;
+	for (int i = 0; i < load.count; i++)
+	{
+		drivers_size += 1 << load.items[i].stub.header.driverSize;
+		strings_size += strlen(load.items[i].path) + 1 + DLDI_FRIENDLY_NAME_LEN + 1;
+	}
+
+	DLDI_CATALOG *cat = NULL;
+	if (rc == 0)
+	{
+		cat = (DLDI_CATALOG *)malloc(sizeof(DLDI_CATALOG) + load.count * sizeof(DLDI_CATALOG_ENTRY) +
+		                             drivers_size + strings_size);
+		if (cat == NULL)
+			rc = -ENOMEM;
+	}
+
+	if (rc == 0)
+	{
+		cat->count = load.count;
+		cat->entries = (DLDI_CATALOG_ENTRY *)(cat + 1);
+		u8 *drivers = (u8 *)(cat->entries + load.count);
+		char *strings = (char *)(drivers + drivers_size);
+
+		for (int i = 0; i < load.count; i++)
+		{
+			const DLDI_CATALOG_ITEM *item = &load.items[i];
+			const DLDI_INTERFACE *io = &item->stub.header;
+			DLDI_CATALOG_ENTRY *entry = &cat->entries[i];
+			size_t driver_size = 1 << io->driverSize;
+
+			memcpy(drivers, item->driver, driver_size);
+			entry->driver = (const DLDI_INTERFACE *)drivers;
+			drivers += driver_size;
+
+			entry->path = strcpy(strings, item->path);
+			strings += strlen(item->path) + 1;
+			memcpy(strings, io->friendlyName, DLDI_FRIENDLY_NAME_LEN);
+			strings[DLDI_FRIENDLY_NAME_LEN] = '\0';
+			entry->name = strings;
+			strings += DLDI_FRIENDLY_NAME_LEN + 1;
+
+			memcpy(entry->id, &io->ioInterface.ioType, 4);
+			entry->id[4] = '\0';
+			entry->stub = item->stub;
+			entry->hash = dldiHash(DLDI_HASH_INIT, entry->driver, driver_size);
+			entry->relocs = NULL;
+			entry->reloc_count = 0;
+		}
+
+		qsort(cat->entries, cat->count, sizeof(DLDI_CATALOG_ENTRY), dldiCatalogCompare);
+		*catalog = cat;
+	}
+
+	for (int i = 0; i < load.count; i++)
+	{
+		free(load.items[i].path);
+		free(load.items[i].driver);
+	}
+	free(load.items);
+
+	return rc;
+}
+
+void dldiCatalogFree(DLDI_CATALOG *catalog)
+{
+	free(catalog);
+}
+
+int dldiCatalogCount(const DLDI_CATALOG *catalog)
+{
+	return catalog->count;
+}
+
+const DLDI_CATALOG_ENTRY *dldiCatalogEntry(const DLDI_CATALOG *catalog, int index)
+{
+	return &catalog->entries[index];
+}
+
+int dldiCatalogFind(const DLDI_CATALOG *catalog, const char *key,
+                    const DLDI_CATALOG_ENTRY **matches, int max_matches)
+{
+	int count = 0;
+
+	for (int i = 0; i < catalog->count; i++)
+	{
+		if (strcmp(catalog->entries[i].id, key) == 0)
+		{
+			if (matches != NULL && count < max_matches)
+				matches[count] = &catalog->entries[i];
+			count++;
+		}
+	}
+	if (count > 0)
+		return count;
+
+	for (int i = 0; i < catalog->count; i++)
+	{
+		if (strcasecmp(catalog->entries[i].name, key) == 0)
+		{
+			if (matches != NULL && count < max_matches)
+				matches[count] = &catalog->entries[i];
+			count++;
+		}
+	}
+
+	return count;
+}
+
+int dldiCatalogPlan(const DLDI_CATALOG_ENTRY *entry, DLDI_RELOC_PLAN **plan)
+{
+	if (entry->relocs != NULL)
+		return dldiRelocPlanLoad(entry->driver, entry->hash, entry->relocs, entry->reloc_count, plan);
+
+	// Plans are built from a full size buffer.
+	u8 *buffer = (u8 *)dldiBufferGet();
+	if (buffer == NULL)
+		return -ENOMEM;
+
+	size_t driver_size = 1 << entry->driver->driverSize;
+	memcpy(buffer, entry->driver, driver_size);
+	memset(buffer + driver_size, 0, DLDI_BUFFER_SIZE - driver_size);
+
+	int rc = dldiRelocPlanCreate((const DLDI_INTERFACE *)buffer, plan);
+	dldiBufferPut(buffer);
+	return rc;
+}
+
+static int dldiBuiltinCompare(const void *key, const void *element)
+{
+	return strcmp((const char *)key, ((const DLDI_BUILTIN *)element)->id);
+}
+
+const DLDI_BUILTIN *dldiBuiltinFind(const DLDI_BUILTIN *table, int count, const char *id)
+{
+	return (const DLDI_BUILTIN *)bsearch(id, table, count, sizeof(DLDI_BUILTIN), dldiBuiltinCompare);
+}
+
+void dldiBuiltinEntry(const DLDI_BUILTIN *builtin, DLDI_CATALOG_ENTRY *entry)
+{
+	entry->path = builtin->path;
+	entry->name = builtin->name;
+	memcpy(entry->id, builtin->id, sizeof(entry->id));
+	entry->hash = builtin->hash;
+	dldiStubInit(&entry->stub, builtin->driver, 0);
+	entry->driver = builtin->driver;
+	entry->relocs = builtin->relocs;
+	entry->reloc_count = builtin->reloc_count;
+}
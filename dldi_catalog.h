@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_CATALOG_H__
+#define DLDIPATCH_DLDI_CATALOG_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dldi_image.h"
+#include "dldi_reloc.h"
+
+/// A driver of a catalog.
+typedef struct DLDI_CATALOG_ENTRY
+{
+    const char *path; ///< File the driver was loaded from.
+    const char *name; ///< friendlyName of the driver.
+    char id[5]; ///< ioType of the driver, as a string.
+    u64 hash; ///< Hash of the driver, to tell copies from different drivers.
+    DLDI_STUB stub; ///< Parsed header. The offset is the one in path.
+    const DLDI_INTERFACE *driver; ///< The 1 << driverSize bytes of the driver.
+    const DLDI_RELOC_ENTRY *relocs; ///< Precomputed relocation, or NULL.
+    u32 reloc_count; ///< Number of entries in relocs.
+} DLDI_CATALOG_ENTRY;
+
+/// A driver compiled into a program.
+///
+/// Tables of built-in drivers are generated at build time by
+/// bundle/dldibundle from drivers that were already validated, with their
+/// relocation precomputed, and sorted by ID. IDs are unique in a table.
+typedef struct DLDI_BUILTIN
+{
+    const char *path; ///< Name of the file the driver was built from.
+    const char *name; ///< friendlyName of the driver.
+    char id[5]; ///< ioType of the driver, as a string.
+    u64 hash; ///< Hash of the driver.
+    const DLDI_INTERFACE *driver; ///< The 1 << driverSize bytes of the driver.
+    const DLDI_RELOC_ENTRY *relocs; ///< Words changed by relocation.
+    u32 reloc_count; ///< Number of entries in relocs.
+} DLDI_BUILTIN;
+
+/// A set of drivers, loaded once and looked up by ID or name.
+///
+/// Entries, names and drivers are kept in a single allocation. A catalog
+/// isn't modified after it is loaded, so it can be shared between threads.
+typedef struct DLDI_CATALOG DLDI_CATALOG;
+
+/// Load every driver found in a set of files and directories.
+///
+/// Directories are walked with dldiCrawl(), so the same files are read. The
+/// first driver of each file is loaded, which may be a .dldi file or the
+/// driver embedded in a homebrew. Files without a valid driver, and empty
+/// stubs that can't read sectors, are skipped.
+///
+/// @param paths Files and directories to load drivers from.
+/// @param count Number of paths.
+/// @param threads Number of threads used to read files.
+/// @param catalog Receives the catalog on success.
+/// @return 0 on success, or a negative errno value.
+int dldiCatalogLoad(const char *const *paths, int count, int threads,
+                    DLDI_CATALOG **catalog);
+
+/// Free a catalog. Entries returned by it become invalid.
+void dldiCatalogFree(DLDI_CATALOG *catalog);
+
+/// Number of drivers in a catalog.
+int dldiCatalogCount(const DLDI_CATALOG *catalog);
+
+/// A driver of a catalog. Entries are sorted by ID, then name, then path,
+/// so entries that share an ID are next to each other.
+const DLDI_CATALOG_ENTRY *dldiCatalogEntry(const DLDI_CATALOG *catalog, int index);
+
+/// Find the drivers with an ID, or if there are none, with a name.
+///
+/// IDs are compared exactly, names without regard to case.
+///
+/// @param catalog The catalog.
+/// @param key ioType or friendlyName to look for.
+/// @param matches Receives the matching entries, or NULL.
+/// @param max_matches Size of matches, in entries.
+/// @return The number of matching entries, which may be larger than
+///     max_matches.
+int dldiCatalogFind(const DLDI_CATALOG *catalog, const char *key,
+                    const DLDI_CATALOG_ENTRY **matches, int max_matches);
+
+/// Build the relocation plan of a driver of a catalog.
+///
+/// Drivers with precomputed relocation only have their plan copied.
+///
+/// @return 0 on success, or a negative errno value.
+int dldiCatalogPlan(const DLDI_CATALOG_ENTRY *entry, DLDI_RELOC_PLAN **plan);
+
+/// Find a driver by ID in a table of built-in drivers, by binary search.
+///
+/// @param table The table, sorted by ID.
+/// @param count Number of drivers in the table.
+/// @param id ioType to look for.
+/// @return The driver, or NULL if there is none with that ID.
+const DLDI_BUILTIN *dldiBuiltinFind(const DLDI_BUILTIN *table, int count, const char *id);
+
+/// Fill in a catalog entry with a built-in driver, so it can be used anywhere
+/// a driver of a catalog can. Nothing is read or copied.
+///
+/// @param builtin The driver. It must outlive the entry.
+/// @param entry The entry to fill in.
+void dldiBuiltinEntry(const DLDI_BUILTIN *builtin, DLDI_CATALOG_ENTRY *entry);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_CATALOG_H__
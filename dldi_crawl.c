@@ -0,0 +1,354 @@
+// SPDX-License-Identifier: Zlib
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "dldi_crawl.h"
+#include "dldi_workers.h"
+
+// Entries that are known to be directories or files, or that have to be
+// checked with lstat() first.
+#define DLDI_CRAWL_UNKNOWN  0
+#define DLDI_CRAWL_DIR      1
+#define DLDI_CRAWL_FILE     2
+
+// How long an idle thread waits for new entries before looking again.
+#define DLDI_CRAWL_IDLE_NS  1000000
+
+typedef struct DLDI_CRAWL_TASK
+{
+	char *path;
+	int type;
+	bool root;
+} DLDI_CRAWL_TASK;
+
+// Entries waiting to be visited by one thread. The owner takes the newest
+// entry from the tail, other threads steal the oldest from the head.
+typedef struct DLDI_CRAWL_QUEUE
+{
+	pthread_mutex_t lock;
+	DLDI_CRAWL_TASK *tasks;
+	size_t head;
+	size_t tail;
+	size_t capacity;
+} DLDI_CRAWL_QUEUE;
+
+typedef struct DLDI_CRAWL
+{
+	DLDI_CRAWL_QUEUE *queues;
+	int threads;
+	int flags;
+	DLDI_INDEX *index;
+	DLDI_CRAWL_FN fn;
+	void *arg;
+
+	// Entries queued or being visited. The crawl is over when it reaches 0.
+	size_t pending;
+	// First error that made the crawl miss entries, or 0.
+	int rc;
+	int next_id;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+} DLDI_CRAWL;
+
+static bool dldiCrawlPush(DLDI_CRAWL_QUEUE *queue, const DLDI_CRAWL_TASK *task)
+{
+	bool ok = true;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->tail == queue->capacity)
+	{
+		// Move the live entries down before growing.
+		size_t live = queue->tail - queue->head;
+		memmove(queue->tasks, queue->tasks + queue->head, live * sizeof(DLDI_CRAWL_TASK));
+		queue->head = 0;
+		queue->tail = live;
+
+		if (live * 2 >= queue->capacity)
+		{
+			size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+			DLDI_CRAWL_TASK *tasks = (DLDI_CRAWL_TASK *)realloc(queue->tasks, capacity * sizeof(DLDI_CRAWL_TASK));
+			if (tasks != NULL)
+			{
+				queue->tasks = tasks;
+				queue->capacity = capacity;
+			}
+		}
+		ok = queue->tail < queue->capacity;
+	}
+	if (ok)
+		queue->tasks[queue->tail++] = *task;
+	pthread_mutex_unlock(&queue->lock);
+
+	return ok;
+}
+
+static bool dldiCrawlPop(DLDI_CRAWL_QUEUE *queue, DLDI_CRAWL_TASK *task, bool steal)
+{
+	bool ok = false;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->head < queue->tail)
+	{
+		*task = steal ? queue->tasks[queue->head++] : queue->tasks[--queue->tail];
+		if (queue->head == queue->tail)
+			queue->head = queue->tail = 0;
+		ok = true;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	return ok;
+}
+
+static bool dldiCrawlWants(const char *name)
+{
+	static const char *const extensions[] = { ".nds", ".dsi", ".srl", ".dldi" };
+
+	const char *ext = strrchr(name, '.');
+	if (ext == NULL)
+		return false;
+
+	for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+	{
+		if (strcasecmp(ext, extensions[i]) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static void dldiCrawlFile(DLDI_CRAWL *crawl, const char *path)
+{
+	DLDI_STATS stats = {};
+	DLDI_IMAGE *image = NULL;
+
+	if (crawl->flags & DLDI_CRAWL_NO_OPEN)
+	{
+		crawl->fn(crawl->arg, path, NULL, 0, NULL);
+		return;
+	}
+
+	int rc = dldiImageOpenIndexed(path, 0, crawl->index, &stats, &image);
+	crawl->fn(crawl->arg, path, rc == 0 ? image : NULL, rc, &stats);
+	if (rc == 0)
+		dldiImageClose(image);
+}
+
+// Queues the entries of a directory on the queue of the calling thread.
+static void dldiCrawlDir(DLDI_CRAWL *crawl, DLDI_CRAWL_QUEUE *queue, const char *path)
+{
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+	{
+		crawl->fn(crawl->arg, path, NULL, -errno, NULL);
+		return;
+	}
+
+	size_t path_len = strlen(path);
+	bool queued = false;
+	int rc = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		DLDI_CRAWL_TASK task = { .root = false };
+		if (entry->d_type == DT_DIR)
+			task.type = DLDI_CRAWL_DIR;
+		else if (entry->d_type == DT_REG)
+			task.type = DLDI_CRAWL_FILE;
+		else if (entry->d_type == DT_UNKNOWN)
+			task.type = DLDI_CRAWL_UNKNOWN;
+		else
+			continue;
+
+		if (task.type == DLDI_CRAWL_FILE && !(crawl->flags & DLDI_CRAWL_ALL_FILES) &&
+		    !dldiCrawlWants(entry->d_name))
+			continue;
+
+		size_t name_len = strlen(entry->d_name);
+		task.path = (char *)malloc(path_len + name_len + 2);
+		if (task.path == NULL)
+		{
+			rc = -ENOMEM;
+			break;
+		}
+		memcpy(task.path, path, path_len);
+		task.path[path_len] = '/';
+		memcpy(task.path + path_len + 1, entry->d_name, name_len + 1);
+
+		__atomic_add_fetch(&crawl->pending, 1, __ATOMIC_RELAXED);
+		if (!dldiCrawlPush(queue, &task))
+		{
+			__atomic_sub_fetch(&crawl->pending, 1, __ATOMIC_RELAXED);
+			free(task.path);
+			rc = -ENOMEM;
+			break;
+		}
+		queued = true;
+	}
+	closedir(dir);
+
+	// The rest of the directory is missed, which fails the crawl.
+	if (rc != 0)
+	{
+		int expected = 0;
+		__atomic_compare_exchange_n(&crawl->rc, &expected, rc, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		crawl->fn(crawl->arg, path, NULL, rc, NULL);
+	}
+
+	// Wake up idle threads once per directory rather than once per entry.
+	if (queued && crawl->threads > 1)
+	{
+		pthread_mutex_lock(&crawl->idle_lock);
+		pthread_cond_broadcast(&crawl->idle_cond);
+		pthread_mutex_unlock(&crawl->idle_lock);
+	}
+}
+
+static void dldiCrawlVisit(DLDI_CRAWL *crawl, DLDI_CRAWL_QUEUE *queue, DLDI_CRAWL_TASK *task)
+{
+	if (task->type == DLDI_CRAWL_UNKNOWN)
+	{
+		// Roots given as symbolic links are followed, links inside them
+		// aren't.
+		struct stat st;
+		if ((task->root ? stat(task->path, &st) : lstat(task->path, &st)) != 0)
+		{
+			crawl->fn(crawl->arg, task->path, NULL, -errno, NULL);
+			return;
+		}
+		if (S_ISDIR(st.st_mode))
+			task->type = DLDI_CRAWL_DIR;
+		else if (S_ISREG(st.st_mode))
+			task->type = DLDI_CRAWL_FILE;
+		else
+			return;
+
+		if (task->type == DLDI_CRAWL_FILE && !task->root &&
+		    !(crawl->flags & DLDI_CRAWL_ALL_FILES) && !dldiCrawlWants(task->path))
+			return;
+	}
+
+	if (task->type == DLDI_CRAWL_DIR)
+		dldiCrawlDir(crawl, queue, task->path);
+	else
+		dldiCrawlFile(crawl, task->path);
+}
+
+static void *dldiCrawlWorker(void *arg)
+{
+	DLDI_CRAWL *crawl = (DLDI_CRAWL *)arg;
+	int id = __atomic_fetch_add(&crawl->next_id, 1, __ATOMIC_RELAXED);
+	DLDI_CRAWL_QUEUE *queue = &crawl->queues[id];
+
+	for (;;)
+	{
+		DLDI_CRAWL_TASK task;
+		bool found = dldiCrawlPop(queue, &task, false);
+		for (int i = 1; !found && i < crawl->threads; i++)
+			found = dldiCrawlPop(&crawl->queues[(id + i) % crawl->threads], &task, true);
+
+		if (found)
+		{
+			dldiCrawlVisit(crawl, queue, &task);
+			free(task.path);
+
+			if (__atomic_sub_fetch(&crawl->pending, 1, __ATOMIC_ACQ_REL) == 0)
+			{
+				pthread_mutex_lock(&crawl->idle_lock);
+				pthread_cond_broadcast(&crawl->idle_cond);
+				pthread_mutex_unlock(&crawl->idle_lock);
+			}
+			continue;
+		}
+
+		if (__atomic_load_n(&crawl->pending, __ATOMIC_ACQUIRE) == 0)
+			break;
+
+		// Another thread is still busy and may queue more entries. The wait
+		// is bounded, so a missed wakeup only costs a little time.
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += DLDI_CRAWL_IDLE_NS;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		pthread_mutex_lock(&crawl->idle_lock);
+		if (__atomic_load_n(&crawl->pending, __ATOMIC_ACQUIRE) != 0)
+			pthread_cond_timedwait(&crawl->idle_cond, &crawl->idle_lock, &deadline);
+		pthread_mutex_unlock(&crawl->idle_lock);
+	}
+
+	return NULL;
+}
+
+int dldiCrawl(const char *const *roots, int root_count, int threads, int flags,
+              DLDI_INDEX *index, DLDI_CRAWL_FN fn, void *arg)
+{
+	if (threads < 1)
+		threads = 1;
+
+	DLDI_CRAWL crawl = {
+		.threads = threads,
+		.flags = flags,
+		.index = index,
+		.fn = fn,
+		.arg = arg,
+		.pending = 0,
+		.next_id = 0,
+	};
+
+	crawl.queues = (DLDI_CRAWL_QUEUE *)calloc(threads, sizeof(DLDI_CRAWL_QUEUE));
+	if (crawl.queues == NULL)
+		return -ENOMEM;
+	for (int i = 0; i < threads; i++)
+		pthread_mutex_init(&crawl.queues[i].lock, NULL);
+	pthread_mutex_init(&crawl.idle_lock, NULL);
+	pthread_cond_init(&crawl.idle_cond, NULL);
+
+	// Roots are spread over the queues, so several trees start in parallel.
+	int rc = 0;
+	for (int i = 0; i < root_count && rc == 0; i++)
+	{
+		DLDI_CRAWL_TASK task = { .type = DLDI_CRAWL_UNKNOWN, .root = true };
+		task.path = strdup(roots[i]);
+		if (task.path == NULL || !dldiCrawlPush(&crawl.queues[i % threads], &task))
+		{
+			free(task.path);
+			rc = -ENOMEM;
+		}
+		else
+		{
+			crawl.pending++;
+		}
+	}
+
+	// Queues of threads that failed to start are stolen from.
+	if (rc == 0)
+		dldiRunWorkers(dldiCrawlWorker, &crawl, threads);
+
+	// Only left over if the crawl didn't start.
+	for (int i = 0; i < threads; i++)
+	{
+		DLDI_CRAWL_TASK task;
+		while (dldiCrawlPop(&crawl.queues[i], &task, false))
+			free(task.path);
+		free(crawl.queues[i].tasks);
+		pthread_mutex_destroy(&crawl.queues[i].lock);
+	}
+	pthread_cond_destroy(&crawl.idle_cond);
+	pthread_mutex_destroy(&crawl.idle_lock);
+	free(crawl.queues);
+
+	return rc != 0 ? rc : crawl.rc;
+}
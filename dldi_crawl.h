@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_CRAWL_H__
+#define DLDIPATCH_DLDI_CRAWL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dldi_image.h"
+#include "dldi_index.h"
+#include "dldi_stats.h"
+
+/// Visit every regular file, rather than only ROMs and drivers.
+#define DLDI_CRAWL_ALL_FILES    0x01
+
+/// Only list files, without opening them. The callback gets a NULL image and
+/// a result of 0, so that the files can be opened some other way.
+#define DLDI_CRAWL_NO_OPEN      0x02
+
+/// Called once for every file visited by dldiCrawl().
+///
+/// Calls come from several threads at once, in no particular order.
+///
+/// @param arg The argument given to dldiCrawl().
+/// @param path Path of the file.
+/// @param image The opened file, or NULL if it couldn't be opened. It is
+///     closed when the callback returns.
+/// @param rc 0 if the file was opened, -ENODATA if it has no DLDI stub, or
+///     another negative errno value. Directories that can't be read are
+///     reported with their own path.
+/// @param stats Counters of the work done on this file, or NULL with
+///     DLDI_CRAWL_NO_OPEN.
+typedef void (*DLDI_CRAWL_FN)(void *arg, const char *path, const DLDI_IMAGE *image,
+                              int rc, const DLDI_STATS *stats);
+
+/// Walk directory trees and open every file in them.
+///
+/// Directories and files are spread over a pool of threads. Each thread
+/// works on the entries it found itself first, and takes the oldest entries
+/// of other threads when it runs out, so a large directory doesn't keep a
+/// single thread busy. Symbolic links aren't followed.
+///
+/// Unless DLDI_CRAWL_ALL_FILES is given, only files with a .nds, .dsi, .srl
+/// or .dldi extension are opened. Roots that are files are always opened.
+///
+/// @param roots Paths of the directories or files to visit.
+/// @param root_count Number of roots.
+/// @param threads Number of threads to use, including the calling thread.
+/// @param flags DLDI_CRAWL_ALL_FILES and DLDI_CRAWL_NO_OPEN.
+/// @param index Stub index to open files with, or NULL.
+/// @param fn Function called for every file.
+/// @param arg Argument passed to fn.
+/// @return 0 once every file has been visited, or a negative errno value if
+///     the crawl couldn't start or some entries couldn't be queued.
+int dldiCrawl(const char *const *roots, int root_count, int threads, int flags,
+              DLDI_INDEX *index, DLDI_CRAWL_FN fn, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_CRAWL_H__
@@ -0,0 +1,737 @@
+// SPDX-License-Identifier: Zlib
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dldi_delta.h"
+
+// Unchanged bytes between two changes that are kept in the same range, since
+// a new IPS record costs about as much.
+#define DLDI_DELTA_GAP      8
+
+// Files are read in pieces of this size for their checksums.
+#define DLDI_DELTA_CHUNK    (1 << 20)
+
+#define IPS_MAX_OFFSET      0xFFFFFF
+#define IPS_MAX_SIZE        0xFFFF
+// A record can't start at this offset, which reads as "EOF".
+#define IPS_EOF_OFFSET      0x454F46
+
+enum
+{
+	BPS_SOURCE_READ,
+	BPS_TARGET_READ,
+	BPS_SOURCE_COPY,
+	BPS_TARGET_COPY,
+};
+
+// New bytes of a range of the file. Run-length encoded IPS records have no
+// data, only the value every byte is set to.
+typedef struct DLDI_DELTA_RANGE
+{
+	u64 offset;
+	u64 size;
+	const u8 *data;
+	u8 value;
+} DLDI_DELTA_RANGE;
+
+typedef struct DLDI_DELTA
+{
+	DLDI_DELTA_RANGE *ranges;
+	int count;
+	int capacity;
+	u64 source_size;
+	u64 target_size;
+} DLDI_DELTA;
+
+// A patch being written, kept in memory until it is complete.
+typedef struct DLDI_DELTA_OUT
+{
+	u8 *data;
+	size_t size;
+	size_t capacity;
+	bool failed;
+} DLDI_DELTA_OUT;
+
+static u32 crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void dldiCrc32Init(void)
+{
+	for (u32 i = 0; i < 256; i++)
+	{
+		u32 crc = i;
+		for (int j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		crc_table[0][i] = crc;
+	}
+	for (u32 i = 0; i < 256; i++)
+	{
+		for (int t = 1; t < 8; t++)
+			crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+	}
+}
+
+// CRC-32 of zlib and BPS, 8 bytes at a time. The first call starts with 0.
+static u32 dldiCrc32(u32 crc, const void *data, size_t size)
+{
+	const u8 *p = (const u8 *)data;
+
+	crc = ~crc;
+	for (; size >= 8; p += 8, size -= 8)
+	{
+		u32 lo = (p[0] | p[1] << 8 | p[2] << 16 | (u32)p[3] << 24) ^ crc;
+		u32 hi = p[4] | p[5] << 8 | p[6] << 16 | (u32)p[7] << 24;
+		crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+		      crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+		      crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+		      crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+	}
+	for (; size > 0; p++, size--)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p) & 0xFF];
+	return ~crc;
+}
+
+static int dldiDeltaAdd(DLDI_DELTA *delta, u64 offset, u64 size, const u8 *data, u8 value)
+{
+	if (delta->count == delta->capacity)
+	{
+		int capacity = delta->capacity > 0 ? delta->capacity * 2 : 16;
+		DLDI_DELTA_RANGE *ranges = (DLDI_DELTA_RANGE *)realloc(delta->ranges, capacity * sizeof(DLDI_DELTA_RANGE));
+		if (ranges == NULL)
+			return -ENOMEM;
+		delta->ranges = ranges;
+		delta->capacity = capacity;
+	}
+
+	delta->ranges[delta->count++] = (DLDI_DELTA_RANGE){ offset, size, data, value };
+	return 0;
+}
+
+// Reads up to size bytes, fewer only at the end of the file.
+static ssize_t dldiDeltaRead(int fd, void *buffer, size_t size, u64 offset, DLDI_STATS *stats)
+{
+	size_t done = 0;
+
+	while (done < size)
+	{
+		ssize_t got = pread(fd, (u8 *)buffer + done, size - done, offset + done);
+		if (stats != NULL)
+			stats->read_calls++;
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0)
+			return -errno;
+		if (got == 0)
+			break;
+		done += got;
+	}
+
+	if (stats != NULL)
+		stats->bytes_read += done;
+	return done;
+}
+
+static int dldiDeltaWriteFull(int fd, const void *data, size_t size, u64 offset, DLDI_STATS *stats)
+{
+	size_t done = 0;
+
+	while (done < size)
+	{
+		ssize_t put = pwrite(fd, (const u8 *)data + done, size - done, offset + done);
+		if (stats != NULL)
+			stats->write_calls++;
+		if (put < 0 && errno == EINTR)
+			continue;
+		if (put <= 0)
+			return put < 0 ? -errno : -EIO;
+		done += put;
+	}
+
+	if (stats != NULL)
+		stats->bytes_written += done;
+	return 0;
+}
+
+// Reads a whole file once, for the CRC-32 of its bytes and of the bytes it
+// has once the ranges are written and it is resized to the target size. The
+// ranges must be sorted and must not overlap.
+static int dldiDeltaChecksums(int fd, u64 size, const DLDI_DELTA *delta, u32 *source_crc,
+                              u32 *target_crc, DLDI_STATS *stats)
+{
+	u8 *buffer = (u8 *)malloc(DLDI_DELTA_CHUNK);
+	if (buffer == NULL)
+		return -ENOMEM;
+
+	u32 source = 0;
+	u32 target = 0;
+	int next = 0;
+	u64 end = size > delta->target_size ? size : delta->target_size;
+	for (u64 pos = 0; pos < end; pos += DLDI_DELTA_CHUNK)
+	{
+		size_t len = end - pos < DLDI_DELTA_CHUNK ? end - pos : DLDI_DELTA_CHUNK;
+		ssize_t got = 0;
+		if (pos < size)
+		{
+			got = dldiDeltaRead(fd, buffer, size - pos < len ? size - pos : len, pos, stats);
+			if (got < 0 || (u64)got != (size - pos < len ? size - pos : len))
+			{
+				free(buffer);
+				return got < 0 ? got : -ESTALE;
+			}
+			source = dldiCrc32(source, buffer, got);
+		}
+		if (pos >= delta->target_size)
+			continue;
+
+		memset(buffer + got, 0, len - got);
+		for (int i = next; i < delta->count && delta->ranges[i].offset < pos + len; i++)
+		{
+			const DLDI_DELTA_RANGE *range = &delta->ranges[i];
+			u64 start = range->offset > pos ? range->offset : pos;
+			u64 stop = range->offset + range->size < pos + len ? range->offset + range->size : pos + len;
+			if (start < stop)
+				memcpy(buffer + (start - pos), range->data + (start - range->offset), stop - start);
+			if (range->offset + range->size <= pos + len)
+				next = i + 1;
+		}
+		target = dldiCrc32(target, buffer, delta->target_size - pos < len ? delta->target_size - pos : len);
+	}
+
+	free(buffer);
+	*source_crc = source;
+	*target_crc = target;
+	return 0;
+}
+
+static void dldiDeltaPut(DLDI_DELTA_OUT *out, const void *data, size_t size)
+{
+	if (out->failed)
+		return;
+
+	if (out->size + size > out->capacity)
+	{
+		size_t capacity = out->capacity > 0 ? out->capacity : 4096;
+		while (capacity < out->size + size)
+			capacity *= 2;
+		u8 *grown = (u8 *)realloc(out->data, capacity);
+		if (grown == NULL)
+		{
+			out->failed = true;
+			return;
+		}
+		out->data = grown;
+		out->capacity = capacity;
+	}
+
+	memcpy(out->data + out->size, data, size);
+	out->size += size;
+}
+
+static void dldiDeltaPutBe(DLDI_DELTA_OUT *out, u32 value, int size)
+{
+	u8 bytes[4];
+	for (int i = 0; i < size; i++)
+		bytes[i] = value >> (8 * (size - 1 - i));
+	dldiDeltaPut(out, bytes, size);
+}
+
+static void dldiDeltaPutLe32(DLDI_DELTA_OUT *out, u32 value)
+{
+	u8 bytes[4] = { value, value >> 8, value >> 16, value >> 24 };
+	dldiDeltaPut(out, bytes, sizeof(bytes));
+}
+
+// Numbers of BPS, 7 bits at a time with the last byte marked.
+static void dldiDeltaPutNumber(DLDI_DELTA_OUT *out, u64 value)
+{
+	for (;;)
+	{
+		u8 byte = value & 0x7F;
+		value >>= 7;
+		if (value == 0)
+		{
+			byte |= 0x80;
+			dldiDeltaPut(out, &byte, 1);
+			return;
+		}
+		dldiDeltaPut(out, &byte, 1);
+		value--;
+	}
+}
+
+static int dldiDeltaWriteIps(const DLDI_DELTA *delta, int fd, DLDI_DELTA_OUT *out, DLDI_STATS *stats)
+{
+	dldiDeltaPut(out, "PATCH", 5);
+
+	for (int i = 0; i < delta->count; i++)
+	{
+		const DLDI_DELTA_RANGE *range = &delta->ranges[i];
+		for (u64 done = 0; done < range->size; )
+		{
+			u64 offset = range->offset + done;
+			u32 size = range->size - done < IPS_MAX_SIZE ? range->size - done : IPS_MAX_SIZE;
+			if (offset > IPS_MAX_OFFSET)
+				return -EFBIG;
+
+			// A record at the offset that reads as "EOF" starts one byte
+			// earlier, with the byte that is there.
+			if (offset == IPS_EOF_OFFSET)
+			{
+				u8 previous;
+				if (done > 0)
+					previous = range->data[done - 1];
+				else if (dldiDeltaRead(fd, &previous, 1, offset - 1, stats) != 1)
+					return -EIO;
+				size = size < IPS_MAX_SIZE ? size : IPS_MAX_SIZE - 1;
+				dldiDeltaPutBe(out, offset - 1, 3);
+				dldiDeltaPutBe(out, size + 1, 2);
+				dldiDeltaPut(out, &previous, 1);
+			}
+			else
+			{
+				dldiDeltaPutBe(out, offset, 3);
+				dldiDeltaPutBe(out, size, 2);
+			}
+			dldiDeltaPut(out, range->data + done, size);
+			done += size;
+		}
+	}
+
+	// Writing past the end of a file grows it, so the size is never given.
+	dldiDeltaPut(out, "EOF", 3);
+	return 0;
+}
+
+static int dldiDeltaWriteBps(const DLDI_DELTA *delta, int fd, DLDI_DELTA_OUT *out, DLDI_STATS *stats)
+{
+	u32 source_crc, target_crc;
+	int rc = dldiDeltaChecksums(fd, delta->source_size, delta, &source_crc, &target_crc, stats);
+	if (rc != 0)
+		return rc;
+
+	dldiDeltaPut(out, "BPS1", 4);
+	dldiDeltaPutNumber(out, delta->source_size);
+	dldiDeltaPutNumber(out, delta->target_size);
+	dldiDeltaPutNumber(out, 0);
+
+	// Unchanged bytes are read from the file where they are, changed ones
+	// from the patch.
+	u64 pos = 0;
+	for (int i = 0; i < delta->count; i++)
+	{
+		const DLDI_DELTA_RANGE *range = &delta->ranges[i];
+		if (range->offset > pos)
+			dldiDeltaPutNumber(out, (range->offset - pos - 1) << 2 | BPS_SOURCE_READ);
+		dldiDeltaPutNumber(out, (range->size - 1) << 2 | BPS_TARGET_READ);
+		dldiDeltaPut(out, range->data, range->size);
+		pos = range->offset + range->size;
+	}
+	if (pos < delta->target_size)
+		dldiDeltaPutNumber(out, (delta->target_size - pos - 1) << 2 | BPS_SOURCE_READ);
+
+	dldiDeltaPutLe32(out, source_crc);
+	dldiDeltaPutLe32(out, target_crc);
+	if (!out->failed)
+		dldiDeltaPutLe32(out, dldiCrc32(0, out->data, out->size));
+	return 0;
+}
+
+int dldiDeltaFormat(const char *path)
+{
+	const char *ext = strrchr(path, '.');
+	if (ext != NULL && strcasecmp(ext, ".ips") == 0)
+		return DLDI_DELTA_IPS;
+	if (ext != NULL && strcasecmp(ext, ".bps") == 0)
+		return DLDI_DELTA_BPS;
+	return -EINVAL;
+}
+
+int dldiDeltaCreate(DLDI_IMAGE *image, const DLDI_RELOC_PLAN *plan, DLDI_DELTA_FORMAT format,
+                    int out_fd)
+{
+	const DLDI_INTERFACE *src_dldi = dldiRelocPlanDriver(plan);
+	DLDI_STATS *stats = dldiImageStats(image);
+	int fd = dldiImageFd(image);
+	int count = dldiImageStubCount(image);
+	u64 start = dldiStatsNow();
+
+	pthread_once(&crc_once, dldiCrc32Init);
+
+	for (int i = 0; i < count; i++)
+	{
+		if (src_dldi->driverSize > dldiImageStub(image, i)->header.allocatedSize)
+			return -ENOSPC;
+	}
+
+	// The new and old bytes of every stub are kept until the patch is
+	// written, since the ranges point into them.
+	u8 *drivers = (u8 *)malloc((size_t)count * 2 * DLDI_BUFFER_SIZE);
+	if (drivers == NULL)
+		return -ENOMEM;
+
+	DLDI_DELTA delta = {
+		.source_size = dldiImageSize(image),
+		.target_size = dldiImageSize(image),
+	};
+	DLDI_DELTA_OUT out = {};
+	int changed = 0;
+	int rc = 0;
+
+	for (int i = 0; i < count && rc == 0; i++)
+	{
+		const DLDI_STUB *stub = dldiImageStub(image, i);
+		DLDI_INTERFACE *new_dldi = (DLDI_INTERFACE *)(drivers + (size_t)i * 2 * DLDI_BUFFER_SIZE);
+		u8 *new_bytes = (u8 *)new_dldi;
+		u8 *old_bytes = new_bytes + DLDI_BUFFER_SIZE;
+
+		dldiRelocPlanApply(plan, new_dldi, stub->header.dldiStart);
+		// restore the original allocated driver size.
+		new_dldi->allocatedSize = stub->header.allocatedSize;
+		start = dldiStatsPhase(stats, DLDI_PHASE_RELOCATE, start);
+
+		u32 dldi_size = 1 << new_dldi->driverSize;
+		ssize_t got = dldiDeltaRead(fd, old_bytes, dldi_size, stub->offset, stats);
+		if (got < 0)
+		{
+			rc = got;
+			break;
+		}
+
+		// Runs of changed bytes, with short unchanged gaps kept inside them.
+		// Bytes past the end of the file always change.
+		int first = delta.count;
+		for (u32 j = 0; j < dldi_size && rc == 0; )
+		{
+			if (j < got && old_bytes[j] == new_bytes[j])
+			{
+				j++;
+				continue;
+			}
+
+			u32 run = j;
+			u32 last = j;
+			for (j++; j < dldi_size && j - last <= DLDI_DELTA_GAP; j++)
+			{
+				if (j >= got || old_bytes[j] != new_bytes[j])
+					last = j;
+			}
+			rc = dldiDeltaAdd(&delta, stub->offset + run, last + 1 - run, new_bytes + run, 0);
+			j = last + 1;
+		}
+		if (delta.count > first)
+			changed++;
+		if ((u64)stub->offset + dldi_size > delta.target_size)
+			delta.target_size = stub->offset + dldi_size;
+		start = dldiStatsPhase(stats, DLDI_PHASE_VALIDATE, start);
+	}
+
+	// Encoding the patch is part of writing it.
+	if (rc == 0)
+	{
+		if (format == DLDI_DELTA_BPS)
+			rc = dldiDeltaWriteBps(&delta, fd, &out, stats);
+		else
+			rc = dldiDeltaWriteIps(&delta, fd, &out, stats);
+	}
+	if (rc == 0 && out.failed)
+		rc = -ENOMEM;
+
+	// The patch is a new file, so it is written from its start.
+	if (rc == 0)
+		rc = dldiDeltaWriteFull(out_fd, out.data, out.size, 0, stats);
+	dldiStatsPhase(stats, DLDI_PHASE_WRITE, start);
+
+	free(out.data);
+	free(delta.ranges);
+	free(drivers);
+	return rc < 0 ? rc : changed;
+}
+
+static u32 dldiDeltaGetBe(const u8 *data, int size)
+{
+	u32 value = 0;
+	for (int i = 0; i < size; i++)
+		value = value << 8 | data[i];
+	return value;
+}
+
+static u32 dldiDeltaGetLe32(const u8 *data)
+{
+	return data[0] | data[1] << 8 | data[2] << 16 | (u32)data[3] << 24;
+}
+
+static int dldiDeltaParseIps(const u8 *data, size_t size, DLDI_DELTA *delta)
+{
+	size_t pos = 5;
+	bool truncated = false;
+
+	for (;;)
+	{
+		if (size - pos < 3)
+			return -EBADMSG;
+		if (memcmp(data + pos, "EOF", 3) == 0)
+		{
+			pos += 3;
+			// Some tools add the size of the patched file.
+			if (size - pos == 3)
+			{
+				delta->target_size = dldiDeltaGetBe(data + pos, 3);
+				truncated = true;
+			}
+			else if (pos != size)
+			{
+				return -EBADMSG;
+			}
+			break;
+		}
+
+		if (size - pos < 5)
+			return -EBADMSG;
+		u64 offset = dldiDeltaGetBe(data + pos, 3);
+		u64 length = dldiDeltaGetBe(data + pos + 3, 2);
+		pos += 5;
+
+		int rc;
+		if (length == 0)
+		{
+			if (size - pos < 3)
+				return -EBADMSG;
+			length = dldiDeltaGetBe(data + pos, 2);
+			rc = dldiDeltaAdd(delta, offset, length, NULL, data[pos + 2]);
+			pos += 3;
+		}
+		else
+		{
+			if (size - pos < length)
+				return -EBADMSG;
+			rc = dldiDeltaAdd(delta, offset, length, data + pos, 0);
+			pos += length;
+		}
+		if (rc != 0)
+			return rc;
+
+		if (!truncated && offset + length > delta->target_size)
+			delta->target_size = offset + length;
+	}
+
+	// Records written past the new end of the file are cut off.
+	if (truncated)
+	{
+		for (int i = 0; i < delta->count; i++)
+		{
+			if (delta->ranges[i].offset + delta->ranges[i].size > delta->target_size)
+				delta->ranges[i].size = delta->ranges[i].offset < delta->target_size ? delta->target_size - delta->ranges[i].offset : 0;
+		}
+	}
+
+	return 0;
+}
+
+static int dldiDeltaGetNumber(const u8 *data, size_t size, size_t *pos, u64 *value)
+{
+	u64 result = 0;
+	u64 shift = 1;
+
+	for (int i = 0; i < 10; i++)
+	{
+		if (*pos >= size)
+			return -EBADMSG;
+		u8 byte = data[(*pos)++];
+		result += (u64)(byte & 0x7F) * shift;
+		if (byte & 0x80)
+		{
+			*value = result;
+			return 0;
+		}
+		shift <<= 7;
+		result += shift;
+	}
+
+	return -EBADMSG;
+}
+
+static int dldiDeltaParseBps(const u8 *data, size_t size, DLDI_DELTA *delta, u32 *source_crc,
+                             u32 *target_crc)
+{
+	if (size < 4 + 3 + 12 || dldiCrc32(0, data, size - 4) != dldiDeltaGetLe32(data + size - 4))
+		return -EBADMSG;
+
+	size_t pos = 4;
+	size_t end = size - 12;
+	u64 metadata;
+	if (dldiDeltaGetNumber(data, end, &pos, &delta->source_size) != 0 ||
+	    dldiDeltaGetNumber(data, end, &pos, &delta->target_size) != 0 ||
+	    dldiDeltaGetNumber(data, end, &pos, &metadata) != 0 ||
+	    end - pos < metadata)
+		return -EBADMSG;
+	pos += metadata;
+
+	u64 out = 0;
+	while (pos < end)
+	{
+		u64 action;
+		if (dldiDeltaGetNumber(data, end, &pos, &action) != 0)
+			return -EBADMSG;
+		u64 length = (action >> 2) + 1;
+		if (length > delta->target_size - out)
+			return -EBADMSG;
+
+		// Reads at other offsets would need the file to be copied first.
+		switch (action & 3)
+		{
+			case BPS_SOURCE_READ:
+				if (out + length > delta->source_size)
+					return -EBADMSG;
+				break;
+			case BPS_TARGET_READ:
+				if (end - pos < length)
+					return -EBADMSG;
+				if (dldiDeltaAdd(delta, out, length, data + pos, 0) != 0)
+					return -ENOMEM;
+				pos += length;
+				break;
+			default:
+				return -ENOTSUP;
+		}
+		out += length;
+	}
+	if (out != delta->target_size)
+		return -EBADMSG;
+
+	*source_crc = dldiDeltaGetLe32(data + end);
+	*target_crc = dldiDeltaGetLe32(data + end + 4);
+	return 0;
+}
+
+// Writes the parts of a range that don't already hold their new bytes.
+// Returns whether anything differed.
+static int dldiDeltaApplyRange(int fd, const DLDI_DELTA_RANGE *range, int flags, u8 *current,
+                               u8 *fill, DLDI_STATS *stats, u64 *start)
+{
+	bool differs = false;
+
+	for (u64 done = 0; done < range->size; done += DLDI_BUFFER_SIZE)
+	{
+		size_t size = range->size - done < DLDI_BUFFER_SIZE ? range->size - done : DLDI_BUFFER_SIZE;
+		const u8 *data = range->data != NULL ? range->data + done : fill;
+		if (range->data == NULL)
+			memset(fill, range->value, size);
+
+		ssize_t got = dldiDeltaRead(fd, current, size, range->offset + done, stats);
+		if (got < 0)
+			return got;
+		*start = dldiStatsPhase(stats, DLDI_PHASE_VALIDATE, *start);
+		if ((size_t)got == size && memcmp(current, data, size) == 0)
+			continue;
+
+		differs = true;
+		if (flags & DLDI_PATCH_CHECK)
+			continue;
+		int rc = dldiDeltaWriteFull(fd, data, size, range->offset + done, stats);
+		*start = dldiStatsPhase(stats, DLDI_PHASE_WRITE, *start);
+		if (rc != 0)
+			return rc;
+	}
+
+	return differs;
+}
+
+int dldiDeltaApply(int delta_fd, int fd, int flags, DLDI_STATS *stats)
+{
+	u64 start = dldiStatsNow();
+	struct stat delta_st, st;
+	if (fstat(delta_fd, &delta_st) != 0 || fstat(fd, &st) != 0)
+		return -errno;
+	if (delta_st.st_size < 8)
+		return -EBADMSG;
+
+	pthread_once(&crc_once, dldiCrc32Init);
+
+	const u8 *data = (const u8 *)mmap(NULL, delta_st.st_size, PROT_READ, MAP_PRIVATE, delta_fd, 0);
+	if (data == MAP_FAILED)
+		return -errno;
+	size_t size = delta_st.st_size;
+
+	DLDI_DELTA delta = {
+		.source_size = st.st_size,
+		.target_size = st.st_size,
+	};
+	u8 *buffers = NULL;
+	int changed = 0;
+	int rc;
+
+	if (memcmp(data, "PATCH", 5) == 0)
+	{
+		rc = dldiDeltaParseIps(data, size, &delta);
+	}
+	else if (memcmp(data, "BPS1", 4) == 0)
+	{
+		u32 source_crc, target_crc;
+		rc = dldiDeltaParseBps(data, size, &delta, &source_crc, &target_crc);
+		start = dldiStatsPhase(stats, DLDI_PHASE_LOAD, start);
+
+		// The file must be the one the patch was made for, or the one it
+		// makes, in which case there is nothing to do.
+		u32 file_crc, patched_crc;
+		if (rc == 0)
+			rc = dldiDeltaChecksums(fd, st.st_size, &delta, &file_crc, &patched_crc, stats);
+		start = dldiStatsPhase(stats, DLDI_PHASE_VALIDATE, start);
+		if (rc == 0 && (u64)st.st_size == delta.source_size && file_crc == source_crc)
+		{
+			if (patched_crc != target_crc)
+				rc = -EBADMSG;
+		}
+		else if (rc == 0 && (u64)st.st_size == delta.target_size && file_crc == target_crc)
+		{
+			delta.count = 0;
+		}
+		else if (rc == 0)
+		{
+			rc = -ESTALE;
+		}
+	}
+	else
+	{
+		rc = -EBADMSG;
+	}
+	start = dldiStatsPhase(stats, DLDI_PHASE_LOAD, start);
+
+	if (rc == 0)
+	{
+		buffers = (u8 *)malloc(2 * DLDI_BUFFER_SIZE);
+		if (buffers == NULL)
+			rc = -ENOMEM;
+	}
+
+	// Ranges are written in patch order, since IPS records may overlap.
+	for (int i = 0; i < delta.count && rc == 0; i++)
+	{
+		rc = dldiDeltaApplyRange(fd, &delta.ranges[i], flags, buffers, buffers + DLDI_BUFFER_SIZE, stats, &start);
+		if (rc > 0)
+			changed++;
+		rc = rc < 0 ? rc : 0;
+	}
+	// Writes past the end of the file already grew it, but it may also have
+	// to shrink.
+	if (rc == 0 && delta.target_size < (u64)st.st_size)
+	{
+		if (changed == 0)
+			changed++;
+		if (!(flags & DLDI_PATCH_CHECK) && ftruncate(fd, delta.target_size) != 0)
+			rc = -errno;
+		dldiStatsPhase(stats, DLDI_PHASE_WRITE, start);
+	}
+
+	free(buffers);
+	free(delta.ranges);
+	munmap((void *)data, size);
+	return rc < 0 ? rc : changed;
+}
@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_DELTA_H__
+#define DLDIPATCH_DLDI_DELTA_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dldi_image.h"
+#include "dldi_reloc.h"
+#include "dldi_stats.h"
+
+/// Formats of delta patches.
+typedef enum DLDI_DELTA_FORMAT
+{
+    /// IPS: records of bytes to write, without checksums. Offsets are limited
+    /// to 16MB.
+    DLDI_DELTA_IPS,
+    /// BPS: the same with sizes and CRC-32 of the file before and after, and
+    /// of the patch itself.
+    DLDI_DELTA_BPS,
+} DLDI_DELTA_FORMAT;
+
+/// Format of a delta patch file from its extension, .ips or .bps.
+///
+/// @return The format, or -EINVAL for other extensions.
+int dldiDeltaFormat(const char *path);
+
+/// Write the delta patch that would patch an image with a driver.
+///
+/// The image isn't written. Only the bytes of the stubs that differ from the
+/// relocated driver are part of the patch, so it is no larger than the
+/// drivers. With BPS, the whole image is read once for its checksums.
+///
+/// @param image The image the patch applies to.
+/// @param plan The plan of the driver to insert.
+/// @param format The format of the patch.
+/// @param out_fd Descriptor the patch is written to.
+/// @return The number of stubs that differed from the driver, so 0 if the
+///     image already had it and the patch does nothing. -ENOSPC if the driver
+///     doesn't fit in a stub, -EFBIG if an IPS patch can't reach a stub, or
+///     another negative errno value.
+int dldiDeltaCreate(DLDI_IMAGE *image, const DLDI_RELOC_PLAN *plan, DLDI_DELTA_FORMAT format,
+                    int out_fd);
+
+/// Apply a delta patch to a file in place.
+///
+/// The whole patch is checked before anything is written, and only the
+/// ranges that don't already hold their new bytes are written. The file must
+/// have been opened for writing unless DLDI_PATCH_CHECK is given.
+///
+/// BPS patches are checked against the CRC-32 of the file, which is read
+/// once, and may only be made of reads from the file and from the patch at
+/// the same offsets, like those of dldiDeltaCreate(). IPS patches have no
+/// checksums, so they are applied to any file.
+///
+/// @param delta_fd Descriptor of the patch.
+/// @param fd Descriptor of the file to patch.
+/// @param flags DLDI_PATCH_CHECK to only compare.
+/// @param stats Counters to add the work done to, or NULL.
+/// @return The number of ranges that differed from the patch, so 0 if the
+///     file was already patched. -EBADMSG if the patch is damaged or isn't a
+///     patch, -ESTALE if it was made for another file, -ENOTSUP if it is a
+///     BPS patch that moves data around, or another negative errno value.
+int dldiDeltaApply(int delta_fd, int fd, int flags, DLDI_STATS *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_DELTA_H__
@@ -0,0 +1,913 @@
+// SPDX-License-Identifier: Zlib
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "dldi_fat.h"
+#include "dldi_image.h"
+#include "dldi_nds.h"
+#include "dldi_output.h"
+#include "dldi_scan.h"
+
+// Size of the pieces files are searched in.
+#define DLDI_FAT_CHUNK_SIZE     (1 << 20)
+
+// Longest long file name, in UTF-16 units, and in UTF-8 bytes.
+#define DLDI_FAT_LFN_UNITS      260
+#define DLDI_FAT_NAME_MAX       (DLDI_FAT_LFN_UNITS * 3 + 1)
+
+#define DLDI_FAT_ATTR_VOLUME    0x08
+#define DLDI_FAT_ATTR_DIR       0x10
+#define DLDI_FAT_ATTR_LFN       0x0F
+
+struct DLDI_FAT
+{
+	int fd;
+	u32 bytes_per_sector;
+	u32 bytes_per_cluster;
+	u32 cluster_count;
+	bool fat32;
+	u64 volume_offset;
+	u64 data_offset;          // Image offset of cluster 2.
+	u64 root_offset;          // Image offset of the FAT16 root directory.
+	u32 root_size;            // Size of the FAT16 root directory.
+	u32 root_cluster;         // First cluster of the FAT32 root directory.
+	u32 *table;               // First copy of the FAT, widened to 32 bits.
+};
+
+// A run of contiguous clusters of a file.
+typedef struct DLDI_FAT_EXTENT
+{
+	u64 file_offset;
+	u64 image_offset;
+	u64 size;
+} DLDI_FAT_EXTENT;
+
+// A file or directory, as the list of runs of clusters it occupies.
+typedef struct DLDI_FAT_FILE
+{
+	u64 size;
+	int extent_count;
+	DLDI_FAT_EXTENT *extents;
+} DLDI_FAT_FILE;
+
+// A directory entry, with its long name if it has one.
+typedef struct DLDI_FAT_ENTRY
+{
+	char name[DLDI_FAT_NAME_MAX];
+	u8 attributes;
+	u32 cluster;
+	u32 size;
+} DLDI_FAT_ENTRY;
+
+static u16 dldiFatRead16(const u8 *data)
+{
+	return data[0] | (data[1] << 8);
+}
+
+static u32 dldiFatRead32(const u8 *data)
+{
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((u32)data[3] << 24);
+}
+
+static int dldiFatPreadFull(int fd, void *buffer, size_t size, u64 offset, DLDI_STATS *stats)
+{
+	size_t done = 0;
+
+	while (done < size)
+	{
+		ssize_t rc = pread(fd, (u8 *)buffer + done, size - done, offset + done);
+		if (stats != NULL)
+			stats->read_calls++;
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0)
+			return -errno;
+		if (rc == 0)
+			return -EIO;
+		done += rc;
+	}
+
+	if (stats != NULL)
+		stats->bytes_read += done;
+	return 0;
+}
+
+static int dldiFatPwriteFull(int fd, const void *buffer, size_t size, u64 offset, DLDI_STATS *stats)
+{
+	size_t done = 0;
+
+	while (done < size)
+	{
+		ssize_t rc = pwrite(fd, (const u8 *)buffer + done, size - done, offset + done);
+		if (stats != NULL)
+			stats->write_calls++;
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return rc < 0 ? -errno : -EIO;
+		done += rc;
+	}
+
+	if (stats != NULL)
+		stats->bytes_written += done;
+	return 0;
+}
+
+// Checks that a sector holds a FAT boot sector, as far as the BPB goes.
+static bool dldiFatIsBootSector(const u8 *sector)
+{
+	u16 bytes_per_sector = dldiFatRead16(sector + 11);
+	u8 sectors_per_cluster = sector[13];
+
+	return (sector[0] == 0xEB || sector[0] == 0xE9) &&
+	       bytes_per_sector >= 512 && bytes_per_sector <= 4096 &&
+	       (bytes_per_sector & (bytes_per_sector - 1)) == 0 &&
+	       sectors_per_cluster != 0 && (sectors_per_cluster & (sectors_per_cluster - 1)) == 0 &&
+	       dldiFatRead16(sector + 14) != 0 && sector[16] != 0;
+}
+
+// Finds the FAT volume of an image, which either starts at the first sector
+// or is the first FAT partition of an MBR.
+static int dldiFatFindVolume(DLDI_FAT *fat, u8 *sector)
+{
+	static const u8 fat_types[] = { 0x04, 0x06, 0x0B, 0x0C, 0x0E };
+
+	int rc = dldiFatPreadFull(fat->fd, sector, 512, 0, NULL);
+	if (rc != 0)
+		return rc;
+	if (dldiFatIsBootSector(sector))
+		return 0;
+	if (sector[510] != 0x55 || sector[511] != 0xAA)
+		return -EINVAL;
+
+	for (int i = 0; i < 4; i++)
+	{
+		const u8 *entry = sector + 0x1BE + i * 16;
+		if (memchr(fat_types, entry[4], sizeof(fat_types)) == NULL)
+			continue;
+
+		fat->volume_offset = (u64)dldiFatRead32(entry + 8) * 512;
+		rc = dldiFatPreadFull(fat->fd, sector, 512, fat->volume_offset, NULL);
+		if (rc != 0)
+			return rc;
+		return dldiFatIsBootSector(sector) ? 0 : -EINVAL;
+	}
+
+	return -EINVAL;
+}
+
+int dldiFatOpen(const char *path, int flags, DLDI_FAT **fat)
+{
+	DLDI_FAT *f = (DLDI_FAT *)calloc(1, sizeof(DLDI_FAT));
+	if (f == NULL)
+		return -ENOMEM;
+
+	int rc = 0;
+	u8 *raw_table = NULL;
+	u8 sector[512];
+
+	f->fd = open(path, (flags & DLDI_IMAGE_WRITE) ? O_RDWR : O_RDONLY);
+	if (f->fd < 0)
+	{
+		rc = -errno;
+		goto fat_fail;
+	}
+
+	rc = dldiFatFindVolume(f, sector);
+	if (rc != 0)
+		goto fat_fail;
+
+	f->bytes_per_sector = dldiFatRead16(sector + 11);
+	f->bytes_per_cluster = f->bytes_per_sector * sector[13];
+	u32 reserved_sectors = dldiFatRead16(sector + 14);
+	u32 fat_count = sector[16];
+	u32 root_entries = dldiFatRead16(sector + 17);
+	u32 total_sectors = dldiFatRead16(sector + 19);
+	if (total_sectors == 0)
+		total_sectors = dldiFatRead32(sector + 32);
+	u32 fat_sectors = dldiFatRead16(sector + 22);
+	if (fat_sectors == 0)
+		fat_sectors = dldiFatRead32(sector + 36);
+
+	// The type of a FAT filesystem only depends on its number of clusters.
+	u32 root_sectors = (root_entries * 32 + f->bytes_per_sector - 1) / f->bytes_per_sector;
+	u32 data_sector = reserved_sectors + fat_count * fat_sectors + root_sectors;
+	if (fat_sectors == 0 || total_sectors <= data_sector)
+	{
+		rc = -EINVAL;
+		goto fat_fail;
+	}
+	f->cluster_count = (total_sectors - data_sector) / sector[13];
+	if (f->cluster_count < 4085)
+	{
+		// FAT12 is only used on media far too small for a ROM.
+		rc = -EINVAL;
+		goto fat_fail;
+	}
+	f->fat32 = f->cluster_count >= 65525;
+
+	u64 sector_size = f->bytes_per_sector;
+	f->root_offset = f->volume_offset + (reserved_sectors + fat_count * fat_sectors) * sector_size;
+	f->root_size = root_sectors * f->bytes_per_sector;
+	f->root_cluster = f->fat32 ? dldiFatRead32(sector + 44) : 0;
+	f->data_offset = f->volume_offset + data_sector * sector_size;
+
+	// Only the entries of the clusters that exist are loaded.
+	size_t entry_size = f->fat32 ? 4 : 2;
+	size_t table_size = (f->cluster_count + 2) * entry_size;
+	if (table_size > fat_sectors * sector_size)
+	{
+		rc = -EINVAL;
+		goto fat_fail;
+	}
+	raw_table = (u8 *)malloc(table_size);
+	f->table = (u32 *)malloc((f->cluster_count + 2) * sizeof(u32));
+	if (raw_table == NULL || f->table == NULL)
+	{
+		rc = -ENOMEM;
+		goto fat_fail;
+	}
+	rc = dldiFatPreadFull(f->fd, raw_table, table_size, f->volume_offset + reserved_sectors * sector_size, NULL);
+	if (rc != 0)
+		goto fat_fail;
+
+	for (u32 i = 0; i < f->cluster_count + 2; i++)
+	{
+		if (f->fat32)
+			f->table[i] = dldiFatRead32(raw_table + i * 4) & 0x0FFFFFFF;
+		else
+			f->table[i] = dldiFatRead16(raw_table + i * 2);
+	}
+	free(raw_table);
+
+	*fat = f;
+	return 0;
+
+fat_fail:
+	free(raw_table);
+	dldiFatClose(f);
+	return rc;
+}
+
+int dldiFatClose(DLDI_FAT *fat)
+{
+	int rc = 0;
+
+	if (fat == NULL)
+		return 0;
+
+	if (fat->fd >= 0 && close(fat->fd) != 0)
+		rc = -errno;
+	free(fat->table);
+	free(fat);
+
+	return rc;
+}
+
+// Follows the cluster chain of a file. Chains that loop, leave the volume
+// or end before size bytes are rejected. Directories pass a size of 0 and
+// get every cluster of their chain.
+static int dldiFatChain(const DLDI_FAT *fat, u32 cluster, u64 size, DLDI_FAT_FILE *file)
+{
+	memset(file, 0, sizeof(*file));
+	file->size = size;
+	if (cluster == 0)
+		return size == 0 ? 0 : -EIO;
+
+	int capacity = 0;
+	u64 offset = 0;
+	u32 end_of_chain = fat->fat32 ? 0x0FFFFFF8 : 0xFFF8;
+	bool is_dir = size == 0;
+
+	for (u32 steps = 0; is_dir || offset < size; steps++)
+	{
+		if (cluster < 2 || cluster >= fat->cluster_count + 2 || steps > fat->cluster_count)
+		{
+			free(file->extents);
+			file->extents = NULL;
+			return -EIO;
+		}
+
+		u64 image_offset = fat->data_offset + (u64)(cluster - 2) * fat->bytes_per_cluster;
+		DLDI_FAT_EXTENT *last = file->extent_count > 0 ? &file->extents[file->extent_count - 1] : NULL;
+		if (last != NULL && last->image_offset + last->size == image_offset)
+		{
+			last->size += fat->bytes_per_cluster;
+		}
+		else
+		{
+			if (file->extent_count == capacity)
+			{
+				capacity = capacity ? capacity * 2 : 8;
+				DLDI_FAT_EXTENT *extents = (DLDI_FAT_EXTENT *)realloc(file->extents, capacity * sizeof(DLDI_FAT_EXTENT));
+				if (extents == NULL)
+				{
+					free(file->extents);
+					file->extents = NULL;
+					return -ENOMEM;
+				}
+				file->extents = extents;
+			}
+			file->extents[file->extent_count++] = (DLDI_FAT_EXTENT){
+				.file_offset = offset,
+				.image_offset = image_offset,
+				.size = fat->bytes_per_cluster,
+			};
+		}
+		offset += fat->bytes_per_cluster;
+
+		cluster = fat->table[cluster];
+		if (cluster >= end_of_chain)
+			break;
+	}
+
+	if (is_dir)
+		file->size = offset;
+	if (offset < file->size)
+	{
+		free(file->extents);
+		file->extents = NULL;
+		return -EIO;
+	}
+
+	return 0;
+}
+
+// Reads or writes part of a file, split over the runs of clusters it covers.
+static int dldiFatFileIo(const DLDI_FAT *fat, const DLDI_FAT_FILE *file, void *buffer,
+                         size_t size, u64 offset, bool write, DLDI_STATS *stats)
+{
+	if (offset + size > file->size)
+		return -EIO;
+
+	// Find the first extent with a binary search, as fragmented files can
+	// have many of them.
+	int lo = 0;
+	int hi = file->extent_count - 1;
+	while (lo < hi)
+	{
+		int mid = (lo + hi + 1) / 2;
+		if (file->extents[mid].file_offset <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	u8 *data = (u8 *)buffer;
+	for (int i = lo; size > 0 && i < file->extent_count; i++)
+	{
+		const DLDI_FAT_EXTENT *extent = &file->extents[i];
+		u64 skip = offset - extent->file_offset;
+		size_t len = extent->size - skip < size ? extent->size - skip : size;
+
+		int rc = write ?
+			dldiFatPwriteFull(fat->fd, data, len, extent->image_offset + skip, stats) :
+			dldiFatPreadFull(fat->fd, data, len, extent->image_offset + skip, stats);
+		if (rc != 0)
+			return rc;
+
+		data += len;
+		offset += len;
+		size -= len;
+	}
+
+	return size == 0 ? 0 : -EIO;
+}
+
+static u8 dldiFatLfnChecksum(const u8 *short_name)
+{
+	u8 sum = 0;
+
+	for (int i = 0; i < 11; i++)
+		sum = ((sum & 1) << 7) + (sum >> 1) + short_name[i];
+
+	return sum;
+}
+
+// Converts a long file name from UTF-16 to UTF-8.
+static void dldiFatLfnToUtf8(const u16 *units, int count, char *out)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < count && units[i] != 0x0000 && units[i] != 0xFFFF; i++)
+	{
+		u32 c = units[i];
+		if (c >= 0xD800 && c < 0xDC00 && i + 1 < count && units[i + 1] >= 0xDC00 && units[i + 1] < 0xE000)
+			c = 0x10000 + ((c - 0xD800) << 10) + (units[++i] - 0xDC00);
+
+		if (c < 0x80)
+		{
+			out[len++] = c;
+		}
+		else if (c < 0x800)
+		{
+			out[len++] = 0xC0 | (c >> 6);
+			out[len++] = 0x80 | (c & 0x3F);
+		}
+		else if (c < 0x10000)
+		{
+			out[len++] = 0xE0 | (c >> 12);
+			out[len++] = 0x80 | ((c >> 6) & 0x3F);
+			out[len++] = 0x80 | (c & 0x3F);
+		}
+		else
+		{
+			out[len++] = 0xF0 | (c >> 18);
+			out[len++] = 0x80 | ((c >> 12) & 0x3F);
+			out[len++] = 0x80 | ((c >> 6) & 0x3F);
+			out[len++] = 0x80 | (c & 0x3F);
+		}
+	}
+	out[len] = '\0';
+}
+
+// Turns an 8.3 name into "NAME.EXT", applying the lowercase flags that
+// Windows NT stores for names that only differ from their short form by case.
+static void dldiFatShortName(const u8 *entry, char *out)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < 8 && entry[i] != ' '; i++)
+	{
+		char c = (i == 0 && entry[0] == 0x05) ? 0xE5 : entry[i];
+		out[len++] = (entry[12] & 0x08) && c >= 'A' && c <= 'Z' ? c + 32 : c;
+	}
+	if (entry[8] != ' ')
+	{
+		out[len++] = '.';
+		for (int i = 8; i < 11 && entry[i] != ' '; i++)
+			out[len++] = (entry[12] & 0x10) && entry[i] >= 'A' && entry[i] <= 'Z' ? entry[i] + 32 : entry[i];
+	}
+	out[len] = '\0';
+}
+
+// Calls fn for every file and directory of a directory. Iteration stops when
+// fn returns non-zero, and that value is returned.
+static int dldiFatListDir(const DLDI_FAT *fat, u32 cluster,
+                          int (*fn)(void *arg, const DLDI_FAT_ENTRY *entry), void *arg)
+{
+	DLDI_FAT_FILE dir;
+	int rc;
+
+	// The FAT16 root directory isn't made of clusters.
+	if (cluster == 0 && !fat->fat32)
+	{
+		dir.size = fat->root_size;
+		dir.extent_count = 1;
+		dir.extents = (DLDI_FAT_EXTENT *)malloc(sizeof(DLDI_FAT_EXTENT));
+		if (dir.extents == NULL)
+			return -ENOMEM;
+		dir.extents[0] = (DLDI_FAT_EXTENT){ 0, fat->root_offset, fat->root_size };
+	}
+	else
+	{
+		rc = dldiFatChain(fat, cluster != 0 ? cluster : fat->root_cluster, 0, &dir);
+		if (rc != 0)
+			return rc;
+	}
+
+	u8 *data = (u8 *)malloc(dir.size);
+	DLDI_FAT_ENTRY *entry = (DLDI_FAT_ENTRY *)malloc(sizeof(DLDI_FAT_ENTRY));
+	u16 *lfn = (u16 *)calloc(DLDI_FAT_LFN_UNITS, sizeof(u16));
+	if (data == NULL || entry == NULL || lfn == NULL)
+	{
+		rc = -ENOMEM;
+		goto list_end;
+	}
+	rc = dldiFatFileIo(fat, &dir, data, dir.size, 0, false, NULL);
+	if (rc != 0)
+		goto list_end;
+
+	int lfn_checksum = -1;
+	for (u64 i = 0; i + 32 <= dir.size && rc == 0; i += 32)
+	{
+		const u8 *raw = data + i;
+		if (raw[0] == 0x00)
+			break;
+		if (raw[0] == 0xE5)
+		{
+			lfn_checksum = -1;
+			continue;
+		}
+
+		// Long name entries come before their short entry, last part first.
+		if (raw[11] == DLDI_FAT_ATTR_LFN)
+		{
+			int seq = raw[0] & 0x1F;
+			if (seq == 0 || seq > 20)
+			{
+				lfn_checksum = -1;
+				continue;
+			}
+			if (raw[0] & 0x40)
+			{
+				memset(lfn, 0, DLDI_FAT_LFN_UNITS * sizeof(u16));
+				lfn_checksum = raw[13];
+			}
+			static const u8 unit_offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+			for (int u = 0; u < 13; u++)
+				lfn[(seq - 1) * 13 + u] = dldiFatRead16(raw + unit_offsets[u]);
+			continue;
+		}
+
+		if (raw[11] & DLDI_FAT_ATTR_VOLUME)
+		{
+			lfn_checksum = -1;
+			continue;
+		}
+
+		if (lfn_checksum >= 0 && lfn_checksum == dldiFatLfnChecksum(raw))
+			dldiFatLfnToUtf8(lfn, DLDI_FAT_LFN_UNITS, entry->name);
+		else
+			dldiFatShortName(raw, entry->name);
+		lfn_checksum = -1;
+
+		if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0)
+			continue;
+
+		entry->attributes = raw[11];
+		entry->cluster = dldiFatRead16(raw + 26);
+		if (fat->fat32)
+			entry->cluster |= (u32)dldiFatRead16(raw + 20) << 16;
+		entry->size = dldiFatRead32(raw + 28);
+		rc = fn(arg, entry);
+	}
+
+list_end:
+	free(lfn);
+	free(entry);
+	free(data);
+	free(dir.extents);
+	return rc;
+}
+
+typedef struct DLDI_FAT_GLOB
+{
+	const DLDI_FAT *fat;
+	char *pattern;            // Remaining components, separated by '/'.
+	char *prefix;             // Path of the directory being listed.
+	char ***paths;
+	int count;
+	int capacity;
+} DLDI_FAT_GLOB;
+
+static int dldiFatGlobDir(DLDI_FAT_GLOB *glob, u32 cluster);
+
+static int dldiFatGlobEntry(void *arg, const DLDI_FAT_ENTRY *entry)
+{
+	DLDI_FAT_GLOB *glob = (DLDI_FAT_GLOB *)arg;
+
+	char *slash = strchr(glob->pattern, '/');
+	if (slash != NULL)
+		*slash = '\0';
+	bool match = fnmatch(glob->pattern, entry->name, FNM_CASEFOLD | FNM_PERIOD) == 0;
+	if (slash != NULL)
+		*slash = '/';
+	if (!match)
+		return 0;
+
+	size_t prefix_len = strlen(glob->prefix);
+	char *path = (char *)malloc(prefix_len + strlen(entry->name) + 2);
+	if (path == NULL)
+		return -ENOMEM;
+	memcpy(path, glob->prefix, prefix_len);
+	path[prefix_len] = '/';
+	strcpy(path + prefix_len + 1, entry->name);
+
+	int rc = 0;
+	if (slash != NULL)
+	{
+		// More components follow, so only directories match.
+		if (entry->attributes & DLDI_FAT_ATTR_DIR)
+		{
+			DLDI_FAT_GLOB sub = *glob;
+			sub.pattern = slash + 1;
+			sub.prefix = path;
+			rc = dldiFatGlobDir(&sub, entry->cluster);
+			glob->count = sub.count;
+			glob->capacity = sub.capacity;
+		}
+		free(path);
+		return rc;
+	}
+
+	if (entry->attributes & DLDI_FAT_ATTR_DIR)
+	{
+		free(path);
+		return 0;
+	}
+
+	if (glob->count == glob->capacity)
+	{
+		int capacity = glob->capacity ? glob->capacity * 2 : 16;
+		char **paths = (char **)realloc(*glob->paths, capacity * sizeof(char *));
+		if (paths == NULL)
+		{
+			free(path);
+			return -ENOMEM;
+		}
+		*glob->paths = paths;
+		glob->capacity = capacity;
+	}
+	(*glob->paths)[glob->count++] = path;
+
+	return 0;
+}
+
+static int dldiFatGlobDir(DLDI_FAT_GLOB *glob, u32 cluster)
+{
+	// Empty components, as in "//" or a trailing "/", are skipped.
+	while (*glob->pattern == '/')
+		glob->pattern++;
+	if (*glob->pattern == '\0')
+		return 0;
+
+	return dldiFatListDir(glob->fat, cluster, dldiFatGlobEntry, glob);
+}
+
+int dldiFatGlob(DLDI_FAT *fat, const char *pattern, char ***paths)
+{
+	char *copy = strdup(pattern);
+	if (copy == NULL)
+		return -ENOMEM;
+
+	DLDI_FAT_GLOB glob = {
+		.fat = fat,
+		.pattern = copy,
+		.prefix = "",
+		.paths = paths,
+		.count = 0,
+		.capacity = 0,
+	};
+
+	*paths = NULL;
+	int rc = dldiFatGlobDir(&glob, 0);
+	free(copy);
+
+	if (rc != 0)
+	{
+		dldiFatGlobFree(*paths, glob.count);
+		*paths = NULL;
+		return rc;
+	}
+
+	return glob.count;
+}
+
+void dldiFatGlobFree(char **paths, int count)
+{
+	for (int i = 0; i < count; i++)
+		free(paths[i]);
+	free(paths);
+}
+
+typedef struct DLDI_FAT_LOOKUP
+{
+	const char *name;
+	DLDI_FAT_ENTRY *entry;
+	bool found;
+} DLDI_FAT_LOOKUP;
+
+static int dldiFatLookupEntry(void *arg, const DLDI_FAT_ENTRY *entry)
+{
+	DLDI_FAT_LOOKUP *lookup = (DLDI_FAT_LOOKUP *)arg;
+
+	if (strcasecmp(entry->name, lookup->name) != 0)
+		return 0;
+
+	*lookup->entry = *entry;
+	lookup->found = true;
+	return 1;
+}
+
+// Finds the directory entry of an absolute path.
+static int dldiFatLookup(const DLDI_FAT *fat, const char *path, DLDI_FAT_ENTRY *entry)
+{
+	char *copy = strdup(path);
+	if (copy == NULL)
+		return -ENOMEM;
+
+	int rc = -ENOENT;
+	u32 cluster = 0;
+	char *save = NULL;
+	for (char *name = strtok_r(copy, "/", &save); name != NULL; name = strtok_r(NULL, "/", &save))
+	{
+		DLDI_FAT_LOOKUP lookup = { .name = name, .entry = entry, .found = false };
+		rc = dldiFatListDir(fat, cluster, dldiFatLookupEntry, &lookup);
+		if (rc < 0)
+			break;
+		rc = lookup.found ? 0 : -ENOENT;
+		if (rc != 0)
+			break;
+		cluster = entry->cluster;
+	}
+
+	free(copy);
+	if (rc == 0 && (entry->attributes & DLDI_FAT_ATTR_DIR))
+		rc = -EISDIR;
+	return rc;
+}
+
+typedef struct DLDI_FAT_STUB
+{
+	u64 offset;
+	DLDI_INTERFACE header;
+} DLDI_FAT_STUB;
+
+// Searches the regions of a file for stubs, one chunk at a time. Chunks
+// overlap by a header, so headers that cross a chunk boundary are found.
+static int dldiFatFindStubs(const DLDI_FAT *fat, const DLDI_FAT_FILE *file,
+                            DLDI_FAT_STUB **stubs, DLDI_STATS *stats)
+{
+	u8 header[DLDI_NDS_HEADER_SIZE];
+	size_t header_size = file->size < sizeof(header) ? file->size : sizeof(header);
+	int rc = dldiFatFileIo(fat, file, header, header_size, 0, false, stats);
+	if (rc != 0)
+		return rc;
+
+	DLDI_REGION regions[DLDI_NDS_MAX_REGIONS];
+	int region_count = dldiScanRegions(header, header_size, file->size, regions);
+
+	u8 *buffer = (u8 *)malloc(DLDI_FAT_CHUNK_SIZE + DLDI_HEADER_SIZE);
+	if (buffer == NULL)
+		return -ENOMEM;
+
+	int count = 0;
+	int capacity = 0;
+	u64 region_bytes = 0;
+	*stubs = NULL;
+	for (int r = 0; r < region_count && rc == 0; r++)
+	{
+		const DLDI_REGION *region = &regions[r];
+
+		// pos is the offset of the chunk in the region, which keeps headers
+		// 4-byte aligned relative to the region like on disk.
+		u64 pos = 0;
+		while (pos < region->size && rc == 0)
+		{
+			u64 left = region->size - pos;
+			size_t emit = left < DLDI_FAT_CHUNK_SIZE ? left : DLDI_FAT_CHUNK_SIZE;
+			size_t len = left < emit + DLDI_HEADER_SIZE ? left : emit + DLDI_HEADER_SIZE;
+
+			u64 start = dldiStatsNow();
+			rc = dldiFatFileIo(fat, file, buffer, len, region->offset + pos, false, stats);
+			start = dldiStatsPhase(stats, DLDI_PHASE_LOAD, start);
+			if (rc != 0)
+				break;
+
+			u64 next_pos = pos + emit;
+			ssize_t offset = dldiFindInBuffer(buffer, len, 0);
+			while (offset >= 0 && (size_t)offset < emit)
+			{
+				if (count == capacity)
+				{
+					capacity = capacity ? capacity * 2 : 2;
+					DLDI_FAT_STUB *grown = (DLDI_FAT_STUB *)realloc(*stubs, capacity * sizeof(DLDI_FAT_STUB));
+					if (grown == NULL)
+					{
+						rc = -ENOMEM;
+						break;
+					}
+					*stubs = grown;
+				}
+
+				DLDI_FAT_STUB *stub = &(*stubs)[count++];
+				stub->offset = region->offset + pos + offset;
+				memcpy(&stub->header, buffer + offset, sizeof(DLDI_INTERFACE));
+				if (stats != NULL && count == 1)
+					stats->bytes_to_stub += region_bytes + pos + offset;
+
+				// The next stub can't start inside this one. If it is past
+				// this chunk, the next chunk starts there.
+				u64 next = offset + dldiStubSpan(&stub->header);
+				if (next >= emit)
+				{
+					next_pos = pos + next;
+					break;
+				}
+				offset = dldiFindInBuffer(buffer, len, next);
+			}
+
+			if (stats != NULL)
+				stats->bytes_scanned += emit;
+			dldiStatsPhase(stats, DLDI_PHASE_SCAN, start);
+			pos = next_pos;
+		}
+		region_bytes += region->size;
+	}
+
+	free(buffer);
+	if (rc == 0 && count == 0)
+		rc = -ENODATA;
+	if (rc != 0)
+	{
+		free(*stubs);
+		*stubs = NULL;
+		return rc;
+	}
+	if (stats != NULL && count == 0)
+		stats->bytes_to_stub += stats->bytes_scanned;
+
+	return count;
+}
+
+int dldiFatPatch(DLDI_FAT *fat, const char *path, const DLDI_RELOC_PLAN *plan,
+                 DLDI_RELOC_CACHE *cache, int flags, int sync, DLDI_STATS *stats)
+{
+	u64 start = dldiStatsNow();
+	DLDI_FAT_ENTRY *entry = (DLDI_FAT_ENTRY *)malloc(sizeof(DLDI_FAT_ENTRY));
+	if (entry == NULL)
+		return -ENOMEM;
+
+	DLDI_FAT_FILE file = {};
+	int rc = dldiFatLookup(fat, path, entry);
+	if (rc == 0)
+		rc = dldiFatChain(fat, entry->cluster, entry->size, &file);
+	free(entry);
+	dldiStatsPhase(stats, DLDI_PHASE_LOAD, start);
+	if (rc != 0)
+		return rc;
+
+	DLDI_FAT_STUB *stubs = NULL;
+	int count = dldiFatFindStubs(fat, &file, &stubs, stats);
+	if (count < 0)
+	{
+		free(file.extents);
+		return count;
+	}
+
+	// Every stub is checked before anything is written.
+	start = dldiStatsNow();
+	const DLDI_INTERFACE *src_dldi = dldiRelocPlanDriver(plan);
+	for (int i = 0; i < count && rc == 0; i++)
+	{
+		if (src_dldi->driverSize > stubs[i].header.allocatedSize)
+			rc = -ENOSPC;
+	}
+	start = dldiStatsPhase(stats, DLDI_PHASE_VALIDATE, start);
+
+	DLDI_INTERFACE *new_dldi = NULL;
+	u8 *old_dldi = NULL;
+	int changed = 0;
+	if (rc == 0)
+	{
+		new_dldi = (DLDI_INTERFACE *)dldiBufferGet();
+		old_dldi = (u8 *)dldiBufferGet();
+		if (new_dldi == NULL || old_dldi == NULL)
+			rc = -ENOMEM;
+	}
+
+	for (int i = 0; i < count && rc == 0; i++)
+	{
+		const DLDI_INTERFACE *dst_dldi = &stubs[i].header;
+		if (cache != NULL)
+		{
+			dldiRelocCacheGet(cache, plan, dst_dldi->dldiStart, dst_dldi->allocatedSize, new_dldi);
+		}
+		else
+		{
+			dldiRelocPlanApply(plan, new_dldi, dst_dldi->dldiStart);
+			new_dldi->allocatedSize = dst_dldi->allocatedSize;
+		}
+		start = dldiStatsPhase(stats, DLDI_PHASE_RELOCATE, start);
+
+		// The stub may be cut short by the end of the file, which is never
+		// extended.
+		u64 dldi_size = 1 << new_dldi->driverSize;
+		if (dldi_size > file.size - stubs[i].offset)
+			dldi_size = file.size - stubs[i].offset;
+
+		// A stub that already holds the driver isn't written again. Its
+		// header is in memory, so only stubs likely to match are read.
+		if (memcmp(&stubs[i].header, new_dldi, DLDI_HEADER_SIZE) == 0)
+		{
+			rc = dldiFatFileIo(fat, &file, old_dldi, dldi_size, stubs[i].offset, false, stats);
+			start = dldiStatsPhase(stats, DLDI_PHASE_VALIDATE, start);
+			if (rc == 0 && memcmp(old_dldi, new_dldi, dldi_size) == 0)
+				continue;
+		}
+
+		changed++;
+		if (rc == 0 && !(flags & DLDI_PATCH_CHECK))
+			rc = dldiFatFileIo(fat, &file, new_dldi, dldi_size, stubs[i].offset, true, stats);
+		start = dldiStatsPhase(stats, DLDI_PHASE_WRITE, start);
+	}
+
+	// Only images that were written have anything to flush.
+	if (rc == 0 && changed > 0 && !(flags & DLDI_PATCH_CHECK))
+		rc = dldiSync(fat->fd, sync, stats);
+
+	dldiBufferPut(old_dldi);
+	dldiBufferPut(new_dldi);
+	free(stubs);
+	free(file.extents);
+	return rc < 0 ? rc : changed;
+}
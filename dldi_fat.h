@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_FAT_H__
+#define DLDIPATCH_DLDI_FAT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dldi_image.h"
+#include "dldi_reloc.h"
+#include "dldi_stats.h"
+
+/// Separates the path of a disk image from the path of a file inside it, as
+/// in "card.img::/games/game.nds".
+#define DLDI_FAT_SEPARATOR  "::"
+
+/// A FAT16 or FAT32 filesystem in a disk image.
+///
+/// The filesystem is only read, never changed: files are patched by writing
+/// to the sectors they already occupy. The file allocation table is loaded
+/// when the image is opened, after which files can be patched from any
+/// number of threads at once.
+typedef struct DLDI_FAT DLDI_FAT;
+
+/// Open a disk image.
+///
+/// The image may hold the filesystem directly, or have an MBR partition
+/// table, in which case the first FAT partition is used.
+///
+/// @param path Path of the disk image.
+/// @param flags DLDI_IMAGE_WRITE to allow patching files.
+/// @param fat Receives the filesystem on success.
+/// @return 0 on success, -EINVAL if the image has no FAT16 or FAT32
+///     filesystem, or another negative errno value.
+int dldiFatOpen(const char *path, int flags, DLDI_FAT **fat);
+
+/// Close a disk image.
+///
+/// @return 0 on success, or a negative errno value if closing the file failed.
+int dldiFatClose(DLDI_FAT *fat);
+
+/// Find the files whose path matches a pattern.
+///
+/// Each component of the pattern may have fnmatch() wildcards. Names are
+/// compared without regard to case, like FAT does. Long file names are used
+/// where they exist.
+///
+/// @param fat The filesystem.
+/// @param pattern Absolute path of the files, such as "/games/*.nds".
+/// @param paths Receives an array of paths, which must be freed with
+///     dldiFatGlobFree().
+/// @return The number of files found, or a negative errno value.
+int dldiFatGlob(DLDI_FAT *fat, const char *pattern, char ***paths);
+
+/// Free the paths returned by dldiFatGlob().
+void dldiFatGlobFree(char **paths, int count);
+
+/// Patch every DLDI stub of a file in the filesystem.
+///
+/// Only the clusters of the file are read. NDS ROMs are only searched in their
+/// ARM binaries, like files on disk. Every stub is checked before anything is
+/// written, so the file is either fully patched or left alone. Stubs that
+/// already hold the relocated driver aren't written.
+///
+/// @param fat The filesystem, opened with DLDI_IMAGE_WRITE unless
+///     DLDI_PATCH_CHECK is given.
+/// @param path Absolute path of the file.
+/// @param plan The plan of the driver to insert.
+/// @param cache Cache of relocated drivers, or NULL.
+/// @param flags DLDI_PATCH_CHECK to only compare.
+/// @param sync DLDI_SYNC_NONE, DLDI_SYNC_DATA or DLDI_SYNC_FULL, to flush the
+///     image once stubs have been written.
+/// @param stats Counters to add the work done to, or NULL.
+/// @return The number of stubs that differed from the driver, as with
+///     dldiImagePatch(). -ENOENT if there is no such file, -ENODATA if it
+///     has no DLDI stub, -ENOSPC if the driver doesn't fit in a stub, or
+///     another negative errno value.
+int dldiFatPatch(DLDI_FAT *fat, const char *path, const DLDI_RELOC_PLAN *plan,
+                 DLDI_RELOC_CACHE *cache, int flags, int sync, DLDI_STATS *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_FAT_H__
@@ -0,0 +1,729 @@
+// SPDX-License-Identifier: Zlib
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dldi_image.h"
+#include "dldi_index.h"
+#include "dldi_nds.h"
+#include "dldi_scan.h"
+#include "dldi_stats.h"
+
+struct DLDI_IMAGE
+{
+	const char *path;
+	int fd;
+	off_t size;
+	DLDI_INTERFACE *driver;
+	int stub_count;
+	DLDI_STUB *stubs;
+	bool *changed; // By the last patch, allocated when first patched.
+	DLDI_INDEX *index;
+	DLDI_STATS *stats;
+	bool writable;
+	int threads; // Of the search, from DLDI_IMAGE_THREADS().
+};
+
+// Buffers beyond this many are freed instead of being kept for reuse.
+#define DLDI_BUFFER_POOL_SIZE   16
+
+static pthread_mutex_t dldiBufferLock = PTHREAD_MUTEX_INITIALIZER;
+static void *dldiBufferPool[DLDI_BUFFER_POOL_SIZE];
+static int dldiBufferCount = 0;
+
+void *dldiBufferGet(void)
+{
+	void *buffer = NULL;
+
+	pthread_mutex_lock(&dldiBufferLock);
+	if (dldiBufferCount > 0)
+		buffer = dldiBufferPool[--dldiBufferCount];
+	pthread_mutex_unlock(&dldiBufferLock);
+
+	if (buffer == NULL)
+		buffer = aligned_alloc(sizeof(u32), DLDI_BUFFER_SIZE);
+
+	return buffer;
+}
+
+void dldiBufferPut(void *buffer)
+{
+	if (buffer == NULL)
+		return;
+
+	pthread_mutex_lock(&dldiBufferLock);
+	if (dldiBufferCount < DLDI_BUFFER_POOL_SIZE)
+	{
+		dldiBufferPool[dldiBufferCount++] = buffer;
+		buffer = NULL;
+	}
+	pthread_mutex_unlock(&dldiBufferLock);
+
+	free(buffer);
+}
+
+static void dldiSetSection(DLDI_SECTION *section, const DLDI_INTERFACE *io,
+                           u32 start, u32 end, bool present)
+{
+	section->start = start - io->dldiStart;
+	section->end = end - io->dldiStart;
+	section->present = present;
+}
+
+void dldiStubInit(DLDI_STUB *stub, const DLDI_INTERFACE *io, off_t offset)
+{
+	stub->offset = offset;
+	memcpy(&stub->header, io, sizeof(DLDI_INTERFACE));
+
+	dldiSetSection(&stub->sections[DLDI_SECTION_DATA], io,
+	               io->dldiStart, io->dldiEnd, true);
+	dldiSetSection(&stub->sections[DLDI_SECTION_GLUE], io,
+	               io->interworkStart, io->interworkEnd, io->fixSectionsFlags & FIX_GLUE);
+	dldiSetSection(&stub->sections[DLDI_SECTION_GOT], io,
+	               io->gotStart, io->gotEnd, io->fixSectionsFlags & FIX_GOT);
+	dldiSetSection(&stub->sections[DLDI_SECTION_BSS], io,
+	               io->bssStart, io->bssEnd, io->fixSectionsFlags & FIX_BSS);
+}
+
+// Copies the driver at offset to a DLDI_BUFFER_SIZE byte buffer.
+static void dldiCopyDriver(void *buffer, const u8 *data, off_t size, off_t offset)
+{
+	const DLDI_INTERFACE *src_dldi = (const DLDI_INTERFACE *)(data + offset);
+	off_t dldi_size = 1 << src_dldi->driverSize;
+
+	// If this is a raw DLDI binary, then the file itself may be smaller
+	// than the reported DLDI size. If we are looking inside a homebrew
+	// app, then we may also go out of bounds of the file.
+	if (dldi_size > size - offset)
+		dldi_size = size - offset;
+
+	memcpy(buffer, src_dldi, dldi_size);
+	memset((u8 *)buffer + dldi_size, 0, DLDI_BUFFER_SIZE - dldi_size);
+}
+
+// Number of region bytes that come before a file offset.
+static u64 dldiRegionBytesBefore(const DLDI_REGION *regions, int count, u64 offset)
+{
+	u64 bytes = 0;
+
+	for (int r = 0; r < count && regions[r].offset < offset; r++)
+	{
+		u64 end = regions[r].offset + regions[r].size;
+		bytes += (end < offset ? end : offset) - regions[r].offset;
+	}
+
+	return bytes;
+}
+
+// Scans a file for every valid DLDI header and copies the first driver to a
+// DLDI_BUFFER_SIZE byte buffer. The file is mapped rather than read, so only
+// the pages that are scanned are touched. NDS ROMs are only searched in their
+// ARM9 and ARM7 binaries, which skips NitroFS data.
+static int dldiScanFd(DLDI_IMAGE *img)
+{
+	if (img->size < (off_t)DLDI_HEADER_SIZE)
+		return -ENODATA;
+
+	const u8 *src_binary = (const u8 *)mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, img->fd, 0);
+	if (src_binary == MAP_FAILED)
+		return -errno;
+	if (img->stats != NULL)
+		img->stats->map_calls++;
+
+	DLDI_REGION regions[DLDI_NDS_MAX_REGIONS];
+	int region_count = dldiScanRegions(src_binary, img->size, img->size, regions);
+	for (int r = 0; r < region_count; r++)
+		madvise((void *)(src_binary + regions[r].offset), regions[r].size, MADV_SEQUENTIAL);
+
+	// The DLDI *must* be 4-byte aligned, or it isn't actually usable.
+	u64 *offsets;
+	int found = dldiFindStubsInRegions(src_binary, regions, region_count, INT_MAX, img->threads, &offsets);
+	int rc = found < 0 ? found : 0;
+	if (found > 0)
+	{
+		img->stubs = (DLDI_STUB *)malloc(found * sizeof(DLDI_STUB));
+		if (img->stubs == NULL)
+		{
+			rc = -ENOMEM;
+		}
+		else
+		{
+			for (int i = 0; i < found; i++)
+				dldiStubInit(&img->stubs[i], (const DLDI_INTERFACE *)(src_binary + offsets[i]), offsets[i]);
+			img->stub_count = found;
+		}
+	}
+	free(offsets);
+
+	if (img->stats != NULL)
+	{
+		// Every region is searched to its end, for further stubs.
+		u64 scanned = dldiRegionBytesBefore(regions, region_count, img->size);
+		img->stats->bytes_scanned += scanned;
+		img->stats->bytes_read += scanned;
+		img->stats->bytes_to_stub += img->stub_count > 0 ?
+			dldiRegionBytesBefore(regions, region_count, img->stubs[0].offset) : scanned;
+	}
+
+	if (rc == 0 && img->stub_count == 0)
+		rc = -ENODATA;
+	if (rc == 0)
+		dldiCopyDriver(img->driver, src_binary, img->size, img->stubs[0].offset);
+
+	munmap((void *)src_binary, img->size);
+	return rc;
+}
+
+// Reads up to size bytes, stopping early only at the end of the file.
+static ssize_t dldiPreadFull(int fd, void *buffer, size_t size, off_t offset, DLDI_STATS *stats)
+{
+	size_t done = 0;
+
+	while (done < size)
+	{
+		ssize_t rc = pread(fd, (u8 *)buffer + done, size - done, offset + done);
+		if (stats != NULL)
+			stats->read_calls++;
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (rc == 0)
+			break;
+		done += rc;
+	}
+
+	if (stats != NULL)
+		stats->bytes_read += done;
+	return done;
+}
+
+// Hashes the drivers of every stub of an image.
+static int dldiHashStubs(DLDI_IMAGE *img, u64 *hash)
+{
+	u8 *buffer = (u8 *)dldiBufferGet();
+	if (buffer == NULL)
+		return -ENOMEM;
+
+	*hash = DLDI_HASH_INIT;
+	for (int i = 0; i < img->stub_count; i++)
+	{
+		const DLDI_STUB *stub = &img->stubs[i];
+		ssize_t size = dldiPreadFull(img->fd, buffer, 1 << stub->header.driverSize, stub->offset, img->stats);
+		if (size < 0)
+		{
+			dldiBufferPut(buffer);
+			return size;
+		}
+		*hash = dldiHash(*hash, buffer, size);
+	}
+
+	dldiBufferPut(buffer);
+	return 0;
+}
+
+// Fills the image from the index, if it has an entry for this version of
+// the file. Every recorded header is read back and compared, so an entry that
+// doesn't match the file is treated like a missing one.
+static int dldiImageFromIndex(DLDI_IMAGE *img, const struct stat *st)
+{
+	DLDI_INDEX_STUB small[4];
+	DLDI_INDEX_STUB *stubs = small;
+	u64 hash = 0;
+
+	int count = dldiIndexLookup(img->index, st, small, 4, &hash);
+	if (count < 0)
+		return count;
+	if (count == 0)
+		return -ENODATA;
+	if (count > 4)
+	{
+		stubs = (DLDI_INDEX_STUB *)malloc(count * sizeof(DLDI_INDEX_STUB));
+		if (stubs == NULL)
+			return -ENOMEM;
+		if (dldiIndexLookup(img->index, st, stubs, count, &hash) != count)
+		{
+			free(stubs);
+			return -ENOENT;
+		}
+	}
+
+	int rc = 0;
+	img->stubs = (DLDI_STUB *)malloc(count * sizeof(DLDI_STUB));
+	if (img->stubs == NULL)
+	{
+		rc = -ENOMEM;
+		goto index_end;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		DLDI_INTERFACE header;
+		if (dldiPreadFull(img->fd, &header, sizeof(header), stubs[i].offset, img->stats) != sizeof(header) ||
+		    memcmp(&header, &stubs[i].header, sizeof(header)) != 0 ||
+		    !dldiIsValid(&header, sizeof(header)))
+		{
+			rc = -ENOENT;
+			goto index_end;
+		}
+		dldiStubInit(&img->stubs[i], &header, stubs[i].offset);
+	}
+	img->stub_count = count;
+
+	if (dldiIndexFlags(img->index) & DLDI_INDEX_HASH)
+	{
+		u64 file_hash;
+		rc = dldiHashStubs(img, &file_hash);
+		if (rc == 0 && file_hash != hash)
+			rc = -ENOENT;
+		if (rc != 0)
+			goto index_end;
+	}
+
+	// Only the first driver is kept in memory.
+	memset(img->driver, 0, DLDI_BUFFER_SIZE);
+	ssize_t size = dldiPreadFull(img->fd, img->driver, 1 << img->stubs[0].header.driverSize, img->stubs[0].offset, img->stats);
+	if (size < 0)
+		rc = size;
+
+index_end:
+	if (rc != 0)
+	{
+		free(img->stubs);
+		img->stubs = NULL;
+		img->stub_count = 0;
+	}
+	if (stubs != small)
+		free(stubs);
+	return rc;
+}
+
+// Absolute path of the file of an image, read from /proc so that images
+// opened from a descriptor have one too. Returns NULL if it isn't known.
+static const char *dldiImageRealPath(const DLDI_IMAGE *img, char *buffer, size_t size)
+{
+	char link[32];
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", img->fd);
+	ssize_t len = readlink(link, buffer, size - 1);
+	if (len <= 0 || buffer[0] != '/')
+		return NULL;
+	buffer[len] = '\0';
+	return buffer;
+}
+
+// Records the stubs of the image in its index, even if it has none. The
+// headers are read back from the file, so this also picks up drivers that
+// were written since opening.
+static int dldiImageToIndex(DLDI_IMAGE *img)
+{
+	struct stat st;
+	if (fstat(img->fd, &st) != 0)
+		return -errno;
+
+	DLDI_INDEX_STUB *stubs = NULL;
+	if (img->stub_count > 0)
+	{
+		stubs = (DLDI_INDEX_STUB *)malloc(img->stub_count * sizeof(DLDI_INDEX_STUB));
+		if (stubs == NULL)
+			return -ENOMEM;
+	}
+
+	int rc = 0;
+	for (int i = 0; i < img->stub_count && rc == 0; i++)
+	{
+		DLDI_STUB *stub = &img->stubs[i];
+		if (dldiPreadFull(img->fd, &stub->header, sizeof(stub->header), stub->offset, img->stats) != sizeof(stub->header))
+			rc = -EIO;
+		stubs[i].offset = stub->offset;
+		stubs[i].header = stub->header;
+	}
+
+	u64 hash = 0;
+	if (rc == 0 && (dldiIndexFlags(img->index) & DLDI_INDEX_HASH))
+		rc = dldiHashStubs(img, &hash);
+	char path[PATH_MAX];
+	if (rc == 0)
+		rc = dldiIndexStore(img->index, dldiImageRealPath(img, path, sizeof(path)), &st, stubs, img->stub_count, hash);
+
+	free(stubs);
+	return rc;
+}
+
+// Locates the drivers of an image whose descriptor is already open.
+static int dldiImageLoad(DLDI_IMAGE *img, u64 start)
+{
+	DLDI_STATS *stats = img->stats;
+	DLDI_INDEX *index = img->index;
+	int rc = 0;
+
+	struct stat st;
+	if (fstat(img->fd, &st) != 0)
+		return -errno;
+	img->size = st.st_size;
+
+	img->driver = (DLDI_INTERFACE *)dldiBufferGet();
+	if (img->driver == NULL)
+		return -ENOMEM;
+
+	start = dldiStatsPhase(stats, DLDI_PHASE_LOAD, start);
+
+	// Reading back the headers recorded in the index replaces the scan. Files
+	// recorded without a stub aren't searched again.
+	if (index != NULL)
+	{
+		rc = dldiImageFromIndex(img, &st);
+		if (rc == 0 || rc == -ENODATA)
+		{
+			dldiStatsPhase(stats, DLDI_PHASE_VALIDATE, start);
+			return rc;
+		}
+	}
+
+	rc = dldiScanFd(img);
+	start = dldiStatsPhase(stats, DLDI_PHASE_SCAN, start);
+	if (rc != 0 && rc != -ENODATA)
+		return rc;
+
+	// Failing to update the index only makes the next run slower.
+	if (index != NULL)
+	{
+		dldiImageToIndex(img);
+		dldiStatsPhase(stats, DLDI_PHASE_LOAD, start);
+	}
+
+	return rc;
+}
+
+int dldiImageOpenIndexed(const char *path, int flags, DLDI_INDEX *index,
+                         DLDI_STATS *stats, DLDI_IMAGE **image)
+{
+	u64 start = dldiStatsNow();
+	DLDI_IMAGE *img = (DLDI_IMAGE *)calloc(1, sizeof(DLDI_IMAGE));
+	if (img == NULL)
+		return -ENOMEM;
+
+	int rc = 0;
+
+	img->path = path;
+	img->index = index;
+	img->stats = stats;
+	img->writable = flags & DLDI_IMAGE_WRITE;
+	img->threads = flags >> 8;
+	img->fd = open(path, img->writable ? O_RDWR : O_RDONLY);
+	if (img->fd < 0)
+		rc = -errno;
+	else
+		rc = dldiImageLoad(img, start);
+
+	if (rc != 0)
+	{
+		img->index = NULL;
+		dldiImageClose(img);
+		return rc;
+	}
+
+	*image = img;
+	return 0;
+}
+
+int dldiImageOpenFd(int fd, int flags, DLDI_INDEX *index, DLDI_STATS *stats, DLDI_IMAGE **image)
+{
+	u64 start = dldiStatsNow();
+	DLDI_IMAGE *img = (DLDI_IMAGE *)calloc(1, sizeof(DLDI_IMAGE));
+	if (img == NULL)
+		return -ENOMEM;
+
+	int rc = 0;
+
+	img->path = NULL;
+	img->index = index;
+	img->stats = stats;
+	img->writable = flags & DLDI_IMAGE_WRITE;
+	img->threads = flags >> 8;
+	img->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (img->fd < 0)
+		rc = -errno;
+	else
+		rc = dldiImageLoad(img, start);
+
+	if (rc != 0)
+	{
+		img->index = NULL;
+		dldiImageClose(img);
+		return rc;
+	}
+
+	*image = img;
+	return 0;
+}
+
+int dldiImageOpen(const char *path, int flags, DLDI_IMAGE **image)
+{
+	return dldiImageOpenIndexed(path, flags, NULL, NULL, image);
+}
+
+int dldiImageClose(DLDI_IMAGE *image)
+{
+	int rc = 0;
+
+	if (image == NULL)
+		return 0;
+
+	// The index entry is refreshed if the drivers may have been patched.
+	bool changed = false;
+	for (int i = 0; image->changed != NULL && i < image->stub_count; i++)
+		changed |= image->changed[i];
+	if (image->writable && image->index != NULL && changed)
+	{
+		u64 start = dldiStatsNow();
+		dldiImageToIndex(image);
+		dldiStatsPhase(image->stats, DLDI_PHASE_LOAD, start);
+	}
+
+	if (image->fd >= 0 && close(image->fd) != 0)
+		rc = -errno;
+	dldiBufferPut(image->driver);
+	free(image->stubs);
+	free(image->changed);
+	free(image);
+
+	return rc;
+}
+
+const char *dldiImagePath(const DLDI_IMAGE *image)
+{
+	return image->path;
+}
+
+int dldiImageFd(const DLDI_IMAGE *image)
+{
+	return image->fd;
+}
+
+off_t dldiImageSize(const DLDI_IMAGE *image)
+{
+	return image->size;
+}
+
+int dldiImageStubCount(const DLDI_IMAGE *image)
+{
+	return image->stub_count;
+}
+
+const DLDI_STUB *dldiImageStub(const DLDI_IMAGE *image, int index)
+{
+	return &image->stubs[index];
+}
+
+bool dldiImageStubChanged(const DLDI_IMAGE *image, int index)
+{
+	return image->changed != NULL && image->changed[index];
+}
+
+off_t dldiImageOffset(const DLDI_IMAGE *image)
+{
+	return image->stubs[0].offset;
+}
+
+const DLDI_INTERFACE *dldiImageDriver(const DLDI_IMAGE *image)
+{
+	return image->driver;
+}
+
+DLDI_STATS *dldiImageStats(const DLDI_IMAGE *image)
+{
+	return image->stats;
+}
+
+// Checks whether a stub already holds a driver. The headers of the stubs are
+// in memory, so most stubs that differ are found without reading the file.
+static int dldiImageMatches(DLDI_IMAGE *img, int index, const DLDI_INTERFACE *driver, void **buffer)
+{
+	const DLDI_STUB *stub = &img->stubs[index];
+	size_t size = 1 << driver->driverSize;
+
+	if (memcmp(&stub->header, driver, DLDI_HEADER_SIZE) != 0)
+		return 0;
+	if (stub->offset + (off_t)size > img->size)
+		return 0;
+
+	// The first driver was read while opening the image.
+	if (index == 0)
+		return memcmp(img->driver, driver, size) == 0;
+
+	if (*buffer == NULL)
+	{
+		*buffer = dldiBufferGet();
+		if (*buffer == NULL)
+			return -ENOMEM;
+	}
+	ssize_t got = dldiPreadFull(img->fd, *buffer, size, stub->offset, img->stats);
+	if (got < 0)
+		return got;
+
+	return (size_t)got == size && memcmp(*buffer, driver, size) == 0;
+}
+
+static int dldiImagePatchTo(DLDI_IMAGE *image, const DLDI_RELOC_PLAN *plan, DLDI_RELOC_CACHE *cache,
+                            int out_fd, DLDI_JOURNAL *journal, int flags)
+{
+	int rc = 0;
+	int changed = 0;
+	const DLDI_INTERFACE *src_dldi = dldiRelocPlanDriver(plan);
+	DLDI_STATS *stats = image->stats;
+	u64 start = dldiStatsNow();
+
+	// Every stub is checked before anything is written, so that a target is
+	// either fully patched or left alone.
+	for (int i = 0; i < image->stub_count; i++)
+	{
+		if (src_dldi->driverSize > image->stubs[i].header.allocatedSize)
+			return -ENOSPC;
+	}
+	start = dldiStatsPhase(stats, DLDI_PHASE_VALIDATE, start);
+
+	if (image->changed == NULL)
+		image->changed = (bool *)malloc(image->stub_count * sizeof(bool));
+	if (image->changed == NULL)
+		return -ENOMEM;
+	memset(image->changed, 0, image->stub_count * sizeof(bool));
+
+	DLDI_INTERFACE *new_dldi = (DLDI_INTERFACE *)dldiBufferGet();
+	if (new_dldi == NULL)
+		return -ENOMEM;
+	void *old_dldi = NULL;
+
+	// The stubs were already located while opening, so each one is a single
+	// write of the driver relocated to its own address, in file order.
+	for (int i = 0; i < image->stub_count && rc == 0; i++)
+	{
+		const DLDI_STUB *stub = &image->stubs[i];
+		const DLDI_INTERFACE *dst_dldi = &stub->header;
+
+		if (cache != NULL)
+		{
+			dldiRelocCacheGet(cache, plan, dst_dldi->dldiStart, dst_dldi->allocatedSize, new_dldi);
+		}
+		else
+		{
+			dldiRelocPlanApply(plan, new_dldi, dst_dldi->dldiStart);
+			// restore the original allocated driver size.
+			new_dldi->allocatedSize = dst_dldi->allocatedSize;
+		}
+		start = dldiStatsPhase(stats, DLDI_PHASE_RELOCATE, start);
+
+		// A stub that already holds the driver isn't written again, so
+		// patching a file twice leaves it untouched.
+		rc = dldiImageMatches(image, i, new_dldi, &old_dldi);
+		start = dldiStatsPhase(stats, DLDI_PHASE_VALIDATE, start);
+		if (rc != 0)
+		{
+			rc = rc < 0 ? rc : 0;
+			continue;
+		}
+
+		changed++;
+		image->changed[i] = true;
+		if (flags & DLDI_PATCH_CHECK)
+			continue;
+
+		ssize_t dldi_size = 1 << new_dldi->driverSize;
+		if (journal != NULL)
+		{
+			// The bytes about to be replaced are recorded first, which
+			// is at most the allocated size of the stub.
+			ssize_t got = -ENOMEM;
+			if (old_dldi == NULL)
+				old_dldi = dldiBufferGet();
+			if (old_dldi != NULL)
+				got = dldiPreadFull(image->fd, old_dldi, dldi_size, stub->offset, stats);
+			rc = got < 0 ? got : dldiJournalRecord(journal, image->fd, image->path, stub->offset,
+			                                       new_dldi, dldi_size, old_dldi);
+			start = dldiStatsPhase(stats, DLDI_PHASE_WRITE, start);
+			if (rc != 0)
+				break;
+		}
+
+		ssize_t written = pwrite(out_fd, new_dldi, dldi_size, stub->offset);
+		if (written != dldi_size)
+			rc = written < 0 ? -errno : -EIO;
+		start = dldiStatsPhase(stats, DLDI_PHASE_WRITE, start);
+		if (stats != NULL)
+		{
+			stats->write_calls++;
+			stats->bytes_written += written > 0 ? written : 0;
+		}
+	}
+
+	dldiBufferPut(old_dldi);
+	dldiBufferPut(new_dldi);
+	return rc < 0 ? rc : changed;
+}
+
+int dldiImagePatch(DLDI_IMAGE *image, const DLDI_RELOC_PLAN *plan, DLDI_RELOC_CACHE *cache,
+                   int out_fd, int flags)
+{
+	return dldiImagePatchTo(image, plan, cache, out_fd, NULL, flags);
+}
+
+int dldiImagePatchJournal(DLDI_IMAGE *image, const DLDI_RELOC_PLAN *plan, DLDI_RELOC_CACHE *cache,
+                          DLDI_JOURNAL *journal, int flags)
+{
+	return dldiImagePatchTo(image, plan, cache, image->fd, journal, flags);
+}
+
+DLDI_INTERFACE *dldiLoadFromFd(int fd, off_t *dldi_offset)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)DLDI_HEADER_SIZE)
+		return NULL;
+
+	const u8 *src_binary = (const u8 *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (src_binary == MAP_FAILED)
+		return NULL;
+
+	DLDI_REGION regions[DLDI_NDS_MAX_REGIONS];
+	int region_count = dldiScanRegions(src_binary, st.st_size, st.st_size, regions);
+
+	// Only the first driver is needed, so the search stops there.
+	DLDI_INTERFACE *dldi = NULL;
+	u64 *offset;
+	if (dldiFindStubsInRegions(src_binary, regions, region_count, 1, 1, &offset) > 0)
+		dldi = (DLDI_INTERFACE *)malloc(DLDI_BUFFER_SIZE);
+	if (dldi != NULL)
+	{
+		dldiCopyDriver(dldi, src_binary, st.st_size, *offset);
+		if (dldi_offset != NULL)
+			*dldi_offset = *offset;
+	}
+	free(offset);
+
+	munmap((void *)src_binary, st.st_size);
+	return dldi;
+}
+
+DLDI_INTERFACE *dldiLoadFromFile(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	DLDI_INTERFACE *dldi = dldiLoadFromFd(fd, NULL);
+	close(fd);
+	return dldi;
+}
+
+void dldiFree(DLDI_INTERFACE *dldi)
+{
+	free(dldi);
+}
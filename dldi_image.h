@@ -0,0 +1,202 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_IMAGE_H__
+#define DLDIPATCH_DLDI_IMAGE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+#include "dldi.h"
+#include "dldi_index.h"
+#include "dldi_journal.h"
+#include "dldi_reloc.h"
+#include "dldi_stats.h"
+
+/// Size of the buffers handed out by the buffer pool. This is the largest
+/// driver a DLDI header can describe.
+#define DLDI_BUFFER_SIZE    (1 << DLDI_SIZE_32KB)
+
+/// Open the image for writing as well as reading.
+#define DLDI_IMAGE_WRITE    0x01
+
+/// Search the file with up to n threads, as dldiFindStubsInRegions() does.
+/// Files are searched with one thread if this isn't given.
+#define DLDI_IMAGE_THREADS(n)   ((n) << 8)
+
+/// Sections described by a DLDI header.
+typedef enum DLDI_SECTION_ID
+{
+    DLDI_SECTION_DATA,
+    DLDI_SECTION_GLUE,
+    DLDI_SECTION_GOT,
+    DLDI_SECTION_BSS,
+    DLDI_SECTION_COUNT
+} DLDI_SECTION_ID;
+
+/// Bounds of a section, as offsets from the start of the driver.
+typedef struct DLDI_SECTION
+{
+    u32 start;
+    u32 end;
+    bool present; ///< False if the section isn't flagged in fixSectionsFlags.
+} DLDI_SECTION;
+
+/// A DLDI header found in a file.
+typedef struct DLDI_STUB
+{
+    off_t offset; ///< File offset of the header.
+    DLDI_INTERFACE header; ///< Copy of the header.
+    DLDI_SECTION sections[DLDI_SECTION_COUNT]; ///< Section bounds.
+} DLDI_STUB;
+
+/// Fill in a stub from a DLDI header.
+///
+/// @param stub The stub to fill in.
+/// @param io A valid DLDI header.
+/// @param offset File offset of the header.
+void dldiStubInit(DLDI_STUB *stub, const DLDI_INTERFACE *io, off_t offset);
+
+/// A file that contains DLDI drivers or DLDI stubs.
+///
+/// The file is scanned once when it is opened. The handle records where every
+/// driver is and keeps a copy of the first one, so the file can be printed,
+/// extracted or patched without scanning it again.
+typedef struct DLDI_IMAGE DLDI_IMAGE;
+
+/// Open a file and locate the DLDI drivers in it.
+///
+/// @param path Path of the file.
+/// @param flags DLDI_IMAGE_WRITE to allow patching the file, and
+///     DLDI_IMAGE_THREADS() to search it with several threads.
+/// @param image Receives the handle on success.
+/// @return 0 on success, -ENODATA if there is no driver, or another negative
+///     errno value.
+int dldiImageOpen(const char *path, int flags, DLDI_IMAGE **image);
+
+/// Open a file and locate the DLDI drivers in it, using a stub index.
+///
+/// If the index has an up-to-date entry for the file, the stubs are read
+/// directly from the recorded offsets and the file isn't scanned. Otherwise
+/// the file is scanned and the index is updated. Images opened for writing
+/// update their entry again when they are closed.
+///
+/// @param path Path of the file.
+/// @param flags DLDI_IMAGE_WRITE to allow patching the file, and
+///     DLDI_IMAGE_THREADS() to search it with several threads.
+/// @param index The index to use, or NULL to always scan.
+/// @param stats Counters to add the work done on the file to, or NULL. They
+///     are also updated when the image is closed.
+/// @param image Receives the handle on success.
+/// @return 0 on success, -ENODATA if there is no driver, or another negative
+///     errno value.
+int dldiImageOpenIndexed(const char *path, int flags, DLDI_INDEX *index,
+                         DLDI_STATS *stats, DLDI_IMAGE **image);
+
+/// Locate the DLDI drivers in a file that is already open.
+///
+/// The descriptor is duplicated, so the caller keeps ownership of fd. It must
+/// refer to a regular file, opened for writing if DLDI_IMAGE_WRITE is given.
+/// The path of the image is NULL.
+///
+/// @param fd Descriptor of the file.
+/// @param flags DLDI_IMAGE_WRITE to allow patching the file, and
+///     DLDI_IMAGE_THREADS() to search it with several threads.
+/// @param index The index to use, or NULL to always scan.
+/// @param stats Counters to add the work done on the file to, or NULL.
+/// @param image Receives the handle on success.
+/// @return 0 on success, -ENODATA if there is no driver, or another negative
+///     errno value.
+int dldiImageOpenFd(int fd, int flags, DLDI_INDEX *index, DLDI_STATS *stats, DLDI_IMAGE **image);
+
+/// Close a handle opened with dldiImageOpen().
+///
+/// @return 0 on success, or a negative errno value if closing the file failed.
+int dldiImageClose(DLDI_IMAGE *image);
+
+/// Path the image was opened with.
+const char *dldiImagePath(const DLDI_IMAGE *image);
+
+/// File descriptor of the image.
+int dldiImageFd(const DLDI_IMAGE *image);
+
+/// Size of the file in bytes.
+off_t dldiImageSize(const DLDI_IMAGE *image);
+
+/// Number of DLDI headers found in the file. This is at least 1.
+int dldiImageStubCount(const DLDI_IMAGE *image);
+
+/// One of the DLDI headers found in the file, in file order.
+const DLDI_STUB *dldiImageStub(const DLDI_IMAGE *image, int index);
+
+/// Whether a stub differed from the driver the last time the image was
+/// patched, and so was written unless DLDI_PATCH_CHECK was given.
+///
+/// @return false if the stub already held the driver, or if the image hasn't
+///     been patched.
+bool dldiImageStubChanged(const DLDI_IMAGE *image, int index);
+
+/// File offset of the first DLDI header.
+off_t dldiImageOffset(const DLDI_IMAGE *image);
+
+/// Copy of the first driver found in the file.
+///
+/// The buffer is DLDI_BUFFER_SIZE bytes long. Bytes past the end of the
+/// file are zero.
+const DLDI_INTERFACE *dldiImageDriver(const DLDI_IMAGE *image);
+
+/// Counters the image was opened with, or NULL.
+///
+/// Code that writes to the image can add its own work to them.
+DLDI_STATS *dldiImageStats(const DLDI_IMAGE *image);
+
+/// Only compare the stubs with the driver, without writing anything.
+#define DLDI_PATCH_CHECK    0x01
+
+/// Replace every DLDI stub of an image by a driver.
+///
+/// Every stub is checked before anything is written, so the image is either
+/// fully patched or left alone. Stubs that already hold the relocated driver,
+/// byte for byte, aren't written. The plan isn't modified, so it can be
+/// shared between threads.
+///
+/// @param image The image to patch.
+/// @param plan The plan of the driver to insert.
+/// @param cache Cache of relocated drivers, or NULL.
+/// @param out_fd Descriptor the drivers are written to: the image itself, or
+///     a copy of it.
+/// @param flags DLDI_PATCH_CHECK to only compare.
+/// @return The number of stubs that differed from the driver, and were
+///     written unless DLDI_PATCH_CHECK was given, so 0 if the image already
+///     had the driver. -ENOSPC if the driver doesn't fit in a stub, or another
+///     negative errno value.
+int dldiImagePatch(DLDI_IMAGE *image, const DLDI_RELOC_PLAN *plan, DLDI_RELOC_CACHE *cache,
+                   int out_fd, int flags);
+
+/// Replace every DLDI stub of an image by a driver in place, like
+/// dldiImagePatch(), keeping the bytes of every stub that is written in an
+/// undo journal first.
+///
+/// The image must have been opened by path with DLDI_IMAGE_WRITE.
+///
+/// @param journal The journal to record the original bytes in.
+/// @return As dldiImagePatch(). Nothing more is written after a record fails.
+int dldiImagePatchJournal(DLDI_IMAGE *image, const DLDI_RELOC_PLAN *plan, DLDI_RELOC_CACHE *cache,
+                          DLDI_JOURNAL *journal, int flags);
+
+/// Get a DLDI_BUFFER_SIZE byte buffer from the buffer pool.
+///
+/// Buffers are recycled between files, so a batch only allocates as many
+/// buffers as it has files in flight. The contents are undefined.
+void *dldiBufferGet(void);
+
+/// Return a buffer obtained with dldiBufferGet() to the pool.
+void dldiBufferPut(void *buffer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_IMAGE_H__
@@ -0,0 +1,449 @@
+// SPDX-License-Identifier: Zlib
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "dldi_index.h"
+
+// The index is a cache of this machine's files, so it is stored in native
+// byte order. Files with another magic number or version are discarded.
+#define DLDI_INDEX_MAGIC    "DLDIIDX"
+#define DLDI_INDEX_VERSION  2
+
+typedef struct DLDI_INDEX_FILE_HEADER
+{
+	char magic[8];
+	u32 version;
+	u32 flags;
+	u32 count;
+	u32 reserved;
+} DLDI_INDEX_FILE_HEADER;
+
+// Fixed part of an entry. It is followed by path_size bytes of path, without
+// a terminator, then by stub_count DLDI_INDEX_STUB.
+typedef struct DLDI_INDEX_KEY
+{
+	u64 dev;
+	u64 ino;
+	u64 size;
+	s64 mtime_sec;
+	u32 mtime_nsec;
+	u32 stub_count;
+	u64 hash;
+	u32 path_size;
+	u32 reserved;
+} DLDI_INDEX_KEY;
+
+typedef struct DLDI_INDEX_ENTRY
+{
+	DLDI_INDEX_KEY key;
+	char *path; // NULL if the path of the file isn't known.
+	DLDI_INDEX_STUB *stubs; // NULL for files without a stub.
+} DLDI_INDEX_ENTRY;
+
+struct DLDI_INDEX
+{
+	pthread_mutex_t lock;
+	char *path;
+	int flags;
+	bool dirty;
+
+	DLDI_INDEX_ENTRY *entries;
+	u32 count;
+	u32 capacity;
+
+	// Open addressing table of entry numbers, hashed by device and inode.
+	// Empty slots are UINT32_MAX.
+	u32 *buckets;
+	u32 bucket_count;
+};
+
+static u32 dldiIndexBucket(const DLDI_INDEX *index, u64 dev, u64 ino)
+{
+	u64 h = (dev * 0x9E3779B97F4A7C15ULL) ^ (ino * 0xC2B2AE3D27D4EB4FULL);
+	return (u32)(h ^ (h >> 32)) & (index->bucket_count - 1);
+}
+
+static void dldiIndexKey(DLDI_INDEX_KEY *key, const struct stat *st)
+{
+	memset(key, 0, sizeof(*key));
+	key->dev = st->st_dev;
+	key->ino = st->st_ino;
+	key->size = st->st_size;
+	key->mtime_sec = st->st_mtim.tv_sec;
+	key->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+// Returns the slot of the file, which is empty if the file isn't indexed.
+static u32 dldiIndexFind(const DLDI_INDEX *index, u64 dev, u64 ino)
+{
+	u32 slot = dldiIndexBucket(index, dev, ino);
+
+	for (;;)
+	{
+		u32 n = index->buckets[slot];
+		if (n == UINT32_MAX)
+			return slot;
+		if (index->entries[n].key.dev == dev && index->entries[n].key.ino == ino)
+			return slot;
+		slot = (slot + 1) & (index->bucket_count - 1);
+	}
+}
+
+// Fills the table from the entries.
+static void dldiIndexRehash(DLDI_INDEX *index)
+{
+	memset(index->buckets, 0xFF, index->bucket_count * sizeof(u32));
+	for (u32 n = 0; n < index->count; n++)
+	{
+		const DLDI_INDEX_KEY *key = &index->entries[n].key;
+		index->buckets[dldiIndexFind(index, key->dev, key->ino)] = n;
+	}
+}
+
+static int dldiIndexGrow(DLDI_INDEX *index)
+{
+	if (index->count == index->capacity)
+	{
+		u32 capacity = index->capacity ? index->capacity * 2 : 64;
+		DLDI_INDEX_ENTRY *entries = (DLDI_INDEX_ENTRY *)realloc(index->entries, capacity * sizeof(DLDI_INDEX_ENTRY));
+		if (entries == NULL)
+			return -ENOMEM;
+		index->entries = entries;
+		index->capacity = capacity;
+	}
+
+	// Keep the table at most half full.
+	if ((index->count + 1) * 2 > index->bucket_count)
+	{
+		u32 bucket_count = index->bucket_count ? index->bucket_count * 2 : 128;
+		u32 *buckets = (u32 *)malloc(bucket_count * sizeof(u32));
+		if (buckets == NULL)
+			return -ENOMEM;
+
+		free(index->buckets);
+		index->buckets = buckets;
+		index->bucket_count = bucket_count;
+		dldiIndexRehash(index);
+	}
+
+	return 0;
+}
+
+static bool dldiIndexSame(const DLDI_INDEX_ENTRY *entry, const DLDI_INDEX_KEY *key, const char *path,
+                          const DLDI_INDEX_STUB *stubs)
+{
+	if (memcmp(&entry->key, key, sizeof(*key)) != 0)
+		return false;
+	if (key->path_size != 0 && memcmp(entry->path, path, key->path_size) != 0)
+		return false;
+	return key->stub_count == 0 || memcmp(entry->stubs, stubs, key->stub_count * sizeof(DLDI_INDEX_STUB)) == 0;
+}
+
+// Adds or replaces an entry. The path and stubs are owned by the index
+// afterwards, and freed if the entry was already there. Returns 1 if the
+// index changed.
+static int dldiIndexInsert(DLDI_INDEX *index, const DLDI_INDEX_KEY *key, char *path, DLDI_INDEX_STUB *stubs)
+{
+	int rc = dldiIndexGrow(index);
+	if (rc != 0)
+		return rc;
+
+	u32 slot = dldiIndexFind(index, key->dev, key->ino);
+	u32 n = index->buckets[slot];
+	if (n == UINT32_MAX)
+	{
+		n = index->count++;
+		index->buckets[slot] = n;
+	}
+	else if (dldiIndexSame(&index->entries[n], key, path, stubs))
+	{
+		free(path);
+		free(stubs);
+		return 0;
+	}
+	else
+	{
+		free(index->entries[n].path);
+		free(index->entries[n].stubs);
+	}
+
+	index->entries[n].key = *key;
+	index->entries[n].path = path;
+	index->entries[n].stubs = stubs;
+	return 1;
+}
+
+// Drops the entries of files that no longer exist, or whose path now leads to
+// another file. Entries without a path are kept.
+static void dldiIndexPrune(DLDI_INDEX *index)
+{
+	u32 kept = 0;
+
+	for (u32 n = 0; n < index->count; n++)
+	{
+		DLDI_INDEX_ENTRY *entry = &index->entries[n];
+		struct stat st;
+		if (entry->path != NULL &&
+		    (stat(entry->path, &st) != 0 || (u64)st.st_dev != entry->key.dev || (u64)st.st_ino != entry->key.ino))
+		{
+			free(entry->path);
+			free(entry->stubs);
+			continue;
+		}
+		index->entries[kept++] = *entry;
+	}
+
+	if (kept != index->count)
+	{
+		index->count = kept;
+		dldiIndexRehash(index);
+	}
+}
+
+static void dldiIndexReadFile(DLDI_INDEX *index)
+{
+	FILE *f = fopen(index->path, "rb");
+	if (f == NULL)
+		return;
+
+	DLDI_INDEX_FILE_HEADER header;
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.magic, DLDI_INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+	    header.version != DLDI_INDEX_VERSION ||
+	    (index->flags & DLDI_INDEX_HASH && !(header.flags & DLDI_INDEX_HASH)))
+	{
+		// Rebuild from scratch.
+		index->dirty = true;
+		fclose(f);
+		return;
+	}
+
+	for (u32 i = 0; i < header.count; i++)
+	{
+		DLDI_INDEX_KEY key;
+		if (fread(&key, sizeof(key), 1, f) != 1)
+			break;
+
+		char *path = NULL;
+		DLDI_INDEX_STUB *stubs = NULL;
+		if (key.path_size != 0)
+		{
+			path = (char *)malloc(key.path_size + 1);
+			if (path == NULL || fread(path, 1, key.path_size, f) != key.path_size)
+				goto read_failed;
+			path[key.path_size] = '\0';
+		}
+		if (key.stub_count != 0)
+		{
+			stubs = (DLDI_INDEX_STUB *)malloc(key.stub_count * sizeof(DLDI_INDEX_STUB));
+			if (stubs == NULL || fread(stubs, sizeof(DLDI_INDEX_STUB), key.stub_count, f) != key.stub_count)
+				goto read_failed;
+		}
+
+		if (dldiIndexInsert(index, &key, path, stubs) < 0)
+		{
+			free(path);
+			free(stubs);
+			break;
+		}
+		continue;
+
+read_failed:
+		// A truncated file keeps the entries read so far.
+		free(path);
+		free(stubs);
+		index->dirty = true;
+		break;
+	}
+
+	fclose(f);
+}
+
+int dldiIndexLoad(const char *path, int flags, DLDI_INDEX **index)
+{
+	DLDI_INDEX *idx = (DLDI_INDEX *)calloc(1, sizeof(DLDI_INDEX));
+	if (idx == NULL)
+		return -ENOMEM;
+
+	idx->path = strdup(path);
+	if (idx->path == NULL)
+	{
+		free(idx);
+		return -ENOMEM;
+	}
+	idx->flags = flags;
+	pthread_mutex_init(&idx->lock, NULL);
+
+	dldiIndexReadFile(idx);
+
+	*index = idx;
+	return 0;
+}
+
+int dldiIndexSave(DLDI_INDEX *index)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&index->lock);
+	if (!index->dirty)
+		goto save_end;
+	dldiIndexPrune(index);
+
+	// Write a temporary file and rename it over the index, so that readers
+	// never see a partial index.
+	size_t tmp_len = strlen(index->path) + 32;
+	char *tmp_path = (char *)malloc(tmp_len);
+	if (tmp_path == NULL)
+	{
+		rc = -ENOMEM;
+		goto save_end;
+	}
+	snprintf(tmp_path, tmp_len, "%s.%ld.tmp", index->path, (long)getpid());
+
+	FILE *f = fopen(tmp_path, "wb");
+	if (f == NULL)
+	{
+		rc = -errno;
+		free(tmp_path);
+		goto save_end;
+	}
+
+	DLDI_INDEX_FILE_HEADER header = {
+		.magic = DLDI_INDEX_MAGIC,
+		.version = DLDI_INDEX_VERSION,
+		.flags = index->flags,
+		.count = index->count,
+	};
+	if (fwrite(&header, sizeof(header), 1, f) != 1)
+		rc = -EIO;
+	for (u32 i = 0; i < index->count && rc == 0; i++)
+	{
+		const DLDI_INDEX_ENTRY *entry = &index->entries[i];
+		if (fwrite(&entry->key, sizeof(entry->key), 1, f) != 1 ||
+		    (entry->path != NULL && fwrite(entry->path, 1, entry->key.path_size, f) != entry->key.path_size) ||
+		    (entry->stubs != NULL && fwrite(entry->stubs, sizeof(DLDI_INDEX_STUB), entry->key.stub_count, f) != entry->key.stub_count))
+			rc = -EIO;
+	}
+	if (fclose(f) != 0 && rc == 0)
+		rc = -EIO;
+
+	if (rc == 0 && rename(tmp_path, index->path) != 0)
+		rc = -errno;
+	if (rc != 0)
+		unlink(tmp_path);
+	else
+		index->dirty = false;
+
+	free(tmp_path);
+
+save_end:
+	pthread_mutex_unlock(&index->lock);
+	return rc;
+}
+
+void dldiIndexFree(DLDI_INDEX *index)
+{
+	if (index == NULL)
+		return;
+
+	for (u32 i = 0; i < index->count; i++)
+	{
+		free(index->entries[i].path);
+		free(index->entries[i].stubs);
+	}
+	free(index->entries);
+	free(index->buckets);
+	free(index->path);
+	pthread_mutex_destroy(&index->lock);
+	free(index);
+}
+
+int dldiIndexFlags(const DLDI_INDEX *index)
+{
+	return index->flags;
+}
+
+int dldiIndexLookup(DLDI_INDEX *index, const struct stat *st,
+                    DLDI_INDEX_STUB *stubs, int max_stubs, u64 *hash)
+{
+	int rc = -ENOENT;
+
+	DLDI_INDEX_KEY key;
+	dldiIndexKey(&key, st);
+
+	pthread_mutex_lock(&index->lock);
+	if (index->count == 0)
+		goto lookup_end;
+
+	u32 n = index->buckets[dldiIndexFind(index, key.dev, key.ino)];
+	if (n == UINT32_MAX)
+		goto lookup_end;
+
+	// An entry for an older version of the file is stale.
+	const DLDI_INDEX_ENTRY *entry = &index->entries[n];
+	if (entry->key.size != key.size || entry->key.mtime_sec != key.mtime_sec ||
+	    entry->key.mtime_nsec != key.mtime_nsec)
+		goto lookup_end;
+
+	int count = entry->key.stub_count;
+	if (count != 0)
+		memcpy(stubs, entry->stubs, (count < max_stubs ? count : max_stubs) * sizeof(DLDI_INDEX_STUB));
+	if (hash != NULL)
+		*hash = entry->key.hash;
+	rc = count;
+
+lookup_end:
+	pthread_mutex_unlock(&index->lock);
+	return rc;
+}
+
+int dldiIndexStore(DLDI_INDEX *index, const char *path, const struct stat *st,
+                   const DLDI_INDEX_STUB *stubs, int count, u64 hash)
+{
+	DLDI_INDEX_KEY key;
+	dldiIndexKey(&key, st);
+	key.stub_count = count;
+	key.path_size = path != NULL ? strlen(path) : 0;
+	if (index->flags & DLDI_INDEX_HASH)
+		key.hash = hash;
+
+	char *path_copy = NULL;
+	DLDI_INDEX_STUB *copy = NULL;
+	if (key.path_size != 0)
+	{
+		path_copy = strdup(path);
+		if (path_copy == NULL)
+			return -ENOMEM;
+	}
+	if (count != 0)
+	{
+		copy = (DLDI_INDEX_STUB *)malloc(count * sizeof(DLDI_INDEX_STUB));
+		if (copy == NULL)
+		{
+			free(path_copy);
+			return -ENOMEM;
+		}
+		memcpy(copy, stubs, count * sizeof(DLDI_INDEX_STUB));
+	}
+
+	// Storing what the index already has leaves it clean, so that runs that
+	// change nothing don't rewrite it.
+	pthread_mutex_lock(&index->lock);
+	int rc = dldiIndexInsert(index, &key, path_copy, copy);
+	if (rc > 0)
+		index->dirty = true;
+	pthread_mutex_unlock(&index->lock);
+
+	if (rc < 0)
+	{
+		free(path_copy);
+		free(copy);
+	}
+	return rc < 0 ? rc : 0;
+}
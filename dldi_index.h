@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_INDEX_H__
+#define DLDIPATCH_DLDI_INDEX_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "dldi.h"
+
+/// Also record a hash of the drivers in each file, and check it on lookup.
+///
+/// This catches files that were changed without updating their size or
+/// modification time, at the cost of reading the drivers on every lookup.
+#define DLDI_INDEX_HASH     0x01
+
+/// Persistent index of the DLDI stubs found in files.
+///
+/// Files are identified by device, inode, size and modification time. Files
+/// without any stub are recorded too, so that they aren't searched again. The
+/// index is loaded into memory, updated as files are opened and written back
+/// by dldiIndexSave(). It can be shared by any number of threads.
+typedef struct DLDI_INDEX DLDI_INDEX;
+
+/// A stub recorded in the index.
+typedef struct DLDI_INDEX_STUB
+{
+    u64 offset; ///< File offset of the header.
+    DLDI_INTERFACE header; ///< The header as it was when indexed.
+} DLDI_INDEX_STUB;
+
+/// Load an index from a file.
+///
+/// A missing file gives an empty index. A file that isn't a valid index, or
+/// was written by another version, is ignored and rebuilt.
+///
+/// @param path Path of the index file.
+/// @param flags DLDI_INDEX_HASH to record and check driver hashes.
+/// @param index Receives the index on success.
+/// @return 0 on success, or a negative errno value.
+int dldiIndexLoad(const char *path, int flags, DLDI_INDEX **index);
+
+/// Write the index back to its file if it has changed.
+///
+/// Entries of files whose path no longer exists, or now leads to another
+/// file, are dropped first. The file is replaced atomically.
+///
+/// @return 0 on success, or a negative errno value.
+int dldiIndexSave(DLDI_INDEX *index);
+
+/// Free an index. Changes that weren't saved are lost.
+void dldiIndexFree(DLDI_INDEX *index);
+
+/// Flags the index was loaded with.
+int dldiIndexFlags(const DLDI_INDEX *index);
+
+/// Look up the stubs of a file.
+///
+/// @param index The index.
+/// @param st Status of the file, from fstat().
+/// @param stubs Buffer that receives the stubs.
+/// @param max_stubs Size of stubs, in entries.
+/// @param hash Receives the recorded driver hash, if hashes are enabled.
+/// @return The number of stubs of the file, which may be larger than
+///     max_stubs or 0 if it has none, or -ENOENT if there is no entry for this
+///     version of the file.
+int dldiIndexLookup(DLDI_INDEX *index, const struct stat *st,
+                    DLDI_INDEX_STUB *stubs, int max_stubs, u64 *hash);
+
+/// Record the stubs of a file, replacing any older entry for it.
+///
+/// The index is only marked as changed if the entry is new or differs from the
+/// one it replaces.
+///
+/// @param index The index.
+/// @param path Absolute path of the file, used to drop the entry once the file
+///     is gone, or NULL if it isn't known.
+/// @param st Status of the file, from fstat().
+/// @param stubs The stubs of the file.
+/// @param count Number of stubs, which may be 0.
+/// @param hash Hash of the drivers. Ignored if hashes are disabled.
+/// @return 0 on success, or -ENOMEM.
+int dldiIndexStore(DLDI_INDEX *index, const char *path, const struct stat *st,
+                   const DLDI_INDEX_STUB *stubs, int count, u64 hash);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_INDEX_H__
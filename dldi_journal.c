@@ -0,0 +1,543 @@
+// SPDX-License-Identifier: Zlib
+
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "dldi_journal.h"
+#include "dldi_output.h"
+#include "dldi_scan.h"
+#include "dldi_workers.h"
+
+// Like the index, the journal is only meant for this machine, so it is
+// stored in native byte order.
+#define DLDI_JOURNAL_MAGIC          "DLDIJNL"
+#define DLDI_JOURNAL_VERSION        1
+#define DLDI_JOURNAL_RECORD_MAGIC   0x4C4E4A44
+
+typedef struct DLDI_JOURNAL_FILE_HEADER
+{
+	char magic[8];
+	u32 version;
+	u32 reserved;
+} DLDI_JOURNAL_FILE_HEADER;
+
+// Fixed part of a record. It is followed by path_size bytes of path, without
+// a terminator, old_size bytes of original data, and zeros up to a multiple
+// of 8 bytes, so that every record is aligned.
+typedef struct DLDI_JOURNAL_RECORD
+{
+	u32 magic;
+	u32 path_size;
+	u64 dev;
+	u64 ino;
+	u64 file_size;  // Size of the file before the write.
+	u64 offset;
+	u32 size;       // Number of bytes written.
+	u32 old_size;   // Number of bytes replaced, less than size at the end of the file.
+	u64 old_hash;   // Hash of the old_size original bytes.
+	u64 new_hash;   // Hash of the size bytes written.
+	u64 checksum;   // Hash of the whole record, with this field zero.
+} DLDI_JOURNAL_RECORD;
+
+static size_t dldiJournalRecordSize(u32 path_size, u32 old_size)
+{
+	return (sizeof(DLDI_JOURNAL_RECORD) + path_size + old_size + 7) & ~(size_t)7;
+}
+
+struct DLDI_JOURNAL
+{
+	pthread_mutex_t lock;
+	int fd;
+	int flags;
+	int error; // First error, after which nothing is recorded.
+};
+
+static u64 dldiJournalChecksum(const DLDI_JOURNAL_RECORD *record, const void *path, const void *old_data)
+{
+	DLDI_JOURNAL_RECORD copy = *record;
+	copy.checksum = 0;
+
+	u64 hash = dldiHash(DLDI_HASH_INIT, &copy, sizeof(copy));
+	hash = dldiHash(hash, path, record->path_size);
+	return dldiHash(hash, old_data, record->old_size);
+}
+
+// Checks the record at pos, and returns the position of the next one, or 0 if
+// the journal ends there. The last record may have been cut short by a crash.
+static size_t dldiJournalNext(const u8 *data, size_t size, size_t pos)
+{
+	DLDI_JOURNAL_RECORD record;
+	if (size - pos < sizeof(record))
+		return 0;
+	memcpy(&record, data + pos, sizeof(record));
+
+	if (record.magic != DLDI_JOURNAL_RECORD_MAGIC ||
+	    record.path_size == 0 || record.path_size >= PATH_MAX ||
+	    record.old_size > record.size)
+		return 0;
+
+	size_t record_size = dldiJournalRecordSize(record.path_size, record.old_size);
+	if (size - pos < record_size)
+		return 0;
+
+	const u8 *path = data + pos + sizeof(record);
+	if (memchr(path, '\0', record.path_size) != NULL ||
+	    dldiJournalChecksum(&record, path, path + record.path_size) != record.checksum)
+		return 0;
+
+	return pos + record_size;
+}
+
+// Maps a whole journal and checks its header. *size is 0 for an empty file,
+// which isn't mapped.
+static int dldiJournalMap(int fd, const u8 **data, size_t *size)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return -errno;
+
+	*data = NULL;
+	*size = st.st_size;
+	if (*size == 0)
+		return 0;
+	if (*size < sizeof(DLDI_JOURNAL_FILE_HEADER))
+		return -EINVAL;
+
+	void *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	const DLDI_JOURNAL_FILE_HEADER *header = (const DLDI_JOURNAL_FILE_HEADER *)map;
+	if (memcmp(header->magic, DLDI_JOURNAL_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != DLDI_JOURNAL_VERSION)
+	{
+		munmap(map, *size);
+		return -EINVAL;
+	}
+
+	*data = (const u8 *)map;
+	return 0;
+}
+
+int dldiJournalOpen(const char *path, int flags, DLDI_JOURNAL **journal)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return -errno;
+
+	const u8 *data;
+	size_t size;
+	int rc = dldiJournalMap(fd, &data, &size);
+
+	if (rc == 0 && size == 0)
+	{
+		DLDI_JOURNAL_FILE_HEADER header = {
+			.magic = DLDI_JOURNAL_MAGIC,
+			.version = DLDI_JOURNAL_VERSION,
+		};
+		if (write(fd, &header, sizeof(header)) != sizeof(header))
+			rc = -EIO;
+	}
+	else if (rc == 0)
+	{
+		// A record cut short by a crash is dropped, so that new records
+		// aren't appended after it where they couldn't be read.
+		size_t end = sizeof(DLDI_JOURNAL_FILE_HEADER);
+		for (size_t next; (next = dldiJournalNext(data, size, end)) != 0; )
+			end = next;
+		munmap((void *)data, size);
+
+		if (end != size && ftruncate(fd, end) != 0)
+			rc = -errno;
+	}
+
+	DLDI_JOURNAL *jnl = NULL;
+	if (rc == 0)
+	{
+		jnl = (DLDI_JOURNAL *)calloc(1, sizeof(DLDI_JOURNAL));
+		if (jnl == NULL)
+			rc = -ENOMEM;
+	}
+	if (rc != 0)
+	{
+		close(fd);
+		return rc;
+	}
+
+	pthread_mutex_init(&jnl->lock, NULL);
+	jnl->fd = fd;
+	jnl->flags = flags;
+
+	*journal = jnl;
+	return 0;
+}
+
+int dldiJournalClose(DLDI_JOURNAL *journal)
+{
+	if (journal == NULL)
+		return 0;
+
+	int rc = journal->error;
+	if (close(journal->fd) != 0 && rc == 0)
+		rc = -errno;
+	pthread_mutex_destroy(&journal->lock);
+	free(journal);
+
+	return rc;
+}
+
+int dldiJournalRecord(DLDI_JOURNAL *journal, int fd, const char *path, u64 offset,
+                      const void *new_data, u32 size, const void *old_data)
+{
+	if (path == NULL)
+		return -EINVAL;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return -errno;
+
+	// Restoring may happen from another directory.
+	char *full_path = realpath(path, NULL);
+	if (full_path == NULL)
+		return -errno;
+
+	u32 old_size = 0;
+	if ((u64)st.st_size > offset)
+		old_size = (u64)st.st_size - offset < size ? (u32)((u64)st.st_size - offset) : size;
+
+	DLDI_JOURNAL_RECORD record = {
+		.magic = DLDI_JOURNAL_RECORD_MAGIC,
+		.path_size = strlen(full_path),
+		.dev = st.st_dev,
+		.ino = st.st_ino,
+		.file_size = st.st_size,
+		.offset = offset,
+		.size = size,
+		.old_size = old_size,
+		.old_hash = dldiHash(DLDI_HASH_INIT, old_data, old_size),
+		.new_hash = dldiHash(DLDI_HASH_INIT, new_data, size),
+	};
+	record.checksum = dldiJournalChecksum(&record, full_path, old_data);
+
+	static const u8 padding[8];
+	ssize_t total = dldiJournalRecordSize(record.path_size, old_size);
+	struct iovec iov[4] = {
+		{ &record, sizeof(record) },
+		{ full_path, record.path_size },
+		{ (void *)old_data, old_size },
+		{ (void *)padding, total - sizeof(record) - record.path_size - old_size },
+	};
+
+	// A single append per record, so records of several threads are never
+	// interleaved.
+	pthread_mutex_lock(&journal->lock);
+	int rc = journal->error;
+	if (rc == 0)
+	{
+		ssize_t written = writev(journal->fd, iov, 4);
+		if (written != total)
+			rc = written < 0 ? -errno : -EIO;
+		else if (journal->flags & DLDI_JOURNAL_SYNC && fdatasync(journal->fd) != 0)
+			rc = -errno;
+
+		// A partial record would hide every record after it.
+		if (rc != 0)
+			journal->error = rc;
+	}
+	pthread_mutex_unlock(&journal->lock);
+
+	free(full_path);
+	return rc;
+}
+
+typedef struct DLDI_RESTORE_ENTRY
+{
+	const DLDI_JOURNAL_RECORD *record;
+	const char *path; // Not terminated.
+	const u8 *old_data;
+	u32 sequence;
+} DLDI_RESTORE_ENTRY;
+
+typedef struct DLDI_RESTORE
+{
+	DLDI_RESTORE_ENTRY *entries;
+	u32 *files; // First entry of every file, then the entry count.
+	int file_count;
+	int sync;
+	DLDI_RESTORE_FN fn;
+	void *arg;
+	int next; // Next file to restore.
+	pthread_mutex_t report_lock;
+} DLDI_RESTORE;
+
+static int dldiRestoreCompare(const void *a, const void *b)
+{
+	const DLDI_RESTORE_ENTRY *ea = (const DLDI_RESTORE_ENTRY *)a;
+	const DLDI_RESTORE_ENTRY *eb = (const DLDI_RESTORE_ENTRY *)b;
+	u32 size_a = ea->record->path_size;
+	u32 size_b = eb->record->path_size;
+
+	int cmp = memcmp(ea->path, eb->path, size_a < size_b ? size_a : size_b);
+	if (cmp == 0 && size_a != size_b)
+		cmp = size_a < size_b ? -1 : 1;
+	if (cmp == 0)
+		cmp = ea->sequence < eb->sequence ? -1 : 1;
+	return cmp;
+}
+
+// A range to write back, once every record of the file has been checked.
+typedef struct DLDI_RESTORE_WRITE
+{
+	u64 offset;
+	const u8 *data;
+	u32 size;
+} DLDI_RESTORE_WRITE;
+
+// Reads the file as it will be once the pending writes and truncation are
+// done. Returns the number of bytes read.
+static ssize_t dldiRestoreRead(int fd, u8 *buffer, u32 size, u64 offset, u64 file_size,
+                               const DLDI_RESTORE_WRITE *writes, int write_count)
+{
+	if (offset >= file_size)
+		return 0;
+	if (file_size - offset < size)
+		size = file_size - offset;
+
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t got = pread(fd, buffer + done, size - done, offset + done);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0)
+			return -errno;
+		if (got == 0)
+			return -ESTALE;
+		done += got;
+	}
+
+	// Later writes undo older records, so they are applied last.
+	for (int i = 0; i < write_count; i++)
+	{
+		u64 start = writes[i].offset > offset ? writes[i].offset : offset;
+		u64 end = writes[i].offset + writes[i].size;
+		if (end > offset + size)
+			end = offset + size;
+		if (start < end)
+			memcpy(buffer + (start - offset), writes[i].data + (start - writes[i].offset), end - start);
+	}
+
+	return size;
+}
+
+static int dldiRestoreFile(DLDI_RESTORE *restore, const DLDI_RESTORE_ENTRY *entries, u32 count,
+                           const char *path)
+{
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? -ESTALE : -errno;
+
+	u32 max_size = 0;
+	for (u32 i = 0; i < count; i++)
+	{
+		if (entries[i].record->size > max_size)
+			max_size = entries[i].record->size;
+	}
+
+	struct stat st = {};
+	u8 *buffer = (u8 *)malloc(max_size > 0 ? 2 * max_size : 1);
+	DLDI_RESTORE_WRITE *writes = (DLDI_RESTORE_WRITE *)malloc(2 * count * sizeof(DLDI_RESTORE_WRITE));
+	int write_count = 0;
+	int rc = 0;
+
+	if (buffer == NULL || writes == NULL)
+		rc = -ENOMEM;
+	else if (fstat(fd, &st) != 0)
+		rc = -errno;
+	u64 file_size = rc == 0 ? (u64)st.st_size : 0;
+
+	// Every range replaced by the file's records, with the oldest record
+	// last, gives the file as it was before the first one.
+	u8 *original = buffer + max_size;
+	DLDI_RESTORE_WRITE *originals = writes + count;
+	u64 original_size = count > 0 ? entries[0].record->file_size : 0;
+	for (u32 i = 0; i < count && writes != NULL; i++)
+	{
+		const DLDI_JOURNAL_RECORD *record = entries[count - 1 - i].record;
+		originals[i] = (DLDI_RESTORE_WRITE){ record->offset, entries[count - 1 - i].old_data, record->old_size };
+	}
+
+	// Every record is checked, from the newest to the oldest, before anything
+	// is written. Once the newer ones are undone, each one must find the
+	// bytes it wrote, or the bytes it replaced if it was already undone, or
+	// those from before the first record if the whole file was restored.
+	for (u32 i = count; i-- > 0 && rc == 0; )
+	{
+		const DLDI_JOURNAL_RECORD *record = entries[i].record;
+		if (record->dev != (u64)st.st_dev || record->ino != (u64)st.st_ino)
+		{
+			rc = -ESTALE;
+			break;
+		}
+
+		u64 written_size = record->offset + record->size;
+		if (written_size < record->file_size)
+			written_size = record->file_size;
+
+		ssize_t got = dldiRestoreRead(fd, buffer, record->size, record->offset, file_size,
+		                              writes, write_count);
+		if (got < 0)
+		{
+			rc = got;
+		}
+		else if (file_size == written_size && (u32)got == record->size &&
+		         dldiHash(DLDI_HASH_INIT, buffer, got) == record->new_hash)
+		{
+			writes[write_count++] = (DLDI_RESTORE_WRITE){ record->offset, entries[i].old_data, record->old_size };
+			file_size = record->file_size;
+		}
+		else if (file_size == record->file_size && (u32)got == record->old_size &&
+		         dldiHash(DLDI_HASH_INIT, buffer, got) == record->old_hash)
+		{
+			continue;
+		}
+		else if (file_size != original_size ||
+		         dldiRestoreRead(fd, original, record->size, record->offset, original_size,
+		                         originals, count) != got ||
+		         memcmp(buffer, original, got) != 0)
+		{
+			rc = -ESTALE;
+		}
+	}
+
+	for (int i = 0; i < write_count && rc == 0; i++)
+	{
+		const DLDI_RESTORE_WRITE *write = &writes[i];
+		size_t done = 0;
+		while (done < write->size && rc == 0)
+		{
+			ssize_t put = pwrite(fd, write->data + done, write->size - done, write->offset + done);
+			if (put < 0 && errno != EINTR)
+				rc = -errno;
+			else if (put > 0)
+				done += put;
+		}
+	}
+	if (rc == 0 && file_size < (u64)st.st_size && ftruncate(fd, file_size) != 0)
+		rc = -errno;
+	if (rc == 0 && write_count > 0)
+		rc = dldiSync(fd, restore->sync, NULL);
+
+	if (close(fd) != 0 && rc == 0)
+		rc = -errno;
+	free(writes);
+	free(buffer);
+	return rc < 0 ? rc : write_count;
+}
+
+static void *dldiRestoreWorker(void *arg)
+{
+	DLDI_RESTORE *restore = (DLDI_RESTORE *)arg;
+	char path[PATH_MAX];
+
+	for (;;)
+	{
+		int index = __atomic_fetch_add(&restore->next, 1, __ATOMIC_RELAXED);
+		if (index >= restore->file_count)
+			break;
+
+		const DLDI_RESTORE_ENTRY *entries = &restore->entries[restore->files[index]];
+		u32 count = restore->files[index + 1] - restore->files[index];
+		memcpy(path, entries->path, entries->record->path_size);
+		path[entries->record->path_size] = '\0';
+
+		int rc = dldiRestoreFile(restore, entries, count, path);
+
+		pthread_mutex_lock(&restore->report_lock);
+		restore->fn(restore->arg, path, rc);
+		pthread_mutex_unlock(&restore->report_lock);
+	}
+
+	return NULL;
+}
+
+int dldiJournalRestore(const char *path, int threads, int sync, DLDI_RESTORE_FN fn, void *arg)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	const u8 *data;
+	size_t size;
+	int rc = dldiJournalMap(fd, &data, &size);
+	close(fd);
+	if (rc != 0)
+		return rc;
+	if (size == 0)
+		return -EINVAL;
+
+	u32 count = 0;
+	for (size_t pos = sizeof(DLDI_JOURNAL_FILE_HEADER); (pos = dldiJournalNext(data, size, pos)) != 0; )
+		count++;
+
+	DLDI_RESTORE restore = {
+		.sync = sync,
+		.fn = fn,
+		.arg = arg,
+	};
+	restore.entries = (DLDI_RESTORE_ENTRY *)malloc((count > 0 ? count : 1) * sizeof(DLDI_RESTORE_ENTRY));
+	restore.files = (u32 *)malloc((count + 1) * sizeof(u32));
+	if (restore.entries == NULL || restore.files == NULL)
+	{
+		rc = -ENOMEM;
+		goto restore_end;
+	}
+
+	// The records of every file are grouped, in journal order.
+	size_t pos = sizeof(DLDI_JOURNAL_FILE_HEADER);
+	for (u32 i = 0; i < count; i++)
+	{
+		const DLDI_JOURNAL_RECORD *record = (const DLDI_JOURNAL_RECORD *)(data + pos);
+		restore.entries[i] = (DLDI_RESTORE_ENTRY){
+			.record = record,
+			.path = (const char *)(record + 1),
+			.old_data = (const u8 *)(record + 1) + record->path_size,
+			.sequence = i,
+		};
+		pos = dldiJournalNext(data, size, pos);
+	}
+	qsort(restore.entries, count, sizeof(DLDI_RESTORE_ENTRY), dldiRestoreCompare);
+
+	for (u32 i = 0; i < count; i++)
+	{
+		if (i == 0 || restore.entries[i].record->path_size != restore.entries[i - 1].record->path_size ||
+		    memcmp(restore.entries[i].path, restore.entries[i - 1].path, restore.entries[i].record->path_size) != 0)
+			restore.files[restore.file_count++] = i;
+	}
+	restore.files[restore.file_count] = count;
+	pthread_mutex_init(&restore.report_lock, NULL);
+
+	if (threads > restore.file_count)
+		threads = restore.file_count;
+	if (threads < 1)
+		threads = 1;
+
+	dldiRunWorkers(dldiRestoreWorker, &restore, threads);
+
+	pthread_mutex_destroy(&restore.report_lock);
+	rc = restore.file_count;
+
+restore_end:
+	free(restore.files);
+	free(restore.entries);
+	munmap((void *)data, size);
+	return rc;
+}
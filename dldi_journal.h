@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_JOURNAL_H__
+#define DLDIPATCH_DLDI_JOURNAL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "types.h"
+
+/// Flush the journal to storage after every record, before the bytes it
+/// describes are overwritten.
+#define DLDI_JOURNAL_SYNC   0x01
+
+/// Undo journal of the stubs overwritten while patching.
+///
+/// Instead of a copy of every file, the journal keeps the original bytes of
+/// each range that is about to be overwritten, with the identity of the file
+/// and hashes of the bytes before and after. Records are only ever appended,
+/// so one journal can cover any number of patch runs, and a record that was
+/// cut short by a crash is dropped when the journal is next opened. It can
+/// be shared by any number of threads.
+typedef struct DLDI_JOURNAL DLDI_JOURNAL;
+
+/// Open a journal for appending, creating it if needed.
+///
+/// @param path Path of the journal.
+/// @param flags DLDI_JOURNAL_SYNC, or 0.
+/// @param journal Receives the journal on success.
+/// @return 0 on success, -EINVAL if the file isn't a journal, or another
+///     negative errno value.
+int dldiJournalOpen(const char *path, int flags, DLDI_JOURNAL **journal);
+
+/// Close a journal.
+///
+/// @return 0 on success, or a negative errno value if a record couldn't be
+///     written or closing the file failed.
+int dldiJournalClose(DLDI_JOURNAL *journal);
+
+/// Record the bytes of a file that are about to be overwritten.
+///
+/// This must return before the file is written. Writes past the end of the
+/// file are undone by truncating it back to its current size.
+///
+/// @param journal The journal.
+/// @param fd Descriptor of the file.
+/// @param path Path of the file. It is made absolute before it is recorded.
+/// @param offset File offset of the write.
+/// @param new_data The bytes that are about to be written.
+/// @param size Number of bytes that are about to be written.
+/// @param old_data The bytes they replace, up to the end of the file.
+/// @return 0 on success, or a negative errno value, in which case the file
+///     must not be written.
+int dldiJournalRecord(DLDI_JOURNAL *journal, int fd, const char *path, u64 offset,
+                      const void *new_data, u32 size, const void *old_data);
+
+/// Called once for every file of a journal by dldiJournalRestore().
+///
+/// Calls are never made from several threads at once.
+///
+/// @param arg The argument given to dldiJournalRestore().
+/// @param path Path of the file.
+/// @param rc The number of ranges that were written back, 0 if the file was
+///     already restored, -ESTALE if the file was replaced or changed since it
+///     was patched, or another negative errno value.
+typedef void (*DLDI_RESTORE_FN)(void *arg, const char *path, int rc);
+
+/// Put back the original bytes of every file in a journal.
+///
+/// Files are restored in parallel. The ranges of each file are undone from
+/// the newest to the oldest, so files patched several times go back to the
+/// state they were in before the first patch. Every range of a file is
+/// checked before anything is written, so a file is either fully restored
+/// or left alone. Ranges that already hold their original bytes are skipped,
+/// so restoring twice is harmless.
+///
+/// @param path Path of the journal.
+/// @param threads Number of threads to use, including the calling thread.
+/// @param sync DLDI_SYNC_NONE, DLDI_SYNC_DATA or DLDI_SYNC_FULL, for the
+///     files that are written.
+/// @param fn Function called for every file.
+/// @param arg Argument passed to fn.
+/// @return The number of files in the journal, or a negative errno value if
+///     the journal couldn't be read.
+int dldiJournalRestore(const char *path, int threads, int sync, DLDI_RESTORE_FN fn, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_JOURNAL_H__
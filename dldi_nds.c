@@ -0,0 +1,342 @@
+// SPDX-License-Identifier: Zlib
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "dldi_nds.h"
+#include "dldi_scan.h"
+
+// Fields of the NDS cartridge header.
+#define NDS_UNIT_CODE           0x012
+#define NDS_ARM9_ROM_OFFSET     0x020
+#define NDS_ARM9_SIZE           0x02C
+#define NDS_ARM7_ROM_OFFSET     0x030
+#define NDS_ARM7_SIZE           0x03C
+#define NDS_HEADER_CRC          0x15E
+#define NDS_HEADER_CRC_SIZE     0x15E
+#define NDS_BASE_HEADER_SIZE    0x200
+
+// Fields of the DSi extended header.
+#define NDS_ARM9I_ROM_OFFSET    0x1C0
+#define NDS_ARM9I_SIZE          0x1CC
+#define NDS_ARM7I_ROM_OFFSET    0x1D0
+#define NDS_ARM7I_SIZE          0x1DC
+
+// Bit 1 of the unit code is set for DSi-enhanced and DSi-exclusive ROMs.
+#define NDS_UNIT_CODE_DSI       0x02
+
+static u16 dldiNdsCrc16(const u8 *data, size_t size)
+{
+	u16 crc = 0xFFFF;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+	}
+
+	return crc;
+}
+
+static u32 dldiNdsRead32(const u8 *header, size_t offset)
+{
+	u32 value;
+	memcpy(&value, header + offset, sizeof(value));
+	return value;
+}
+
+static int dldiNdsAddRegion(DLDI_REGION *regions, int count, u64 file_size,
+                            u32 offset, u32 size)
+{
+	if (size == 0 || offset < NDS_BASE_HEADER_SIZE || offset >= file_size)
+		return count;
+
+	if (size > file_size - offset)
+		size = file_size - offset;
+
+	regions[count].offset = offset;
+	regions[count].size = size;
+	return count + 1;
+}
+
+int dldiNdsRegions(const void *header, size_t header_size, u64 file_size,
+                   DLDI_REGION *regions)
+{
+	const u8 *h = (const u8 *)header;
+
+	if (header_size < NDS_BASE_HEADER_SIZE || file_size < NDS_BASE_HEADER_SIZE)
+		return 0;
+
+	u16 crc;
+	memcpy(&crc, h + NDS_HEADER_CRC, sizeof(crc));
+	if (dldiNdsCrc16(h, NDS_HEADER_CRC_SIZE) != crc)
+		return 0;
+
+	int count = 0;
+	count = dldiNdsAddRegion(regions, count, file_size,
+	                         dldiNdsRead32(h, NDS_ARM9_ROM_OFFSET), dldiNdsRead32(h, NDS_ARM9_SIZE));
+	count = dldiNdsAddRegion(regions, count, file_size,
+	                         dldiNdsRead32(h, NDS_ARM7_ROM_OFFSET), dldiNdsRead32(h, NDS_ARM7_SIZE));
+
+	if ((h[NDS_UNIT_CODE] & NDS_UNIT_CODE_DSI) && header_size >= DLDI_NDS_HEADER_SIZE)
+	{
+		count = dldiNdsAddRegion(regions, count, file_size,
+		                         dldiNdsRead32(h, NDS_ARM9I_ROM_OFFSET), dldiNdsRead32(h, NDS_ARM9I_SIZE));
+		count = dldiNdsAddRegion(regions, count, file_size,
+		                         dldiNdsRead32(h, NDS_ARM7I_ROM_OFFSET), dldiNdsRead32(h, NDS_ARM7I_SIZE));
+	}
+
+	// Sort by offset. There are at most four regions.
+	for (int i = 1; i < count; i++)
+	{
+		for (int j = i; j > 0 && regions[j - 1].offset > regions[j].offset; j--)
+		{
+			DLDI_REGION tmp = regions[j];
+			regions[j] = regions[j - 1];
+			regions[j - 1] = tmp;
+		}
+	}
+
+	// Merge regions that overlap, so no byte is scanned twice.
+	int merged = 0;
+	for (int i = 0; i < count; i++)
+	{
+		if (merged > 0 && regions[i].offset <= regions[merged - 1].offset + regions[merged - 1].size)
+		{
+			u64 end = regions[i].offset + regions[i].size;
+			if (end > regions[merged - 1].offset + regions[merged - 1].size)
+				regions[merged - 1].size = end - regions[merged - 1].offset;
+		}
+		else
+		{
+			regions[merged++] = regions[i];
+		}
+	}
+
+	return merged;
+}
+
+int dldiScanRegions(const void *header, size_t header_size, u64 file_size,
+                    DLDI_REGION *regions)
+{
+	int count = dldiNdsRegions(header, header_size, file_size, regions);
+	if (count > 0)
+		return count;
+
+	regions[0].offset = 0;
+	regions[0].size = file_size;
+	return 1;
+}
+
+ssize_t dldiFindInRegions(const void *data, const DLDI_REGION *regions, int count,
+                          u64 start)
+{
+	for (int i = 0; i < count; i++)
+	{
+		const DLDI_REGION *region = &regions[i];
+		if (region->offset + region->size <= start)
+			continue;
+
+		u64 from = 0;
+		if (start > region->offset)
+			from = (start - region->offset + 3) & ~(u64)3;
+
+		ssize_t offset = dldiFindInBuffer((const u8 *)data + region->offset, region->size, from);
+		if (offset >= 0)
+			return region->offset + offset;
+	}
+
+	return -1;
+}
+
+// A part of a region, searched by one thread. Headers that start in the chunk
+// are found even if they end past it.
+typedef struct DLDI_SCAN_CHUNK
+{
+	u64 start;
+	u64 end;
+	u64 search_end;
+	u64 *offsets;
+	int count;
+	int capacity;
+	int rc;
+	bool done;
+} DLDI_SCAN_CHUNK;
+
+typedef struct DLDI_SCAN_JOB
+{
+	const u8 *data;
+	DLDI_SCAN_CHUNK *chunks;
+	int chunk_count;
+	int next;
+	bool cancel;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} DLDI_SCAN_JOB;
+
+static int dldiScanAdd(u64 **offsets, int *count, int *capacity, u64 offset)
+{
+	if (*count == *capacity)
+	{
+		int new_capacity = *capacity ? *capacity * 2 : 4;
+		u64 *new_offsets = (u64 *)realloc(*offsets, new_capacity * sizeof(u64));
+		if (new_offsets == NULL)
+			return -ENOMEM;
+		*offsets = new_offsets;
+		*capacity = new_capacity;
+	}
+
+	(*offsets)[(*count)++] = offset;
+	return 0;
+}
+
+static void *dldiScanWorker(void *arg)
+{
+	DLDI_SCAN_JOB *job = (DLDI_SCAN_JOB *)arg;
+
+	for (;;)
+	{
+		int i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= job->chunk_count || __atomic_load_n(&job->cancel, __ATOMIC_RELAXED))
+			break;
+
+		// Every valid header is recorded, including ones inside the span of
+		// an earlier stub. Only the merge knows which stubs come first.
+		DLDI_SCAN_CHUNK *chunk = &job->chunks[i];
+		size_t from = 0;
+		while (chunk->rc == 0)
+		{
+			ssize_t offset = dldiFindInBuffer(job->data + chunk->start, chunk->search_end - chunk->start, from);
+			if (offset < 0 || chunk->start + offset >= chunk->end)
+				break;
+			chunk->rc = dldiScanAdd(&chunk->offsets, &chunk->count, &chunk->capacity, chunk->start + offset);
+			from = offset + 4;
+		}
+
+		pthread_mutex_lock(&job->lock);
+		chunk->done = true;
+		pthread_cond_broadcast(&job->cond);
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	return NULL;
+}
+
+// Searches the regions one stub at a time, on the calling thread.
+static int dldiFindStubsSerial(const void *data, const DLDI_REGION *regions, int count,
+                               int max_stubs, u64 **offsets)
+{
+	int found = 0;
+	int capacity = 0;
+
+	ssize_t i = dldiFindInRegions(data, regions, count, 0);
+	while (i >= 0 && found < max_stubs)
+	{
+		if (dldiScanAdd(offsets, &found, &capacity, i) != 0)
+			return -ENOMEM;
+		i = dldiFindInRegions(data, regions, count,
+		                      i + dldiStubSpan((const DLDI_INTERFACE *)((const u8 *)data + i)));
+	}
+
+	return found;
+}
+
+int dldiFindStubsInRegions(const void *data, const DLDI_REGION *regions, int count,
+                           int max_stubs, int threads, u64 **offsets)
+{
+	*offsets = NULL;
+
+	u64 total = 0;
+	for (int r = 0; r < count; r++)
+		total += (regions[r].size + DLDI_SCAN_CHUNK_SIZE - 1) / DLDI_SCAN_CHUNK_SIZE;
+
+	if (threads > (int)total)
+		threads = total;
+	if (threads <= 1)
+		return dldiFindStubsSerial(data, regions, count, max_stubs, offsets);
+
+	// Chunks start at multiples of the chunk size from the start of their
+	// region, which keeps headers aligned the same way as a serial search.
+	DLDI_SCAN_JOB job = {
+		.data = (const u8 *)data,
+		.chunks = (DLDI_SCAN_CHUNK *)calloc(total, sizeof(DLDI_SCAN_CHUNK)),
+	};
+	if (job.chunks == NULL)
+		return -ENOMEM;
+	for (int r = 0; r < count; r++)
+	{
+		u64 region_end = regions[r].offset + regions[r].size;
+		for (u64 start = regions[r].offset; start < region_end; start += DLDI_SCAN_CHUNK_SIZE)
+		{
+			DLDI_SCAN_CHUNK *chunk = &job.chunks[job.chunk_count++];
+			chunk->start = start;
+			chunk->end = start + DLDI_SCAN_CHUNK_SIZE < region_end ? start + DLDI_SCAN_CHUNK_SIZE : region_end;
+			chunk->search_end = chunk->end + DLDI_HEADER_SIZE < region_end ? chunk->end + DLDI_HEADER_SIZE : region_end;
+		}
+	}
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+
+	pthread_t *workers = (pthread_t *)calloc(threads, sizeof(pthread_t));
+	int started = 0;
+	if (workers != NULL)
+	{
+		for (started = 0; started < threads; started++)
+		{
+			if (pthread_create(&workers[started], NULL, dldiScanWorker, &job) != 0)
+				break;
+		}
+	}
+
+	// Without any thread, this one does the work before merging.
+	if (started == 0)
+		dldiScanWorker(&job);
+
+	// Chunks are merged in file order as soon as they are done, skipping the
+	// span of each stub like a serial search does. Once enough stubs are
+	// found, the chunks after them aren't needed.
+	int rc = 0;
+	int found = 0;
+	int capacity = 0;
+	u64 next = 0;
+	for (int i = 0; i < job.chunk_count && rc == 0 && found < max_stubs; i++)
+	{
+		DLDI_SCAN_CHUNK *chunk = &job.chunks[i];
+		pthread_mutex_lock(&job.lock);
+		while (!chunk->done)
+			pthread_cond_wait(&job.cond, &job.lock);
+		pthread_mutex_unlock(&job.lock);
+
+		rc = chunk->rc;
+		for (int j = 0; j < chunk->count && rc == 0 && found < max_stubs; j++)
+		{
+			u64 offset = chunk->offsets[j];
+			if (offset < next)
+				continue;
+			rc = dldiScanAdd(offsets, &found, &capacity, offset);
+			next = offset + dldiStubSpan((const DLDI_INTERFACE *)(job.data + offset));
+		}
+	}
+
+	__atomic_store_n(&job.cancel, true, __ATOMIC_RELAXED);
+	for (int i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	for (int i = 0; i < job.chunk_count; i++)
+		free(job.chunks[i].offsets);
+	free(job.chunks);
+	pthread_cond_destroy(&job.cond);
+	pthread_mutex_destroy(&job.lock);
+
+	if (rc != 0)
+	{
+		free(*offsets);
+		*offsets = NULL;
+		return rc;
+	}
+	return found;
+}
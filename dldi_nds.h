@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_NDS_H__
+#define DLDIPATCH_DLDI_NDS_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "types.h"
+
+/// Size of the NDS cartridge header, including the DSi extended header.
+#define DLDI_NDS_HEADER_SIZE    0x1000
+
+/// Maximum number of regions returned by dldiNdsRegions().
+#define DLDI_NDS_MAX_REGIONS    4
+
+/// A range of bytes of a file.
+typedef struct DLDI_REGION
+{
+    u64 offset;
+    u64 size;
+} DLDI_REGION;
+
+/// Find the executable binaries of an NDS ROM.
+///
+/// The header is only trusted if its CRC matches. The ARM9 and ARM7 binaries
+/// are returned, plus the ARM9i and ARM7i binaries if the ROM has a DSi
+/// extended header. Regions are sorted by offset, clipped to the file and
+/// merged where they overlap.
+///
+/// @param header Start of the file. At least the first 0x200 bytes are needed.
+/// @param header_size Number of bytes available at header.
+/// @param file_size Size of the whole file.
+/// @param regions Receives up to DLDI_NDS_MAX_REGIONS regions.
+/// @return The number of regions, or 0 if this isn't an NDS ROM.
+int dldiNdsRegions(const void *header, size_t header_size, u64 file_size,
+                   DLDI_REGION *regions);
+
+/// Find the parts of a file that have to be searched for DLDI stubs.
+///
+/// This is the same as dldiNdsRegions(), except that files that aren't NDS
+/// ROMs, like raw .dldi files, are returned as a single region.
+///
+/// @return The number of regions, which is at least 1.
+int dldiScanRegions(const void *header, size_t header_size, u64 file_size,
+                    DLDI_REGION *regions);
+
+/// Find the next valid DLDI header inside a set of regions.
+///
+/// Headers are 4-byte aligned relative to the start of their region.
+///
+/// @param data Start of the file.
+/// @param regions Regions to search, sorted by offset.
+/// @param count Number of regions.
+/// @param start File offset to start searching from.
+/// @return The file offset of the header, or -1 if there is none.
+ssize_t dldiFindInRegions(const void *data, const DLDI_REGION *regions, int count,
+                          u64 start);
+
+/// Size of the chunks searched in parallel by dldiFindStubsInRegions().
+#define DLDI_SCAN_CHUNK_SIZE    (16 << 20)
+
+/// Find the DLDI stubs inside a set of regions.
+///
+/// The result is the same as calling dldiFindInRegions() repeatedly, each time
+/// starting past the dldiStubSpan() of the previous stub. Regions larger than
+/// DLDI_SCAN_CHUNK_SIZE are split into chunks that are searched in parallel,
+/// and merged in file order as they complete, so the first stubs are known
+/// as soon as the chunks before them are done.
+///
+/// @param data Start of the file.
+/// @param regions Regions to search, sorted by offset.
+/// @param count Number of regions.
+/// @param max_stubs Stop after this many stubs.
+/// @param threads Largest number of threads to search with. Programs that open
+///     many files at once are better served by one thread per file, and
+///     programs that open a single large file by one thread per core.
+/// @param offsets Receives an array of file offsets, which must be freed with
+///     free(). It is NULL if nothing was found.
+/// @return The number of stubs found, or a negative errno value.
+int dldiFindStubsInRegions(const void *data, const DLDI_REGION *regions, int count,
+                           int max_stubs, int threads, u64 **offsets);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_NDS_H__
@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: Zlib
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libgen.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "dldi_output.h"
+
+// Size of the buffer of the plain copy fallback.
+#define DLDI_COPY_CHUNK_SIZE    (1 << 20)
+
+struct DLDI_OUTPUT
+{
+	char *path;
+	char *temp_path;
+	int fd;
+	DLDI_STATS *stats;
+};
+
+// Copies with a read and write loop, for filesystems that support neither
+// reflinks nor copy_file_range().
+static int dldiCopyPlain(int src_fd, int dst_fd, off_t size, DLDI_STATS *stats)
+{
+	u8 *buffer = (u8 *)malloc(DLDI_COPY_CHUNK_SIZE);
+	if (buffer == NULL)
+		return -ENOMEM;
+
+	int rc = 0;
+	off_t done = 0;
+	while (done < size && rc == 0)
+	{
+		size_t len = size - done < DLDI_COPY_CHUNK_SIZE ? size - done : DLDI_COPY_CHUNK_SIZE;
+		ssize_t got = pread(src_fd, buffer, len, done);
+		if (stats != NULL)
+			stats->read_calls++;
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+		{
+			rc = got < 0 ? -errno : -EIO;
+			break;
+		}
+		if (stats != NULL)
+			stats->bytes_read += got;
+
+		for (ssize_t put = 0; put < got; )
+		{
+			ssize_t wrote = pwrite(dst_fd, buffer + put, got - put, done + put);
+			if (stats != NULL)
+				stats->write_calls++;
+			if (wrote < 0 && errno == EINTR)
+				continue;
+			if (wrote < 0)
+			{
+				rc = -errno;
+				break;
+			}
+			put += wrote;
+			if (stats != NULL)
+				stats->bytes_written += wrote;
+		}
+		done += got;
+	}
+
+	free(buffer);
+	return rc;
+}
+
+// Copies a whole file, as cheaply as the filesystem allows.
+static int dldiCopyFile(int src_fd, int dst_fd, off_t size, DLDI_STATS *stats)
+{
+	// A reflink shares the blocks of the source until one of them is written.
+	if (ioctl(dst_fd, FICLONE, src_fd) == 0)
+		return 0;
+
+	off_t src_offset = 0;
+	off_t dst_offset = 0;
+	while (src_offset < size)
+	{
+		ssize_t copied = copy_file_range(src_fd, &src_offset, dst_fd, &dst_offset, size - src_offset, 0);
+		if (copied < 0 && errno == EINTR)
+			continue;
+		if (copied <= 0)
+			break;
+		if (stats != NULL)
+		{
+			stats->write_calls++;
+			stats->bytes_written += copied;
+		}
+	}
+
+	// copy_file_range() may not work across filesystems or at all. Whatever
+	// it didn't copy is copied by hand.
+	if (src_offset < size)
+	{
+		if (ftruncate(dst_fd, 0) != 0)
+			return -errno;
+		return dldiCopyPlain(src_fd, dst_fd, size, stats);
+	}
+
+	return 0;
+}
+
+int dldiSync(int fd, int sync, DLDI_STATS *stats)
+{
+	if (sync == DLDI_SYNC_NONE)
+		return 0;
+
+	u64 start = dldiStatsNow();
+	int rc = (sync == DLDI_SYNC_FULL ? fsync(fd) : fdatasync(fd)) == 0 ? 0 : -errno;
+	dldiStatsPhase(stats, DLDI_PHASE_FSYNC, start);
+
+	return rc;
+}
+
+static void dldiOutputFree(DLDI_OUTPUT *output)
+{
+	if (output->fd >= 0)
+		close(output->fd);
+	free(output->temp_path);
+	free(output->path);
+	free(output);
+}
+
+int dldiOutputCreate(int src_fd, const char *path, DLDI_STATS *stats, DLDI_OUTPUT **output)
+{
+	struct stat st;
+	if (fstat(src_fd, &st) != 0)
+		return -errno;
+
+	DLDI_OUTPUT *out = (DLDI_OUTPUT *)calloc(1, sizeof(DLDI_OUTPUT));
+	if (out == NULL)
+		return -ENOMEM;
+	out->fd = -1;
+	out->stats = stats;
+
+	// The temporary file is in the same directory, so renaming it is atomic.
+	size_t len = strlen(path);
+	out->path = strdup(path);
+	out->temp_path = (char *)malloc(len + sizeof(".XXXXXX"));
+	if (out->path == NULL || out->temp_path == NULL)
+	{
+		dldiOutputFree(out);
+		return -ENOMEM;
+	}
+	memcpy(out->temp_path, path, len);
+	memcpy(out->temp_path + len, ".XXXXXX", sizeof(".XXXXXX"));
+
+	out->fd = mkostemp(out->temp_path, O_CLOEXEC);
+	if (out->fd < 0)
+	{
+		int rc = -errno;
+		free(out->temp_path);
+		out->temp_path = NULL;
+		dldiOutputFree(out);
+		return rc;
+	}
+
+	u64 start = dldiStatsNow();
+	int rc = fchmod(out->fd, st.st_mode & 07777) == 0 ? 0 : -errno;
+	if (rc == 0)
+		rc = dldiCopyFile(src_fd, out->fd, st.st_size, stats);
+	dldiStatsPhase(stats, DLDI_PHASE_WRITE, start);
+
+	if (rc != 0)
+	{
+		dldiOutputAbort(out);
+		return rc;
+	}
+
+	*output = out;
+	return 0;
+}
+
+int dldiOutputFd(const DLDI_OUTPUT *output)
+{
+	return output->fd;
+}
+
+int dldiOutputCommit(DLDI_OUTPUT *output, int sync)
+{
+	int rc = dldiSync(output->fd, sync, output->stats);
+
+	if (close(output->fd) != 0 && rc == 0)
+		rc = -errno;
+	output->fd = -1;
+
+	if (rc == 0 && rename(output->temp_path, output->path) != 0)
+		rc = -errno;
+	if (rc != 0)
+	{
+		dldiOutputAbort(output);
+		return rc;
+	}
+
+	// The rename itself is only durable once the directory is flushed.
+	if (sync == DLDI_SYNC_FULL)
+	{
+		int dir_fd = open(dirname(output->temp_path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dir_fd >= 0)
+		{
+			rc = dldiSync(dir_fd, DLDI_SYNC_FULL, output->stats);
+			close(dir_fd);
+		}
+	}
+
+	dldiOutputFree(output);
+	return rc;
+}
+
+void dldiOutputAbort(DLDI_OUTPUT *output)
+{
+	if (output == NULL)
+		return;
+
+	if (output->temp_path != NULL)
+		unlink(output->temp_path);
+	dldiOutputFree(output);
+}
@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_OUTPUT_H__
+#define DLDIPATCH_DLDI_OUTPUT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+
+#include "dldi_stats.h"
+
+/// Don't flush the output to storage before it replaces the destination.
+#define DLDI_SYNC_NONE  0
+/// Flush the contents of the output before renaming it.
+#define DLDI_SYNC_DATA  1
+/// Also flush the metadata of the output, and the directory after renaming.
+#define DLDI_SYNC_FULL  2
+
+/// A copy of a file that is patched and then atomically moved to its
+/// destination.
+///
+/// The copy is written to a temporary file next to the destination, so the
+/// destination either keeps its old contents or gets the fully patched file,
+/// even if the process or the system stops halfway.
+typedef struct DLDI_OUTPUT DLDI_OUTPUT;
+
+/// Copy a file to a temporary file next to a destination path.
+///
+/// The copy is made with a reflink if the filesystem supports it, so no data
+/// is copied at all. Otherwise copy_file_range() is used, which lets the
+/// kernel or the filesystem copy the data, and a plain read and write loop is
+/// the last resort. The copy gets the permissions of the source.
+///
+/// @param src_fd Descriptor of the file to copy.
+/// @param path Destination path. It isn't touched until dldiOutputCommit().
+/// @param stats Counters to add the work done to, or NULL.
+/// @param output Receives the output on success.
+/// @return 0 on success, or a negative errno value.
+int dldiOutputCreate(int src_fd, const char *path, DLDI_STATS *stats,
+                     DLDI_OUTPUT **output);
+
+/// Descriptor of the temporary file, to write patches to.
+int dldiOutputFd(const DLDI_OUTPUT *output);
+
+/// Move the temporary file to the destination and free the output.
+///
+/// @param output The output. It is freed even if this fails, in which case
+///     the temporary file is removed.
+/// @param sync DLDI_SYNC_NONE, DLDI_SYNC_DATA or DLDI_SYNC_FULL.
+/// @return 0 on success, or a negative errno value.
+int dldiOutputCommit(DLDI_OUTPUT *output, int sync);
+
+/// Remove the temporary file and free the output. The destination is left
+/// alone.
+void dldiOutputAbort(DLDI_OUTPUT *output);
+
+/// Flush a file to storage.
+///
+/// @param fd Descriptor of the file.
+/// @param sync DLDI_SYNC_NONE, DLDI_SYNC_DATA or DLDI_SYNC_FULL.
+/// @param stats Counters to add the time spent to, or NULL.
+/// @return 0 on success, or a negative errno value.
+int dldiSync(int fd, int sync, DLDI_STATS *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_OUTPUT_H__
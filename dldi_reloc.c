@@ -0,0 +1,507 @@
+// SPDX-License-Identifier: Zlib
+// SPDX-FileNotice: Modified from the original version by the BlocksDS project.
+// SPDX-FileNotice: Modified from the BlocksDS version to provide a PC version.
+//
+// Copyright (c) 2006 Michael Chisholm (Chishm) and Tim Seidel (Mighty Max).
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DLDI_RELOC_X86
+#endif
+
+#include "dldi_reloc.h"
+#include "dldi_scan.h"
+
+// Adds offset to every word in [oldStart, oldStart + size). The compare is
+// done as a single unsigned subtraction so that the loop has no branches.
+static u32 dldiFixWordsPortable(u32 *words, size_t count, u32 oldStart, u32 size, u32 offset)
+{
+	u32 fixed = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		u32 in_range = (words[i] - oldStart) < size;
+		words[i] += offset & -in_range;
+		fixed += in_range;
+	}
+
+	return fixed;
+}
+
+#ifdef DLDI_RELOC_X86
+
+// SSE2 and AVX2 only have signed compares. Flipping the sign bit of both
+// sides turns them into unsigned compares.
+#define DLDI_SIGN_BIAS  ((int)0x80000000)
+
+__attribute__((target("sse2")))
+static u32 dldiFixWordsSSE2(u32 *words, size_t count, u32 oldStart, u32 size, u32 offset)
+{
+	const __m128i start = _mm_set1_epi32((int)oldStart);
+	const __m128i bias = _mm_set1_epi32(DLDI_SIGN_BIAS);
+	const __m128i limit = _mm_set1_epi32((int)(size ^ 0x80000000));
+	const __m128i add = _mm_set1_epi32((int)offset);
+	u32 fixed = 0;
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i w = _mm_loadu_si128((const __m128i *)(words + i));
+		__m128i rel = _mm_xor_si128(_mm_sub_epi32(w, start), bias);
+		__m128i in_range = _mm_cmplt_epi32(rel, limit);
+		_mm_storeu_si128((__m128i *)(words + i), _mm_add_epi32(w, _mm_and_si128(in_range, add)));
+		fixed += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(in_range)));
+	}
+
+	return fixed + dldiFixWordsPortable(words + i, count - i, oldStart, size, offset);
+}
+
+__attribute__((target("avx2")))
+static u32 dldiFixWordsAVX2(u32 *words, size_t count, u32 oldStart, u32 size, u32 offset)
+{
+	const __m256i start = _mm256_set1_epi32((int)oldStart);
+	const __m256i bias = _mm256_set1_epi32(DLDI_SIGN_BIAS);
+	const __m256i limit = _mm256_set1_epi32((int)(size ^ 0x80000000));
+	const __m256i add = _mm256_set1_epi32((int)offset);
+	u32 fixed = 0;
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i w = _mm256_loadu_si256((const __m256i *)(words + i));
+		__m256i rel = _mm256_xor_si256(_mm256_sub_epi32(w, start), bias);
+		__m256i in_range = _mm256_cmpgt_epi32(limit, rel);
+		_mm256_storeu_si256((__m256i *)(words + i), _mm256_add_epi32(w, _mm256_and_si256(in_range, add)));
+		fixed += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(in_range)));
+	}
+
+	return fixed + dldiFixWordsSSE2(words + i, count - i, oldStart, size, offset);
+}
+
+#endif // DLDI_RELOC_X86
+
+typedef u32 (*dldiFixWordsFn)(u32 *words, size_t count, u32 oldStart, u32 size, u32 offset);
+
+static dldiFixWordsFn dldiFixWordsSelect(void)
+{
+#ifdef DLDI_RELOC_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return dldiFixWordsAVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return dldiFixWordsSSE2;
+#endif
+	return dldiFixWordsPortable;
+}
+
+static u32 dldiFixWords(u32 *words, size_t count, u32 oldStart, u32 size, u32 offset)
+{
+	static dldiFixWordsFn fix = NULL;
+
+	// Racing threads all select the same function, so a relaxed store is
+	// enough here.
+	dldiFixWordsFn fn = __atomic_load_n(&fix, __ATOMIC_RELAXED);
+	if (fn == NULL)
+	{
+		fn = dldiFixWordsSelect();
+		__atomic_store_n(&fix, fn, __ATOMIC_RELAXED);
+	}
+
+	return fn(words, count, oldStart, size, offset);
+}
+
+// Fixes the words of the section [start, end), given as addresses before
+// relocation. Sections are indexed in whole words from the start of the
+// driver, like the original dlditool does.
+static u32 dldiFixSection(u32 *words, u32 start, u32 end, u32 oldStart, u32 oldEnd, u32 offset)
+{
+	u32 first = (start - oldStart) / sizeof(u32);
+	u32 last = (end - oldStart) / sizeof(u32);
+
+	if (last <= first)
+		return 0;
+
+	return dldiFixWords(words + first, last - first, oldStart, oldEnd - oldStart, offset);
+}
+
+// The flags are a compile-time constant in every caller, so each combination
+// gets its own copy with the unused sections removed.
+static inline __attribute__((always_inline))
+u32 dldiRelocateFlags(DLDI_INTERFACE *io, u32 targetAddress, const u8 flags)
+{
+    u32 offset;
+    u32 oldStart;
+    u32 oldEnd;
+    u32 fixed = 0;
+
+    offset = targetAddress - io->dldiStart;
+
+    oldStart = io->dldiStart;
+    oldEnd = io->dldiEnd;
+
+    // Section bounds before relocation
+    const u32 interworkStart = io->interworkStart;
+    const u32 interworkEnd = io->interworkEnd;
+    const u32 gotStart = io->gotStart;
+    const u32 gotEnd = io->gotEnd;
+    const u32 bssStart = io->bssStart;
+    const u32 bssEnd = io->bssEnd;
+
+    // Correct all pointers to the offsets from the location of this interface
+    io->dldiStart = io->dldiStart + offset;
+    io->dldiEnd = io->dldiEnd + offset;
+    io->interworkStart = io->interworkStart + offset;
+    io->interworkEnd = io->interworkEnd + offset;
+    io->gotStart = io->gotStart + offset;
+    io->gotEnd = io->gotEnd + offset;
+    io->bssStart = io->bssStart + offset;
+    io->bssEnd = io->bssEnd + offset;
+
+    io->ioInterface.startup =
+        io->ioInterface.startup + offset;
+    io->ioInterface.isInserted =
+        io->ioInterface.isInserted + offset;
+    io->ioInterface.readSectors =
+        io->ioInterface.readSectors + offset;
+    io->ioInterface.writeSectors =
+        io->ioInterface.writeSectors + offset;
+    io->ioInterface.clearStatus =
+        io->ioInterface.clearStatus + offset;
+    io->ioInterface.shutdown =
+        io->ioInterface.shutdown + offset;
+
+    u32 *words = (u32 *)io;
+
+    // Fix all addresses with in the DLDI
+    if (flags & FIX_ALL)
+        fixed += dldiFixSection(words, oldStart, oldEnd, oldStart, oldEnd, offset);
+
+    // Fix the interworking glue section
+    if (flags & FIX_GLUE)
+        fixed += dldiFixSection(words, interworkStart, interworkEnd, oldStart, oldEnd, offset);
+
+    // Fix the global offset table section
+    if (flags & FIX_GOT)
+        fixed += dldiFixSection(words, gotStart, gotEnd, oldStart, oldEnd, offset);
+
+    // Initialise the BSS to 0
+    if (flags & FIX_BSS)
+        memset((u8 *)io + (bssStart - oldStart), 0, bssEnd - bssStart);
+
+    return fixed;
+}
+
+#define DLDI_RELOCATE_FN(flags) \
+	static u32 dldiRelocate##flags(DLDI_INTERFACE *io, u32 targetAddress) \
+	{ \
+		return dldiRelocateFlags(io, targetAddress, flags); \
+	}
+
+DLDI_RELOCATE_FN(0)  DLDI_RELOCATE_FN(1)  DLDI_RELOCATE_FN(2)  DLDI_RELOCATE_FN(3)
+DLDI_RELOCATE_FN(4)  DLDI_RELOCATE_FN(5)  DLDI_RELOCATE_FN(6)  DLDI_RELOCATE_FN(7)
+DLDI_RELOCATE_FN(8)  DLDI_RELOCATE_FN(9)  DLDI_RELOCATE_FN(10) DLDI_RELOCATE_FN(11)
+DLDI_RELOCATE_FN(12) DLDI_RELOCATE_FN(13) DLDI_RELOCATE_FN(14) DLDI_RELOCATE_FN(15)
+
+u32 dldiRelocate(DLDI_INTERFACE *io, u32 targetAddress)
+{
+	static u32 (*const relocate[16])(DLDI_INTERFACE *, u32) = {
+		dldiRelocate0,  dldiRelocate1,  dldiRelocate2,  dldiRelocate3,
+		dldiRelocate4,  dldiRelocate5,  dldiRelocate6,  dldiRelocate7,
+		dldiRelocate8,  dldiRelocate9,  dldiRelocate10, dldiRelocate11,
+		dldiRelocate12, dldiRelocate13, dldiRelocate14, dldiRelocate15,
+	};
+
+	return relocate[io->fixSectionsFlags & 0x0F](io, targetAddress);
+}
+
+// Size of the buffers the driver is relocated in.
+#define DLDI_RELOC_BUFFER_SIZE  (1 << DLDI_SIZE_32KB)
+
+struct DLDI_RELOC_PLAN
+{
+	u64 hash;
+	u32 oldStart;
+	u32 oldSize;
+	u32 bssOffset;
+	u32 bssSize;
+	u32 count;
+	DLDI_RELOC_ENTRY *entries;
+	u8 driver[DLDI_RELOC_BUFFER_SIZE];
+};
+
+// Word indices of the header pointers that are always moved.
+#define DLDI_RELOC_HEADER_FIRST (offsetof(DLDI_INTERFACE, dldiStart) / sizeof(u32))
+#define DLDI_RELOC_HEADER_LAST  (offsetof(DLDI_INTERFACE, bssEnd) / sizeof(u32))
+#define DLDI_RELOC_IFACE_FIRST  (offsetof(DLDI_INTERFACE, ioInterface.startup) / sizeof(u32))
+#define DLDI_RELOC_IFACE_LAST   (offsetof(DLDI_INTERFACE, ioInterface.shutdown) / sizeof(u32))
+
+static bool dldiRelocIsHeaderWord(u32 index)
+{
+	return (index >= DLDI_RELOC_HEADER_FIRST && index <= DLDI_RELOC_HEADER_LAST) ||
+	       (index >= DLDI_RELOC_IFACE_FIRST && index <= DLDI_RELOC_IFACE_LAST);
+}
+
+// Adds one pass to every word of the section [start, end).
+static void dldiRelocCountSection(u8 *passes, u32 start, u32 end, u32 oldStart)
+{
+	u32 first = (start - oldStart) / sizeof(u32);
+	u32 last = (end - oldStart) / sizeof(u32);
+
+	for (u32 i = first; i < last; i++)
+		passes[i]++;
+}
+
+// Fills in the fields of a plan that come from the header.
+static void dldiRelocPlanInit(DLDI_RELOC_PLAN *p, const DLDI_INTERFACE *io, u64 hash)
+{
+	p->hash = hash;
+	p->oldStart = io->dldiStart;
+	p->oldSize = io->dldiEnd - io->dldiStart;
+	if (io->fixSectionsFlags & FIX_BSS)
+	{
+		p->bssOffset = io->bssStart - io->dldiStart;
+		p->bssSize = io->bssEnd - io->bssStart;
+	}
+}
+
+int dldiRelocPlanCreate(const DLDI_INTERFACE *io, DLDI_RELOC_PLAN **plan)
+{
+	const u32 word_count = DLDI_RELOC_BUFFER_SIZE / sizeof(u32);
+	const u32 *words = (const u32 *)io;
+
+	DLDI_RELOC_PLAN *p = (DLDI_RELOC_PLAN *)calloc(1, sizeof(DLDI_RELOC_PLAN));
+	if (p == NULL)
+		return -ENOMEM;
+
+	u8 *passes = (u8 *)calloc(word_count, 1);
+	if (passes == NULL)
+	{
+		free(p);
+		return -ENOMEM;
+	}
+
+	memcpy(p->driver, io, DLDI_RELOC_BUFFER_SIZE);
+	dldiRelocPlanInit(p, io, dldiHash(DLDI_HASH_INIT, p->driver, 1 << io->driverSize));
+
+	if (io->fixSectionsFlags & FIX_ALL)
+		dldiRelocCountSection(passes, io->dldiStart, io->dldiEnd, io->dldiStart);
+	if (io->fixSectionsFlags & FIX_GLUE)
+		dldiRelocCountSection(passes, io->interworkStart, io->interworkEnd, io->dldiStart);
+	if (io->fixSectionsFlags & FIX_GOT)
+		dldiRelocCountSection(passes, io->gotStart, io->gotEnd, io->dldiStart);
+
+	// A section word that doesn't point into the driver now never will, so
+	// it can be left out of the plan.
+	u32 count = 0;
+	for (u32 i = 0; i < word_count; i++)
+	{
+		if (dldiRelocIsHeaderWord(i) ||
+		    (passes[i] != 0 && words[i] - p->oldStart < p->oldSize))
+			count++;
+	}
+
+	p->entries = (DLDI_RELOC_ENTRY *)malloc(count * sizeof(DLDI_RELOC_ENTRY));
+	if (p->entries == NULL)
+	{
+		free(passes);
+		free(p);
+		return -ENOMEM;
+	}
+
+	for (u32 i = 0; i < word_count; i++)
+	{
+		bool always = dldiRelocIsHeaderWord(i);
+		if (always || (passes[i] != 0 && words[i] - p->oldStart < p->oldSize))
+		{
+			DLDI_RELOC_ENTRY *entry = &p->entries[p->count++];
+			entry->index = i;
+			entry->always = always;
+			entry->passes = passes[i];
+		}
+	}
+
+	free(passes);
+	*plan = p;
+	return 0;
+}
+
+int dldiRelocPlanLoad(const DLDI_INTERFACE *io, u64 hash, const DLDI_RELOC_ENTRY *entries, u32 count,
+                      DLDI_RELOC_PLAN **plan)
+{
+	DLDI_RELOC_PLAN *p = (DLDI_RELOC_PLAN *)calloc(1, sizeof(DLDI_RELOC_PLAN));
+	if (p == NULL)
+		return -ENOMEM;
+
+	p->entries = (DLDI_RELOC_ENTRY *)malloc(count * sizeof(DLDI_RELOC_ENTRY));
+	if (p->entries == NULL)
+	{
+		free(p);
+		return -ENOMEM;
+	}
+
+	// The rest of the buffer stays zero, like the buffers plans are created
+	// from.
+	memcpy(p->driver, io, 1 << io->driverSize);
+	memcpy(p->entries, entries, count * sizeof(DLDI_RELOC_ENTRY));
+	p->count = count;
+	dldiRelocPlanInit(p, io, hash);
+
+	*plan = p;
+	return 0;
+}
+
+void dldiRelocPlanFree(DLDI_RELOC_PLAN *plan)
+{
+	if (plan == NULL)
+		return;
+
+	free(plan->entries);
+	free(plan);
+}
+
+const DLDI_INTERFACE *dldiRelocPlanDriver(const DLDI_RELOC_PLAN *plan)
+{
+	return (const DLDI_INTERFACE *)plan->driver;
+}
+
+u64 dldiRelocPlanHash(const DLDI_RELOC_PLAN *plan)
+{
+	return plan->hash;
+}
+
+u32 dldiRelocPlanEntries(const DLDI_RELOC_PLAN *plan, const DLDI_RELOC_ENTRY **entries)
+{
+	*entries = plan->entries;
+	return plan->count;
+}
+
+u32 dldiRelocPlanApply(const DLDI_RELOC_PLAN *plan, DLDI_INTERFACE *out, u32 targetAddress)
+{
+	u32 offset = targetAddress - plan->oldStart;
+	u32 *words = (u32 *)out;
+	u32 fixed = 0;
+
+	memcpy(out, plan->driver, DLDI_RELOC_BUFFER_SIZE);
+
+	for (u32 i = 0; i < plan->count; i++)
+	{
+		const DLDI_RELOC_ENTRY *entry = &plan->entries[i];
+		u32 word = words[entry->index];
+
+		if (entry->always)
+			word += offset;
+		for (u32 pass = 0; pass < entry->passes; pass++)
+		{
+			u32 in_range = (word - plan->oldStart) < plan->oldSize;
+			word += offset & -in_range;
+			fixed += in_range;
+		}
+
+		words[entry->index] = word;
+	}
+
+	// Initialise the BSS to 0
+	memset((u8 *)out + plan->bssOffset, 0, plan->bssSize);
+
+	return fixed;
+}
+
+typedef struct DLDI_RELOC_CACHE_ENTRY
+{
+	u64 hash;
+	u32 targetAddress;
+	u8 allocatedSize;
+	bool used;
+	u8 *driver;
+} DLDI_RELOC_CACHE_ENTRY;
+
+struct DLDI_RELOC_CACHE
+{
+	pthread_mutex_t lock;
+	unsigned int capacity;
+	unsigned int next; // Slot replaced by the next insertion
+	DLDI_RELOC_CACHE_ENTRY *entries;
+};
+
+DLDI_RELOC_CACHE *dldiRelocCacheCreate(unsigned int capacity)
+{
+	if (capacity == 0)
+		capacity = 1;
+
+	DLDI_RELOC_CACHE *cache = (DLDI_RELOC_CACHE *)calloc(1, sizeof(DLDI_RELOC_CACHE));
+	if (cache == NULL)
+		return NULL;
+
+	cache->entries = (DLDI_RELOC_CACHE_ENTRY *)calloc(capacity, sizeof(DLDI_RELOC_CACHE_ENTRY));
+	if (cache->entries == NULL)
+	{
+		free(cache);
+		return NULL;
+	}
+
+	cache->capacity = capacity;
+	pthread_mutex_init(&cache->lock, NULL);
+	return cache;
+}
+
+void dldiRelocCacheFree(DLDI_RELOC_CACHE *cache)
+{
+	if (cache == NULL)
+		return;
+
+	for (unsigned int i = 0; i < cache->capacity; i++)
+		free(cache->entries[i].driver);
+	free(cache->entries);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+bool dldiRelocCacheGet(DLDI_RELOC_CACHE *cache, const DLDI_RELOC_PLAN *plan,
+                       u32 targetAddress, u8 allocatedSize, DLDI_INTERFACE *out)
+{
+	const size_t size = 1 << dldiRelocPlanDriver(plan)->driverSize;
+
+	// Entries are copied out under the lock, so they can be replaced by other
+	// threads as soon as this returns.
+	pthread_mutex_lock(&cache->lock);
+	for (unsigned int i = 0; i < cache->capacity; i++)
+	{
+		DLDI_RELOC_CACHE_ENTRY *entry = &cache->entries[i];
+		if (entry->used && entry->hash == plan->hash &&
+		    entry->targetAddress == targetAddress && entry->allocatedSize == allocatedSize)
+		{
+			memcpy(out, entry->driver, size);
+			pthread_mutex_unlock(&cache->lock);
+			return true;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	dldiRelocPlanApply(plan, out, targetAddress);
+	// restore the original allocated driver size.
+	out->allocatedSize = allocatedSize;
+
+	u8 *copy = (u8 *)malloc(size);
+	if (copy == NULL)
+		return false;
+	memcpy(copy, out, size);
+
+	pthread_mutex_lock(&cache->lock);
+	DLDI_RELOC_CACHE_ENTRY *entry = &cache->entries[cache->next];
+	cache->next = (cache->next + 1) % cache->capacity;
+	free(entry->driver);
+	entry->hash = plan->hash;
+	entry->targetAddress = targetAddress;
+	entry->allocatedSize = allocatedSize;
+	entry->used = true;
+	entry->driver = copy;
+	pthread_mutex_unlock(&cache->lock);
+
+	return false;
+}
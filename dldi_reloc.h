@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_RELOC_H__
+#define DLDIPATCH_DLDI_RELOC_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dldi.h"
+
+/// Relocate a DLDI driver to a new address.
+///
+/// The header and interface pointers are always moved. Words in the sections
+/// selected by fixSectionsFlags that point into the old text/data section are
+/// moved as well, and the BSS is cleared if FIX_BSS is set.
+///
+/// The driver must be a valid header (see dldiIsValid()) at the start of a
+/// 4-byte aligned buffer of at least 1 << DLDI_SIZE_32KB bytes.
+///
+/// @param io The driver to relocate.
+/// @param targetAddress The new value of dldiStart.
+/// @return The number of section words that were fixed.
+u32 dldiRelocate(DLDI_INTERFACE *io, u32 targetAddress);
+
+/// Precomputed relocation of one driver.
+///
+/// The plan keeps a pristine copy of the driver and the list of words that
+/// dldiRelocate() would change, so relocating the driver to another address
+/// only touches those words instead of rescanning every section.
+typedef struct DLDI_RELOC_PLAN DLDI_RELOC_PLAN;
+
+/// A word of a driver changed by relocation.
+///
+/// Words of the header are always moved first. After that, a word that is
+/// inside several fixed sections is checked and moved once per section,
+/// exactly as dldiRelocate() does.
+typedef struct DLDI_RELOC_ENTRY
+{
+    u16 index; ///< Index of the word from the start of the driver.
+    u8 always; ///< 1 for header words, which are always moved.
+    u8 passes; ///< Number of fixed sections the word is in.
+} DLDI_RELOC_ENTRY;
+
+/// Cache of drivers that have already been relocated.
+///
+/// Entries are keyed by driver hash, target address and allocated size. The
+/// cache can be shared by any number of threads.
+typedef struct DLDI_RELOC_CACHE DLDI_RELOC_CACHE;
+
+/// Build the relocation plan of a driver.
+///
+/// @param io A valid driver in a buffer of at least 1 << DLDI_SIZE_32KB bytes.
+///     It isn't modified, and isn't referenced after this returns.
+/// @param plan Receives the plan on success.
+/// @return 0 on success, or a negative errno value.
+int dldiRelocPlanCreate(const DLDI_INTERFACE *io, DLDI_RELOC_PLAN **plan);
+
+/// Build the relocation plan of a driver from words listed beforehand.
+///
+/// Nothing is scanned, so this is only a copy of the driver and of the
+/// entries. They must be those of a plan of the same driver, as returned by
+/// dldiRelocPlanEntries().
+///
+/// @param io A valid driver of 1 << driverSize bytes. It isn't modified, and
+///     isn't referenced after this returns.
+/// @param hash Hash of the driver, as returned by dldiRelocPlanHash().
+/// @param entries The words changed by relocation, in increasing order.
+/// @param count Number of entries.
+/// @param plan Receives the plan on success.
+/// @return 0 on success, or a negative errno value.
+int dldiRelocPlanLoad(const DLDI_INTERFACE *io, u64 hash, const DLDI_RELOC_ENTRY *entries, u32 count,
+                      DLDI_RELOC_PLAN **plan);
+
+/// Free a plan created with dldiRelocPlanCreate() or dldiRelocPlanLoad().
+void dldiRelocPlanFree(DLDI_RELOC_PLAN *plan);
+
+/// The unrelocated driver the plan was built from.
+const DLDI_INTERFACE *dldiRelocPlanDriver(const DLDI_RELOC_PLAN *plan);
+
+/// 64-bit hash of the driver the plan was built from.
+u64 dldiRelocPlanHash(const DLDI_RELOC_PLAN *plan);
+
+/// The words of the driver that relocation changes.
+///
+/// @param plan The plan.
+/// @param entries Receives the entries, which belong to the plan.
+/// @return The number of entries.
+u32 dldiRelocPlanEntries(const DLDI_RELOC_PLAN *plan, const DLDI_RELOC_ENTRY **entries);
+
+/// Relocate the driver of a plan to a new address.
+///
+/// The result is identical to copying the driver and calling dldiRelocate().
+///
+/// @param plan The plan of the driver.
+/// @param out Buffer of at least 1 << DLDI_SIZE_32KB bytes, 4-byte aligned.
+/// @param targetAddress The new value of dldiStart.
+/// @return The number of section words that were fixed.
+u32 dldiRelocPlanApply(const DLDI_RELOC_PLAN *plan, DLDI_INTERFACE *out, u32 targetAddress);
+
+/// Create a relocation cache.
+///
+/// @param capacity Maximum number of relocated drivers kept in the cache.
+/// @return The cache, or NULL if out of memory.
+DLDI_RELOC_CACHE *dldiRelocCacheCreate(unsigned int capacity);
+
+/// Free a cache created with dldiRelocCacheCreate().
+void dldiRelocCacheFree(DLDI_RELOC_CACHE *cache);
+
+/// Get the driver of a plan relocated for a target.
+///
+/// The driver is taken from the cache if it has already been relocated for
+/// the same address and allocated size, and relocated and added otherwise.
+///
+/// @param cache The cache.
+/// @param plan The plan of the driver.
+/// @param targetAddress The new value of dldiStart.
+/// @param allocatedSize The allocatedSize of the target's stub.
+/// @param out Buffer of at least 1 << DLDI_SIZE_32KB bytes, 4-byte aligned.
+/// @return true if the driver was found in the cache.
+bool dldiRelocCacheGet(DLDI_RELOC_CACHE *cache, const DLDI_RELOC_PLAN *plan,
+                       u32 targetAddress, u8 allocatedSize, DLDI_INTERFACE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_RELOC_H__
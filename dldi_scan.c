@@ -0,0 +1,183 @@
+// SPDX-License-Identifier: Zlib
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DLDI_SCAN_X86
+#endif
+
+#include "dldi_scan.h"
+
+const u32 DLDI_MAGIC_NUMBER = 0xBF8DA5ED;
+static const char DLDI_MAGIC_STRING[DLDI_MAGIC_STRING_LEN] = " Chishm";
+
+bool dldiIsValid(const DLDI_INTERFACE *io, size_t available)
+{
+	if (available < DLDI_HEADER_SIZE)
+		return false;
+
+	if (io->magicNumber != DLDI_MAGIC_NUMBER)
+		return false;
+	if (memcmp(io->magicString, DLDI_MAGIC_STRING, DLDI_MAGIC_STRING_LEN) != 0)
+		return false;
+
+	if (io->driverSize < DLDI_SIZE_512B || io->driverSize > DLDI_SIZE_32KB)
+		return false;
+	if (io->allocatedSize < DLDI_SIZE_512B || io->allocatedSize > DLDI_SIZE_32KB)
+		return false;
+
+	// The text/data section has to fit in the space the driver claims.
+	u32 max_size = 1u << (io->driverSize > io->allocatedSize ? io->driverSize : io->allocatedSize);
+	if (io->dldiEnd < io->dldiStart || io->dldiEnd - io->dldiStart > max_size)
+		return false;
+
+	// Sections that are going to be fixed must be inside the driver.
+	if (io->fixSectionsFlags & FIX_GLUE)
+	{
+		if (io->interworkEnd < io->interworkStart || io->interworkStart < io->dldiStart ||
+		    io->interworkEnd - io->dldiStart > max_size)
+			return false;
+	}
+	if (io->fixSectionsFlags & FIX_GOT)
+	{
+		if (io->gotEnd < io->gotStart || io->gotStart < io->dldiStart ||
+		    io->gotEnd - io->dldiStart > max_size)
+			return false;
+	}
+	if (io->fixSectionsFlags & FIX_BSS)
+	{
+		if (io->bssEnd < io->bssStart || io->bssStart < io->dldiStart ||
+		    io->bssEnd - io->dldiStart > max_size)
+			return false;
+	}
+
+	return true;
+}
+
+static ssize_t dldiScanMagicPortable(const void *data, size_t size, size_t start)
+{
+	const u8 *bytes = (const u8 *)data;
+
+	for (size_t i = start; i + 4 <= size; i += 4)
+	{
+		u32 word;
+		memcpy(&word, bytes + i, sizeof(word));
+		if (word == DLDI_MAGIC_NUMBER)
+			return i;
+	}
+
+	return -1;
+}
+
+#ifdef DLDI_SCAN_X86
+
+__attribute__((target("sse2")))
+static ssize_t dldiScanMagicSSE2(const void *data, size_t size, size_t start)
+{
+	const u8 *bytes = (const u8 *)data;
+	const __m128i magic = _mm_set1_epi32((int)DLDI_MAGIC_NUMBER);
+	size_t i = start;
+
+	// Four words per compare, two compares per iteration.
+	for (; i + 32 <= size; i += 32)
+	{
+		__m128i a = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(bytes + i)), magic);
+		__m128i b = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(bytes + i + 16)), magic);
+		unsigned int mask = _mm_movemask_ps(_mm_castsi128_ps(a)) |
+		                    (_mm_movemask_ps(_mm_castsi128_ps(b)) << 4);
+		if (mask != 0)
+			return i + 4 * __builtin_ctz(mask);
+	}
+
+	return dldiScanMagicPortable(data, size, i);
+}
+
+__attribute__((target("avx2")))
+static ssize_t dldiScanMagicAVX2(const void *data, size_t size, size_t start)
+{
+	const u8 *bytes = (const u8 *)data;
+	const __m256i magic = _mm256_set1_epi32((int)DLDI_MAGIC_NUMBER);
+	size_t i = start;
+
+	// Eight words per compare, two compares per iteration.
+	for (; i + 64 <= size; i += 64)
+	{
+		__m256i a = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(bytes + i)), magic);
+		__m256i b = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)(bytes + i + 32)), magic);
+		unsigned int mask = _mm256_movemask_ps(_mm256_castsi256_ps(a)) |
+		                    (_mm256_movemask_ps(_mm256_castsi256_ps(b)) << 8);
+		if (mask != 0)
+			return i + 4 * __builtin_ctz(mask);
+	}
+
+	return dldiScanMagicSSE2(data, size, i);
+}
+
+#endif // DLDI_SCAN_X86
+
+typedef ssize_t (*dldiScanFn)(const void *data, size_t size, size_t start);
+
+static dldiScanFn dldiScanSelect(void)
+{
+#ifdef DLDI_SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return dldiScanMagicAVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return dldiScanMagicSSE2;
+#endif
+	return dldiScanMagicPortable;
+}
+
+ssize_t dldiScanMagic(const void *data, size_t size, size_t start)
+{
+	static dldiScanFn scan = NULL;
+
+	// Racing threads all select the same function, so a relaxed store is
+	// enough here.
+	dldiScanFn fn = __atomic_load_n(&scan, __ATOMIC_RELAXED);
+	if (fn == NULL)
+	{
+		fn = dldiScanSelect();
+		__atomic_store_n(&scan, fn, __ATOMIC_RELAXED);
+	}
+
+	return fn(data, size, start);
+}
+
+ssize_t dldiFindInBuffer(const void *data, size_t size, size_t start)
+{
+	const u8 *bytes = (const u8 *)data;
+
+	for (;;)
+	{
+		ssize_t offset = dldiScanMagic(data, size, start);
+		if (offset < 0)
+			return -1;
+
+		if (dldiIsValid((const DLDI_INTERFACE *)(bytes + offset), size - offset))
+			return offset;
+
+		start = offset + 4;
+	}
+}
+
+size_t dldiStubSpan(const DLDI_INTERFACE *io)
+{
+	u8 size = io->allocatedSize > io->driverSize ? io->allocatedSize : io->driverSize;
+	return (size_t)1 << size;
+}
+
+u64 dldiHash(u64 hash, const void *data, size_t size)
+{
+	const u8 *bytes = (const u8 *)data;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
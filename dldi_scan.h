@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_SCAN_H__
+#define DLDIPATCH_DLDI_SCAN_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "dldi.h"
+
+/// Magic number at the start of every DLDI header.
+extern const u32 DLDI_MAGIC_NUMBER;
+
+/// Size of the fixed DLDI header, including the disc interface.
+#define DLDI_HEADER_SIZE    ((size_t)sizeof(DLDI_INTERFACE))
+
+/// Check that a buffer holds a plausible DLDI header.
+///
+/// The magic number, the magic string, the size fields and the section
+/// pointers are all checked, so that a magic number that happens to appear
+/// in data isn't taken as a driver.
+///
+/// @param io The candidate header.
+/// @param available Number of readable bytes starting at io.
+/// @return true if the header is valid.
+bool dldiIsValid(const DLDI_INTERFACE *io, size_t available);
+
+/// Find the next 4-byte aligned DLDI magic number in a buffer.
+///
+/// The fastest implementation supported by the CPU is chosen on first use.
+///
+/// @param data Start of the buffer. Alignment is relative to this pointer.
+/// @param size Size of the buffer in bytes.
+/// @param start Offset to start searching from. Must be a multiple of 4.
+/// @return The offset of the magic number, or -1 if there is none.
+ssize_t dldiScanMagic(const void *data, size_t size, size_t start);
+
+/// Find the next valid DLDI header in a buffer.
+///
+/// @param data Start of the buffer.
+/// @param size Size of the buffer in bytes.
+/// @param start Offset to start searching from. Must be a multiple of 4.
+/// @return The offset of the header, or -1 if there is none.
+ssize_t dldiFindInBuffer(const void *data, size_t size, size_t start);
+
+/// Number of bytes reserved for a DLDI driver, starting at its header.
+///
+/// A file may carry several stubs, for example a second copy in the ARM7
+/// binary. The next stub can't start before the end of this area, so
+/// searches for further stubs continue from there.
+///
+/// @param io A valid DLDI header.
+/// @return The size of the area, in bytes.
+size_t dldiStubSpan(const DLDI_INTERFACE *io);
+
+/// Initial value for dldiHash().
+#define DLDI_HASH_INIT  0xCBF29CE484222325ULL
+
+/// Hash a buffer with 64-bit FNV-1a.
+///
+/// @param hash DLDI_HASH_INIT, or the result of a previous call to hash
+///     several buffers as one.
+/// @param data The buffer.
+/// @param size Size of the buffer in bytes.
+/// @return The updated hash.
+u64 dldiHash(u64 hash, const void *data, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_SCAN_H__
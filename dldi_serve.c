@@ -0,0 +1,757 @@
+// SPDX-License-Identifier: Zlib
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "dldi_serve.h"
+#include "dldi_output.h"
+#include "dldi_stream.h"
+
+// Number of relocated drivers shared by all requests.
+#define DLDI_SERVE_CACHE_SIZE   64
+
+// A client that stops halfway through a request is dropped after this many
+// seconds, so that it doesn't hold a worker forever.
+#define DLDI_SERVE_TIMEOUT      5
+
+struct DLDI_SERVER
+{
+	char *path;
+	int listen_fd;
+	int wake[2];
+	int threads;
+	bool stopping;
+
+	const DLDI_CATALOG *catalog;
+	DLDI_INDEX *index;
+	DLDI_RELOC_CACHE *cache;
+
+	// Plans of the drivers of the catalog, built the first time they are used.
+	pthread_mutex_t plan_lock;
+	DLDI_RELOC_PLAN **plans;
+
+	// Connections with a request to handle wait in a bounded ring for a
+	// worker. Workers hand connections back through the done list and the
+	// wake pipe, to wait for their next request.
+	pthread_mutex_t lock;
+	pthread_cond_t ready_cond;
+	pthread_cond_t space_cond;
+	int *ready;
+	int ready_head;
+	int ready_count;
+	int ready_capacity;
+	int *done;
+	int done_count;
+	int done_capacity;
+	bool closing;
+
+	DLDI_SERVE_STATS stats;
+};
+
+// A request being handled, with the descriptors that came with it.
+typedef struct DLDI_SERVE_CALL
+{
+	DLDI_SERVE_REQUEST request;
+	char payload[DLDI_SERVE_MAX_REQUEST - sizeof(DLDI_SERVE_REQUEST) + 1];
+	int fds[DLDI_SERVE_MAX_FDS];
+	int fd_count;
+	DLDI_SERVE_RESPONSE response;
+	void *reply;
+} DLDI_SERVE_CALL;
+
+int dldiServerCreate(const char *socket_path, const DLDI_CATALOG *catalog,
+                     DLDI_INDEX *index, int threads, DLDI_SERVER **server)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, socket_path);
+
+	DLDI_SERVER *srv = (DLDI_SERVER *)calloc(1, sizeof(DLDI_SERVER));
+	if (srv == NULL)
+		return -ENOMEM;
+
+	srv->listen_fd = -1;
+	srv->wake[0] = srv->wake[1] = -1;
+	srv->threads = threads < 1 ? 1 : threads;
+	srv->catalog = catalog;
+	srv->index = index;
+	srv->ready_capacity = srv->threads * 2;
+	pthread_mutex_init(&srv->plan_lock, NULL);
+	pthread_mutex_init(&srv->lock, NULL);
+	pthread_cond_init(&srv->ready_cond, NULL);
+	pthread_cond_init(&srv->space_cond, NULL);
+
+	int rc = 0;
+	srv->path = strdup(socket_path);
+	srv->cache = dldiRelocCacheCreate(DLDI_SERVE_CACHE_SIZE);
+	srv->ready = (int *)calloc(srv->ready_capacity, sizeof(int));
+	if (catalog != NULL)
+		srv->plans = (DLDI_RELOC_PLAN **)calloc(dldiCatalogCount(catalog) + 1, sizeof(DLDI_RELOC_PLAN *));
+	if (srv->path == NULL || srv->cache == NULL || srv->ready == NULL ||
+	    (catalog != NULL && srv->plans == NULL))
+	{
+		rc = -ENOMEM;
+		goto create_fail;
+	}
+
+	if (pipe2(srv->wake, O_CLOEXEC | O_NONBLOCK) != 0)
+	{
+		rc = -errno;
+		goto create_fail;
+	}
+
+	// A socket left behind by a server that didn't exit cleanly is replaced,
+	// but nothing else is.
+	struct stat st;
+	if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(socket_path);
+
+	srv->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (srv->listen_fd < 0 ||
+	    bind(srv->listen_fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		rc = -errno;
+		goto create_fail;
+	}
+	if (listen(srv->listen_fd, SOMAXCONN) != 0)
+	{
+		rc = -errno;
+		unlink(socket_path);
+		goto create_fail;
+	}
+
+	*server = srv;
+	return 0;
+
+create_fail:
+	// The socket wasn't bound, so there is nothing to remove.
+	free(srv->path);
+	srv->path = NULL;
+	dldiServerFree(srv);
+	return rc;
+}
+
+void dldiServerFree(DLDI_SERVER *server)
+{
+	if (server == NULL)
+		return;
+
+	if (server->listen_fd >= 0)
+		close(server->listen_fd);
+	if (server->path != NULL)
+		unlink(server->path);
+	if (server->wake[0] >= 0)
+		close(server->wake[0]);
+	if (server->wake[1] >= 0)
+		close(server->wake[1]);
+
+	if (server->plans != NULL)
+	{
+		for (int i = 0; i < dldiCatalogCount(server->catalog); i++)
+			dldiRelocPlanFree(server->plans[i]);
+	}
+	free(server->plans);
+	dldiRelocCacheFree(server->cache);
+	free(server->ready);
+	free(server->done);
+	free(server->path);
+
+	pthread_cond_destroy(&server->space_cond);
+	pthread_cond_destroy(&server->ready_cond);
+	pthread_mutex_destroy(&server->lock);
+	pthread_mutex_destroy(&server->plan_lock);
+	free(server);
+}
+
+static void dldiServerWake(DLDI_SERVER *server)
+{
+	// If the pipe is full, the poller is already due to wake up.
+	ssize_t written = write(server->wake[1], "", 1);
+	(void)written;
+}
+
+void dldiServerStop(DLDI_SERVER *server)
+{
+	__atomic_store_n(&server->stopping, true, __ATOMIC_RELEASE);
+	dldiServerWake(server);
+}
+
+void dldiServerStats(DLDI_SERVER *server, DLDI_SERVE_STATS *stats)
+{
+	const u64 *src = (const u64 *)&server->stats;
+	u64 *dst = (u64 *)stats;
+
+	for (size_t i = 0; i < sizeof(DLDI_SERVE_STATS) / sizeof(u64); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+static void dldiServerCount(u64 *counter)
+{
+	__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+// Finds the plan of the driver of the catalog named by a request. Copies of
+// one driver may share an ID, but different drivers may not.
+static int dldiServerPlan(DLDI_SERVER *server, const char *key, const DLDI_RELOC_PLAN **plan)
+{
+	if (server->catalog == NULL)
+		return -ENOENT;
+
+	int count = dldiCatalogFind(server->catalog, key, NULL, 0);
+	if (count == 0)
+		return -ENOENT;
+
+	const DLDI_CATALOG_ENTRY **matches = (const DLDI_CATALOG_ENTRY **)calloc(count, sizeof(DLDI_CATALOG_ENTRY *));
+	if (matches == NULL)
+		return -ENOMEM;
+	dldiCatalogFind(server->catalog, key, matches, count);
+
+	int rc = 0;
+	for (int i = 1; i < count; i++)
+	{
+		if (matches[i]->hash != matches[0]->hash)
+			rc = -EINVAL;
+	}
+
+	int index = matches[0] - dldiCatalogEntry(server->catalog, 0);
+	free(matches);
+	if (rc != 0)
+		return rc;
+
+	pthread_mutex_lock(&server->plan_lock);
+	if (server->plans[index] == NULL)
+		rc = dldiCatalogPlan(dldiCatalogEntry(server->catalog, index), &server->plans[index]);
+	*plan = server->plans[index];
+	pthread_mutex_unlock(&server->plan_lock);
+
+	return rc;
+}
+
+static int dldiServePatch(DLDI_SERVER *server, DLDI_SERVE_CALL *call)
+{
+	bool driver_fd = call->request.flags & DLDI_SERVE_DRIVER_FD;
+	int first = driver_fd ? 1 : 0;
+	int files = call->fd_count - first;
+	if (files < 1 || files > 2 || (driver_fd && call->payload[0] != '\0') ||
+	    ((call->request.flags & DLDI_SERVE_CHECK) && files != 1))
+		return -EINVAL;
+
+	const DLDI_RELOC_PLAN *plan;
+	DLDI_RELOC_PLAN *own_plan = NULL;
+	int rc;
+	if (driver_fd)
+	{
+		DLDI_IMAGE *driver;
+		rc = dldiImageOpenFd(call->fds[0], 0, NULL, NULL, &driver);
+		if (rc != 0)
+			return rc;
+		rc = dldiRelocPlanCreate(dldiImageDriver(driver), &own_plan);
+		dldiImageClose(driver);
+		plan = own_plan;
+	}
+	else
+	{
+		rc = dldiServerPlan(server, call->payload, &plan);
+	}
+	if (rc != 0)
+		return rc;
+
+	int out_fd = call->fds[first + files - 1];
+	bool written = false;
+	if (files == 2)
+	{
+		rc = dldiPatchStream(plan, call->fds[first], out_fd, NULL);
+		written = rc == 0;
+	}
+	else
+	{
+		// Files that only need checking may be read-only.
+		bool check = call->request.flags & DLDI_SERVE_CHECK;
+		DLDI_IMAGE *image;
+		rc = dldiImageOpenFd(call->fds[first], check ? 0 : DLDI_IMAGE_WRITE, server->index, NULL, &image);
+		if (rc == 0)
+		{
+			rc = dldiImagePatch(image, plan, server->cache, dldiImageFd(image), check ? DLDI_PATCH_CHECK : 0);
+			if (rc >= 0)
+			{
+				call->response.count = rc;
+				written = !check && rc > 0;
+				rc = 0;
+			}
+			int close_rc = dldiImageClose(image);
+			if (rc == 0)
+				rc = close_rc;
+		}
+	}
+
+	// A file that already had the driver wasn't written, so it isn't flushed.
+	if (rc == 0 && written && (call->request.flags & DLDI_SERVE_SYNC))
+		rc = dldiSync(out_fd, DLDI_SYNC_DATA, NULL);
+
+	dldiRelocPlanFree(own_plan);
+	return rc;
+}
+
+static int dldiServeInfo(DLDI_SERVER *server, DLDI_SERVE_CALL *call)
+{
+	if (call->fd_count != 1)
+		return -EINVAL;
+
+	DLDI_IMAGE *image;
+	int rc = dldiImageOpenFd(call->fds[0], 0, server->index, NULL, &image);
+	if (rc != 0)
+		return rc;
+
+	int count = dldiImageStubCount(image);
+	DLDI_SERVE_STUB *stubs = (DLDI_SERVE_STUB *)calloc(count, sizeof(DLDI_SERVE_STUB));
+	if (stubs == NULL)
+	{
+		dldiImageClose(image);
+		return -ENOMEM;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		const DLDI_STUB *stub = dldiImageStub(image, i);
+		stubs[i].offset = stub->offset;
+		stubs[i].header = stub->header;
+	}
+	dldiImageClose(image);
+
+	call->reply = stubs;
+	call->response.count = count;
+	call->response.size += count * sizeof(DLDI_SERVE_STUB);
+	return 0;
+}
+
+static int dldiServeExtract(DLDI_SERVER *server, DLDI_SERVE_CALL *call)
+{
+	if (call->fd_count != 2)
+		return -EINVAL;
+
+	DLDI_IMAGE *image;
+	int rc = dldiImageOpenFd(call->fds[0], 0, server->index, NULL, &image);
+	if (rc != 0)
+		return rc;
+
+	const u8 *data = (const u8 *)dldiImageDriver(image);
+	u32 size = dldiImageStub(image, 0)->sections[DLDI_SECTION_DATA].end;
+	u32 done = 0;
+	while (done < size)
+	{
+		ssize_t written = write(call->fds[1], data + done, size - done);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+		{
+			rc = written < 0 ? -errno : -EIO;
+			break;
+		}
+		done += written;
+	}
+	dldiImageClose(image);
+
+	if (rc == 0 && (call->request.flags & DLDI_SERVE_SYNC))
+		rc = dldiSync(call->fds[1], DLDI_SYNC_DATA, NULL);
+	call->response.count = done;
+	return rc;
+}
+
+static int dldiServeStats(DLDI_SERVER *server, DLDI_SERVE_CALL *call)
+{
+	if (call->fd_count != 0)
+		return -EINVAL;
+
+	DLDI_SERVE_STATS *stats = (DLDI_SERVE_STATS *)malloc(sizeof(DLDI_SERVE_STATS));
+	if (stats == NULL)
+		return -ENOMEM;
+
+	dldiServerStats(server, stats);
+	call->reply = stats;
+	call->response.size += sizeof(DLDI_SERVE_STATS);
+	return 0;
+}
+
+// Reads exactly size bytes, or fails.
+static int dldiServeRecv(int conn, void *buffer, size_t size)
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t received = recv(conn, (u8 *)buffer + done, size - done, MSG_WAITALL);
+		if (received < 0 && errno == EINTR)
+			continue;
+		if (received <= 0)
+			return received < 0 ? -errno : -ECONNRESET;
+		done += received;
+	}
+	return 0;
+}
+
+// Reads a request and the descriptors sent with it.
+static int dldiServeRead(int conn, DLDI_SERVE_CALL *call)
+{
+	union {
+		char buffer[CMSG_SPACE(DLDI_SERVE_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {
+		.iov_base = &call->request,
+		.iov_len = sizeof(DLDI_SERVE_REQUEST),
+	};
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buffer,
+		.msg_controllen = sizeof(control.buffer),
+	};
+
+	ssize_t received;
+	do
+		received = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+	while (received < 0 && errno == EINTR);
+	if (received <= 0)
+		return received < 0 ? -errno : -ECONNRESET;
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (int i = 0; i < count && call->fd_count < DLDI_SERVE_MAX_FDS; i++)
+			memcpy(&call->fds[call->fd_count++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+	}
+
+	// The rest of the header and the payload come without descriptors.
+	int rc = dldiServeRecv(conn, (u8 *)&call->request + received, sizeof(DLDI_SERVE_REQUEST) - received);
+	if (rc != 0)
+		return rc;
+
+	// A request of the wrong size can't be skipped safely.
+	u32 size = call->request.size;
+	if (size < sizeof(DLDI_SERVE_REQUEST) || size > DLDI_SERVE_MAX_REQUEST)
+		return -EMSGSIZE;
+
+	size -= sizeof(DLDI_SERVE_REQUEST);
+	rc = dldiServeRecv(conn, call->payload, size);
+	call->payload[size] = '\0';
+	if (rc != 0)
+		return rc;
+
+	// Descriptors that didn't fit were closed by the kernel, so the request
+	// can't be handled, but the connection is still in sync.
+	if (msg.msg_flags & MSG_CTRUNC)
+		return -E2BIG;
+
+	return 0;
+}
+
+static int dldiServeWrite(int conn, const DLDI_SERVE_CALL *call)
+{
+	struct iovec iov[2] = {
+		{ .iov_base = (void *)&call->response, .iov_len = sizeof(DLDI_SERVE_RESPONSE) },
+		{ .iov_base = call->reply, .iov_len = call->response.size - sizeof(DLDI_SERVE_RESPONSE) },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+	};
+
+	while (msg.msg_iovlen > 0)
+	{
+		ssize_t sent = sendmsg(conn, &msg, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent < 0)
+			return -errno;
+
+		while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len)
+		{
+			sent -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0)
+		{
+			msg.msg_iov->iov_base = (u8 *)msg.msg_iov->iov_base + sent;
+			msg.msg_iov->iov_len -= sent;
+		}
+	}
+
+	return 0;
+}
+
+// Handles one request of a connection. Fails if the connection has to be
+// closed.
+static int dldiServeOne(DLDI_SERVER *server, int conn)
+{
+	u64 start = dldiStatsNow();
+	DLDI_SERVE_CALL *call = (DLDI_SERVE_CALL *)calloc(1, sizeof(DLDI_SERVE_CALL));
+	if (call == NULL)
+		return -ENOMEM;
+
+	int rc = dldiServeRead(conn, call);
+	if (rc != 0 && rc != -E2BIG)
+		goto serve_end;
+
+	call->response.size = sizeof(DLDI_SERVE_RESPONSE);
+	u32 op = call->request.op;
+	if (op >= DLDI_SERVE_OP_COUNT || call->request.reserved != 0)
+		op = 0;
+
+	if (rc == 0)
+	{
+		switch (op)
+		{
+			case DLDI_SERVE_OP_PATCH:
+				rc = dldiServePatch(server, call);
+				break;
+			case DLDI_SERVE_OP_INFO:
+				rc = dldiServeInfo(server, call);
+				break;
+			case DLDI_SERVE_OP_EXTRACT:
+				rc = dldiServeExtract(server, call);
+				break;
+			case DLDI_SERVE_OP_STATS:
+				rc = dldiServeStats(server, call);
+				break;
+			default:
+				rc = -EINVAL;
+				break;
+		}
+	}
+
+	for (int i = 0; i < call->fd_count; i++)
+		close(call->fds[i]);
+	call->fd_count = 0;
+
+	// Only successful requests carry a payload.
+	if (rc != 0)
+	{
+		call->response.size = sizeof(DLDI_SERVE_RESPONSE);
+		call->response.count = 0;
+		dldiServerCount(&server->stats.errors);
+	}
+	call->response.result = rc;
+	dldiServerCount(&server->stats.requests[op]);
+
+	rc = dldiServeWrite(conn, call);
+
+	u64 us = (dldiStatsNow() - start) / 1000;
+	int bucket = us < 2 ? 0 : 63 - __builtin_clzll(us);
+	if (bucket >= DLDI_SERVE_BUCKETS)
+		bucket = DLDI_SERVE_BUCKETS - 1;
+	dldiServerCount(&server->stats.latency_us[bucket]);
+
+serve_end:
+	for (int i = 0; i < call->fd_count; i++)
+		close(call->fds[i]);
+	free(call->reply);
+	free(call);
+	return rc;
+}
+
+static void *dldiServeWorker(void *arg)
+{
+	DLDI_SERVER *server = (DLDI_SERVER *)arg;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&server->lock);
+		while (server->ready_count == 0 && !server->closing)
+			pthread_cond_wait(&server->ready_cond, &server->lock);
+		if (server->ready_count == 0)
+		{
+			pthread_mutex_unlock(&server->lock);
+			break;
+		}
+		int conn = server->ready[server->ready_head];
+		server->ready_head = (server->ready_head + 1) % server->ready_capacity;
+		server->ready_count--;
+		pthread_cond_signal(&server->space_cond);
+		pthread_mutex_unlock(&server->lock);
+
+		if (dldiServeOne(server, conn) != 0)
+		{
+			close(conn);
+			continue;
+		}
+
+		// The connection goes back to the poller for its next request.
+		bool kept = false;
+		pthread_mutex_lock(&server->lock);
+		if (server->done_count == server->done_capacity)
+		{
+			int capacity = server->done_capacity ? server->done_capacity * 2 : 16;
+			int *done = (int *)realloc(server->done, capacity * sizeof(int));
+			if (done != NULL)
+			{
+				server->done = done;
+				server->done_capacity = capacity;
+			}
+		}
+		if (server->done_count < server->done_capacity)
+		{
+			server->done[server->done_count++] = conn;
+			kept = true;
+		}
+		pthread_mutex_unlock(&server->lock);
+
+		if (kept)
+			dldiServerWake(server);
+		else
+			close(conn);
+	}
+
+	return NULL;
+}
+
+// Hands a connection with a request to the workers, waiting for room in the
+// queue. Connections beyond that wait in the poller.
+static void dldiServerQueue(DLDI_SERVER *server, int conn)
+{
+	pthread_mutex_lock(&server->lock);
+	while (server->ready_count == server->ready_capacity)
+		pthread_cond_wait(&server->space_cond, &server->lock);
+	server->ready[(server->ready_head + server->ready_count) % server->ready_capacity] = conn;
+	server->ready_count++;
+	pthread_cond_signal(&server->ready_cond);
+	pthread_mutex_unlock(&server->lock);
+}
+
+int dldiServerRun(DLDI_SERVER *server)
+{
+	pthread_t *workers = (pthread_t *)calloc(server->threads, sizeof(pthread_t));
+	int started = 0;
+	int rc = 0;
+
+	if (workers == NULL)
+		return -ENOMEM;
+	for (started = 0; started < server->threads; started++)
+	{
+		if (pthread_create(&workers[started], NULL, dldiServeWorker, server) != 0)
+			break;
+	}
+	if (started == 0)
+		rc = -EAGAIN;
+
+	// Idle connections are polled here, and only go to a worker once their
+	// next request has arrived, so a worker is never tied to a quiet client.
+	int *conns = NULL;
+	int conn_count = 0;
+	int conn_capacity = 0;
+	struct pollfd *fds = NULL;
+
+	while (rc == 0 && !__atomic_load_n(&server->stopping, __ATOMIC_ACQUIRE))
+	{
+		struct pollfd *new_fds = (struct pollfd *)realloc(fds, (conn_count + 2) * sizeof(struct pollfd));
+		if (new_fds == NULL)
+		{
+			rc = -ENOMEM;
+			break;
+		}
+		fds = new_fds;
+		fds[0] = (struct pollfd){ .fd = server->wake[0], .events = POLLIN };
+		fds[1] = (struct pollfd){ .fd = server->listen_fd, .events = POLLIN };
+		for (int i = 0; i < conn_count; i++)
+			fds[i + 2] = (struct pollfd){ .fd = conns[i], .events = POLLIN };
+
+		if (poll(fds, conn_count + 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			rc = -errno;
+			break;
+		}
+
+		// Connections that have something to read, or were closed, are
+		// handed over. The worker finds out which it is.
+		int kept = 0;
+		for (int i = 0; i < conn_count; i++)
+		{
+			if (fds[i + 2].revents != 0)
+				dldiServerQueue(server, conns[i]);
+			else
+				conns[kept++] = conns[i];
+		}
+		conn_count = kept;
+
+		if (fds[0].revents & POLLIN)
+		{
+			char drain[64];
+			while (read(server->wake[0], drain, sizeof(drain)) > 0)
+				;
+		}
+
+		pthread_mutex_lock(&server->lock);
+		int returned = server->done_count;
+		pthread_mutex_unlock(&server->lock);
+
+		bool accept_conn = fds[1].revents & POLLIN;
+		int needed = conn_count + returned + (accept_conn ? 1 : 0);
+		if (needed > conn_capacity)
+		{
+			int capacity = conn_capacity ? conn_capacity : 16;
+			while (capacity < needed)
+				capacity *= 2;
+			int *new_conns = (int *)realloc(conns, capacity * sizeof(int));
+			if (new_conns == NULL)
+			{
+				rc = -ENOMEM;
+				break;
+			}
+			conns = new_conns;
+			conn_capacity = capacity;
+		}
+
+		pthread_mutex_lock(&server->lock);
+		for (int i = 0; i < server->done_count && i < returned; i++)
+			conns[conn_count++] = server->done[i];
+		memmove(server->done, server->done + returned, (server->done_count - returned) * sizeof(int));
+		server->done_count -= returned;
+		pthread_mutex_unlock(&server->lock);
+
+		if (accept_conn)
+		{
+			int conn = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (conn >= 0)
+			{
+				struct timeval timeout = { .tv_sec = DLDI_SERVE_TIMEOUT };
+				setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+				setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+				conns[conn_count++] = conn;
+				dldiServerCount(&server->stats.connections);
+			}
+		}
+	}
+
+	// Requests already queued are still answered.
+	pthread_mutex_lock(&server->lock);
+	server->closing = true;
+	pthread_cond_broadcast(&server->ready_cond);
+	pthread_mutex_unlock(&server->lock);
+	for (int i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	for (int i = 0; i < conn_count; i++)
+		close(conns[i]);
+	for (int i = 0; i < server->done_count; i++)
+		close(server->done[i]);
+	server->done_count = 0;
+	free(conns);
+	free(fds);
+
+	return rc;
+}
@@ -0,0 +1,152 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_SERVE_H__
+#define DLDIPATCH_DLDI_SERVE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dldi_catalog.h"
+#include "dldi_index.h"
+
+// The protocol is a sequence of requests, each answered by one response, on
+// a Unix stream socket. Messages are a header followed by a payload, in host
+// byte order since both ends are on the same machine. Files are not sent
+// through the socket: the client passes open descriptors alongside the
+// request header with SCM_RIGHTS, and the server reads and writes them
+// directly.
+//
+// A connection may send any number of requests, one at a time. The server
+// handles requests from different connections in parallel.
+
+/// Largest request the server accepts, header included.
+#define DLDI_SERVE_MAX_REQUEST  4096
+
+/// Largest number of descriptors passed with a request.
+#define DLDI_SERVE_MAX_FDS      3
+
+/// Number of buckets of the latency histogram.
+#define DLDI_SERVE_BUCKETS      32
+
+/// Operations of the protocol.
+typedef enum DLDI_SERVE_OP
+{
+    /// Patch a file. The descriptors are the file to patch, opened for
+    /// reading and writing, which is patched in place. If a second descriptor
+    /// is given, the file is read from the first one and the patched file is
+    /// written to the second one instead, and neither has to be seekable.
+    ///
+    /// The driver is the one of the server's catalog whose ID or name is the
+    /// payload. With DLDI_SERVE_DRIVER_FD, the payload is empty and the driver
+    /// is read from an extra descriptor passed before the others.
+    ///
+    /// Stubs that already hold the driver aren't written. The count of the
+    /// response is the number of stubs that differed from the driver, so 0
+    /// if the file was already patched with it, and always 0 when streaming.
+    /// With DLDI_SERVE_CHECK, nothing is written and the file may be
+    /// read-only.
+    DLDI_SERVE_OP_PATCH = 1,
+
+    /// Describe the drivers in a file. The descriptor is the file. The payload
+    /// of the response has count DLDI_SERVE_STUB records.
+    DLDI_SERVE_OP_INFO = 2,
+
+    /// Extract the first driver of a file. The descriptors are the file and
+    /// the output the driver is written to. The count of the response is the
+    /// number of bytes written.
+    DLDI_SERVE_OP_EXTRACT = 3,
+
+    /// Get the counters of the server. No descriptors are passed. The payload
+    /// of the response is a DLDI_SERVE_STATS.
+    DLDI_SERVE_OP_STATS = 4,
+
+    DLDI_SERVE_OP_COUNT
+} DLDI_SERVE_OP;
+
+/// Read the driver of a patch request from a descriptor.
+#define DLDI_SERVE_DRIVER_FD    0x01
+
+/// Flush the data written by a request to storage before answering.
+#define DLDI_SERVE_SYNC         0x02
+
+/// Only check whether the file of a patch request already has the driver.
+#define DLDI_SERVE_CHECK        0x04
+
+/// Header of a request.
+typedef struct DLDI_SERVE_REQUEST
+{
+    u32 size; ///< Size of the request, header included.
+    u32 op; ///< One of DLDI_SERVE_OP.
+    u32 flags; ///< DLDI_SERVE_DRIVER_FD, DLDI_SERVE_SYNC and DLDI_SERVE_CHECK.
+    u32 reserved; ///< Must be 0.
+} DLDI_SERVE_REQUEST;
+
+/// Header of a response.
+typedef struct DLDI_SERVE_RESPONSE
+{
+    u32 size; ///< Size of the response, header included.
+    s32 result; ///< 0 on success, or a negative errno value.
+    u32 count; ///< Depends on the operation.
+    u32 reserved;
+} DLDI_SERVE_RESPONSE;
+
+/// A driver found by DLDI_SERVE_OP_INFO.
+typedef struct DLDI_SERVE_STUB
+{
+    u64 offset; ///< File offset of the header.
+    DLDI_INTERFACE header; ///< Copy of the header.
+} DLDI_SERVE_STUB;
+
+/// Counters of a server, since it was created.
+typedef struct DLDI_SERVE_STATS
+{
+    u64 requests[DLDI_SERVE_OP_COUNT]; ///< Requests by operation. 0 counts invalid ones.
+    u64 errors; ///< Requests that failed.
+    u64 connections; ///< Connections accepted.
+    /// Latency of requests, from reading the request to sending the response.
+    /// Bucket i counts the requests that took from 2^i to 2^(i+1)
+    /// microseconds. The first bucket also counts faster ones, and the last
+    /// one slower ones.
+    u64 latency_us[DLDI_SERVE_BUCKETS];
+} DLDI_SERVE_STATS;
+
+/// A server listening on a Unix socket.
+typedef struct DLDI_SERVER DLDI_SERVER;
+
+/// Create a server and start listening.
+///
+/// Writing to a pipe whose reader has gone away raises SIGPIPE, so programs
+/// that serve clients passing pipes should ignore it.
+///
+/// @param socket_path Path of the socket. An existing socket is replaced.
+/// @param catalog Drivers that patch requests can name, or NULL. It must
+///     outlive the server.
+/// @param index Stub index used for the files of requests, or NULL.
+/// @param threads Number of requests handled at once.
+/// @param server Receives the server on success.
+/// @return 0 on success, or a negative errno value.
+int dldiServerCreate(const char *socket_path, const DLDI_CATALOG *catalog,
+                     DLDI_INDEX *index, int threads, DLDI_SERVER **server);
+
+/// Handle requests until dldiServerStop() is called.
+///
+/// @return 0 once stopped, or a negative errno value.
+int dldiServerRun(DLDI_SERVER *server);
+
+/// Make dldiServerRun() return. Requests being handled are finished first.
+///
+/// This is async-signal-safe, so it may be called from a signal handler.
+void dldiServerStop(DLDI_SERVER *server);
+
+/// Get the counters of a server.
+void dldiServerStats(DLDI_SERVER *server, DLDI_SERVE_STATS *stats);
+
+/// Close a server and remove its socket.
+void dldiServerFree(DLDI_SERVER *server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_SERVE_H__
@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: Zlib
+
+#include <stddef.h>
+#include <time.h>
+
+#include "dldi_stats.h"
+
+u64 dldiStatsNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+u64 dldiStatsPhase(DLDI_STATS *stats, DLDI_PHASE phase, u64 start)
+{
+	u64 now = dldiStatsNow();
+
+	if (stats != NULL)
+		stats->phase_ns[phase] += now - start;
+
+	return now;
+}
+
+void dldiStatsAdd(DLDI_STATS *total, const DLDI_STATS *stats)
+{
+	for (int i = 0; i < DLDI_PHASE_COUNT; i++)
+		total->phase_ns[i] += stats->phase_ns[i];
+
+	total->bytes_read += stats->bytes_read;
+	total->bytes_written += stats->bytes_written;
+	total->read_calls += stats->read_calls;
+	total->write_calls += stats->write_calls;
+	total->seek_calls += stats->seek_calls;
+	total->map_calls += stats->map_calls;
+	total->bytes_scanned += stats->bytes_scanned;
+	total->bytes_to_stub += stats->bytes_to_stub;
+}
+
+const char *dldiPhaseName(DLDI_PHASE phase)
+{
+	static const char *const names[DLDI_PHASE_COUNT] = {
+		"load", "scan", "validate", "relocate", "write", "fsync"
+	};
+
+	return phase < DLDI_PHASE_COUNT ? names[phase] : "unknown";
+}
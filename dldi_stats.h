@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_STATS_H__
+#define DLDIPATCH_DLDI_STATS_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "types.h"
+
+/// Phases of loading and patching a file that are timed separately.
+typedef enum DLDI_PHASE
+{
+    DLDI_PHASE_LOAD,     ///< Opening files and reading drivers.
+    DLDI_PHASE_SCAN,     ///< Searching for DLDI headers.
+    DLDI_PHASE_VALIDATE, ///< Checking headers found through an index or before patching.
+    DLDI_PHASE_RELOCATE, ///< Relocating the new driver.
+    DLDI_PHASE_WRITE,    ///< Writing the new driver.
+    DLDI_PHASE_FSYNC,    ///< Flushing the written file to storage.
+    DLDI_PHASE_COUNT
+} DLDI_PHASE;
+
+/// Counters for the work done on one file or a batch of files.
+///
+/// Functions that take a DLDI_STATS add to it and never reset it, so one
+/// struct can collect a whole batch. A struct must not be updated by several
+/// threads at once; give each thread its own and merge them with
+/// dldiStatsAdd().
+typedef struct DLDI_STATS
+{
+    u64 phase_ns[DLDI_PHASE_COUNT]; ///< Wall time spent in each phase.
+    u64 bytes_read;     ///< Bytes read from files, including mapped bytes that were scanned.
+    u64 bytes_written;  ///< Bytes written to files.
+    u64 read_calls;     ///< Number of read() and pread() calls.
+    u64 write_calls;    ///< Number of write() and pwrite() calls.
+    u64 seek_calls;     ///< Number of lseek() calls.
+    u64 map_calls;      ///< Number of files mapped to be scanned.
+    u64 bytes_scanned;  ///< Bytes searched for DLDI headers.
+    u64 bytes_to_stub;  ///< Bytes searched before the first header was found.
+} DLDI_STATS;
+
+/// Current time of a monotonic clock, in nanoseconds.
+u64 dldiStatsNow(void);
+
+/// Add the time since start to a phase, and return the current time.
+///
+/// @param stats The counters to update, or NULL to only read the clock.
+/// @param phase The phase that just ended.
+/// @param start Time the phase started, from dldiStatsNow().
+/// @return The current time, so that the next phase can start from it.
+u64 dldiStatsPhase(DLDI_STATS *stats, DLDI_PHASE phase, u64 start);
+
+/// Add every counter of one struct to another.
+void dldiStatsAdd(DLDI_STATS *total, const DLDI_STATS *stats);
+
+/// Short lowercase name of a phase, such as "scan".
+const char *dldiPhaseName(DLDI_PHASE phase);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_STATS_H__
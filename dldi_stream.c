@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: Zlib
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "dldi_image.h"
+#include "dldi_nds.h"
+#include "dldi_scan.h"
+#include "dldi_stream.h"
+
+// Reads until the buffer is full or the end of the input is reached.
+static ssize_t dldiReadFull(int fd, u8 *buffer, size_t size, DLDI_STATS *stats)
+{
+	size_t done = 0;
+
+	while (done < size)
+	{
+		ssize_t rc = read(fd, buffer + done, size - done);
+		if (stats != NULL)
+			stats->read_calls++;
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (rc == 0)
+			break;
+		done += rc;
+	}
+
+	if (stats != NULL)
+		stats->bytes_read += done;
+	return done;
+}
+
+static int dldiWriteFull(int fd, const u8 *buffer, size_t size, DLDI_STATS *stats)
+{
+	while (size > 0)
+	{
+		ssize_t rc = write(fd, buffer, size);
+		if (stats != NULL)
+			stats->write_calls++;
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buffer += rc;
+		size -= rc;
+		if (stats != NULL)
+			stats->bytes_written += rc;
+	}
+
+	return 0;
+}
+
+// The first region that ends after a stream offset, or NULL.
+static const DLDI_REGION *dldiStreamRegion(const DLDI_REGION *regions, int count, u64 offset)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (regions[i].offset + regions[i].size > offset)
+			return &regions[i];
+	}
+
+	return NULL;
+}
+
+int dldiPatchStream(const DLDI_RELOC_PLAN *plan, int in_fd, int out_fd, DLDI_STATS *stats)
+{
+	const DLDI_INTERFACE *src_dldi = dldiRelocPlanDriver(plan);
+
+	// A header that starts near the end of a chunk is carried over to the next
+	// one, so the buffer has room for a chunk plus a partial header.
+	u8 *buffer = (u8 *)malloc(DLDI_STREAM_CHUNK_SIZE + DLDI_HEADER_SIZE);
+	DLDI_INTERFACE *new_dldi = (DLDI_INTERFACE *)dldiBufferGet();
+	if (buffer == NULL || new_dldi == NULL)
+	{
+		free(buffer);
+		dldiBufferPut(new_dldi);
+		return -ENOMEM;
+	}
+
+	// All positions are stream offsets. base is the offset of buffer[0].
+	int rc = 0;
+	bool found = false;
+	size_t len = 0;
+	u64 base = 0;
+	u64 scan_from = 0;
+	u64 replace_start = 0;
+	u64 replace_end = 0;
+
+	// Only the executable binaries of an NDS ROM are searched, like in a
+	// file. The header is in the first chunk. Without a valid header, the
+	// whole stream is searched.
+	DLDI_REGION regions[DLDI_NDS_MAX_REGIONS];
+	int region_count = 0;
+	bool first_chunk = true;
+
+	u64 start = dldiStatsNow();
+
+	for (;;)
+	{
+		ssize_t got = dldiReadFull(in_fd, buffer + len, DLDI_STREAM_CHUNK_SIZE, stats);
+		start = dldiStatsPhase(stats, DLDI_PHASE_LOAD, start);
+		if (got < 0)
+		{
+			rc = got;
+			break;
+		}
+		len += got;
+		bool eof = got < DLDI_STREAM_CHUNK_SIZE;
+
+		if (first_chunk)
+		{
+			// The size of the stream isn't known, so regions aren't clipped.
+			region_count = dldiNdsRegions(buffer, len, UINT64_MAX, regions);
+			first_chunk = false;
+		}
+
+		// Only the part of the buffer where a whole header can be seen is
+		// searched and written, unless there is no more input. The rest is
+		// kept for the next chunk.
+		size_t emit = len;
+		if (!eof)
+			emit = len > DLDI_HEADER_SIZE ? (len - DLDI_HEADER_SIZE) & ~3 : 0;
+
+		for (;;)
+		{
+			// Overwrite the part of the current stub that is in the buffer.
+			if (replace_end > base && replace_start < base + len)
+			{
+				u64 from = replace_start > base ? replace_start : base;
+				u64 to = replace_end < base + len ? replace_end : base + len;
+				memcpy(buffer + (from - base), (u8 *)new_dldi + (from - replace_start), to - from);
+			}
+
+			if (scan_from >= base + emit)
+				break;
+
+			// Headers are 4-byte aligned relative to the start of their
+			// region, and must end inside it.
+			u64 search_end = base + len;
+			u64 shift = 0;
+			if (region_count > 0)
+			{
+				const DLDI_REGION *region = dldiStreamRegion(regions, region_count, scan_from);
+				if (region == NULL)
+				{
+					// Past the last binary, the rest is only copied.
+					scan_from = UINT64_MAX;
+					break;
+				}
+				if (scan_from < region->offset)
+					scan_from = region->offset;
+				scan_from = region->offset + ((scan_from - region->offset + 3) & ~(u64)3);
+				if (scan_from >= base + emit)
+					break;
+				if (region->offset + region->size < search_end)
+					search_end = region->offset + region->size;
+				shift = region->offset & 3;
+			}
+
+			// Aligning may have moved past the end of the region.
+			if (scan_from >= search_end)
+				continue;
+
+			ssize_t offset = dldiFindInBuffer(buffer + shift, search_end - base - shift, scan_from - base - shift);
+			if (offset >= 0)
+				offset += shift;
+			u64 scan_end = search_end < base + emit ? search_end : base + emit;
+			u64 scanned_to = offset < 0 || (size_t)offset >= emit ? scan_end : base + offset;
+			if (stats != NULL)
+			{
+				stats->bytes_scanned += scanned_to - scan_from;
+				if (!found)
+					stats->bytes_to_stub += scanned_to - scan_from;
+			}
+			start = dldiStatsPhase(stats, DLDI_PHASE_SCAN, start);
+			if (scanned_to == scan_end)
+			{
+				// Nothing up to the end of the region, or before the
+				// carried-over tail, which is searched again with the next
+				// chunk.
+				scan_from = scanned_to;
+				continue;
+			}
+
+			const DLDI_INTERFACE *dst_dldi = (const DLDI_INTERFACE *)(buffer + offset);
+			if (src_dldi->driverSize > dst_dldi->allocatedSize)
+			{
+				rc = -ENOSPC;
+				break;
+			}
+
+			dldiRelocPlanApply(plan, new_dldi, dst_dldi->dldiStart);
+			// restore the original allocated driver size.
+			new_dldi->allocatedSize = dst_dldi->allocatedSize;
+			start = dldiStatsPhase(stats, DLDI_PHASE_RELOCATE, start);
+
+			found = true;
+			replace_start = base + offset;
+			replace_end = replace_start + (1 << new_dldi->driverSize);
+			scan_from = replace_start + dldiStubSpan(dst_dldi);
+		}
+		if (rc != 0)
+			break;
+
+		rc = dldiWriteFull(out_fd, buffer, emit, stats);
+		start = dldiStatsPhase(stats, DLDI_PHASE_WRITE, start);
+		if (rc != 0)
+			break;
+
+		memmove(buffer, buffer + emit, len - emit);
+		len -= emit;
+		base += emit;
+
+		if (eof)
+			break;
+	}
+
+	if (rc == 0 && !found)
+		rc = -ENODATA;
+
+	dldiBufferPut(new_dldi);
+	free(buffer);
+	return rc;
+}
@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_STREAM_H__
+#define DLDIPATCH_DLDI_STREAM_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "dldi_reloc.h"
+#include "dldi_stats.h"
+
+/// Size of the chunks a stream is read in.
+#define DLDI_STREAM_CHUNK_SIZE  (1 << 20)
+
+/// Patch a file as it is copied from one descriptor to another.
+///
+/// The input is read in DLDI_STREAM_CHUNK_SIZE chunks, so memory use doesn't
+/// depend on the size of the file and neither descriptor has to be seekable.
+/// Every valid DLDI stub is replaced by the driver of the plan, relocated to
+/// the address of that stub. Every other byte is copied unchanged.
+///
+/// As with files, only the executable binaries of an NDS ROM are searched,
+/// which are found from the header at the start of the first chunk. Streams
+/// without a valid NDS header are searched entirely.
+///
+/// @param plan The plan of the driver to insert.
+/// @param in_fd Descriptor the original file is read from.
+/// @param out_fd Descriptor the patched file is written to.
+/// @param stats Counters to add the work done to, or NULL.
+/// @return 0 on success, -ENODATA if the input has no DLDI stub, -ENOSPC if
+///     the driver doesn't fit in the stub, or another negative errno value.
+int dldiPatchStream(const DLDI_RELOC_PLAN *plan, int in_fd, int out_fd, DLDI_STATS *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_STREAM_H__
@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: Zlib
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "dldi_workers.h"
+
+void dldiRunWorkers(void *(*fn)(void *), void *arg, int threads)
+{
+	pthread_t *workers = threads > 1 ? (pthread_t *)calloc(threads - 1, sizeof(pthread_t)) : NULL;
+	int started = 0;
+	if (workers != NULL)
+	{
+		for (started = 0; started < threads - 1; started++)
+		{
+			if (pthread_create(&workers[started], NULL, fn, arg) != 0)
+				break;
+		}
+	}
+	fn(arg);
+	for (int i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+}
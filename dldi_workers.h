@@ -0,0 +1,26 @@
+// SPDX-License-Identifier: Zlib
+
+#ifndef DLDIPATCH_DLDI_WORKERS_H__
+#define DLDIPATCH_DLDI_WORKERS_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Run a function on several threads and wait for all of them.
+///
+/// The calling thread is always the first worker, so fn runs at least once
+/// even if no thread can be started. Workers are expected to share the work
+/// through arg, for example by taking items from an atomic index until none
+/// are left.
+///
+/// @param fn Function every worker runs. Its return value is ignored.
+/// @param arg Argument passed to every worker.
+/// @param threads Number of workers, including the calling thread.
+void dldiRunWorkers(void *(*fn)(void *), void *arg, int threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // DLDIPATCH_DLDI_WORKERS_H__
@@ -11,151 +11,147 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include "dldi.h"
-
-const u32 DLDI_MAGIC_NUMBER = 0xBF8DA5ED;
-
-void dldiRelocate(DLDI_INTERFACE *io, uint32_t targetAddress)
-{
-    u32 offset;
-    u32 oldStart;
-    u32 oldEnd;
-
-    offset = targetAddress - io->dldiStart;
-
-	printf("Relocation offset = 0x%08X\n", offset);
-
-    oldStart = io->dldiStart;
-    oldEnd = io->dldiEnd;
-
-    // Correct all pointers to the offsets from the location of this interface
-    io->dldiStart = io->dldiStart + offset;
-    io->dldiEnd = io->dldiEnd + offset;
-    io->interworkStart = io->interworkStart + offset;
-    io->interworkEnd = io->interworkEnd + offset;
-    io->gotStart = io->gotStart + offset;
-    io->gotEnd = io->gotEnd + offset;
-    io->bssStart = io->bssStart + offset;
-    io->bssEnd = io->bssEnd + offset;
-
-    io->ioInterface.startup =
-        io->ioInterface.startup + offset;
-    io->ioInterface.isInserted =
-        io->ioInterface.isInserted + offset;
-    io->ioInterface.readSectors =
-        io->ioInterface.readSectors + offset;
-    io->ioInterface.writeSectors =
-        io->ioInterface.writeSectors + offset;
-    io->ioInterface.clearStatus =
-        io->ioInterface.clearStatus + offset;
-    io->ioInterface.shutdown =
-        io->ioInterface.shutdown + offset;
-
-	u8 *u8_io = (u8*)io;
-
-    // Fix all addresses with in the DLDI
-    if (io->fixSectionsFlags & FIX_ALL)
-    {
-        for (u32 i = 0; i < (io->dldiEnd - io->dldiStart); i++)
-        {
-            if (oldStart <= *(u8_io + i) && *(u8_io + i) < oldEnd)
-                *(u8_io + i) += offset;
-        }
-    }
-
-    // Fix the interworking glue section
-    if (io->fixSectionsFlags & FIX_GLUE)
-    {
-        for (u32 i = io->interworkStart - io->dldiStart; i < (io->interworkEnd - io->interworkStart); i++)
-        {
-            if (oldStart <= *(u8_io + i) && *(u8_io + i) < oldEnd)
-                *(u8_io + i) += offset;
-        }
-    }
-
-    // Fix the global offset table section
-    if (io->fixSectionsFlags & FIX_GOT)
-    {
-        for (u32 i = io->gotStart - io->dldiStart; i < (io->gotEnd - io->gotStart); i++)
-        {
-            if (oldStart <= *(u8_io + i) && *(u8_io + i) < oldEnd)
-                *(u8_io + i) += offset;
-        }
-    }
-
-    // Initialise the BSS to 0
-    if (io->fixSectionsFlags & FIX_BSS)
-        memset((u8_io + (io->bssStart - io->dldiStart)), 0, io->bssEnd - io->bssStart);
-}
-
-DLDI_INTERFACE *dldiLoadFromFile(const char* src_path)
-{
-	DLDI_INTERFACE* src_dldi = NULL;
-	u8 *src_binary = NULL;
-
-	FILE *src_file = fopen(src_path, "rb");
-	if (src_file == NULL)
-	{
-		printf("Input file does not exist.\n");
-		return NULL;
+#include "libdldipatch.h"
+#include "bundle/dldi_builtin.h"
+
+// Number of relocated drivers kept around while patching a batch of targets.
+#define DLDI_RELOC_CACHE_SIZE   16
+
+// Stub index given with --index, shared by every image that is opened.
+static DLDI_INDEX* stub_index = NULL;
+
+// How patched files are flushed to storage, from --fsync.
+static int sync_mode = DLDI_SYNC_NONE;
+
+// DLDI_PATCH_CHECK with --check, which only reports which files would change.
+static int patch_flags = 0;
+
+// Exit code of --check when some files don't have the driver yet.
+#define DLDI_EXIT_STALE     1
+
+// Engine of --batch, which patches and reads many files at once, or -1 to
+// handle files one at a time.
+static int batch_engine = -1;
+
+// Threads each file is searched with, unless the threads are shared between
+// several files.
+static int scan_threads = 1;
+
+// Files in flight with --batch uring.
+#define DLDI_BATCH_DEPTH    64
+
+// Undo journal of --journal, shared by every target, or NULL.
+static DLDI_JOURNAL* journal = NULL;
+
+// With --stats, every file gets a JSON line on stderr, and the counters of
+// every file are added to run_stats for the final line. With --check, the
+// final line also has the number of files that aren't patched yet.
+static bool print_stats = false;
+static DLDI_STATS run_stats;
+static int run_files = 0;
+static int run_stale = 0;
+static u64 run_start = 0;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dldiPrintJsonString(FILE* file, const char* str)
+{
+	fputc('"', file);
+	for (; *str != '\0'; str++)
+	{
+		unsigned char c = *str;
+		if (c == '"' || c == '\\')
+			fprintf(file, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
 	}
-	fseek(src_file, 0, SEEK_END);
-	int size = ftell(src_file);
-	src_binary = (u8*)malloc(size);
-	fseek(src_file, 0, SEEK_SET);
-	fread(src_binary, 1, size, src_file);
-	fclose(src_file);
-
-	// Scan the file in 32-bit increments.
-	// The DLDI *must* be 4-byte aligned, or it isn't actually usable.
-	for (int i = 0; i < size; i += 4)
-	{
-		if (((u32*)src_binary)[i>>2] == DLDI_MAGIC_NUMBER)
-		{
-			u8 *src_binary_dldi_area = src_binary + i;
-			int dldi_size = (1 << src_binary_dldi_area[0xD]);
-
-			// If this is a raw DLDI binary, then the file itself may be smaller
-			// than the reported DLDI size.
-			if (dldi_size > size)
-				dldi_size = size;
-			// However, if we are looking inside a homebrew app, then we may
-			// accidentally go out of bounds of the file.
-			else if ((src_binary_dldi_area + dldi_size) > (src_binary + size))
-				dldi_size = (src_binary + size) - (src_binary_dldi_area);
-
-			// We do want to allocate the whole area here, though.
-			src_dldi = (DLDI_INTERFACE *)malloc(1 << src_binary_dldi_area[0xD]);
-			memset(src_dldi, 0, (1 << src_binary_dldi_area[0xD]));
-
-			// Finally, copy it to our pointer.
-			memcpy(src_dldi, src_binary_dldi_area, dldi_size);
-			break;
-		}
+	fputc('"', file);
+}
+
+// Prints the counters of one file, or of the whole run if path is NULL. The
+// wall time of the run is less than the sum of its phases when files are
+// patched in parallel.
+static void dldiPrintStats(const char* path, int rc, const DLDI_STATS* stats)
+{
+	FILE* file = stderr;
+
+	fprintf(file, "{\"file\":");
+	if (path != NULL)
+	{
+		dldiPrintJsonString(file, path);
+	}
+	else
+	{
+		fprintf(file, "null,\"files\":%d,\"wall_ns\":%llu", run_files, (unsigned long long)(dldiStatsNow() - run_start));
+		if (patch_flags & DLDI_PATCH_CHECK)
+			fprintf(file, ",\"stale\":%d", run_stale);
 	}
+	fprintf(file, ",\"result\":");
+	dldiPrintJsonString(file, rc == 0 ? "ok" : strerror(-rc));
 
-	if (src_dldi == NULL)
+	u64 total_ns = 0;
+	for (int i = 0; i < DLDI_PHASE_COUNT; i++)
 	{
-		printf("Input file does not have a DLDI section.\n");
-		if (src_binary != NULL)
-			free(src_binary);
-		return NULL;
+		fprintf(file, ",\"%s_ns\":%llu", dldiPhaseName(i), (unsigned long long)stats->phase_ns[i]);
+		total_ns += stats->phase_ns[i];
 	}
+	fprintf(file,
+		",\"total_ns\":%llu,\"bytes_read\":%llu,\"bytes_written\":%llu"
+		",\"read_calls\":%llu,\"write_calls\":%llu,\"seek_calls\":%llu,\"map_calls\":%llu"
+		",\"bytes_scanned\":%llu,\"bytes_to_stub\":%llu}\n",
+		(unsigned long long)total_ns,
+		(unsigned long long)stats->bytes_read,
+		(unsigned long long)stats->bytes_written,
+		(unsigned long long)stats->read_calls,
+		(unsigned long long)stats->write_calls,
+		(unsigned long long)stats->seek_calls,
+		(unsigned long long)stats->map_calls,
+		(unsigned long long)stats->bytes_scanned,
+		(unsigned long long)stats->bytes_to_stub
+	);
+}
+
+// Reports the counters of a file that is done with, if --stats was given.
+static void dldiFileStats(const char* path, int rc, const DLDI_STATS* stats)
+{
+	if (!print_stats)
+		return;
 
-	free(src_binary);
-	return src_dldi;
+	pthread_mutex_lock(&stats_lock);
+	dldiPrintStats(path, rc, stats);
+	dldiStatsAdd(&run_stats, stats);
+	run_files++;
+	pthread_mutex_unlock(&stats_lock);
 }
 
-int dldiPrint(const char* src_path)
+// Opens an image and prints why it failed, if it did. Unless flags has
+// DLDI_IMAGE_THREADS(), the file is searched with scan_threads.
+static int dldiOpen(const char* path, int flags, DLDI_STATS* stats, DLDI_IMAGE** image)
 {
-	DLDI_INTERFACE* src_dldi = dldiLoadFromFile(src_path);
+	if (flags >> 8 == 0)
+		flags |= DLDI_IMAGE_THREADS(scan_threads);
+	int rc = dldiImageOpenIndexed(path, flags, stub_index, stats, image);
 
-	if (src_dldi == NULL)
-	{
-		printf("Failed to load input DLDI.\n");
-		return -EINVAL;
-	}
+	if (rc == -ENOENT)
+		printf("%s: Input file does not exist.\n", path);
+	else if (rc == -ENODATA)
+		printf("%s: Input file does not have a DLDI section.\n", path);
+	else if (rc != 0)
+		printf("%s: Failed to load input DLDI: %s\n", path, strerror(-rc));
+
+	return rc;
+}
+
+void dldiPrintStub(const DLDI_STUB* stub)
+{
+	const DLDI_INTERFACE* src_dldi = &stub->header;
+	const DLDI_SECTION* section;
 
 	char dldi_ioType[5] = {};
 	memcpy(dldi_ioType, &(src_dldi->ioInterface.ioType), 4);
@@ -167,53 +163,25 @@ int dldiPrint(const char* src_path)
 		src_dldi->friendlyName
 	);
 
-	printf(
-		"data = 0x%04x(%d)-0x%04x(%d)\n", 
-		(u32)(src_dldi->dldiStart) - (u32)src_dldi->dldiStart,
-		(u32)(src_dldi->dldiStart) - (u32)src_dldi->dldiStart,
-		(u32)(src_dldi->dldiEnd) - (u32)src_dldi->dldiStart,
-		(u32)(src_dldi->dldiEnd) - (u32)src_dldi->dldiStart
-	);
-	if (src_dldi->fixSectionsFlags & FIX_GLUE)
-	{
-		printf("glue = 0x%04x(%d)-0x%04x(%d)\n",
-			(u32)(src_dldi->interworkStart) - (u32)src_dldi->dldiStart,
-			(u32)(src_dldi->interworkStart) - (u32)src_dldi->dldiStart,
-			(u32)(src_dldi->interworkEnd) - (u32)src_dldi->dldiStart,
-			(u32)(src_dldi->interworkEnd) - (u32)src_dldi->dldiStart
-		);
-	}
-	else
-	{
-		printf("glue = unset\n");
-	}
-	if (src_dldi->fixSectionsFlags & FIX_GOT)
-	{
-		printf(
-			"got  = 0x%04x(%d)-0x%04x(%d)\n",
-			(u32)(src_dldi->gotStart) - (u32)src_dldi->dldiStart,
-			(u32)(src_dldi->gotStart) - (u32)src_dldi->dldiStart,
-			(u32)(src_dldi->gotEnd) - (u32)src_dldi->dldiStart,
-			(u32)(src_dldi->gotEnd) - (u32)src_dldi->dldiStart
-		);
-	}
-	else
-	{
-		printf("got  = unset\n");
-	}
-	if (src_dldi->fixSectionsFlags & FIX_BSS)
-	{
-		printf(
-			"bss  = 0x%04x(%d)-0x%04x(%d)\n",
-			(u32)(src_dldi->bssStart) - (u32)src_dldi->dldiStart,
-			(u32)(src_dldi->bssStart) - (u32)src_dldi->dldiStart,
-			(u32)(src_dldi->bssEnd) - (u32)src_dldi->dldiStart,
-			(u32)(src_dldi->bssEnd) - (u32)src_dldi->dldiStart
-		);
-	}
-	else
+	static const char* const section_names[DLDI_SECTION_COUNT] = {
+		"data", "glue", "got ", "bss "
+	};
+	for (int i = 0; i < DLDI_SECTION_COUNT; i++)
 	{
-		printf("bss  = unset\n");
+		section = &stub->sections[i];
+		if (section->present)
+		{
+			printf(
+				"%s = 0x%04x(%d)-0x%04x(%d)\n",
+				section_names[i],
+				section->start, section->start,
+				section->end, section->end
+			);
+		}
+		else
+		{
+			printf("%s = unset\n", section_names[i]);
+		}
 	}
 	printf("\n");
 
@@ -247,152 +215,2039 @@ int dldiPrint(const char* src_path)
 		(u32)src_dldi->ioInterface.shutdown - (u32)src_dldi->dldiStart,
 		(u32)src_dldi->ioInterface.shutdown - (u32)src_dldi->dldiStart
 	);
+}
 
-	free(src_dldi);
-	return 0;
+void dldiPrint(const DLDI_IMAGE* image)
+{
+	int count = dldiImageStubCount(image);
+
+	if (count == 1)
+	{
+		dldiPrintStub(dldiImageStub(image, 0));
+		return;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		const DLDI_STUB* stub = dldiImageStub(image, i);
+		if (i != 0)
+			printf("\n");
+		printf("DLDI %d of %d at offset 0x%llx:\n\n", i + 1, count, (unsigned long long)stub->offset);
+		dldiPrintStub(stub);
+	}
 }
 
-int dldiExtract(const char* src_path, const char* dst_path)
+int dldiInfo(const char* src_path)
+{
+	DLDI_STATS stats = {};
+	DLDI_IMAGE* src_image;
+	int rc = dldiOpen(src_path, 0, &stats, &src_image);
+	if (rc == 0)
+	{
+		dldiPrint(src_image);
+		rc = dldiImageClose(src_image);
+	}
+
+	dldiFileStats(src_path, rc, &stats);
+	return rc;
+}
+
+// Output formats of "info -r".
+#define DLDI_FORMAT_JSON    0
+#define DLDI_FORMAT_CSV     1
+
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dldiPrintCsvString(FILE* file, const char* str)
+{
+	if (strpbrk(str, ",\"\r\n") == NULL)
+	{
+		fputs(str, file);
+		return;
+	}
+
+	fputc('"', file);
+	for (; *str != '\0'; str++)
+	{
+		if (*str == '"')
+			fputc('"', file);
+		fputc(*str, file);
+	}
+	fputc('"', file);
+}
+
+static void dldiPrintString(FILE* file, int format, const char* str)
+{
+	if (format == DLDI_FORMAT_CSV)
+		dldiPrintCsvString(file, str);
+	else
+		dldiPrintJsonString(file, str);
+}
+
+// Starts a field after the first one of a record.
+static void dldiPrintKey(FILE* file, int format, const char* key)
+{
+	if (format == DLDI_FORMAT_CSV)
+		fputc(',', file);
+	else
+		fprintf(file, ",\"%s\":", key);
+}
+
+// Prints one record of "info -r". stub is NULL for files that couldn't be
+// read, and error is NULL for files that could.
+static void dldiPrintRecord(FILE* file, int format, const char* path, int index,
+                            const DLDI_STUB* stub, const char* error)
+{
+	static const char* const section_keys[DLDI_SECTION_COUNT][2] = {
+		{ "data_start", "data_end" },
+		{ "glue_start", "glue_end" },
+		{ "got_start", "got_end" },
+		{ "bss_start", "bss_end" },
+	};
+
+	if (format == DLDI_FORMAT_JSON)
+		fprintf(file, "{\"path\":");
+	dldiPrintString(file, format, path);
+
+	if (stub == NULL)
+	{
+		if (format == DLDI_FORMAT_CSV)
+			fprintf(file, ",,,,,,,,,,,,,,,,,,");
+		else
+			fprintf(file, ",\"error\":");
+		dldiPrintString(file, format, error);
+		fprintf(file, format == DLDI_FORMAT_CSV ? "\n" : "}\n");
+		return;
+	}
+
+	const DLDI_INTERFACE* io = &stub->header;
+	char io_type[5] = {};
+	memcpy(io_type, &io->ioInterface.ioType, 4);
+	char name[DLDI_FRIENDLY_NAME_LEN + 1] = {};
+	memcpy(name, io->friendlyName, DLDI_FRIENDLY_NAME_LEN);
+
+	dldiPrintKey(file, format, "stub");
+	fprintf(file, "%d", index);
+	dldiPrintKey(file, format, "offset");
+	fprintf(file, "%llu", (unsigned long long)stub->offset);
+	dldiPrintKey(file, format, "io_type");
+	dldiPrintString(file, format, io_type);
+	dldiPrintKey(file, format, "name");
+	dldiPrintString(file, format, name);
+	dldiPrintKey(file, format, "version");
+	fprintf(file, "%u", io->versionNumber);
+	dldiPrintKey(file, format, "features");
+	fprintf(file, "%u", io->ioInterface.features);
+	dldiPrintKey(file, format, "fix");
+	fprintf(file, "%u", io->fixSectionsFlags);
+	dldiPrintKey(file, format, "driver_size");
+	fprintf(file, "%u", 1u << io->driverSize);
+	dldiPrintKey(file, format, "allocated_size");
+	fprintf(file, "%u", 1u << io->allocatedSize);
+
+	// Sections that aren't fixed are null in JSON and empty in CSV.
+	for (int i = 0; i < DLDI_SECTION_COUNT; i++)
+	{
+		const DLDI_SECTION* section = &stub->sections[i];
+		dldiPrintKey(file, format, section_keys[i][0]);
+		if (section->present)
+			fprintf(file, "%u", section->start);
+		else if (format == DLDI_FORMAT_JSON)
+			fprintf(file, "null");
+		dldiPrintKey(file, format, section_keys[i][1]);
+		if (section->present)
+			fprintf(file, "%u", section->end);
+		else if (format == DLDI_FORMAT_JSON)
+			fprintf(file, "null");
+	}
+	fprintf(file, format == DLDI_FORMAT_CSV ? ",\n" : "}\n");
+}
+
+// Prints the records of a file as soon as the crawler is done with it, one
+// per stub.
+static void dldiInfoRecord(void* arg, const char* path, const DLDI_IMAGE* image,
+                           int rc, const DLDI_STATS* stats)
+{
+	int format = *(const int *)arg;
+
+	pthread_mutex_lock(&record_lock);
+	if (image == NULL)
+	{
+		dldiPrintRecord(stdout, format, path, 0, NULL, rc == -ENODATA ? "no DLDI section" : strerror(-rc));
+	}
+	else
+	{
+		for (int i = 0; i < dldiImageStubCount(image); i++)
+			dldiPrintRecord(stdout, format, path, i, dldiImageStub(image, i), NULL);
+	}
+	pthread_mutex_unlock(&record_lock);
+
+	if (stats != NULL)
+		dldiFileStats(path, rc, stats);
+}
+
+// Paths found by a crawl, to be read as a batch.
+typedef struct DLDI_PATH_LIST
+{
+	char** paths;
+	int count;
+	int format;
+} DLDI_PATH_LIST;
+
+// Keeps the path of every file the crawler finds. Directories that can't be
+// read are reported right away.
+static void dldiInfoCollect(void* arg, const char* path, const DLDI_IMAGE* image,
+                            int rc, const DLDI_STATS* stats)
+{
+	DLDI_PATH_LIST* list = (DLDI_PATH_LIST *)arg;
+	(void)image;
+	(void)stats;
+
+	pthread_mutex_lock(&record_lock);
+	char** paths = rc == 0 ? (char **)realloc(list->paths, (list->count + 1) * sizeof(char *)) : NULL;
+	if (paths != NULL)
+		list->paths = paths;
+	char* copy = paths != NULL ? strdup(path) : NULL;
+	if (copy != NULL)
+		list->paths[list->count++] = copy;
+	else
+		dldiPrintRecord(stdout, list->format, path, 0, NULL, strerror(rc != 0 ? -rc : ENOMEM));
+	pthread_mutex_unlock(&record_lock);
+}
+
+static void dldiInfoBatchRecord(void* arg, int index, int rc, const DLDI_STUB* stubs,
+                                int stub_count, const bool* changed, const DLDI_STATS* stats)
 {
-	int rc = dldiPrint(src_path);
+	DLDI_PATH_LIST* list = (DLDI_PATH_LIST *)arg;
+	const char* path = list->paths[index];
+	(void)changed;
+
 	if (rc != 0)
-		return rc;
+		dldiPrintRecord(stdout, list->format, path, 0, NULL, rc == -ENODATA ? "no DLDI section" : strerror(-rc));
+	for (int i = 0; rc == 0 && i < stub_count; i++)
+		dldiPrintRecord(stdout, list->format, path, i, &stubs[i], NULL);
 
-	printf("\n");
+	dldiFileStats(path, rc, stats);
+}
 
-	DLDI_INTERFACE* src_dldi = dldiLoadFromFile(src_path);
-	u32 dldi_size = src_dldi->dldiEnd - src_dldi->dldiStart;
-	FILE *dst_file = fopen(dst_path, "wb");
-	if (dst_file == NULL)
+// Lists the files first, then reads them all through dldiBatchRun().
+static int dldiInfoBatch(const char** roots, int root_count, int threads, int flags, int format)
+{
+	DLDI_PATH_LIST list = { .format = format };
+
+	int rc = dldiCrawl(roots, root_count, threads, flags | DLDI_CRAWL_NO_OPEN, NULL, dldiInfoCollect, &list);
+	if (rc != 0)
 	{
-		printf("Failed to open output DLDI for writing: %s\n", strerror(errno));
-		return errno;
+		fprintf(stderr, "Failed to walk directories: %s\n", strerror(-rc));
+		goto batch_free;
 	}
-	fwrite(src_dldi, 1, dldi_size, dst_file);
-	fflush(dst_file);
-	fclose(dst_file);
-	free(src_dldi);
 
-	return 0;
+	rc = dldiBatchRun((const char *const *)list.paths, list.count, NULL, NULL, 0, DLDI_SYNC_NONE,
+	                  batch_engine, DLDI_BATCH_DEPTH, threads, dldiInfoBatchRecord, &list);
+	if (rc < 0)
+		fprintf(stderr, "Failed to start batch: %s\n", strerror(-rc));
+	else
+		rc = 0;
+
+batch_free:
+	for (int i = 0; i < list.count; i++)
+		free(list.paths[i]);
+	free(list.paths);
+	return rc;
 }
 
-int dldiPatch(const char* src_path, const char* dst_path)
+int dldiInfoRecursive(const char** roots, int root_count, int threads, int flags, int format)
 {
-	printf("Old DLDI:\n\n");
-	int rc = dldiPrint(dst_path);
+	// Records are written as soon as each file is done, even into a pipe.
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	if (format == DLDI_FORMAT_CSV)
+	{
+		printf("path,stub,offset,io_type,name,version,features,fix,driver_size,allocated_size,"
+		       "data_start,data_end,glue_start,glue_end,got_start,got_end,bss_start,bss_end,error\n");
+	}
+
+	if (batch_engine >= 0)
+		return dldiInfoBatch(roots, root_count, threads, flags, format);
+
+	int rc = dldiCrawl(roots, root_count, threads, flags, stub_index, dldiInfoRecord, &format);
 	if (rc != 0)
-		goto patch_end;
-	printf("\n");
-	printf("New DLDI:\n\n");
-	rc = dldiPrint(src_path);
+		fprintf(stderr, "Failed to walk directories: %s\n", strerror(-rc));
+	return rc;
+}
+
+int dldiExtract(const char* src_path, const char* dst_path)
+{
+	DLDI_STATS stats = {};
+	DLDI_IMAGE* src_image;
+	int rc = dldiOpen(src_path, 0, &stats, &src_image);
 	if (rc != 0)
-		goto patch_end;
+	{
+		dldiFileStats(src_path, rc, &stats);
+		return rc;
+	}
 
+	dldiPrint(src_image);
 	printf("\n");
 
-	DLDI_INTERFACE* src_dldi = dldiLoadFromFile(src_path);
-	DLDI_INTERFACE* dst_dldi = dldiLoadFromFile(dst_path);
-	if (dst_dldi == NULL || src_dldi == NULL)
+	const DLDI_SECTION* data = &dldiImageStub(src_image, 0)->sections[DLDI_SECTION_DATA];
+	FILE *dst_file = fopen(dst_path, "wb");
+	if (dst_file == NULL)
 	{
-		rc = -ENOMEM;
-		goto patch_end;
+		rc = -errno;
+		printf("Failed to open output DLDI for writing: %s\n", strerror(-rc));
+		goto extract_end;
 	}
+	u64 start = dldiStatsNow();
+	if (fwrite(dldiImageDriver(src_image), 1, data->end, dst_file) != data->end)
+		rc = -EIO;
+	if (fclose(dst_file) != 0 && rc == 0)
+		rc = -EIO;
+	dldiStatsPhase(&stats, DLDI_PHASE_WRITE, start);
+	stats.write_calls++;
+	stats.bytes_written += data->end;
+
+extract_end:
+	dldiImageClose(src_image);
+	dldiFileStats(src_path, rc, &stats);
+	return rc;
+}
+
+// Patches every stub of an open target with the relocation plan of the source
+// driver. The plan is left untouched so that it can be shared between worker
+// threads. If cache isn't NULL, drivers already relocated to the same address
+// are reused. The drivers are written to out_fd, which is either the image
+// itself or a copy of it. Returns the number of stubs that had to change, or
+// -ENOSPC if the driver doesn't fit in one of them.
+int dldiPatchImage(const DLDI_RELOC_PLAN* plan, DLDI_RELOC_CACHE* cache, DLDI_IMAGE* dst_image, int out_fd)
+{
+	const DLDI_INTERFACE* src_dldi = dldiRelocPlanDriver(plan);
+	int count = dldiImageStubCount(dst_image);
 
-	if (src_dldi->driverSize > dst_dldi->allocatedSize)
+	for (int i = 0; i < count; i++)
 	{
-		printf("Not enough space to patch. Input driver size: %d bytes, allocated size %d bytes\n", 1 << src_dldi->driverSize, 1 << dst_dldi->allocatedSize);
-		rc = -EINVAL;
-		goto patch_free;
+		if (src_dldi->driverSize > dldiImageStub(dst_image, i)->header.allocatedSize)
+			return -ENOSPC;
 	}
 
-	dldiRelocate(src_dldi, dst_dldi->dldiStart);
-	// restore the original allocated driver size.
-	src_dldi->allocatedSize = dst_dldi->allocatedSize;
+	if (journal != NULL)
+		return dldiImagePatchJournal(dst_image, plan, cache, journal, patch_flags);
+	return dldiImagePatch(dst_image, plan, cache, out_fd, patch_flags);
+}
+
+// What is printed about a patched image, saved so that the image can be
+// closed before anything is printed.
+typedef struct DLDI_PATCH_REPORT
+{
+	u32* offsets;        // Relocation offsets of the stubs that were written.
+	int count;
+	u8 driver_size;      // Size of the new driver, as a power of two.
+	u8 allocated_size;   // Size of the stub the driver doesn't fit in.
+} DLDI_PATCH_REPORT;
 
-	FILE* dst_file = fopen(dst_path, "r+b");
-	fseek(dst_file, 0, SEEK_END);
-	int dst_size = ftell(dst_file);
-	fseek(dst_file, 0, SEEK_SET);
+// Saves the report of an image given the result of dldiPatchImage(). Offsets
+// are only saved for stubs that a patch wrote, so none are saved for targets
+// that were already up to date, or with --check.
+static int dldiPatchReportSave(DLDI_PATCH_REPORT* report, const DLDI_RELOC_PLAN* plan, const DLDI_IMAGE* image, int rc)
+{
+	const DLDI_INTERFACE* src_dldi = dldiRelocPlanDriver(plan);
+	int count = dldiImageStubCount(image);
 
-	// Scan the file in 32-bit increments.
-	// The DLDI *must* be 4-byte aligned, or it isn't actually usable.
-	for (int i = 0; i < dst_size; i += 4)
+	*report = (DLDI_PATCH_REPORT){ .driver_size = src_dldi->driverSize };
+	for (int i = 0; rc == -ENOSPC && i < count; i++)
 	{
-		u32 dldiMagic = 0;
-		fseek(dst_file, i, SEEK_SET);
-		fread(&dldiMagic, 1, 4, dst_file);
-		if (dldiMagic == DLDI_MAGIC_NUMBER)
+		const DLDI_INTERFACE* dst_dldi = &dldiImageStub(image, i)->header;
+		if (src_dldi->driverSize > dst_dldi->allocatedSize)
 		{
-			fseek(dst_file, i, SEEK_SET);
-			fwrite(src_dldi, 1, 1 << src_dldi->driverSize, dst_file);
-			fflush(dst_file);
-			fclose(dst_file);
-			rc = 0;
+			report->allocated_size = dst_dldi->allocatedSize;
 			break;
 		}
 	}
 
-	printf("\n");
-	printf("Patch successful\n");
+	if (rc <= 0 || (patch_flags & DLDI_PATCH_CHECK))
+		return 0;
+	report->offsets = (u32 *)malloc(count * sizeof(u32));
+	if (report->offsets == NULL)
+		return -ENOMEM;
+	for (int i = 0; i < count; i++)
+	{
+		if (dldiImageStubChanged(image, i))
+			report->offsets[report->count++] = dldiImageStub(image, i)->header.dldiStart - src_dldi->dldiStart;
+	}
+	return 0;
+}
 
-patch_free:
-	if (src_dldi != NULL)
-		free(src_dldi);
-	if (dst_dldi != NULL)
-		free(dst_dldi);
+// Prints why the driver didn't fit and the relocation offsets of a saved
+// report, then frees it. The result line is printed separately.
+static void dldiPatchReportPrint(const char* path, DLDI_PATCH_REPORT* report, int rc)
+{
+	if (rc == -ENOSPC)
+		printf("%s: Not enough space to patch. Input driver size: %d bytes, allocated size %d bytes\n", path, 1 << report->driver_size, 1 << report->allocated_size);
+	for (int i = 0; rc > 0 && i < report->count; i++)
+		printf("%s: Relocation offset = 0x%08X\n", path, report->offsets[i]);
+	free(report->offsets);
+}
+
+// Prints the outcome of patching a file, given the number of stubs that had
+// to change or a negative errno value.
+static void dldiPrintResult(const char* path, int rc)
+{
+	if (rc < 0)
+		printf("%s: Patch failed (%s)\n", path, strerror(-rc));
+	else if (patch_flags & DLDI_PATCH_CHECK)
+		printf("%s: %s\n", path, rc == 0 ? "Up to date" : "Needs patching");
+	else if (rc == 0)
+		printf("%s: Already up to date, not written\n", path);
+	else
+		printf("%s: Patch successful\n", path);
+}
+
+int dldiPatchTarget(const DLDI_RELOC_PLAN* plan, DLDI_RELOC_CACHE* cache, const char* dst_path, int threads)
+{
+	DLDI_STATS stats = {};
+	DLDI_IMAGE* dst_image;
+	int flags = patch_flags & DLDI_PATCH_CHECK ? 0 : DLDI_IMAGE_WRITE;
+	flags |= DLDI_IMAGE_THREADS(threads);
+	int rc = dldiOpen(dst_path, flags, &stats, &dst_image);
+
+	DLDI_PATCH_REPORT report = {};
+	if (rc == 0)
+	{
+		rc = dldiPatchImage(plan, cache, dst_image, dldiImageFd(dst_image));
+		// Files that were already up to date aren't written, so there is
+		// nothing to flush.
+		int sync_rc = 0;
+		if (rc > 0 && !(patch_flags & DLDI_PATCH_CHECK))
+			sync_rc = dldiSync(dldiImageFd(dst_image), sync_mode, &stats);
+		int report_rc = dldiPatchReportSave(&report, plan, dst_image, rc);
+		int close_rc = dldiImageClose(dst_image);
+		if (rc >= 0)
+			rc = sync_rc != 0 ? sync_rc : report_rc != 0 ? report_rc : close_rc != 0 ? close_rc : rc;
+	}
 
-patch_end:
+	// The lines of a file are printed together, even with several workers.
+	// Only printing is done under the lock, so that workers write in parallel.
+	flockfile(stdout);
+	dldiPatchReportPrint(dst_path, &report, rc);
+	dldiPrintResult(dst_path, rc);
+	funlockfile(stdout);
+
+	dldiFileStats(dst_path, rc < 0 ? rc : 0, &stats);
 	return rc;
 }
 
-void print_help(void)
+// A file to patch, either on disk or inside a FAT disk image.
+typedef struct DLDI_TARGET
 {
-	printf("dldipatch\n\n");
-	printf("Patching a homebrew using a DLDI or another homebrew's embedded DLDI:\n");
-	printf("dldipatch patch dldi/homebrew [homebrew...]\n\n");
-	printf("Extracting a DLDI from a homebrew's embedded DLDI:\n");
-	printf("dldipatch extract homebrew dldi.dldi\n\n");
-	printf("Extracting a DLDI from a homebrew's embedded DLDI:\n");
-	printf("dldipatch info dldi/homebrew \n\n");
+	const char* path; // As shown in messages.
+	DLDI_FAT* fat; // NULL for files on disk.
+	const char* fat_path; // Path of the file inside fat.
+} DLDI_TARGET;
+
+// Targets of a patch command, with the disk images they are in. Each image
+// is opened once, however many of its files are patched.
+typedef struct DLDI_TARGET_LIST
+{
+	DLDI_TARGET* targets;
+	int count;
+	char** strings;
+	int string_count;
+	const char** image_paths;
+	DLDI_FAT** images;
+	int image_count;
+} DLDI_TARGET_LIST;
+
+static int dldiTargetAdd(DLDI_TARGET_LIST* list, const char* path, DLDI_FAT* fat, const char* fat_path)
+{
+	DLDI_TARGET* targets = (DLDI_TARGET *)realloc(list->targets, (list->count + 1) * sizeof(DLDI_TARGET));
+	if (targets == NULL)
+		return -ENOMEM;
+	list->targets = targets;
+	list->targets[list->count++] = (DLDI_TARGET){ path, fat, fat_path };
+	return 0;
 }
 
-int main(const int argc, const char **argv)
+// Keeps a string until the list is freed.
+static char* dldiTargetString(DLDI_TARGET_LIST* list, char* str)
 {
-	if (argc < 2 || (argc < 4 && strncmp(argv[1], "info", 4) != 0))
+	char** strings = str != NULL ? (char **)realloc(list->strings, (list->string_count + 1) * sizeof(char *)) : NULL;
+	if (strings == NULL)
 	{
-		print_help();
-		return -EINVAL;
+		free(str);
+		return NULL;
 	}
+	list->strings = strings;
+	list->strings[list->string_count++] = str;
+	return str;
+}
 
-	if (access(argv[2], F_OK) != 0)
+static int dldiTargetImage(DLDI_TARGET_LIST* list, const char* image_path, DLDI_FAT** fat)
+{
+	for (int i = 0; i < list->image_count; i++)
 	{
-		printf("Input file does not exist.\n");
-		return -ENOENT;
+		if (strcmp(list->image_paths[i], image_path) == 0)
+		{
+			*fat = list->images[i];
+			return 0;
+		}
 	}
 
-	// show DLDI info
-	if (strncmp(argv[1], "info", 4) == 0)
+	int rc = dldiFatOpen(image_path, patch_flags & DLDI_PATCH_CHECK ? 0 : DLDI_IMAGE_WRITE, fat);
+	if (rc == -EINVAL)
+		printf("%s: Not a FAT16 or FAT32 disk image.\n", image_path);
+	else if (rc != 0)
+		printf("%s: Failed to open disk image: %s\n", image_path, strerror(-rc));
+	if (rc != 0)
+		return rc;
+
+	const char** image_paths = (const char **)realloc(list->image_paths, (list->image_count + 1) * sizeof(char *));
+	if (image_paths != NULL)
+		list->image_paths = image_paths;
+	DLDI_FAT** images = (DLDI_FAT **)realloc(list->images, (list->image_count + 1) * sizeof(DLDI_FAT *));
+	if (images != NULL)
+		list->images = images;
+	if (image_paths == NULL || images == NULL)
 	{
-		return dldiPrint(argv[2]);
+		dldiFatClose(*fat);
+		return -ENOMEM;
 	}
+	list->image_paths[list->image_count] = image_path;
+	list->images[list->image_count++] = *fat;
+	return 0;
+}
 
-	// extract DLDI
-	else if (strncmp(argv[1], "extract", 7) == 0)
+// Expands targets of the form "card.img::/pattern", or every target if
+// image_path isn't NULL, into the files they match inside the disk image.
+// Other targets are files on disk.
+static int dldiTargetsExpand(DLDI_TARGET_LIST* list, const char** args, int count, const char* image_path)
+{
+	int rc = 0;
+
+	for (int i = 0; i < count && rc == 0; i++)
 	{
-		return dldiExtract(argv[2], argv[3]);
+		const char* separator = strstr(args[i], DLDI_FAT_SEPARATOR);
+		if (image_path == NULL && separator == NULL)
+		{
+			rc = dldiTargetAdd(list, args[i], NULL, NULL);
+			continue;
+		}
+
+		const char* pattern = args[i];
+		const char* image = image_path;
+		if (image == NULL)
+		{
+			image = dldiTargetString(list, strndup(args[i], separator - args[i]));
+			pattern = separator + strlen(DLDI_FAT_SEPARATOR);
+			if (image == NULL)
+			{
+				rc = -ENOMEM;
+				break;
+			}
+		}
+
+		DLDI_FAT* fat;
+		rc = dldiTargetImage(list, image, &fat);
+		if (rc != 0)
+			break;
+
+		char** paths;
+		int matches = dldiFatGlob(fat, pattern, &paths);
+		if (matches < 0)
+		{
+			rc = matches;
+			printf("%s: Failed to read disk image: %s\n", image, strerror(-rc));
+			break;
+		}
+		if (matches == 0)
+			printf("%s%s%s: No such file\n", image, DLDI_FAT_SEPARATOR, pattern);
+
+		for (int m = 0; m < matches && rc == 0; m++)
+		{
+			char* fat_path = dldiTargetString(list, paths[m]);
+			char* path = (char *)malloc(strlen(image) + strlen(DLDI_FAT_SEPARATOR) + strlen(paths[m]) + 1);
+			if (path != NULL)
+				sprintf(path, "%s%s%s", image, DLDI_FAT_SEPARATOR, paths[m]);
+			paths[m] = NULL;
+			if (fat_path == NULL || dldiTargetString(list, path) == NULL)
+				rc = -ENOMEM;
+			else
+				rc = dldiTargetAdd(list, path, fat, fat_path);
+		}
+		dldiFatGlobFree(paths, matches);
 	}
 
-	// patch DLDI
-	else if (strncmp(argv[1], "patch", 5) == 0)
+	return rc;
+}
+
+// Frees a target list and closes its disk images.
+static int dldiTargetsFree(DLDI_TARGET_LIST* list)
+{
+	int rc = 0;
+
+	for (int i = 0; i < list->image_count; i++)
 	{
-		return dldiPatch(argv[2], argv[3]);
+		int close_rc = dldiFatClose(list->images[i]);
+		if (rc == 0)
+			rc = close_rc;
 	}
-	// what are you even trying to do
-	else
+	for (int i = 0; i < list->string_count; i++)
+		free(list->strings[i]);
+	free(list->strings);
+	free(list->image_paths);
+	free(list->images);
+	free(list->targets);
+
+	return rc;
+}
+
+// Patches a file inside a disk image, with the same messages as files on disk.
+static int dldiPatchFatTarget(const DLDI_RELOC_PLAN* plan, DLDI_RELOC_CACHE* cache, const DLDI_TARGET* target)
+{
+	DLDI_STATS stats = {};
+	int rc = dldiFatPatch(target->fat, target->fat_path, plan, cache, patch_flags, sync_mode, &stats);
+
+	flockfile(stdout);
+	if (rc == -ENOENT)
+		printf("%s: Input file does not exist.\n", target->path);
+	else if (rc == -ENODATA)
+		printf("%s: Input file does not have a DLDI section.\n", target->path);
+	else if (rc == -ENOSPC)
+		printf("%s: Not enough space to patch. Input driver size: %d bytes\n", target->path, 1 << dldiRelocPlanDriver(plan)->driverSize);
+	dldiPrintResult(target->path, rc);
+	funlockfile(stdout);
+
+	dldiFileStats(target->path, rc < 0 ? rc : 0, &stats);
+	return rc;
+}
+
+typedef struct DLDI_PATCH_JOB
+{
+	const DLDI_RELOC_PLAN* plan;
+	DLDI_RELOC_CACHE* cache;
+	const DLDI_TARGET* targets;
+	int* results;
+	int count;
+	int next;
+	int scan_threads; // Of each target.
+	// With --batch, the targets on disk that were patched as a batch, by
+	// their index in the batch.
+	int* batched;
+	int batch_count;
+} DLDI_PATCH_JOB;
+
+static void *dldiPatchWorker(void *arg)
+{
+	DLDI_PATCH_JOB* job = (DLDI_PATCH_JOB *)arg;
+
+	for (;;)
 	{
-		printf("Invalid argument: %s\n", argv[1]);
-		return -EINVAL;
+		int i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= job->count)
+			break;
+
+		// Files in a disk image are independent of each other, so they are
+		// patched in parallel like files on disk.
+		const DLDI_TARGET* target = &job->targets[i];
+		if (target->fat == NULL && job->batched != NULL)
+			continue;
+		if (target->fat != NULL)
+			job->results[i] = dldiPatchFatTarget(job->plan, job->cache, target);
+		else
+			job->results[i] = dldiPatchTarget(job->plan, job->cache, target->path, job->scan_threads);
 	}
 
-	return 0;
+	return NULL;
+}
+
+// Reports a target of a batch, with the same messages as targets patched one
+// at a time.
+static void dldiPatchBatchResult(void* arg, int index, int rc, const DLDI_STUB* stubs,
+                                 int stub_count, const bool* changed, const DLDI_STATS* stats)
+{
+	DLDI_PATCH_JOB* job = (DLDI_PATCH_JOB *)arg;
+	int i = job->batched[index];
+	const char* path = job->targets[i].path;
+	const DLDI_INTERFACE* src_dldi = dldiRelocPlanDriver(job->plan);
+
+	if (rc == -ENOENT)
+		printf("%s: Input file does not exist.\n", path);
+	else if (rc == -ENODATA)
+		printf("%s: Input file does not have a DLDI section.\n", path);
+	else if (rc == -ENOSPC)
+		printf("%s: Not enough space to patch. Input driver size: %d bytes\n", path, 1 << src_dldi->driverSize);
+	for (int s = 0; rc > 0 && changed != NULL && s < stub_count && !(patch_flags & DLDI_PATCH_CHECK); s++)
+	{
+		if (changed[s])
+			printf("%s: Relocation offset = 0x%08X\n", path, stubs[s].header.dldiStart - src_dldi->dldiStart);
+	}
+	dldiPrintResult(path, rc);
+
+	dldiFileStats(path, rc < 0 ? rc : 0, stats);
+	job->results[i] = rc;
+}
+
+// Patches the targets on disk with dldiBatchRun(), leaving the targets in
+// disk images to the workers.
+static int dldiPatchBatch(DLDI_PATCH_JOB* job, int threads)
+{
+	const char** paths = (const char **)malloc(job->count * sizeof(char *));
+	job->batched = (int *)malloc(job->count * sizeof(int));
+	if (paths == NULL || job->batched == NULL)
+	{
+		free(paths);
+		return -ENOMEM;
+	}
+
+	job->batch_count = 0;
+	for (int i = 0; i < job->count; i++)
+	{
+		if (job->targets[i].fat == NULL)
+		{
+			paths[job->batch_count] = job->targets[i].path;
+			job->batched[job->batch_count++] = i;
+		}
+	}
+
+	int rc = dldiBatchRun(paths, job->batch_count, job->plan, job->cache, patch_flags, sync_mode,
+	                      batch_engine, DLDI_BATCH_DEPTH, threads, dldiPatchBatchResult, job);
+	if (rc < 0)
+		printf("Failed to start batch: %s\n", strerror(-rc));
+	else if (batch_engine == DLDI_BATCH_AUTO && rc == DLDI_BATCH_THREADS)
+		printf("io_uring isn't available, patched with threads instead\n");
+
+	free(paths);
+	return rc < 0 ? rc : 0;
+}
+
+// Patches a copy of a single target, leaving the target itself alone. Only the
+// stubs are written to the copy, which is a reflink of the target where the
+// filesystem supports it.
+static int dldiPatchOutput(const DLDI_RELOC_PLAN* plan, DLDI_IMAGE* dst_image, const char* out_path)
+{
+	DLDI_STATS* stats = dldiImageStats(dst_image);
+	DLDI_OUTPUT* output;
+	int rc = dldiOutputCreate(dldiImageFd(dst_image), out_path, stats, &output);
+	if (rc != 0)
+	{
+		printf("%s: Failed to create output: %s\n", out_path, strerror(-rc));
+		return rc;
+	}
+
+	rc = dldiPatchImage(plan, NULL, dst_image, dldiOutputFd(output));
+	if (rc < 0)
+	{
+		dldiOutputAbort(output);
+		return rc;
+	}
+
+	// The output is a new file, so it counts as written even if the target
+	// already had the driver.
+	rc = dldiOutputCommit(output, sync_mode);
+	return rc != 0 ? rc : 1;
+}
+
+// Builds the plan of the new driver, from a file or from an entry of the
+// driver catalog, and prints the driver unless the output is stdout.
+static int dldiLoadPlan(const char* src_path, const DLDI_CATALOG_ENTRY* src_driver, bool verbose, DLDI_RELOC_PLAN** plan)
+{
+	DLDI_STATS src_stats = {};
+	u64 start;
+	int rc;
+
+	// Drivers of the catalog are already in memory.
+	if (src_driver != NULL)
+	{
+		if (verbose)
+		{
+			printf("New DLDI (%s):\n\n", src_driver->path);
+			dldiPrintStub(&src_driver->stub);
+			printf("\n");
+		}
+
+		start = dldiStatsNow();
+		rc = dldiCatalogPlan(src_driver, plan);
+		dldiStatsPhase(&src_stats, DLDI_PHASE_RELOCATE, start);
+		dldiFileStats(src_driver->path, rc, &src_stats);
+		return rc;
+	}
+
+	DLDI_IMAGE* src_image;
+	if (verbose)
+	{
+		rc = dldiOpen(src_path, 0, &src_stats, &src_image);
+	}
+	else
+	{
+		rc = dldiImageOpenIndexed(src_path, 0, NULL, &src_stats, &src_image);
+		if (rc != 0)
+			fprintf(stderr, "%s: Failed to load input DLDI: %s\n", src_path, strerror(-rc));
+	}
+	if (rc != 0)
+	{
+		dldiFileStats(src_path, rc, &src_stats);
+		return rc;
+	}
+
+	if (verbose)
+	{
+		printf("New DLDI:\n\n");
+		dldiPrint(src_image);
+		printf("\n");
+	}
+
+	// Only the plan is needed from here on, so the source can be closed.
+	start = dldiStatsNow();
+	rc = dldiRelocPlanCreate(dldiImageDriver(src_image), plan);
+	dldiStatsPhase(&src_stats, DLDI_PHASE_RELOCATE, start);
+	dldiImageClose(src_image);
+	dldiFileStats(src_path, rc, &src_stats);
+	return rc;
+}
+
+// Patches targets with a driver. Returns the number of targets that didn't
+// have the driver yet, or the error of the first target that failed.
+int dldiPatch(const char* src_path, const DLDI_CATALOG_ENTRY* src_driver, const DLDI_TARGET* targets,
+              int dst_count, int threads, const char* out_path)
+{
+	int rc = 0;
+	DLDI_RELOC_PLAN* plan;
+
+	// A single target on disk is opened once and kept open for the patch, so
+	// that its old driver can be printed first.
+	if (dst_count == 1 && targets[0].fat == NULL)
+	{
+		const char* dst_path = targets[0].path;
+		DLDI_STATS dst_stats = {};
+		DLDI_IMAGE* dst_image;
+		bool writable = out_path == NULL && !(patch_flags & DLDI_PATCH_CHECK);
+		rc = dldiOpen(dst_path, writable ? DLDI_IMAGE_WRITE : 0, &dst_stats, &dst_image);
+		if (rc != 0)
+		{
+			dldiFileStats(dst_path, rc, &dst_stats);
+			return rc;
+		}
+
+		printf("Old DLDI:\n\n");
+		dldiPrint(dst_image);
+		printf("\n");
+
+		rc = dldiLoadPlan(src_path, src_driver, true, &plan);
+		if (rc == 0)
+		{
+			DLDI_PATCH_REPORT report;
+			if (out_path != NULL)
+			{
+				rc = dldiPatchOutput(plan, dst_image, out_path);
+			}
+			else
+			{
+				rc = dldiPatchImage(plan, NULL, dst_image, dldiImageFd(dst_image));
+				if (rc > 0 && writable)
+				{
+					int sync_rc = dldiSync(dldiImageFd(dst_image), sync_mode, &dst_stats);
+					if (sync_rc != 0)
+						rc = sync_rc;
+				}
+			}
+			int report_rc = dldiPatchReportSave(&report, plan, dst_image, rc);
+			if (rc >= 0 && report_rc != 0)
+				rc = report_rc;
+			dldiPatchReportPrint(out_path != NULL ? out_path : dst_path, &report, rc);
+			dldiRelocPlanFree(plan);
+		}
+
+		int close_rc = dldiImageClose(dst_image);
+		if (rc >= 0 && close_rc != 0)
+			rc = close_rc;
+		dldiPrintResult(out_path != NULL ? out_path : dst_path, rc);
+
+		dldiFileStats(dst_path, rc < 0 ? rc : 0, &dst_stats);
+		return rc < 0 ? rc : rc > 0;
+	}
+
+	// The source driver is loaded and validated once for all targets.
+	rc = dldiLoadPlan(src_path, src_driver, true, &plan);
+	if (rc != 0)
+		return rc;
+
+	// Targets built from the same sources share their stub address, so most
+	// of them can reuse a driver relocated for an earlier target.
+	DLDI_RELOC_CACHE* cache = dldiRelocCacheCreate(DLDI_RELOC_CACHE_SIZE);
+	int* results = (int *)calloc(dst_count, sizeof(int));
+	if (cache == NULL || results == NULL)
+	{
+		rc = -ENOMEM;
+		goto patch_free;
+	}
+
+	DLDI_PATCH_JOB job = {
+		.plan = plan,
+		.cache = cache,
+		.targets = targets,
+		.results = results,
+		.count = dst_count,
+		.next = 0,
+		// The threads are shared between the targets patched at once.
+		.scan_threads = threads / dst_count > 1 ? threads / dst_count : 1,
+		.batched = NULL,
+	};
+
+	if (batch_engine >= 0)
+	{
+		rc = dldiPatchBatch(&job, threads);
+		if (rc != 0)
+		{
+			free(job.batched);
+			goto patch_free;
+		}
+	}
+
+	if (threads > dst_count)
+		threads = dst_count;
+	if (threads < 1)
+		threads = 1;
+
+	dldiRunWorkers(dldiPatchWorker, &job, threads);
+	free(job.batched);
+
+	// The aggregate result is the error of the first failed target if any,
+	// or else the number of targets that had to change.
+	int failed = 0;
+	int changed = 0;
+	for (int i = 0; i < dst_count; i++)
+	{
+		if (results[i] < 0)
+		{
+			if (failed == 0)
+				rc = results[i];
+			failed++;
+		}
+		else if (results[i] > 0)
+		{
+			changed++;
+		}
+	}
+	int current = dst_count - failed - changed;
+	if (patch_flags & DLDI_PATCH_CHECK)
+		printf("\n%d of %d files up to date\n", current, dst_count);
+	else
+		printf("\nPatched %d of %d files, %d already up to date\n", changed, dst_count, current);
+	if (failed == 0)
+		rc = changed;
+
+patch_free:
+	free(results);
+	dldiRelocCacheFree(cache);
+	dldiRelocPlanFree(plan);
+	return rc;
+}
+
+// Patches stdin to stdout. Since stdout carries the patched file, messages
+// go to stderr.
+int dldiPatchStdio(const char* src_path, const DLDI_CATALOG_ENTRY* src_driver)
+{
+	DLDI_RELOC_PLAN* plan;
+	int rc = dldiLoadPlan(src_path, src_driver, false, &plan);
+	if (rc != 0)
+		return rc;
+
+	DLDI_STATS stream_stats = {};
+	rc = dldiPatchStream(plan, STDIN_FILENO, STDOUT_FILENO, &stream_stats);
+	if (rc == -ENODATA)
+		fprintf(stderr, "Input file does not have a DLDI section.\n");
+	else if (rc == -ENOSPC)
+		fprintf(stderr, "Not enough space to patch. Input driver size: %d bytes\n", 1 << dldiRelocPlanDriver(plan)->driverSize);
+	else if (rc != 0)
+		fprintf(stderr, "Patch failed: %s\n", strerror(-rc));
+
+	dldiFileStats("-", rc, &stream_stats);
+	dldiRelocPlanFree(plan);
+	return rc;
+}
+
+// A copy of the source of fanout, patched with one driver of the catalog.
+typedef struct DLDI_FANOUT_OUTPUT
+{
+	const DLDI_CATALOG_ENTRY* driver;
+	char* path;
+	int result;
+} DLDI_FANOUT_OUTPUT;
+
+typedef struct DLDI_FANOUT_JOB
+{
+	DLDI_IMAGE* src_image;
+	DLDI_FANOUT_OUTPUT* outputs;
+	int count;
+	int next;
+	pthread_mutex_t lock;
+} DLDI_FANOUT_JOB;
+
+static void *dldiFanoutWorker(void *arg)
+{
+	DLDI_FANOUT_JOB* job = (DLDI_FANOUT_JOB *)arg;
+
+	for (;;)
+	{
+		int i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= job->count)
+			break;
+
+		// Each driver is relocated by the thread that writes its copy, so
+		// drivers are relocated in parallel.
+		DLDI_FANOUT_OUTPUT* out = &job->outputs[i];
+		DLDI_STATS stats = {};
+		DLDI_RELOC_PLAN* plan = NULL;
+		u64 start = dldiStatsNow();
+		int rc = dldiCatalogPlan(out->driver, &plan);
+		dldiStatsPhase(&stats, DLDI_PHASE_RELOCATE, start);
+
+		DLDI_OUTPUT* output;
+		if (rc == 0)
+			rc = dldiOutputCreate(dldiImageFd(job->src_image), out->path, &stats, &output);
+		if (rc == 0)
+		{
+			rc = dldiImagePatch(job->src_image, plan, NULL, dldiOutputFd(output), 0);
+			if (rc < 0)
+				dldiOutputAbort(output);
+			else
+				rc = dldiOutputCommit(output, sync_mode);
+			if (rc == 0)
+				rc = 1;
+		}
+		dldiRelocPlanFree(plan);
+		out->result = rc;
+
+		pthread_mutex_lock(&job->lock);
+		dldiPrintResult(out->path, rc);
+		pthread_mutex_unlock(&job->lock);
+		dldiFileStats(out->path, rc < 0 ? rc : 0, &stats);
+	}
+
+	return NULL;
+}
+
+// Whether two drivers of the catalog are copies of each other. Hashes only
+// rule out most pairs quickly, the bytes are what decides.
+static bool dldiSameDriver(const DLDI_CATALOG_ENTRY* a, const DLDI_CATALOG_ENTRY* b)
+{
+	return a->hash == b->hash && a->stub.header.driverSize == b->stub.header.driverSize &&
+	       memcmp(a->driver, b->driver, 1 << a->stub.header.driverSize) == 0;
+}
+
+// Patches a copy of one homebrew with every driver of the catalog. The source
+// is read and scanned once, and every copy is a reflink of it where the
+// filesystem supports it, so each one only gets its stubs written. Copies of
+// the same driver only get one output. Drivers that are too large, or that
+// would overwrite another output, are reported and left out without failing
+// the others.
+int dldiFanout(const char* src_path, const DLDI_CATALOG* catalog, const char* out_dir, int threads)
+{
+	// The image is shared by every thread, so it doesn't keep counters.
+	DLDI_IMAGE* src_image;
+	int rc = dldiOpen(src_path, 0, NULL, &src_image);
+	if (rc != 0)
+		return rc;
+
+	if (mkdir(out_dir, 0777) != 0 && errno != EEXIST)
+	{
+		rc = -errno;
+		printf("%s: Failed to create output directory: %s\n", out_dir, strerror(-rc));
+		dldiImageClose(src_image);
+		return rc;
+	}
+
+	// Outputs are named after the source and the file of the driver, like
+	// out/game.r4tf.nds.
+	const char* src_name = strrchr(src_path, '/') != NULL ? strrchr(src_path, '/') + 1 : src_path;
+	const char* src_ext = strrchr(src_name, '.') != NULL && strrchr(src_name, '.') != src_name ? strrchr(src_name, '.') : "";
+	int src_stem = src_ext - src_name;
+	if (*src_ext == '\0')
+		src_stem = strlen(src_name);
+
+	int allocated = DLDI_SIZE_32KB;
+	for (int i = 0; i < dldiImageStubCount(src_image); i++)
+	{
+		if (dldiImageStub(src_image, i)->header.allocatedSize < allocated)
+			allocated = dldiImageStub(src_image, i)->header.allocatedSize;
+	}
+
+	int driver_count = dldiCatalogCount(catalog);
+	DLDI_FANOUT_OUTPUT* outputs = (DLDI_FANOUT_OUTPUT *)calloc(driver_count > 0 ? driver_count : 1, sizeof(DLDI_FANOUT_OUTPUT));
+	if (outputs == NULL)
+	{
+		dldiImageClose(src_image);
+		return -ENOMEM;
+	}
+
+	// Every driver that can't be written is reported before anything is.
+	int count = 0;
+	int drivers = 0;
+	int too_large = 0;
+	int skipped = 0;
+	for (int i = 0; i < driver_count && rc == 0; i++)
+	{
+		const DLDI_CATALOG_ENTRY* entry = dldiCatalogEntry(catalog, i);
+		bool copy = false;
+		for (int j = 0; j < i && !copy; j++)
+			copy = dldiSameDriver(dldiCatalogEntry(catalog, j), entry);
+		if (copy)
+			continue;
+		drivers++;
+
+		if (entry->stub.header.driverSize > allocated)
+		{
+			if (too_large++ == 0)
+				printf("Drivers larger than the %d bytes allocated in %s:\n", 1 << allocated, src_path);
+			printf("  %s  %s (%s): %d bytes\n", entry->id, entry->name, entry->path, 1 << entry->stub.header.driverSize);
+			continue;
+		}
+
+		const char* name = strrchr(entry->path, '/') != NULL ? strrchr(entry->path, '/') + 1 : entry->path;
+		int stem = strrchr(name, '.') != NULL && strrchr(name, '.') != name ? strrchr(name, '.') - name : (int)strlen(name);
+		size_t size = strlen(out_dir) + src_stem + stem + strlen(src_ext) + 3;
+		char* path = (char *)malloc(size);
+		if (path == NULL)
+		{
+			rc = -ENOMEM;
+			break;
+		}
+		snprintf(path, size, "%s/%.*s.%.*s%s", out_dir, src_stem, src_name, stem, name, src_ext);
+
+		const DLDI_FANOUT_OUTPUT* other = NULL;
+		for (int j = 0; j < count && other == NULL; j++)
+			other = strcmp(outputs[j].path, path) == 0 ? &outputs[j] : NULL;
+		if (other != NULL)
+		{
+			printf("%s: Same output as %s, skipped\n", entry->path, other->driver->path);
+			skipped++;
+			free(path);
+			continue;
+		}
+
+		outputs[count++] = (DLDI_FANOUT_OUTPUT){ .driver = entry, .path = path };
+	}
+	if (too_large > 0 || skipped > 0)
+		printf("\n");
+
+	DLDI_FANOUT_JOB job = {
+		.src_image = src_image,
+		.outputs = outputs,
+		.count = rc == 0 ? count : 0,
+		.next = 0,
+	};
+	pthread_mutex_init(&job.lock, NULL);
+
+	if (threads > job.count)
+		threads = job.count;
+	if (threads < 1)
+		threads = 1;
+
+	dldiRunWorkers(dldiFanoutWorker, &job, threads);
+	pthread_mutex_destroy(&job.lock);
+
+	// The result is the error of the first output that failed, if any.
+	// Drivers that were left out are already reported on their own.
+	int written = 0;
+	for (int i = 0; i < job.count; i++)
+	{
+		if (outputs[i].result < 0 && rc == 0)
+			rc = outputs[i].result;
+		else if (outputs[i].result > 0)
+			written++;
+	}
+	printf("\nWrote %d of %d drivers, %d too large\n", written, drivers, too_large);
+
+	for (int i = 0; i < count; i++)
+		free(outputs[i].path);
+	free(outputs);
+	int close_rc = dldiImageClose(src_image);
+	return rc != 0 ? rc : close_rc;
+}
+
+// Writes the IPS or BPS patch that patches a homebrew with a driver, without
+// writing the homebrew itself.
+int dldiDiff(const char* src_path, const DLDI_CATALOG_ENTRY* src_driver, const char* dst_path, const char* out_path)
+{
+	int format = dldiDeltaFormat(out_path);
+	if (format < 0)
+	{
+		printf("%s: Unknown patch format, the name must end with .ips or .bps\n", out_path);
+		return format;
+	}
+
+	DLDI_STATS dst_stats = {};
+	DLDI_IMAGE* dst_image;
+	int rc = dldiOpen(dst_path, 0, &dst_stats, &dst_image);
+	if (rc != 0)
+	{
+		dldiFileStats(dst_path, rc, &dst_stats);
+		return rc;
+	}
+
+	DLDI_RELOC_PLAN* plan;
+	rc = dldiLoadPlan(src_path, src_driver, true, &plan);
+	if (rc != 0)
+	{
+		dldiImageClose(dst_image);
+		dldiFileStats(dst_path, rc, &dst_stats);
+		return rc;
+	}
+
+	int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (out_fd < 0)
+	{
+		rc = -errno;
+		printf("%s: Failed to create output: %s\n", out_path, strerror(-rc));
+	}
+	else
+	{
+		rc = dldiDeltaCreate(dst_image, plan, format, out_fd);
+		int sync_rc = rc >= 0 ? dldiSync(out_fd, sync_mode, &dst_stats) : 0;
+		off_t size = lseek(out_fd, 0, SEEK_END);
+		if (close(out_fd) != 0 && sync_rc == 0)
+			sync_rc = -errno;
+		if (rc >= 0 && sync_rc != 0)
+			rc = sync_rc;
+
+		if (rc == -ENOSPC)
+			printf("%s: Not enough space to patch. Input driver size: %d bytes\n", dst_path, 1 << dldiRelocPlanDriver(plan)->driverSize);
+		else if (rc == -EFBIG)
+			printf("%s: A DLDI section is past the 16MB IPS can reach, use .bps\n", dst_path);
+		else if (rc < 0)
+			printf("%s: Diff failed (%s)\n", out_path, strerror(-rc));
+		else if (rc == 0)
+			printf("%s: Already has the driver, the patch is empty\n", dst_path);
+		else
+			printf("%s: Patch written, %lld bytes\n", out_path, (long long)size);
+		if (rc < 0)
+			unlink(out_path);
+	}
+
+	dldiRelocPlanFree(plan);
+	int close_rc = dldiImageClose(dst_image);
+	if (rc >= 0 && close_rc != 0)
+		rc = close_rc;
+	dldiFileStats(dst_path, rc < 0 ? rc : 0, &dst_stats);
+	return rc < 0 ? rc : 0;
+}
+
+// Applies an IPS or BPS patch to a homebrew in place, or to a copy of it with
+// -o. Returns whether the homebrew had to change, or a negative errno value.
+int dldiApply(const char* delta_path, const char* dst_path, const char* out_path)
+{
+	DLDI_STATS stats = {};
+	int rc = 0;
+	int delta_fd = open(delta_path, O_RDONLY | O_CLOEXEC);
+	if (delta_fd < 0)
+	{
+		rc = -errno;
+		printf("%s: Failed to open patch: %s\n", delta_path, strerror(-rc));
+		return rc;
+	}
+
+	u64 start = dldiStatsNow();
+	bool writable = out_path == NULL && !(patch_flags & DLDI_PATCH_CHECK);
+	int dst_fd = open(dst_path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	dldiStatsPhase(&stats, DLDI_PHASE_LOAD, start);
+	if (dst_fd < 0)
+	{
+		rc = -errno;
+		if (rc == -ENOENT)
+			printf("%s: Input file does not exist.\n", dst_path);
+		else
+			printf("%s: Failed to open: %s\n", dst_path, strerror(-rc));
+		close(delta_fd);
+		return rc;
+	}
+
+	// A copy only gets the ranges of the patch written, like -o of patch.
+	DLDI_OUTPUT* output = NULL;
+	if (out_path != NULL)
+	{
+		rc = dldiOutputCreate(dst_fd, out_path, &stats, &output);
+		if (rc != 0)
+			printf("%s: Failed to create output: %s\n", out_path, strerror(-rc));
+	}
+
+	if (rc == 0)
+		rc = dldiDeltaApply(delta_fd, output != NULL ? dldiOutputFd(output) : dst_fd, patch_flags, &stats);
+
+	if (output != NULL && rc < 0)
+	{
+		dldiOutputAbort(output);
+	}
+	else if (output != NULL)
+	{
+		rc = dldiOutputCommit(output, sync_mode);
+		if (rc == 0)
+			rc = 1;
+	}
+	else if (rc > 0 && writable)
+	{
+		int sync_rc = dldiSync(dst_fd, sync_mode, &stats);
+		if (sync_rc != 0)
+			rc = sync_rc;
+	}
+
+	if (close(dst_fd) != 0 && rc >= 0)
+		rc = -errno;
+	close(delta_fd);
+
+	if (rc == -EBADMSG)
+		printf("%s: Damaged or not an IPS or BPS patch\n", delta_path);
+	else if (rc == -ESTALE)
+		printf("%s: The patch was made for another file\n", dst_path);
+	else if (rc == -ENOTSUP)
+		printf("%s: BPS patches that move data around aren't supported\n", delta_path);
+	else
+		dldiPrintResult(out_path != NULL ? out_path : dst_path, rc);
+
+	dldiFileStats(dst_path, rc < 0 ? rc : 0, &stats);
+	return rc;
+}
+
+// Loads the driver catalog and reports drivers that share an ID. Copies of the
+// same driver are harmless, but different drivers with one ID can't be told
+// apart by --driver-id.
+static int dldiCatalogOpen(const char** dirs, int dir_count, int threads, FILE* file, DLDI_CATALOG** catalog)
+{
+	int rc = dldiCatalogLoad(dirs, dir_count, threads, catalog);
+	if (rc != 0)
+	{
+		fprintf(file, "Failed to load drivers: %s\n", strerror(-rc));
+		return rc;
+	}
+
+	int count = dldiCatalogCount(*catalog);
+	for (int first = 0, last; first < count; first = last)
+	{
+		const DLDI_CATALOG_ENTRY* entry = dldiCatalogEntry(*catalog, first);
+		bool identical = true;
+		for (last = first + 1; last < count; last++)
+		{
+			const DLDI_CATALOG_ENTRY* other = dldiCatalogEntry(*catalog, last);
+			if (strcmp(other->id, entry->id) != 0)
+				break;
+			if (other->hash != entry->hash)
+				identical = false;
+		}
+		if (last - first == 1)
+			continue;
+
+		fprintf(file, "%s driver ID %s:\n", identical ? "Duplicate" : "Conflicting", entry->id);
+		for (int i = first; i < last; i++)
+		{
+			const DLDI_CATALOG_ENTRY* other = dldiCatalogEntry(*catalog, i);
+			fprintf(file, "  %s (%s, %016llx)\n", other->path, other->name, (unsigned long long)other->hash);
+		}
+	}
+
+	return 0;
+}
+
+// Selects the driver given with --driver-id. Several matches are only accepted
+// if they are all the same driver.
+static int dldiCatalogSelect(const DLDI_CATALOG* catalog, const char* key, FILE* file, const DLDI_CATALOG_ENTRY** driver)
+{
+	int count = dldiCatalogFind(catalog, key, NULL, 0);
+	if (count == 0)
+	{
+		fprintf(file, "No driver with ID or name %s\n", key);
+		return -ENOENT;
+	}
+
+	const DLDI_CATALOG_ENTRY** matches = (const DLDI_CATALOG_ENTRY **)calloc(count, sizeof(DLDI_CATALOG_ENTRY *));
+	if (matches == NULL)
+		return -ENOMEM;
+	dldiCatalogFind(catalog, key, matches, count);
+
+	int rc = 0;
+	for (int i = 1; i < count; i++)
+	{
+		if (matches[i]->hash != matches[0]->hash)
+		{
+			fprintf(file, "Driver %s is ambiguous:\n", key);
+			for (int j = 0; j < count; j++)
+				fprintf(file, "  %s: %s (%s)\n", matches[j]->id, matches[j]->path, matches[j]->name);
+			rc = -EINVAL;
+			break;
+		}
+	}
+
+	*driver = matches[0];
+	free(matches);
+	return rc;
+}
+
+// Lists the drivers of a catalog, one per line.
+static void dldiCatalogPrint(const DLDI_CATALOG* catalog)
+{
+	int count = dldiCatalogCount(catalog);
+	for (int i = 0; i < count; i++)
+	{
+		const DLDI_CATALOG_ENTRY* entry = dldiCatalogEntry(catalog, i);
+		printf("%s  %-48s  %s\n", entry->id, entry->name, entry->path);
+	}
+	printf("\n%d drivers\n", count);
+}
+
+// Selects the built-in driver given with --builtin. Built-in drivers are
+// already in memory and relocated, so nothing is read.
+static int dldiBuiltinSelect(const char* id, FILE* file, DLDI_CATALOG_ENTRY* entry)
+{
+	const DLDI_BUILTIN* builtin = dldiBuiltinFind(dldiBuiltins, dldiBuiltinCount, id);
+	if (builtin == NULL)
+	{
+		fprintf(file, "No built-in driver with ID %s\n", id);
+		return -ENOENT;
+	}
+
+	dldiBuiltinEntry(builtin, entry);
+	return 0;
+}
+
+// Lists the built-in drivers, one per line, like dldiCatalogPrint().
+static void dldiBuiltinPrint(void)
+{
+	for (int i = 0; i < dldiBuiltinCount; i++)
+	{
+		const DLDI_BUILTIN* builtin = &dldiBuiltins[i];
+		printf("%s  %-48s  %s\n", builtin->id, builtin->name, builtin->path);
+	}
+	printf("\n%d drivers\n", dldiBuiltinCount);
+}
+
+// The server stopped by SIGINT and SIGTERM.
+static DLDI_SERVER* serving = NULL;
+
+static void dldiServeSignal(int sig)
+{
+	(void)sig;
+	dldiServerStop(serving);
+}
+
+// Answers requests on a Unix socket until interrupted. The catalog and the
+// relocated drivers stay in memory between requests.
+int dldiServe(const char* socket_path, const DLDI_CATALOG* catalog, int threads)
+{
+	int rc = dldiServerCreate(socket_path, catalog, stub_index, threads, &serving);
+	if (rc != 0)
+	{
+		printf("%s: Failed to listen: %s\n", socket_path, strerror(-rc));
+		return rc;
+	}
+
+	// Clients may pass pipes, whose readers can go away at any time.
+	signal(SIGPIPE, SIG_IGN);
+	struct sigaction action = { .sa_handler = dldiServeSignal };
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	printf("Listening on %s\n", socket_path);
+	fflush(stdout);
+	rc = dldiServerRun(serving);
+	if (rc != 0)
+		printf("%s: Server failed: %s\n", socket_path, strerror(-rc));
+
+	DLDI_SERVE_STATS stats;
+	dldiServerStats(serving, &stats);
+	u64 requests = 0;
+	for (int i = 0; i < DLDI_SERVE_OP_COUNT; i++)
+		requests += stats.requests[i];
+	printf("Served %llu requests on %llu connections, %llu failed\n",
+	       (unsigned long long)requests, (unsigned long long)stats.connections,
+	       (unsigned long long)stats.errors);
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	dldiServerFree(serving);
+	serving = NULL;
+	return rc;
+}
+
+// Outcome of restore, counted as files are reported.
+typedef struct DLDI_RESTORE_RESULTS
+{
+	int restored;
+	int failed;
+	int error; // Of the first file that failed.
+} DLDI_RESTORE_RESULTS;
+
+static void dldiRestoreResult(void* arg, const char* path, int rc)
+{
+	DLDI_RESTORE_RESULTS* results = (DLDI_RESTORE_RESULTS *)arg;
+
+	if (rc == -ESTALE)
+		printf("%s: Changed since it was patched, not restored\n", path);
+	else if (rc < 0)
+		printf("%s: Restore failed (%s)\n", path, strerror(-rc));
+	else if (rc == 0)
+		printf("%s: Already restored, not written\n", path);
+	else
+		printf("%s: Restored\n", path);
+
+	if (rc < 0 && results->failed++ == 0)
+		results->error = rc;
+	else if (rc > 0)
+		results->restored++;
+}
+
+// Puts back the original bytes of every file patched with a journal.
+int dldiRestore(const char* journal_path, int threads)
+{
+	DLDI_RESTORE_RESULTS results = {};
+	int rc = dldiJournalRestore(journal_path, threads, sync_mode, dldiRestoreResult, &results);
+	if (rc < 0)
+	{
+		printf("Failed to read journal %s: %s\n", journal_path, strerror(-rc));
+		return rc;
+	}
+
+	int current = rc - results.failed - results.restored;
+	printf("\nRestored %d of %d files, %d already restored\n", results.restored, rc, current);
+	return results.error;
+}
+
+void print_help(void)
+{
+	printf("dldipatch\n\n");
+	printf("Patching a homebrew using a DLDI or another homebrew's embedded DLDI:\n");
+	printf("dldipatch patch [-j threads] [--batch engine] dldi/homebrew [homebrew...]\n\n");
+	printf("Patching homebrew inside a FAT16 or FAT32 SD card image:\n");
+	printf("dldipatch patch dldi/homebrew card.img::/path/*.nds [...]\n");
+	printf("dldipatch patch --image card.img dldi/homebrew /path/*.nds [...]\n\n");
+	printf("Patching a copy of a homebrew, leaving the original alone:\n");
+	printf("dldipatch patch [--fsync mode] dldi/homebrew homebrew -o out.nds\n\n");
+	printf("Patching homebrew using a driver of a driver directory, by ID or name:\n");
+	printf("dldipatch patch --drivers dir --driver-id ID homebrew [homebrew...]\n\n");
+	printf("Patching homebrew using a driver built into dldipatch, and listing them:\n");
+	printf("dldipatch patch --builtin ID homebrew [homebrew...]\n");
+	printf("dldipatch list-builtin\n\n");
+	printf("Patching a homebrew read from stdin and writing it to stdout:\n");
+	printf("dldipatch patch --stream dldi/homebrew < in.nds > out.nds\n");
+	printf("dldipatch patch dldi/homebrew - - < in.nds > out.nds\n\n");
+	printf("Patching homebrew in place, keeping their original stubs in a journal:\n");
+	printf("dldipatch patch --journal undo.jnl dldi/homebrew homebrew [homebrew...]\n\n");
+	printf("Undoing every patch recorded in a journal:\n");
+	printf("dldipatch restore [-j threads] undo.jnl\n\n");
+	printf("Checking which homebrew don't have a DLDI yet, without patching them:\n");
+	printf("dldipatch patch --check dldi/homebrew homebrew [homebrew...]\n\n");
+	printf("Patching copies of a homebrew with every driver of driver directories:\n");
+	printf("dldipatch fanout [-j threads] --drivers dir --out dir homebrew\n\n");
+	printf("Writing an IPS or BPS patch that patches a homebrew, and applying it:\n");
+	printf("dldipatch diff dldi/homebrew homebrew -o patch.ips|patch.bps\n");
+	printf("dldipatch apply [--check] patch.ips|patch.bps homebrew [-o out.nds]\n\n");
+	printf("Extracting a DLDI from a homebrew's embedded DLDI:\n");
+	printf("dldipatch extract homebrew dldi.dldi\n\n");
+	printf("Extracting a DLDI from a homebrew's embedded DLDI:\n");
+	printf("dldipatch info dldi/homebrew \n\n");
+	printf("Listing the DLDI of every homebrew in directories, one record per line:\n");
+	printf("dldipatch info -r [--format json|csv] [-j threads] dir [dir...]\n\n");
+	printf("Listing the drivers of driver directories:\n");
+	printf("dldipatch drivers dir [dir...]\n\n");
+	printf("Serving patch, info and extract requests on a Unix socket:\n");
+	printf("dldipatch serve --socket path [--drivers dir] [-j threads]\n\n");
+	printf("Options:\n");
+	printf("  -j threads         Number of files patched or read at once\n");
+	printf("  --image file       Patch files inside a FAT disk image\n");
+	printf("  --drivers dir      Load drivers from a directory, may be repeated\n");
+	printf("  --driver-id ID     Patch with the driver of --drivers that has this ID or\n");
+	printf("                     name, instead of a driver given as the first argument\n");
+	printf("  --builtin ID       Patch with the built-in driver that has this ID, instead\n");
+	printf("                     of a driver given as the first argument\n");
+	printf("  --socket path      Socket the serve command listens on\n");
+	printf("  -o file            Write the patched homebrew, or the patch of diff, to a\n");
+	printf("                     new file\n");
+	printf("  --out dir          Directory fanout writes its copies to\n");
+	printf("  --check            Only report whether each homebrew already has the DLDI.\n");
+	printf("                     Exits with 1 if some don't\n");
+	printf("  --batch engine     Patch several homebrew on disk, or read the files of\n");
+	printf("                     info -r, as one batch: auto, uring or threads. auto uses\n");
+	printf("                     io_uring where the kernel allows it. --index isn't used\n");
+	printf("  --journal file     Append the bytes each in-place patch overwrites to an\n");
+	printf("                     undo journal, for the restore command\n");
+	printf("  --fsync mode       Flush patched files: none, data or full. The default\n");
+	printf("                     is none, or data with -o. Any mode also flushes the\n");
+	printf("                     journal before each write\n");
+	printf("  -r                 Read every .nds, .dsi, .srl and .dldi file in directories\n");
+	printf("  --all-files        With -r, read every file regardless of its extension\n");
+	printf("  --format format    Record format of -r, json (default) or csv\n");
+	printf("  --index file       Remember where stubs are in a stub index file\n");
+	printf("  --index-hash       Also check driver hashes against the index\n");
+	printf("  --stats            Print timings and I/O counters as JSON lines on stderr\n\n");
+}
+
+int main(const int argc, const char **argv)
+{
+	if (argc < 3 && !(argc == 2 && strcmp(argv[1], "list-builtin") == 0))
+	{
+		print_help();
+		return -EINVAL;
+	}
+
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	bool stream = false;
+	bool recursive = false;
+	const char* image_path = NULL;
+	const char* out_path = NULL;
+	const char* out_dir = NULL;
+	int sync = -1;
+	int crawl_flags = 0;
+	int format = DLDI_FORMAT_JSON;
+	const char* index_path = NULL;
+	int index_flags = 0;
+	const char* driver_id = NULL;
+	const char* builtin_id = NULL;
+	const char* socket_path = NULL;
+	const char* journal_path = NULL;
+	DLDI_CATALOG* catalog = NULL;
+	const DLDI_CATALOG_ENTRY* src_driver = NULL;
+	DLDI_CATALOG_ENTRY builtin_driver;
+	const char** args = (const char **)calloc(argc, sizeof(char *));
+	const char** driver_dirs = (const char **)calloc(argc, sizeof(char *));
+	int nargs = 0;
+	int ndriver_dirs = 0;
+	int rc = 0;
+
+	if (args == NULL || driver_dirs == NULL)
+	{
+		rc = -ENOMEM;
+		goto main_end;
+	}
+
+	// Options may appear anywhere after the command. A lone "-" is an
+	// argument, meaning stdin or stdout.
+	for (int arg = 2; arg < argc; arg++)
+	{
+		if (argv[arg][0] != '-' || argv[arg][1] == '\0')
+		{
+			args[nargs++] = argv[arg];
+		}
+		else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc)
+		{
+			char *end;
+			threads = strtol(argv[++arg], &end, 10);
+			if (*end != '\0' || threads < 1)
+			{
+				printf("Invalid thread count: %s\n", argv[arg]);
+				rc = -EINVAL;
+				goto main_end;
+			}
+		}
+		else if (strcmp(argv[arg], "--drivers") == 0 && arg + 1 < argc)
+		{
+			driver_dirs[ndriver_dirs++] = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "--driver-id") == 0 && arg + 1 < argc)
+		{
+			driver_id = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "--builtin") == 0 && arg + 1 < argc)
+		{
+			builtin_id = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "--socket") == 0 && arg + 1 < argc)
+		{
+			socket_path = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "--check") == 0)
+		{
+			patch_flags |= DLDI_PATCH_CHECK;
+		}
+		else if (strcmp(argv[arg], "--batch") == 0 && arg + 1 < argc)
+		{
+			arg++;
+			if (strcmp(argv[arg], "auto") == 0)
+				batch_engine = DLDI_BATCH_AUTO;
+			else if (strcmp(argv[arg], "uring") == 0)
+				batch_engine = DLDI_BATCH_URING;
+			else if (strcmp(argv[arg], "threads") == 0)
+				batch_engine = DLDI_BATCH_THREADS;
+			else
+			{
+				printf("Invalid batch engine: %s\n", argv[arg]);
+				rc = -EINVAL;
+				goto main_end;
+			}
+		}
+		else if (strcmp(argv[arg], "--journal") == 0 && arg + 1 < argc)
+		{
+			journal_path = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "--stream") == 0)
+		{
+			stream = true;
+		}
+		else if (strcmp(argv[arg], "-o") == 0 && arg + 1 < argc)
+		{
+			out_path = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "--out") == 0 && arg + 1 < argc)
+		{
+			out_dir = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "--fsync") == 0 && arg + 1 < argc)
+		{
+			arg++;
+			if (strcmp(argv[arg], "none") == 0)
+				sync = DLDI_SYNC_NONE;
+			else if (strcmp(argv[arg], "data") == 0)
+				sync = DLDI_SYNC_DATA;
+			else if (strcmp(argv[arg], "full") == 0)
+				sync = DLDI_SYNC_FULL;
+			else
+			{
+				printf("Invalid fsync mode: %s\n", argv[arg]);
+				rc = -EINVAL;
+				goto main_end;
+			}
+		}
+		else if (strcmp(argv[arg], "--image") == 0 && arg + 1 < argc)
+		{
+			image_path = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "-r") == 0)
+		{
+			recursive = true;
+		}
+		else if (strcmp(argv[arg], "--all-files") == 0)
+		{
+			crawl_flags |= DLDI_CRAWL_ALL_FILES;
+		}
+		else if (strcmp(argv[arg], "--format") == 0 && arg + 1 < argc)
+		{
+			arg++;
+			if (strcmp(argv[arg], "json") == 0)
+				format = DLDI_FORMAT_JSON;
+			else if (strcmp(argv[arg], "csv") == 0)
+				format = DLDI_FORMAT_CSV;
+			else
+			{
+				printf("Invalid format: %s\n", argv[arg]);
+				rc = -EINVAL;
+				goto main_end;
+			}
+		}
+		else if (strcmp(argv[arg], "--index") == 0 && arg + 1 < argc)
+		{
+			index_path = argv[++arg];
+		}
+		else if (strcmp(argv[arg], "--index-hash") == 0)
+		{
+			index_flags |= DLDI_INDEX_HASH;
+		}
+		else if (strcmp(argv[arg], "--stats") == 0)
+		{
+			print_stats = true;
+		}
+		else
+		{
+			printf("Invalid option: %s\n", argv[arg]);
+			rc = -EINVAL;
+			goto main_end;
+		}
+	}
+
+	bool is_patch = strncmp(argv[1], "patch", 5) == 0;
+	bool is_info = strncmp(argv[1], "info", 4) == 0;
+	bool is_extract = strncmp(argv[1], "extract", 7) == 0;
+	bool is_drivers = strncmp(argv[1], "drivers", 7) == 0;
+	bool is_serve = strncmp(argv[1], "serve", 5) == 0;
+	bool is_restore = strncmp(argv[1], "restore", 7) == 0;
+	bool is_fanout = strncmp(argv[1], "fanout", 6) == 0;
+	bool is_diff = strncmp(argv[1], "diff", 4) == 0;
+	bool is_apply = strncmp(argv[1], "apply", 5) == 0;
+	bool is_list_builtin = strcmp(argv[1], "list-builtin") == 0;
+
+	// With --driver-id or --builtin, the driver comes from the catalog or
+	// from the program and every argument is a target.
+	bool driver_given = driver_id != NULL || builtin_id != NULL;
+	int src_args = ((is_patch || is_diff) && driver_given) || is_drivers || is_serve || is_restore || is_list_builtin ? 0 : 1;
+
+	// "patch driver - -" is the same as "patch --stream driver".
+	if (is_patch && nargs == src_args + 2 &&
+	    strcmp(args[src_args], "-") == 0 && strcmp(args[src_args + 1], "-") == 0)
+	{
+		stream = true;
+		nargs = src_args;
+	}
+
+	int min_args = is_info || is_drivers || is_restore || is_fanout ? 1 : is_serve || is_list_builtin ? 0 : is_patch ? src_args + (stream ? 0 : 1) : src_args + 1;
+
+	if (!is_patch && !is_info && !is_extract && !is_drivers && !is_serve && !is_restore && !is_fanout &&
+	    !is_diff && !is_apply && !is_list_builtin)
+	{
+		// what are you even trying to do
+		printf("Invalid argument: %s\n", argv[1]);
+		rc = -EINVAL;
+		goto main_end;
+	}
+	if (is_drivers)
+	{
+		// Directories may be given either way.
+		for (int i = 0; i < nargs; i++)
+			driver_dirs[ndriver_dirs++] = args[i];
+		nargs = ndriver_dirs;
+	}
+	if (nargs < min_args)
+	{
+		print_help();
+		rc = -EINVAL;
+		goto main_end;
+	}
+	if ((patch_flags & DLDI_PATCH_CHECK) && (!(is_patch || is_apply) || stream || out_path != NULL))
+	{
+		printf("--check needs a patch command that patches files in place\n");
+		rc = -EINVAL;
+		goto main_end;
+	}
+	if (batch_engine >= 0 && (is_patch ? stream || out_path != NULL : !(is_info && recursive)))
+	{
+		printf("--batch needs a patch command that patches files in place, or info -r\n");
+		rc = -EINVAL;
+		goto main_end;
+	}
+	if (journal_path != NULL && (!is_patch || stream || out_path != NULL || batch_engine >= 0 ||
+	                             (patch_flags & DLDI_PATCH_CHECK)))
+	{
+		printf("--journal needs a patch command that patches files in place, without --batch\n");
+		rc = -EINVAL;
+		goto main_end;
+	}
+	if (is_fanout != (out_dir != NULL) || (is_fanout && (nargs != 1 || ndriver_dirs == 0)))
+	{
+		printf("fanout needs a single homebrew, --drivers and --out\n");
+		rc = -EINVAL;
+		goto main_end;
+	}
+	if (is_restore && nargs != 1)
+	{
+		printf("restore needs a single journal\n");
+		rc = -EINVAL;
+		goto main_end;
+	}
+	if (is_serve != (socket_path != NULL) || (is_serve && nargs != 0))
+	{
+		printf("serve needs --socket and no other arguments\n");
+		rc = -EINVAL;
+		goto main_end;
+	}
+	if (driver_id != NULL && (!(is_patch || is_diff) || ndriver_dirs == 0))
+	{
+		printf("--driver-id needs a patch or diff command and --drivers\n");
+		rc = -EINVAL;
+		goto main_end;
+	}
+	if (builtin_id != NULL && (!(is_patch || is_diff) || driver_id != NULL))
+	{
+		printf("--builtin needs a patch or diff command, without --driver-id\n");
+		rc = -EINVAL;
+		goto main_end;
+	}
+	if (is_list_builtin && nargs != 0)
+	{
+		printf("list-builtin takes no arguments\n");
+		rc = -EINVAL;
+		goto main_end;
+	}
+	if ((is_diff || is_apply) && (nargs != src_args + 1 || image_path != NULL ||
+	                              strstr(args[src_args], DLDI_FAT_SEPARATOR) != NULL || (is_diff && out_path == NULL)))
+	{
+		printf("%s needs a single homebrew on disk%s\n", argv[1], is_diff ? " and -o" : "");
+		rc = -EINVAL;
+		goto main_end;
+	}
+	if (out_path != NULL && (!(is_patch || is_diff || is_apply) || stream || nargs != src_args + 1 || image_path != NULL ||
+	                         strstr(args[src_args], DLDI_FAT_SEPARATOR) != NULL))
+	{
+		printf("-o needs a patch command with a single homebrew\n");
+		rc = -EINVAL;
+		goto main_end;
+	}
+
+	// A new output is worth flushing before it replaces a file, an in-place
+	// patch only if asked to.
+	if (sync >= 0)
+		sync_mode = sync;
+	else if (out_path != NULL || out_dir != NULL)
+		sync_mode = DLDI_SYNC_DATA;
+
+	if (src_args == 1 && access(args[0], F_OK) != 0)
+	{
+		fprintf(stream ? stderr : stdout, "Input file does not exist.\n");
+		rc = -ENOENT;
+		goto main_end;
+	}
+
+	run_start = dldiStatsNow();
+
+	if (index_path != NULL)
+	{
+		rc = dldiIndexLoad(index_path, index_flags, &stub_index);
+		if (rc != 0)
+		{
+			printf("Failed to load index %s: %s\n", index_path, strerror(-rc));
+			goto main_end;
+		}
+	}
+
+	// The journal is flushed before each write if the patched files are.
+	if (journal_path != NULL)
+	{
+		rc = dldiJournalOpen(journal_path, sync_mode != DLDI_SYNC_NONE ? DLDI_JOURNAL_SYNC : 0, &journal);
+		if (rc != 0)
+		{
+			printf("Failed to open journal %s: %s\n", journal_path, strerror(-rc));
+			goto main_index;
+		}
+	}
+
+	// The catalog is loaded once, however many targets there are.
+	if (ndriver_dirs > 0)
+	{
+		FILE* file = stream ? stderr : stdout;
+		rc = dldiCatalogOpen(driver_dirs, ndriver_dirs, threads, file, &catalog);
+		if (rc == 0 && driver_id != NULL)
+			rc = dldiCatalogSelect(catalog, driver_id, file, &src_driver);
+		if (rc != 0)
+			goto main_index;
+	}
+	if (builtin_id != NULL)
+	{
+		rc = dldiBuiltinSelect(builtin_id, stream ? stderr : stdout, &builtin_driver);
+		if (rc != 0)
+			goto main_index;
+		src_driver = &builtin_driver;
+	}
+
+	// A single large file is scanned with every thread. Crawls and the server
+	// already keep threads busy with one file each.
+	if (!recursive && !is_serve)
+		scan_threads = threads;
+
+	// patch DLDI
+	if (is_patch)
+	{
+		const char* src_path = src_args != 0 ? args[0] : NULL;
+		if (stream)
+		{
+			rc = dldiPatchStdio(src_path, src_driver);
+		}
+		else
+		{
+			DLDI_TARGET_LIST targets = {};
+			rc = dldiTargetsExpand(&targets, args + src_args, nargs - src_args, image_path);
+			if (rc == 0 && targets.count == 0)
+				rc = -ENOENT;
+			for (int i = 0; i < targets.count && rc == 0 && journal != NULL; i++)
+			{
+				// Disk images have their own files, which the journal can't
+				// identify.
+				if (targets.targets[i].fat != NULL)
+				{
+					printf("%s: --journal only patches files on disk\n", targets.targets[i].path);
+					rc = -EINVAL;
+				}
+			}
+			if (rc == 0)
+				rc = dldiPatch(src_path, src_driver, targets.targets, targets.count, threads, out_path);
+			int close_rc = dldiTargetsFree(&targets);
+			if (rc >= 0 && close_rc != 0)
+				rc = close_rc;
+
+			// Only --check fails because files aren't patched yet.
+			if (rc > 0 && (patch_flags & DLDI_PATCH_CHECK))
+				run_stale = rc;
+			if (rc > 0)
+				rc = patch_flags & DLDI_PATCH_CHECK ? DLDI_EXIT_STALE : 0;
+		}
+	}
+
+	// show DLDI info
+	else if (is_info)
+	{
+		if (recursive)
+			rc = dldiInfoRecursive(args, nargs, threads, crawl_flags, format);
+		else
+			rc = dldiInfo(args[0]);
+	}
+
+	// write or apply a delta patch
+	else if (is_diff)
+	{
+		rc = dldiDiff(src_args != 0 ? args[0] : NULL, src_driver, args[src_args], out_path);
+	}
+	else if (is_apply)
+	{
+		rc = dldiApply(args[0], args[1], out_path);
+		// Only --check fails because files aren't patched yet.
+		if (rc > 0 && (patch_flags & DLDI_PATCH_CHECK))
+			run_stale = rc;
+		if (rc > 0)
+			rc = patch_flags & DLDI_PATCH_CHECK ? DLDI_EXIT_STALE : 0;
+	}
+
+	// patch copies with every driver
+	else if (is_fanout)
+	{
+		rc = dldiFanout(args[0], catalog, out_dir, threads);
+	}
+
+	// undo a journal
+	else if (is_restore)
+	{
+		rc = dldiRestore(args[0], threads);
+	}
+
+	// serve requests
+	else if (is_serve)
+	{
+		rc = dldiServe(socket_path, catalog, threads);
+	}
+
+	// list drivers
+	else if (is_drivers)
+	{
+		dldiCatalogPrint(catalog);
+	}
+	else if (is_list_builtin)
+	{
+		dldiBuiltinPrint();
+	}
+
+	// extract DLDI
+	else
+	{
+		rc = dldiExtract(args[0], args[1]);
+	}
+
+main_index:
+	if (journal != NULL)
+	{
+		int journal_rc = dldiJournalClose(journal);
+		if (journal_rc != 0)
+			printf("Failed to write journal %s: %s\n", journal_path, strerror(-journal_rc));
+		if (rc >= 0 && journal_rc != 0)
+			rc = journal_rc;
+		journal = NULL;
+	}
+	if (stub_index != NULL)
+	{
+		int index_rc = dldiIndexSave(stub_index);
+		if (index_rc != 0)
+			fprintf(stream ? stderr : stdout, "Failed to save index %s: %s\n", index_path, strerror(-index_rc));
+		dldiIndexFree(stub_index);
+	}
+
+	// The last line covers every file. Files that --check found stale are
+	// counted in it rather than reported as an error.
+	if (print_stats)
+		dldiPrintStats(NULL, rc < 0 ? rc : 0, &run_stats);
+
+main_end:
+	dldiCatalogFree(catalog);
+	free(driver_dirs);
+	free(args);
+	return rc;
 }
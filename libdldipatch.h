@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: Zlib
+
+/// @file libdldipatch.h
+///
+/// @brief Public interface of libdldipatch.
+///
+/// Every function reports errors as negative errno values and never prints.
+/// Functions don't keep state between calls other than internal buffer pools
+/// and caches, which are locked, so they can be called from many threads at
+/// once as long as the threads don't share the memory they patch.
+
+#ifndef DLDIPATCH_LIBDLDIPATCH_H__
+#define DLDIPATCH_LIBDLDIPATCH_H__
+
+#include "dldi.h"
+#include "dldi_batch.h"
+#include "dldi_buffer.h"
+#include "dldi_catalog.h"
+#include "dldi_crawl.h"
+#include "dldi_delta.h"
+#include "dldi_fat.h"
+#include "dldi_image.h"
+#include "dldi_index.h"
+#include "dldi_journal.h"
+#include "dldi_nds.h"
+#include "dldi_output.h"
+#include "dldi_reloc.h"
+#include "dldi_scan.h"
+#include "dldi_serve.h"
+#include "dldi_stats.h"
+#include "dldi_stream.h"
+#include "dldi_workers.h"
+
+#endif // DLDIPATCH_LIBDLDIPATCH_H__